@@ -0,0 +1,25 @@
+#ifndef NBFS_CRC32_H
+#define NBFS_CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* -------------------------------------------------------------------------
+ * CRC32
+ *
+ * IEEE 802.3 CRC-32 (reflected, polynomial 0xEDB88320) as stored in
+ * the superblock, inodes and journal. A structure with a crc32 field
+ * is checksummed over its whole size with that field set to zero.
+ *
+ * nbfs_crc32_sliced() is table-driven slicing-by-8 and needs nothing
+ * but <stdint.h>, so freestanding code links it from
+ * shared/libc/crc32.c. It continues a CRC returned by an earlier
+ * call, or starts one from 0.
+ * ------------------------------------------------------------------------- */
+
+uint32_t nbfs_crc32_sliced(
+    uint32_t crc,
+    const void *buffer,
+    size_t length);
+
+#endif
@@ -1,6 +1,101 @@
 #ifndef NBFS_DIRECTORY_H
 #define NBFS_DIRECTORY_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <nbfs/nbfs.h>
 
+/* -------------------------------------------------------------------------
+ * Directory records
+ *
+ * A record is the 12-byte nbfs_directory_entry_t header followed by
+ * name_length name bytes, padded to NBFS_DIRENT_ALIGN. record_length
+ * also covers any free space behind the record, so the records of a
+ * block chain from offset 0 to its end. A record with inode 0 is free
+ * space. A deleted record is merged into the one before it, so apart
+ * from the index root below only the first record of a block can be
+ * free.
+ * ------------------------------------------------------------------------- */
+
+#define NBFS_DIRENT_ALIGN       8
+#define NBFS_DIRENT_NAME_MAX    255
+
+#define NBFS_DIRENT_RECORD_SIZE(name_length) \
+    ((sizeof(nbfs_directory_entry_t) + (name_length) + \
+      NBFS_DIRENT_ALIGN - 1) & ~(size_t)(NBFS_DIRENT_ALIGN - 1))
+
+#define NBFS_DIRENT_FILE        1
+#define NBFS_DIRENT_DIRECTORY   2
+
+#define NBFS_MODE_FILE          0x8000
+#define NBFS_MODE_DIRECTORY     0x4000
+#define NBFS_MODE_TYPE          0xF000
+
+/* -------------------------------------------------------------------------
+ * Directory index
+ *
+ * A directory larger than one block is indexed by name hash. Block 0
+ * keeps "." and ".." and, behind them, one free record whose body is
+ * the index root, so a linear reader still sees a valid block. The
+ * root and any index nodes below it map hash ranges to directory
+ * blocks; the blocks at the bottom hold the records. Entry 0 of every
+ * index covers all hashes below entry 1, and names with equal hashes
+ * always share a block.
+ *
+ * Index nodes are whole directory blocks behind a free record that
+ * spans the block. Block numbers are directory (file) blocks.
+ * ------------------------------------------------------------------------- */
+
+#define NBFS_DIR_INDEX_MAGIC    0x58444E42u  /* "NBDX" */
+#define NBFS_DIR_INDEX_DEPTH    3
+
+#define NBFS_DIR_HASH_FNV1A     1
+
+/*
+ * FNV-1a, finished with a full avalanche: names that differ only in
+ * their last bytes would otherwise land on neighbouring hashes and
+ * crowd the same block.
+ */
+static inline uint32_t nbfs_dir_hash(const char *name, size_t length)
+{
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6Bu;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35u;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+typedef struct NBFS_PACKED
+{
+    uint32_t magic;
+
+    uint8_t  depth;
+    uint8_t  hash_version;
+    uint16_t reserved;
+
+    uint16_t limit;
+    uint16_t count;
+
+    uint32_t crc32;
+
+} nbfs_dir_index_t;
+
+typedef struct NBFS_PACKED
+{
+    uint32_t hash;
+    uint32_t block;
+
+} nbfs_dir_index_entry_t;
+
 #endif
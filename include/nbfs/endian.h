@@ -0,0 +1,234 @@
+#ifndef NBFS_ENDIAN_H
+#define NBFS_ENDIAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <nbfs/nbfs.h>
+#include <nbfs/directory.h>
+#include <nbfs/extent.h>
+#include <nbfs/journal.h>
+
+/* -------------------------------------------------------------------------
+ * Byte order
+ *
+ * Everything on disk is little-endian. Code that copies an on-disk
+ * structure into memory converts it once, with the in-place
+ * converters below, and works on native values from then on; the
+ * same call converts back before the structure is written. Blocks
+ * worked on where they lie, such as directory and extent-tree
+ * blocks in the block cache, go through the field accessors
+ * instead, since other threads may be reading the same copy.
+ *
+ * On little-endian hosts every function here is empty or the
+ * identity and compiles away. On the 68060 each is inline: a field
+ * costs one byte swap, never a call. Inodes are converted one at a
+ * time; they are not a whole number per block and can straddle
+ * two.
+ * ------------------------------------------------------------------------- */
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define NBFS_BIG_ENDIAN 1
+#endif
+
+/*
+ * Field accessors. Each converts in either direction.
+ */
+static inline uint16_t nbfs_le16(uint16_t value)
+{
+#ifdef NBFS_BIG_ENDIAN
+    return __builtin_bswap16(value);
+#else
+    return value;
+#endif
+}
+
+static inline uint32_t nbfs_le32(uint32_t value)
+{
+#ifdef NBFS_BIG_ENDIAN
+    return __builtin_bswap32(value);
+#else
+    return value;
+#endif
+}
+
+static inline uint64_t nbfs_le64(uint64_t value)
+{
+#ifdef NBFS_BIG_ENDIAN
+    return __builtin_bswap64(value);
+#else
+    return value;
+#endif
+}
+
+/*
+ * Structure converters, in place, in either direction.
+ */
+static inline void nbfs_superblock_le(nbfs_superblock_t *sb)
+{
+#ifdef NBFS_BIG_ENDIAN
+    sb->magic              = nbfs_le32(sb->magic);
+    sb->version_major      = nbfs_le16(sb->version_major);
+    sb->version_minor      = nbfs_le16(sb->version_minor);
+    sb->block_size         = nbfs_le32(sb->block_size);
+    sb->flags              = nbfs_le32(sb->flags);
+    sb->total_blocks       = nbfs_le64(sb->total_blocks);
+    sb->free_blocks        = nbfs_le64(sb->free_blocks);
+    sb->total_inodes       = nbfs_le64(sb->total_inodes);
+    sb->free_inodes        = nbfs_le64(sb->free_inodes);
+    sb->root_inode         = nbfs_le64(sb->root_inode);
+    sb->journal_start      = nbfs_le64(sb->journal_start);
+    sb->journal_blocks     = nbfs_le64(sb->journal_blocks);
+    sb->block_bitmap_start = nbfs_le64(sb->block_bitmap_start);
+    sb->inode_bitmap_start = nbfs_le64(sb->inode_bitmap_start);
+    sb->inode_table_start  = nbfs_le64(sb->inode_table_start);
+    sb->data_start         = nbfs_le64(sb->data_start);
+    sb->crc32              = nbfs_le32(sb->crc32);
+#else
+    (void)sb;
+#endif
+}
+
+static inline void nbfs_extent_le(nbfs_extent_t *extent)
+{
+#ifdef NBFS_BIG_ENDIAN
+    extent->start_block = nbfs_le64(extent->start_block);
+    extent->block_count = nbfs_le32(extent->block_count);
+    extent->flags       = nbfs_le32(extent->flags);
+#else
+    (void)extent;
+#endif
+}
+
+static inline void nbfs_inode_le(nbfs_inode_t *inode)
+{
+#ifdef NBFS_BIG_ENDIAN
+    inode->inode_number = nbfs_le64(inode->inode_number);
+    inode->mode         = nbfs_le16(inode->mode);
+    inode->links        = nbfs_le16(inode->links);
+    inode->uid          = nbfs_le32(inode->uid);
+    inode->gid          = nbfs_le32(inode->gid);
+    inode->size         = nbfs_le64(inode->size);
+    inode->created      = nbfs_le64(inode->created);
+    inode->modified     = nbfs_le64(inode->modified);
+    inode->accessed     = nbfs_le64(inode->accessed);
+
+    for (int i = 0; i < NBFS_EXTENTS_PER_INODE; i++)
+        nbfs_extent_le(&inode->extents[i]);
+
+    inode->crc32        = nbfs_le32(inode->crc32);
+#else
+    (void)inode;
+#endif
+}
+
+static inline void nbfs_directory_entry_le(nbfs_directory_entry_t *entry)
+{
+#ifdef NBFS_BIG_ENDIAN
+    entry->inode         = nbfs_le64(entry->inode);
+    entry->record_length = nbfs_le16(entry->record_length);
+#else
+    (void)entry;
+#endif
+}
+
+static inline void nbfs_extent_node_le(nbfs_extent_node_t *node)
+{
+#ifdef NBFS_BIG_ENDIAN
+    node->magic       = nbfs_le32(node->magic);
+    node->entries     = nbfs_le16(node->entries);
+    node->max_entries = nbfs_le16(node->max_entries);
+    node->depth       = nbfs_le16(node->depth);
+    node->crc32       = nbfs_le32(node->crc32);
+#else
+    (void)node;
+#endif
+}
+
+static inline void nbfs_extent_record_le(nbfs_extent_record_t *record)
+{
+#ifdef NBFS_BIG_ENDIAN
+    record->logical     = nbfs_le64(record->logical);
+    record->start_block = nbfs_le64(record->start_block);
+    record->block_count = nbfs_le32(record->block_count);
+    record->flags       = nbfs_le32(record->flags);
+#else
+    (void)record;
+#endif
+}
+
+static inline void nbfs_extent_branch_le(nbfs_extent_branch_t *branch)
+{
+#ifdef NBFS_BIG_ENDIAN
+    branch->logical = nbfs_le64(branch->logical);
+    branch->child   = nbfs_le64(branch->child);
+#else
+    (void)branch;
+#endif
+}
+
+static inline void nbfs_dir_index_entry_le(nbfs_dir_index_entry_t *entry)
+{
+#ifdef NBFS_BIG_ENDIAN
+    entry->hash  = nbfs_le32(entry->hash);
+    entry->block = nbfs_le32(entry->block);
+#else
+    (void)entry;
+#endif
+}
+
+static inline void nbfs_journal_block_le(nbfs_journal_block_t *block)
+{
+#ifdef NBFS_BIG_ENDIAN
+    block->magic    = nbfs_le32(block->magic);
+    block->type     = nbfs_le32(block->type);
+    block->sequence = nbfs_le64(block->sequence);
+#else
+    (void)block;
+#endif
+}
+
+static inline void nbfs_journal_header_le(nbfs_journal_header_t *header)
+{
+#ifdef NBFS_BIG_ENDIAN
+    nbfs_journal_block_le(&header->block);
+
+    header->block_size = nbfs_le32(header->block_size);
+    header->blocks     = nbfs_le32(header->blocks);
+    header->crc32      = nbfs_le32(header->crc32);
+#else
+    (void)header;
+#endif
+}
+
+/*
+ * The home block numbers that follow a descriptor go through
+ * nbfs_le64() one at a time.
+ */
+static inline void nbfs_journal_descriptor_le(nbfs_journal_descriptor_t *d)
+{
+#ifdef NBFS_BIG_ENDIAN
+    nbfs_journal_block_le(&d->block);
+
+    d->count    = nbfs_le32(d->count);
+    d->reserved = nbfs_le32(d->reserved);
+#else
+    (void)d;
+#endif
+}
+
+static inline void nbfs_journal_commit_le(nbfs_journal_commit_t *commit)
+{
+#ifdef NBFS_BIG_ENDIAN
+    nbfs_journal_block_le(&commit->block);
+
+    commit->count      = nbfs_le32(commit->count);
+    commit->data_crc32 = nbfs_le32(commit->data_crc32);
+    commit->timestamp  = nbfs_le64(commit->timestamp);
+    commit->crc32      = nbfs_le32(commit->crc32);
+#else
+    (void)commit;
+#endif
+}
+
+#endif
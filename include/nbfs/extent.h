@@ -3,4 +3,54 @@
 
 #include <nbfs/nbfs.h>
 
+/* -------------------------------------------------------------------------
+ * Extent tree
+ *
+ * A file that needs more than NBFS_EXTENTS_PER_INODE extents keeps
+ * them in a B+tree instead. extents[0] of the inode then carries
+ * NBFS_EXTENT_TREE in flags and start_block names the root node;
+ * the other inode extents are unused.
+ *
+ * Every node is one block: a header followed by entries sorted by
+ * first file block. Leaves (depth 0) hold extent records; index
+ * nodes hold one branch per child, keyed by the child's first file
+ * block. The root stays in the same block as the tree grows.
+ * ------------------------------------------------------------------------- */
+
+#define NBFS_EXTENT_TREE        0x00000001u
+
+#define NBFS_EXTENT_NODE_MAGIC  0x5458424Eu  /* "NBXT" */
+
+typedef struct NBFS_PACKED
+{
+    uint32_t magic;
+
+    uint16_t entries;
+    uint16_t max_entries;
+
+    uint16_t depth;
+    uint16_t reserved;
+
+    uint32_t crc32;
+
+} nbfs_extent_node_t;
+
+typedef struct NBFS_PACKED
+{
+    uint64_t logical;
+
+    uint64_t start_block;
+    uint32_t block_count;
+    uint32_t flags;
+
+} nbfs_extent_record_t;
+
+typedef struct NBFS_PACKED
+{
+    uint64_t logical;
+
+    uint64_t child;
+
+} nbfs_extent_branch_t;
+
 #endif
@@ -0,0 +1,76 @@
+#ifndef NBFS_JOURNAL_H
+#define NBFS_JOURNAL_H
+
+#include <nbfs/nbfs.h>
+
+/* -------------------------------------------------------------------------
+ * Journal
+ *
+ * Block 0 of the journal area is the header; transactions follow it
+ * back to back from block 1. A transaction is one descriptor block
+ * listing the home blocks it covers, an image of each of those
+ * blocks, and a commit block. The commit block carries a CRC32 of
+ * the descriptor and every image, so a transaction written with one
+ * request is either complete or ignored. Every field, the home
+ * block numbers included, is little-endian, and each CRC covers the
+ * bytes as they lie on disk.
+ *
+ * The header names the sequence number of the transaction at block
+ * 1. Replay applies transactions in order until a block does not
+ * carry the next sequence number or a CRC fails. Once every home
+ * block is durable the journal is emptied by moving the header's
+ * sequence past the last transaction.
+ * ------------------------------------------------------------------------- */
+
+#define NBFS_JOURNAL_MAGIC      0x4C4E4A4Eu  /* "NJNL" */
+
+#define NBFS_JOURNAL_HEADER     1
+#define NBFS_JOURNAL_DESCRIPTOR 2
+#define NBFS_JOURNAL_COMMIT     3
+
+typedef struct NBFS_PACKED
+{
+    uint32_t magic;
+    uint32_t type;
+
+    uint64_t sequence;
+
+} nbfs_journal_block_t;
+
+typedef struct NBFS_PACKED
+{
+    nbfs_journal_block_t block;
+
+    uint32_t block_size;
+    uint32_t blocks;
+
+    uint32_t crc32;
+
+} nbfs_journal_header_t;
+
+/*
+ * Followed by count uint64_t home block numbers.
+ */
+typedef struct NBFS_PACKED
+{
+    nbfs_journal_block_t block;
+
+    uint32_t count;
+    uint32_t reserved;
+
+} nbfs_journal_descriptor_t;
+
+typedef struct NBFS_PACKED
+{
+    nbfs_journal_block_t block;
+
+    uint32_t count;
+    uint32_t data_crc32;
+
+    uint64_t timestamp;
+
+    uint32_t crc32;
+
+} nbfs_journal_commit_t;
+
+#endif
@@ -26,7 +26,11 @@
 #define NBFS_DEFAULT_BLOCK_SIZE NBFS_BLOCK_SIZE_4K
 
 /* -------------------------------------------------------------------------
- * Fixed block locations - layout v1
+ * Block locations - layout v1
+ *
+ * The layout mkfs.nbfs writes with its default geometry. Other
+ * geometries move every region after the superblock; the superblock
+ * records where each one starts.
  *
  * 0          boot block
  * 1          superblock
@@ -90,6 +94,14 @@ typedef struct NBFS_PACKED
 
 } nbfs_superblock_t;
 
+/*
+ * Superblock flags
+ *
+ * NBFS_SUPERBLOCK_CHECKSUMS: the superblock and every inode in use
+ * carry a CRC32 of themselves (see nbfs/crc32.h).
+ */
+#define NBFS_SUPERBLOCK_CHECKSUMS 0x00000001u
+
 /* -------------------------------------------------------------------------
  * Extent
  * ------------------------------------------------------------------------- */
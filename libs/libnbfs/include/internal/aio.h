@@ -0,0 +1,65 @@
+#ifndef LIBNBFS_INTERNAL_AIO_H
+#define LIBNBFS_INTERNAL_AIO_H
+
+/*
+ * Asynchronous block I/O
+ *
+ * nbfs_submit_read()/nbfs_submit_write() hand requests to an io_uring
+ * when the context reads through a file descriptor on Linux and the
+ * kernel lets us set one up. Everywhere else each request runs to
+ * completion as it is submitted and only its completion waits for
+ * nbfs_reap(), so callers see the same interface either way.
+ *
+ * The queue is created at the first submission and holds up to the
+ * context's queue depth of requests, from submission until reaped.
+ * ctx->aio_lock covers it.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../../src/context_internal.h"
+
+#define NBFS_QUEUE_DEPTH_DEFAULT 32
+#define NBFS_QUEUE_DEPTH_MAX     4096
+
+/*
+ * Wait for the requests still in flight and drop the queue. Their
+ * completions are lost.
+ */
+void nbfs_aio_destroy(nbfs_context_t *ctx);
+
+/*
+ * io_uring on a file descriptor, see src/block_uring.c.
+ *
+ * queue adds a read or write to the submission ring; submit passes
+ * everything queued to the kernel and waits for at least wait
+ * completions. complete takes one completion off the ring: 1 with
+ * its tag and result (bytes moved or -errno), 0 when there is none.
+ */
+struct nbfs_uring;
+
+struct nbfs_uring *nbfs_uring_create(
+    int fd,
+    uint32_t depth);
+
+void nbfs_uring_destroy(struct nbfs_uring *ring);
+
+int nbfs_uring_queue(
+    struct nbfs_uring *ring,
+    bool write,
+    void *buffer,
+    uint32_t length,
+    uint64_t offset,
+    uint64_t tag);
+
+int nbfs_uring_submit(
+    struct nbfs_uring *ring,
+    uint32_t wait);
+
+int nbfs_uring_complete(
+    struct nbfs_uring *ring,
+    uint64_t *tag,
+    int32_t *result);
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef LIBNBFS_INTERNAL_ALLOCATOR_H
+#define LIBNBFS_INTERNAL_ALLOCATOR_H
+
+/*
+ * Block allocation
+ *
+ * The block bitmap is the authority. Every change to it goes through
+ * nbfs_bitmap_claim_blocks() or nbfs_bitmap_release_blocks(), which
+ * keep the free-space summary, the superblock free counter and the
+ * free-extent index in step.
+ *
+ * The bitmaps are split into NBFS_ALLOC_SHARDS shards with a lock
+ * and next-fit cursors each (see context_internal.h). Threads start
+ * in different shards, so single-block and inode allocations from
+ * several threads rarely meet; a range is claimed with every shard
+ * it crosses held, in ascending order. The summary and the index
+ * below sit under ctx->allocator_lock.
+ *
+ * The free-extent index holds every free run of the data area twice:
+ * sorted by start, for goal lookups and coalescing, and sorted by
+ * (length, start), for best fit. It is built from the bitmap at
+ * open and dropped whenever it stops matching; the next extent
+ * allocation rebuilds it.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../../src/context_internal.h"
+
+typedef struct
+{
+    uint64_t start;
+
+    /*
+     * Bits in use by the bitmap.
+     */
+    uint64_t bits;
+
+    /*
+     * Bits below low are never handed out: the metadata blocks, or
+     * inode 0.
+     */
+    uint64_t low;
+
+} nbfs_bitmap_region_t;
+
+/*
+ * Describe the block or inode bitmap of the loaded superblock.
+ */
+int nbfs_bitmap_region(
+    nbfs_context_t *ctx,
+    bool inodes,
+    nbfs_bitmap_region_t *region);
+
+/*
+ * Mark count blocks from first used or free. Fails without changing
+ * anything unless the whole range was free, or allocated.
+ */
+int nbfs_bitmap_claim_blocks(
+    nbfs_context_t *ctx,
+    uint64_t first,
+    uint64_t count);
+
+int nbfs_bitmap_release_blocks(
+    nbfs_context_t *ctx,
+    uint64_t first,
+    uint64_t count);
+
+/*
+ * Call visit for every maximal run of clear bits in [low, bits), in
+ * ascending order. A non-zero return from visit stops the walk.
+ */
+int nbfs_bitmap_free_runs(
+    nbfs_context_t *ctx,
+    const nbfs_bitmap_region_t *region,
+    int (*visit)(void *arg, uint64_t start, uint64_t length),
+    void *arg);
+
+/*
+ * Discard
+ *
+ * Freed block ranges wait on ctx->discards until the frees are
+ * committed; only then may the image give their space back to the
+ * host (backend discard). take detaches the waiting ranges; issue
+ * discards whatever of them is still free and frees the list.
+ */
+struct nbfs_discard;
+
+struct nbfs_discard *nbfs_discard_take(nbfs_context_t *ctx);
+
+void nbfs_discard_issue(
+    nbfs_context_t *ctx,
+    struct nbfs_discard *list);
+
+void nbfs_discard_destroy(nbfs_context_t *ctx);
+
+/*
+ * Hold every shard, so the bitmaps stand still.
+ */
+void nbfs_allocator_freeze(nbfs_context_t *ctx);
+
+void nbfs_allocator_thaw(nbfs_context_t *ctx);
+
+/*
+ * Next-fit goal in the calling thread's shard of the block bitmap,
+ * and the move of a shard's cursor to next, the block after an
+ * allocation.
+ */
+uint64_t nbfs_allocator_goal(nbfs_context_t *ctx);
+
+void nbfs_allocator_advance(
+    nbfs_context_t *ctx,
+    uint64_t next);
+
+/*
+ * Free-space summary over the block bitmap, see bitmap.c. Built at
+ * open, or on the first block allocation.
+ */
+int nbfs_free_summary_build(nbfs_context_t *ctx);
+
+/*
+ * Bring ctx->superblock.free_blocks up to date from the summary.
+ * The caller holds the superblock lock for writing.
+ */
+void nbfs_free_summary_apply(nbfs_context_t *ctx);
+
+void nbfs_free_summary_destroy(nbfs_context_t *ctx);
+
+/*
+ * Free-extent index. Building takes the locks it needs; the other
+ * calls expect ctx->allocator_lock held.
+ */
+int nbfs_extent_index_build(nbfs_context_t *ctx);
+
+void nbfs_extent_index_insert(
+    nbfs_context_t *ctx,
+    uint64_t start,
+    uint64_t length);
+
+void nbfs_extent_index_remove(
+    nbfs_context_t *ctx,
+    uint64_t start,
+    uint64_t length);
+
+void nbfs_extent_index_destroy(nbfs_context_t *ctx);
+
+#endif
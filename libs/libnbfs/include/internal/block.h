@@ -1,4 +1,67 @@
 #ifndef BLOCK_H
 #define BLOCK_H
 
+/*
+ * Byte-range I/O for structures that do not fill a block, such as
+ * inodes. Goes straight to the backend and keeps the block cache
+ * coherent.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../src/context_internal.h"
+
+int nbfs_io_read(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    void *buffer,
+    size_t length);
+
+int nbfs_io_write(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    const void *buffer,
+    size_t length);
+
+/*
+ * Wait until every write issued so far is durable, as far as the
+ * context's durability mode asks for. Backends without a sync
+ * operation have nothing to wait for.
+ */
+int nbfs_io_sync(nbfs_context_t *ctx);
+
+/*
+ * Long write-backs start the storage on each NBFS_WRITEBACK_WINDOW
+ * they have written, so that the next sync finds little left to do
+ * instead of the whole flush at once.
+ */
+#define NBFS_WRITEBACK_WINDOW (4u * 1024 * 1024)
+
+/*
+ * Start writing [offset, offset + length) out without waiting. A
+ * no-op without durability or a backend writeback operation.
+ */
+void nbfs_io_writeback(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    uint64_t length);
+
+/*
+ * Writable access to one block, whatever the backend: the mapping,
+ * a cache slot, or a private copy written back on release when
+ * dirty is set. Release returns -1 when that write-back failed; it
+ * is also recorded for nbfs_flush() to report.
+ */
+void *nbfs_block_acquire(
+    nbfs_context_t *ctx,
+    uint64_t block);
+
+int nbfs_block_release(
+    nbfs_context_t *ctx,
+    uint64_t block,
+    void *data,
+    bool dirty);
+
 #endif
@@ -0,0 +1,125 @@
+#ifndef LIBNBFS_BLOCK_CACHE_H
+#define LIBNBFS_BLOCK_CACHE_H
+
+/*
+ * Block cache
+ *
+ * A fixed number of block-sized slots, replaced with CLOCK. Slots
+ * held through nbfs_cache_get() or pinned are never evicted. Dirty
+ * slots are written back on eviction and by nbfs_cache_flush(),
+ * except those held for the journal. The cache lock is not held for
+ * the writes; the slots stay resident until they are done.
+ *
+ * Mapped contexts have no cache; nbfs_cache_get() returns NULL for
+ * them, as it does when every slot is busy. Callers then fall back
+ * to direct I/O, except for writes inside a journal transaction,
+ * which fail instead of reaching the image unlogged.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../../src/context_internal.h"
+
+#define NBFS_CACHE_DEFAULT_SIZE (8u * 1024u * 1024u)
+
+/*
+ * Share of the slots, in percent, that metadata pinned when the
+ * superblock is loaded may take. The rest of it is cached like
+ * any other block.
+ */
+#define NBFS_CACHE_PIN_SHARE 25
+
+/*
+ * Return the cached copy of block, reading it from the image when
+ * read is true. The slot stays resident until the matching
+ * nbfs_cache_release(). With write set the caller may change it:
+ * while a journal transaction is running the slot is taken for the
+ * transaction, and NULL comes back once that already holds as many
+ * blocks as one journal transaction can log.
+ */
+void *nbfs_cache_get(
+    nbfs_context_t *ctx,
+    uint64_t block,
+    bool read,
+    bool write);
+
+void nbfs_cache_release(
+    nbfs_context_t *ctx,
+    void *data,
+    bool dirty);
+
+/*
+ * Bring count blocks starting at first into the cache. Missing
+ * blocks are read straight into their slots, one vectored request
+ * per contiguous run. With pin set every block in the range is
+ * also pinned. Returns the number of blocks now resident.
+ */
+uint64_t nbfs_cache_prefetch(
+    nbfs_context_t *ctx,
+    uint64_t first,
+    uint64_t count,
+    bool pin);
+
+/*
+ * True when data points into the cache of ctx.
+ */
+bool nbfs_cache_owns(
+    nbfs_context_t *ctx,
+    const void *data);
+
+/*
+ * Keep coherent with I/O that bypassed the cache.
+ *
+ * overlay copies dirty cached blocks over a buffer just read from
+ * the image; update refreshes cached blocks after a direct write.
+ * Both take a byte range that need not be block aligned.
+ */
+void nbfs_cache_overlay(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    void *buffer,
+    uint64_t length);
+
+void nbfs_cache_update(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    const void *buffer,
+    uint64_t length);
+
+/*
+ * Drop cached copies of blocks that were freed, dirty or not: their
+ * contents no longer matter. Slots in use are only marked clean.
+ */
+void nbfs_cache_discard(
+    nbfs_context_t *ctx,
+    uint64_t first,
+    uint64_t count);
+
+/*
+ * Write back every dirty block except those held for the journal.
+ */
+int nbfs_cache_flush(nbfs_context_t *ctx);
+
+/*
+ * Blocks dirtied while a journal transaction is running are held
+ * back from eviction and from nbfs_cache_flush() until the journal
+ * has logged them; see include/internal/journal.h.
+ *
+ * collect fills blocks and iov with up to max of them in block order
+ * and returns how many there are. checkpoint writes them all home,
+ * after which they are ordinary clean blocks.
+ */
+uint32_t nbfs_cache_journaled(nbfs_context_t *ctx);
+
+uint32_t nbfs_cache_journal_collect(
+    nbfs_context_t *ctx,
+    uint64_t *blocks,
+    nbfs_iovec_t *iov,
+    uint32_t max);
+
+int nbfs_cache_checkpoint(nbfs_context_t *ctx);
+
+void nbfs_cache_destroy(nbfs_context_t *ctx);
+
+#endif
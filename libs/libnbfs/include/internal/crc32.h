@@ -1,4 +1,23 @@
 #ifndef CRC32_H
 #define CRC32_H
 
+/*
+ * CRC-32 (IEEE 802.3, reflected, polynomial 0xEDB88320).
+ *
+ * nbfs_crc32_update() continues a CRC returned by an earlier call,
+ * or starts one from 0, so a checksum can be taken over several
+ * buffers:
+ *
+ *     crc = nbfs_crc32_update(0, a, a_length);
+ *     crc = nbfs_crc32_update(crc, b, b_length);
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t nbfs_crc32_update(
+    uint32_t crc,
+    const void *buffer,
+    size_t length);
+
 #endif
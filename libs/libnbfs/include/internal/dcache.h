@@ -0,0 +1,61 @@
+#ifndef LIBNBFS_INTERNAL_DCACHE_H
+#define LIBNBFS_INTERNAL_DCACHE_H
+
+/*
+ * Directory entry cache
+ *
+ * Maps (directory inode, name) to the inode the name refers to, or
+ * to nothing for a name known to be absent. Entries are hashed into
+ * NBFS_DCACHE_BUCKETS chains and the least recently used one makes
+ * room once NBFS_DCACHE_ENTRIES are held.
+ *
+ * Every change to a directory goes through the cache, so entries are
+ * never stale; nbfs_dcache_forget() covers names that disappear some
+ * other way.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../src/context_internal.h"
+
+#define NBFS_DCACHE_BUCKETS 4096
+#define NBFS_DCACHE_ENTRIES 8192
+
+/*
+ * 0 with the inode of a cached name, 1 for a cached absence, -1 when
+ * the cache has nothing on it.
+ */
+int nbfs_dcache_lookup(
+    nbfs_context_t *ctx,
+    uint64_t parent,
+    const char *name,
+    size_t length,
+    uint64_t *inode);
+
+/*
+ * Remember name in parent as inode, or as absent for inode 0.
+ */
+void nbfs_dcache_insert(
+    nbfs_context_t *ctx,
+    uint64_t parent,
+    const char *name,
+    size_t length,
+    uint64_t inode);
+
+void nbfs_dcache_forget(
+    nbfs_context_t *ctx,
+    uint64_t parent,
+    const char *name,
+    size_t length);
+
+/*
+ * Drop every entry under a directory that is going away.
+ */
+void nbfs_dcache_forget_directory(
+    nbfs_context_t *ctx,
+    uint64_t parent);
+
+void nbfs_dcache_destroy(nbfs_context_t *ctx);
+
+#endif
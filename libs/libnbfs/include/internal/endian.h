@@ -1,4 +0,0 @@
-#ifndef ENDIAN_H
-#define ENDIAN_H
-
-#endif
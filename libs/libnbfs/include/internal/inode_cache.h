@@ -0,0 +1,44 @@
+#ifndef LIBNBFS_INODE_CACHE_H
+#define LIBNBFS_INODE_CACHE_H
+
+/*
+ * Inode cache
+ *
+ * Inode-table blocks are kept resident in the block cache and
+ * updated in place. An inode write only dirties the block holding
+ * it; each dirty table block is written back once, at flush.
+ *
+ * The table is brought in by windows of NBFS_INODE_READAHEAD
+ * blocks, one read per window, and pinned while pins stay under
+ * half of the cache.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../src/context_internal.h"
+
+#define NBFS_INODE_READAHEAD 16
+
+/*
+ * offset and length address inode-table bytes in the image.
+ */
+int nbfs_inode_cache_read(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    void *buffer,
+    size_t length);
+
+int nbfs_inode_cache_write(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    const void *buffer,
+    size_t length);
+
+/*
+ * Forget which windows are resident. Called when the block cache
+ * is rebuilt.
+ */
+void nbfs_inode_cache_reset(nbfs_context_t *ctx);
+
+#endif
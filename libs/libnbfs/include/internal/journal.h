@@ -0,0 +1,109 @@
+#ifndef LIBNBFS_INTERNAL_JOURNAL_H
+#define LIBNBFS_INTERNAL_JOURNAL_H
+
+/*
+ * Metadata journal
+ *
+ * Blocks dirtied in the block cache while a transaction is open
+ * (nbfs_journal_begin() .. nbfs_journal_commit()) belong to the
+ * running transaction. They stay in the cache until a commit logs
+ * them: the file data written back so far, a descriptor and the
+ * block images, one sync, then a CRC protected commit block and a
+ * second sync. Only after that are they written home, without
+ * waiting.
+ *
+ * Transactions from any number of threads pile into the running
+ * one, and a commit takes everything closed so far (group commit).
+ * A commit happens at nbfs_flush() and when a closing transaction
+ * leaves the running one at NBFS_JOURNAL_THRESHOLD of the journal,
+ * or of the cache slots it can take if those are fewer.
+ *
+ * The running transaction never outgrows one journal transaction,
+ * so a commit is logged whole. A transaction opens only while each
+ * open one, itself included, still has NBFS_JOURNAL_CREDITS blocks
+ * of room; otherwise it waits for a commit. A write that would take
+ * the running transaction past all the journal can log, or every
+ * cache slot, fails: nothing dirtied inside a transaction goes home
+ * unlogged.
+ *
+ * Nesting is tracked per thread and per journal, so a transaction
+ * open on one context does not hold back commits on another.
+ *
+ * The journal is emptied (reset) when it is full, at close, and
+ * before a commit when a block it still holds an image of has been
+ * freed, so replay never writes an old image over a reused block.
+ * Mapped contexts and contexts without a block cache have no
+ * journal; a mapped context replays it before the image is mapped.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../../src/context_internal.h"
+
+/*
+ * Share of the journal, in percent, the running transaction may
+ * fill before the next closing transaction commits it.
+ */
+#define NBFS_JOURNAL_THRESHOLD 50
+
+/*
+ * Blocks room is kept for per open transaction: enough for a create
+ * or unlink, or a write that allocates one extent.
+ */
+#define NBFS_JOURNAL_CREDITS 16
+
+/*
+ * Attach the journal of a writable image and replay it. An image
+ * without a usable journal area gets no journal.
+ */
+int nbfs_journal_open(nbfs_context_t *ctx);
+
+/*
+ * Replay the journal of a writable image that will be used without
+ * a block cache, then let it go.
+ */
+int nbfs_journal_recover(nbfs_context_t *ctx);
+
+/*
+ * True while a transaction is open, so that blocks dirtied now
+ * belong to the journal.
+ */
+bool nbfs_journal_running(nbfs_context_t *ctx);
+
+/*
+ * Most blocks the running transaction may hold; 0 without a
+ * journal.
+ */
+uint32_t nbfs_journal_capacity(nbfs_context_t *ctx);
+
+/*
+ * Commit the running transaction. Waits for open transactions on
+ * other threads; called inside one, the commit is left to whoever
+ * closes the last one.
+ */
+int nbfs_journal_flush(nbfs_context_t *ctx);
+
+/*
+ * As nbfs_journal_flush(), but only until the transactions the
+ * calling thread has closed are committed; a commit by another
+ * thread may already have taken them along.
+ */
+int nbfs_journal_sync(nbfs_context_t *ctx);
+
+/*
+ * Blocks [first, first + count) were freed.
+ */
+void nbfs_journal_revoke(
+    nbfs_context_t *ctx,
+    uint64_t first,
+    uint64_t count);
+
+/*
+ * Make every logged block durable at home and empty the journal.
+ */
+int nbfs_journal_checkpoint(nbfs_context_t *ctx);
+
+void nbfs_journal_destroy(nbfs_context_t *ctx);
+
+#endif
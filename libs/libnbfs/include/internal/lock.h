@@ -0,0 +1,73 @@
+#ifndef LIBNBFS_INTERNAL_LOCK_H
+#define LIBNBFS_INTERNAL_LOCK_H
+
+/*
+ * Context locking
+ *
+ * One context may be used from any number of threads. The public
+ * entry points take what they need, always in this order:
+ *
+ *   1. a journal handle (nbfs_journal_begin())
+ *   2. ctx->namespace_lock: shared for directory operations,
+ *      exclusive for rename, which walks and relinks several
+ *      directories
+ *   3. inode locks: NBFS_INODE_LOCKS reader-writer locks, inode
+ *      numbers hashed onto them, taken as one set in stripe order
+ *   4. allocator shards, in ascending order
+ *   5. ctx->superblock_lock
+ *   6. ctx->allocator_lock: free-space summary, free-extent index
+ *   7. leaf locks: delalloc list, entry cache, inode windows, the
+ *      asynchronous I/O queue, then the block cache, journal and
+ *      discard list locks
+ *
+ * An operation locks every inode it will touch as one set before it
+ * starts: a create allocates the new inode first and locks it with
+ * the parent, an unlink locks the entry's inode with the directory.
+ * A public call made under another's locks, as its journal handle
+ * is covered by the outer one, then finds its stripes held and takes
+ * nothing. The one nested call that does take a stripe is rename's
+ * walk up from the new parent, with the namespace held exclusively:
+ * every other thread holding a stripe then holds that of one file,
+ * and waits for no other stripe while it does, so the wait ends.
+ * Pending data of other files is committed with no stripe held.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../../src/context_internal.h"
+
+/*
+ * Lock the stripes of count inodes (at most NBFS_INODE_LOCK_SET),
+ * for writing or for reading. Duplicates are fine. -1, holding
+ * nothing new, when the set is too large, the thread holds too many
+ * stripes, or a stripe held for reading is wanted for writing;
+ * nbfs_inode_unlock() is then not called. Contention never fails a
+ * call; it waits.
+ */
+#define NBFS_INODE_LOCK_SET 4
+
+int nbfs_inode_lock(
+    nbfs_context_t *ctx,
+    const uint64_t *inodes,
+    int count,
+    bool write);
+
+void nbfs_inode_unlock(nbfs_context_t *ctx);
+
+/*
+ * Allocator shard a thread starts its searches in. A thread whose
+ * shard fills moves on to the one that served it.
+ */
+uint32_t nbfs_thread_shard(void);
+
+void nbfs_thread_shard_move(uint32_t shard);
+
+/*
+ * Set up and tear down the locks of a context.
+ */
+void nbfs_locks_init(nbfs_context_t *ctx);
+
+void nbfs_locks_destroy(nbfs_context_t *ctx);
+
+#endif
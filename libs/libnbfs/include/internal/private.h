@@ -0,0 +1,171 @@
+#ifndef LIBNBFS_INTERNAL_PRIVATE_H
+#define LIBNBFS_INTERNAL_PRIVATE_H
+
+/*
+ * Open files
+ *
+ * A handle keeps its own copy of the inode, the first file block of
+ * every extent, and a cursor on the extent used last, so sequential
+ * I/O maps each block range without searching.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <nbfs/extent.h>
+
+#include "../../src/context_internal.h"
+
+struct nbfs_file
+{
+    nbfs_context_t *ctx;
+
+    nbfs_inode_t inode;
+
+    /*
+     * logical[i] is the first file block of extent i; logical[count]
+     * is the number of blocks the inode owns.
+     */
+    uint64_t logical[NBFS_EXTENTS_PER_INODE + 1];
+
+    int count;
+
+    int cursor;
+
+    /*
+     * One block for partial edge blocks.
+     */
+    uint8_t *bounce;
+
+    /*
+     * ctx->file_generation when the inode was last read.
+     */
+    uint64_t generation;
+
+    /*
+     * Blocks the inode owns, and the image block just past its last
+     * extent, where growth looks first.
+     */
+    uint64_t blocks;
+
+    uint64_t goal;
+
+    /*
+     * Copy of the extent-tree leaf used last.
+     */
+    uint64_t leaf_block;
+
+    uint16_t leaf_entries;
+
+    nbfs_extent_record_t *leaf;
+};
+
+/*
+ * Delayed allocation
+ *
+ * Writes past the blocks a file owns are held in memory, one buffer
+ * per inode, and given blocks only when the buffer is committed: at
+ * flush, when pending data would pass NBFS_DELALLOC_LIMIT, or before
+ * a write too large to hold. The file size on disk moves with the
+ * commit, so the image never names blocks that were not written.
+ */
+#define NBFS_DELALLOC_LIMIT (32u * 1024u * 1024u)
+
+struct nbfs_delalloc
+{
+    struct nbfs_delalloc *next;
+    struct nbfs_delalloc *prev;
+
+    /*
+     * Next in the same hash bucket.
+     */
+    struct nbfs_delalloc *chain;
+
+    uint64_t inode;
+
+    /*
+     * File offset of data[0]: the end of the blocks the inode owns.
+     */
+    uint64_t base;
+
+    /*
+     * File size including the pending bytes.
+     */
+    uint64_t size;
+
+    /*
+     * Whole blocks, zero past size.
+     */
+    uint8_t *data;
+
+    uint64_t capacity;
+};
+
+/*
+ * Commit every pending buffer, each under its inode's lock. Called
+ * with no inode locked.
+ */
+int nbfs_delalloc_flush(nbfs_context_t *ctx);
+
+/*
+ * Drop pending buffers without writing them.
+ */
+void nbfs_delalloc_destroy(nbfs_context_t *ctx);
+
+/*
+ * Map a file block to its image block. run is the number of blocks
+ * from there to the end of the extent.
+ */
+int nbfs_file_map(
+    nbfs_file_t *file,
+    uint64_t block,
+    uint64_t *physical,
+    uint64_t *run);
+
+/*
+ * Give the file at least blocks blocks, growing its last extent in
+ * place where possible.
+ */
+int nbfs_file_reserve(
+    nbfs_file_t *file,
+    uint64_t blocks);
+
+/*
+ * Extent tree
+ *
+ * Used once a file needs more extents than the inode holds; see
+ * nbfs/extent.h for the layout.
+ */
+static inline bool nbfs_extent_tree_active(const nbfs_inode_t *inode)
+{
+    return (inode->extents[0].flags & NBFS_EXTENT_TREE) != 0;
+}
+
+int nbfs_extent_tree_lookup(
+    nbfs_file_t *file,
+    uint64_t block,
+    nbfs_extent_record_t *record);
+
+/*
+ * Last record of the file; 1 when the tree is empty.
+ */
+int nbfs_extent_tree_last(
+    nbfs_file_t *file,
+    nbfs_extent_record_t *record);
+
+int nbfs_extent_tree_append(
+    nbfs_file_t *file,
+    const nbfs_extent_record_t *record);
+
+int nbfs_extent_tree_build(
+    nbfs_file_t *file,
+    const nbfs_extent_record_t *records,
+    size_t count);
+
+int nbfs_extent_tree_collect(
+    nbfs_file_t *file,
+    nbfs_extent_record_t **records,
+    size_t *count);
+
+#endif
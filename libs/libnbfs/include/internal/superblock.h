@@ -0,0 +1,28 @@
+#ifndef LIBNBFS_INTERNAL_SUPERBLOCK_H
+#define LIBNBFS_INTERNAL_SUPERBLOCK_H
+
+/*
+ * ctx->superblock is the live copy. Allocation updates its free
+ * counters in memory, under ctx->superblock_lock, and sets
+ * ctx->superblock_dirty; the block is rewritten at flush.
+ */
+
+#include "../../src/context_internal.h"
+
+/*
+ * Read and verify the superblock unless a valid one is loaded.
+ */
+int nbfs_superblock_load(nbfs_context_t *ctx);
+
+/*
+ * Block size of the formatted image behind ctx, from its superblock;
+ * 0 when there is none.
+ */
+uint32_t nbfs_superblock_probe(nbfs_context_t *ctx);
+
+/*
+ * Write ctx->superblock back if it changed.
+ */
+int nbfs_superblock_sync(nbfs_context_t *ctx);
+
+#endif
@@ -6,6 +6,7 @@
  * Public API
  */
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -21,8 +22,14 @@ extern "C" {
 
 typedef struct nbfs_context nbfs_context_t;
 
+typedef struct nbfs_file nbfs_file_t;
+
 /* --------------------------------------------------------------------------
  * Context Management
+ *
+ * Calls on one context may come from several threads at once; a file
+ * handle is used by one thread at a time. Contexts are created and
+ * closed by a single thread.
  * -------------------------------------------------------------------------- */
 
 nbfs_context_t *nbfs_context_create(void);
@@ -34,10 +41,50 @@ void nbfs_context_destroy(nbfs_context_t *ctx);
 
 nbfs_context_t *nbfs_create(const char *path);
 nbfs_context_t *nbfs_open(const char *path);
+
+/*
+ * Create an image of bytes without writing them. The file is sparse
+ * and takes host space only as blocks are written; blocks freed
+ * later give theirs back.
+ */
+nbfs_context_t *nbfs_create_size(
+    const char *path,
+    uint64_t bytes);
+
+/*
+ * Map the whole image into memory. Block access through
+ * nbfs_block_get() then returns pointers into the mapping.
+ */
+nbfs_context_t *nbfs_open_mmap(const char *path);
 void nbfs_close(nbfs_context_t *ctx);
 
 int nbfs_flush(nbfs_context_t *ctx);
 
+/*
+ * What nbfs_flush() and nbfs_close() guarantee once they return.
+ *
+ * NONE      everything is handed to the OS, nothing is synced. The
+ *           journal still protects against a crash of the process,
+ *           not of the machine.
+ * ORDERED   file data reaches the image before the metadata that
+ *           refers to it, and each journal commit is fdatasync()ed.
+ *           The default.
+ * FULL      as ORDERED, and every flush ends with fsync().
+ */
+typedef enum
+{
+    NBFS_DURABILITY_NONE,
+    NBFS_DURABILITY_ORDERED,
+    NBFS_DURABILITY_FULL
+
+} nbfs_durability_t;
+
+int nbfs_set_durability(
+    nbfs_context_t *ctx,
+    nbfs_durability_t durability);
+
+nbfs_durability_t nbfs_get_durability(nbfs_context_t *ctx);
+
 /* --------------------------------------------------------------------------
  * Block I/O
  * -------------------------------------------------------------------------- */
@@ -52,6 +99,185 @@ int nbfs_write_block(
     uint64_t block,
     const void *buffer);
 
+/*
+ * Multi-block I/O
+ *
+ * nbfs_read_blocks()/nbfs_write_blocks() move count contiguous
+ * blocks in one request. The vectored forms move one contiguous
+ * block range to or from several buffers; the buffer lengths must
+ * add up to a whole number of blocks.
+ */
+typedef struct
+{
+    void *base;
+    size_t length;
+
+} nbfs_iovec_t;
+
+int nbfs_read_blocks(
+    nbfs_context_t *ctx,
+    uint64_t block,
+    uint64_t count,
+    void *buffer);
+
+int nbfs_write_blocks(
+    nbfs_context_t *ctx,
+    uint64_t block,
+    uint64_t count,
+    const void *buffer);
+
+int nbfs_readv_blocks(
+    nbfs_context_t *ctx,
+    uint64_t block,
+    const nbfs_iovec_t *iov,
+    int iovcnt);
+
+int nbfs_writev_blocks(
+    nbfs_context_t *ctx,
+    uint64_t block,
+    const nbfs_iovec_t *iov,
+    int iovcnt);
+
+/*
+ * Zero-copy block access.
+ *
+ * On a mapped context the returned pointer addresses the mapping
+ * directly. Other contexts return a private copy of the block.
+ * Every successful nbfs_block_get() must be paired with
+ * nbfs_block_put().
+ */
+const void *nbfs_block_get(
+    nbfs_context_t *ctx,
+    uint64_t block);
+
+void nbfs_block_put(
+    nbfs_context_t *ctx,
+    const void *data);
+
+typedef enum
+{
+    NBFS_ADVISE_NORMAL,
+    NBFS_ADVISE_SEQUENTIAL,
+    NBFS_ADVISE_RANDOM,
+    NBFS_ADVISE_WILLNEED,
+    NBFS_ADVISE_DONTNEED
+
+} nbfs_advice_t;
+
+/*
+ * Access-pattern hint for a block range. Only mapped contexts
+ * act on it; elsewhere it is a no-op.
+ */
+int nbfs_block_advise(
+    nbfs_context_t *ctx,
+    uint64_t block,
+    uint64_t count,
+    nbfs_advice_t advice);
+
+/* --------------------------------------------------------------------------
+ * Asynchronous I/O
+ *
+ * nbfs_submit_read()/nbfs_submit_write() queue a transfer of count
+ * blocks and return at once; the buffer belongs to the library until
+ * nbfs_reap() hands back the request's tag. Requests finish in any
+ * order. On Linux contexts from nbfs_open() and nbfs_create() use
+ * io_uring; elsewhere a request is done by the time it is submitted
+ * and only its completion waits.
+ *
+ * Queued requests go to the kernel together at the next nbfs_reap(),
+ * which returns up to max completions after waiting for at least
+ * wait of them (never for more than are in flight). nbfs_reap() with
+ * max 0 only starts what is queued.
+ *
+ * Submission fails while the queue depth's worth of requests is in
+ * flight; reap first. nbfs_flush() covers writes once reaped.
+ * -------------------------------------------------------------------------- */
+
+typedef struct
+{
+    uint64_t tag;
+
+    /* 0, or -1 when the transfer failed */
+    int result;
+
+} nbfs_completion_t;
+
+int nbfs_submit_read(
+    nbfs_context_t *ctx,
+    uint64_t block,
+    uint64_t count,
+    void *buffer,
+    uint64_t tag);
+
+int nbfs_submit_write(
+    nbfs_context_t *ctx,
+    uint64_t block,
+    uint64_t count,
+    const void *buffer,
+    uint64_t tag);
+
+int nbfs_reap(
+    nbfs_context_t *ctx,
+    nbfs_completion_t *completions,
+    int max,
+    int wait);
+
+/*
+ * Requests in flight at once, 1 to 4096, 32 by default. Fails while
+ * any are.
+ */
+int nbfs_set_queue_depth(
+    nbfs_context_t *ctx,
+    uint32_t depth);
+
+uint32_t nbfs_get_queue_depth(nbfs_context_t *ctx);
+
+/* --------------------------------------------------------------------------
+ * Block Cache
+ *
+ * Contexts opened with nbfs_open() or nbfs_create() cache blocks in a
+ * fixed memory budget. Single-block writes stay in the cache until
+ * nbfs_flush(), nbfs_close() or eviction. Mapped contexts have no
+ * cache.
+ * -------------------------------------------------------------------------- */
+
+typedef struct
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;
+
+    uint32_t slots;
+    uint32_t resident;
+    uint32_t dirty;
+    uint32_t pinned;
+
+} nbfs_cache_stats_t;
+
+/*
+ * Resize the cache to bytes, writing dirty blocks back first.
+ * Zero disables caching. Pins do not survive a resize.
+ */
+int nbfs_cache_configure(
+    nbfs_context_t *ctx,
+    uint64_t bytes);
+
+/*
+ * Pinned blocks are never evicted. Pins nest.
+ */
+int nbfs_cache_pin(
+    nbfs_context_t *ctx,
+    uint64_t block);
+
+int nbfs_cache_unpin(
+    nbfs_context_t *ctx,
+    uint64_t block);
+
+int nbfs_cache_stats(
+    nbfs_context_t *ctx,
+    nbfs_cache_stats_t *stats);
+
 /* --------------------------------------------------------------------------
  * Superblock
  * -------------------------------------------------------------------------- */
@@ -75,10 +301,46 @@ int nbfs_allocate_block(
     nbfs_context_t *ctx,
     uint64_t *block);
 
+/*
+ * Allocate the first free block at or after goal in goal's share of
+ * the bitmap, wrapping around to the start of the share, and in the
+ * other shares after that. nbfs_allocate_block() continues from the
+ * previous allocation in the calling thread's share.
+ */
+int nbfs_allocate_block_near(
+    nbfs_context_t *ctx,
+    uint64_t goal,
+    uint64_t *block);
+
 int nbfs_free_block(
     nbfs_context_t *ctx,
     uint64_t block);
 
+/* --------------------------------------------------------------------------
+ * Extents
+ * -------------------------------------------------------------------------- */
+
+/*
+ * Allocate up to want contiguous blocks.
+ *
+ * The extent starts at goal when the free run holding goal is long
+ * enough; pass the block after a file's last extent to grow it in
+ * place. Otherwise the smallest free run that fits is used, and when
+ * none fits, the largest. block_count then falls short of want and
+ * the caller allocates again for the rest. A goal of 0 continues
+ * from the previous allocation in the calling thread's share of the
+ * bitmap.
+ */
+int nbfs_allocate_extent(
+    nbfs_context_t *ctx,
+    uint64_t want,
+    uint64_t goal,
+    nbfs_extent_t *extent);
+
+int nbfs_free_extent(
+    nbfs_context_t *ctx,
+    const nbfs_extent_t *extent);
+
 /* --------------------------------------------------------------------------
  * Inodes
  * -------------------------------------------------------------------------- */
@@ -100,6 +362,50 @@ int nbfs_write_inode(
     nbfs_context_t *ctx,
     const nbfs_inode_t *inode);
 
+/* --------------------------------------------------------------------------
+ * Files
+ * -------------------------------------------------------------------------- */
+
+nbfs_file_t *nbfs_file_open(
+    nbfs_context_t *ctx,
+    uint64_t inode);
+
+int nbfs_file_close(nbfs_file_t *file);
+
+uint64_t nbfs_file_size(nbfs_file_t *file);
+
+/*
+ * Whole blocks move straight between the caller's buffer and the
+ * image; only partial blocks at either end are copied.
+ *
+ * pread returns the number of bytes read, short at end of file.
+ * pwrite returns length; a write past the end leaves zeros in the
+ * gap. Both return -1 on error.
+ *
+ * Writes past the blocks a file owns are held in memory and given
+ * blocks at nbfs_flush(), so a file built from many small appends
+ * still ends up in one extent.
+ */
+int64_t nbfs_file_pread(
+    nbfs_file_t *file,
+    void *buffer,
+    uint64_t length,
+    uint64_t offset);
+
+int64_t nbfs_file_pwrite(
+    nbfs_file_t *file,
+    const void *buffer,
+    uint64_t length,
+    uint64_t offset);
+
+/*
+ * Set the file size, releasing blocks past the new end or
+ * zero-filling up to it.
+ */
+int nbfs_file_truncate(
+    nbfs_file_t *file,
+    uint64_t size);
+
 /* --------------------------------------------------------------------------
  * Directories
  * -------------------------------------------------------------------------- */
@@ -136,6 +442,35 @@ int nbfs_lookup(
     const char *name,
     uint64_t *inode);
 
+/*
+ * Remove name from the directory. The inode goes with its last
+ * link; directories must be empty.
+ */
+int nbfs_unlink(
+    nbfs_context_t *ctx,
+    uint64_t directory_inode,
+    const char *name);
+
+/*
+ * Resolve a '/'-separated path from the root directory.
+ */
+int nbfs_lookup_path(
+    nbfs_context_t *ctx,
+    const char *path,
+    uint64_t *inode);
+
+/*
+ * Move old_name in old_parent to new_name in new_parent, replacing a
+ * file already there. Directories are never replaced and cannot move
+ * below themselves.
+ */
+int nbfs_rename(
+    nbfs_context_t *ctx,
+    uint64_t old_parent,
+    const char *old_name,
+    uint64_t new_parent,
+    const char *new_name);
+
 /* --------------------------------------------------------------------------
  * Journal
  * -------------------------------------------------------------------------- */
@@ -1,66 +1,1220 @@
+#include <pthread.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <nbfs/endian.h>
+
 #include "libnbfs.h"
+#include "context_internal.h"
+#include "internal/allocator.h"
+#include "internal/block.h"
+#include "internal/journal.h"
+#include "internal/lock.h"
+#include "internal/superblock.h"
 
-int nbfs_allocate_block(nbfs_context_t *ctx, uint64_t *block)
+/*
+ * Block and inode bitmaps
+ *
+ * Bit n of a bitmap is bit n % 8 of byte n / 8. Loaded as
+ * little-endian 64-bit words, bit n is then bit n % 64 of word
+ * n / 64, so a scan can skip a full word with one compare and find
+ * the first clear bit in a word with count-trailing-zeros.
+ */
+
+static uint64_t load_word(const uint8_t *p)
+{
+    uint64_t word;
+
+    memcpy(&word, p, sizeof(word));
+
+    return nbfs_le64(word);
+}
+
+static void store_word(uint8_t *p, uint64_t word)
+{
+    word = nbfs_le64(word);
+
+    memcpy(p, &word, sizeof(word));
+}
+
+/*
+ * Mask of bits [first, first + count) within one word.
+ */
+static uint64_t word_mask(uint32_t first, uint32_t count)
+{
+    uint64_t mask = (count >= 64) ? ~0ULL : ((1ULL << count) - 1);
+
+    return mask << first;
+}
+
+/*
+ * A bitmap runs up to the next region.
+ */
+int nbfs_bitmap_region(
+    nbfs_context_t *ctx,
+    bool inodes,
+    nbfs_bitmap_region_t *region)
 {
-    (void)ctx;
+    if (nbfs_superblock_load(ctx) != 0)
+        return -1;
 
-    if (!block)
+    const nbfs_superblock_t *sb = &ctx->superblock;
+    uint64_t end;
+
+    if (inodes)
+    {
+        region->start = sb->inode_bitmap_start;
+        region->bits = sb->total_inodes;
+        region->low = 1;
+        end = sb->inode_table_start;
+    }
+    else
+    {
+        region->start = sb->block_bitmap_start;
+        region->bits = sb->total_blocks;
+        region->low = sb->data_start;
+        end = sb->inode_bitmap_start;
+    }
+
+    if (end <= region->start)
+        return -1;
+
+    uint64_t capacity = (end - region->start) * sb->block_size * 8;
+
+    if (region->bits > capacity)
+        region->bits = capacity;
+
+    if (region->low >= region->bits)
         return -1;
 
-    *block = 0;
     return 0;
 }
 
-int nbfs_free_block(nbfs_context_t *ctx, uint64_t block)
+/*
+ * Free-space summary
+ *
+ * The block bitmap is split into groups of one bitmap block each.
+ * Every group keeps its free count, and two levels of "has free
+ * space" bits sit above the counts: one bit per group, and one bit
+ * per 64 groups. Finding the next group with space reads at most a
+ * word of each level plus one level-2 word per 4096 groups, so the
+ * cost stays flat as the volume fills.
+ *
+ * The superblock free_blocks counter is derived from the summary
+ * total when the superblock is read or written back.
+ */
+#define SUMMARY_NONE UINT64_MAX
+
+struct nbfs_free_summary
+{
+    uint64_t groups;
+
+    uint64_t free;
+
+    uint32_t *group_free;
+
+    uint64_t *level1;
+
+    uint64_t *level2;
+
+    uint64_t level1_words;
+
+    uint64_t level2_words;
+};
+
+static void summary_set(
+    struct nbfs_free_summary *summary,
+    uint64_t group,
+    uint32_t free)
+{
+    uint64_t w = group / 64;
+    uint64_t bit = 1ULL << (group % 64);
+
+    summary->free -= summary->group_free[group];
+    summary->free += free;
+    summary->group_free[group] = free;
+
+    if (free)
+        summary->level1[w] |= bit;
+    else
+        summary->level1[w] &= ~bit;
+
+    uint64_t bit2 = 1ULL << (w % 64);
+
+    if (summary->level1[w])
+        summary->level2[w / 64] |= bit2;
+    else
+        summary->level2[w / 64] &= ~bit2;
+}
+
+/*
+ * First group at or after group with free space.
+ */
+static uint64_t summary_next(
+    const struct nbfs_free_summary *summary,
+    uint64_t group)
+{
+    if (group >= summary->groups)
+        return SUMMARY_NONE;
+
+    uint64_t w = group / 64;
+    uint64_t word = summary->level1[w] & ~word_mask(0, group % 64);
+
+    if (word)
+        return w * 64 + (uint64_t)__builtin_ctzll(word);
+
+    for (uint64_t l1 = w + 1; l1 < summary->level1_words; )
+    {
+        uint64_t w2 = l1 / 64;
+        uint64_t word2 = summary->level2[w2] & ~word_mask(0, l1 % 64);
+
+        if (word2)
+        {
+            l1 = w2 * 64 + (uint64_t)__builtin_ctzll(word2);
+
+            return l1 * 64 +
+                (uint64_t)__builtin_ctzll(summary->level1[l1]);
+        }
+
+        l1 = (w2 + 1) * 64;
+    }
+
+    return SUMMARY_NONE;
+}
+
+/*
+ * Move the groups covering [first, first + count) by the blocks
+ * that were just claimed or freed.
+ */
+static void summary_adjust(
+    nbfs_context_t *ctx,
+    uint64_t first,
+    uint64_t count,
+    bool freed)
+{
+    struct nbfs_free_summary *summary = ctx->free_summary;
+    uint64_t group_bits = (uint64_t)ctx->block_size * 8;
+
+    while (count > 0)
+    {
+        uint64_t group = first / group_bits;
+        uint64_t span = group_bits - first % group_bits;
+
+        if (span > count)
+            span = count;
+
+        uint32_t free = summary->group_free[group];
+
+        summary_set(summary,
+                    group,
+                    freed ? free + (uint32_t)span : free - (uint32_t)span);
+
+        first += span;
+        count -= span;
+    }
+}
+
+/*
+ * Find the first clear bit in [from, limit).
+ */
+static int bitmap_find_zero(
+    nbfs_context_t *ctx,
+    const nbfs_bitmap_region_t *region,
+    const struct nbfs_free_summary *summary,
+    uint64_t from,
+    uint64_t limit,
+    uint64_t *bit)
+{
+    uint64_t block_bits = (uint64_t)ctx->block_size * 8;
+
+    while (from < limit)
+    {
+        /*
+         * Skip straight past groups without free space.
+         */
+        if (summary)
+        {
+            pthread_mutex_lock(&ctx->allocator_lock);
+
+            uint64_t group = summary_next(summary, from / block_bits);
+
+            pthread_mutex_unlock(&ctx->allocator_lock);
+
+            if (group == SUMMARY_NONE || group * block_bits >= limit)
+                return 1;
+
+            if (group * block_bits > from)
+                from = group * block_bits;
+        }
+
+        uint64_t block = region->start + from / block_bits;
+        uint64_t base = from - from % block_bits;
+
+        const uint8_t *data = nbfs_block_get(ctx, block);
+
+        if (!data)
+            return -1;
+
+        uint64_t end = base + block_bits;
+
+        if (end > limit)
+            end = limit;
+
+        uint64_t index = (from - base) / 64;
+        uint64_t word = load_word(data + index * 8);
+
+        /*
+         * Treat the bits below from as used.
+         */
+        word |= word_mask(0, (uint32_t)(from % 64));
+
+        for (;;)
+        {
+            if (word != ~0ULL)
+            {
+                uint64_t found =
+                    base + index * 64 + (uint64_t)__builtin_ctzll(~word);
+
+                nbfs_block_put(ctx, data);
+
+                if (found >= end)
+                    break;
+
+                *bit = found;
+                return 0;
+            }
+
+            index++;
+
+            if (base + index * 64 >= end)
+            {
+                nbfs_block_put(ctx, data);
+                break;
+            }
+
+            word = load_word(data + index * 8);
+        }
+
+        from = end;
+    }
+
+    return 1;
+}
+
+/*
+ * Set or clear count bits starting at first. Returns the number of
+ * bits that actually changed, or -1.
+ */
+static int64_t bitmap_update(
+    nbfs_context_t *ctx,
+    const nbfs_bitmap_region_t *region,
+    uint64_t first,
+    uint64_t count,
+    bool set)
+{
+    uint64_t block_bits = (uint64_t)ctx->block_size * 8;
+    int64_t changed = 0;
+
+    while (count > 0)
+    {
+        uint64_t block = region->start + first / block_bits;
+        uint64_t offset = first % block_bits;
+
+        uint8_t *data = nbfs_block_acquire(ctx, block);
+        int64_t before = changed;
+
+        if (!data)
+            return -1;
+
+        while (count > 0 && offset < block_bits)
+        {
+            uint8_t *p = data + (offset / 64) * 8;
+            uint32_t shift = (uint32_t)(offset % 64);
+            uint32_t span = 64 - shift;
+
+            if (span > count)
+                span = (uint32_t)count;
+
+            uint64_t mask = word_mask(shift, span);
+            uint64_t word = load_word(p);
+            uint64_t flip = set ? (mask & ~word) : (mask & word);
+
+            changed += __builtin_popcountll(flip);
+            store_word(p, word ^ flip);
+
+            offset += span;
+            first += span;
+            count -= span;
+        }
+
+        nbfs_block_release(ctx, block, data, changed != before);
+    }
+
+    return changed;
+}
+
+/*
+ * Number of set bits in count bits starting at first.
+ */
+static int64_t bitmap_count(
+    nbfs_context_t *ctx,
+    const nbfs_bitmap_region_t *region,
+    uint64_t first,
+    uint64_t count)
+{
+    uint64_t block_bits = (uint64_t)ctx->block_size * 8;
+    int64_t used = 0;
+
+    while (count > 0)
+    {
+        uint64_t offset = first % block_bits;
+
+        const uint8_t *data =
+            nbfs_block_get(ctx, region->start + first / block_bits);
+
+        if (!data)
+            return -1;
+
+        while (count > 0 && offset < block_bits)
+        {
+            uint32_t shift = (uint32_t)(offset % 64);
+            uint32_t span = 64 - shift;
+
+            if (span > count)
+                span = (uint32_t)count;
+
+            uint64_t word = load_word(data + (offset / 64) * 8);
+
+            used += __builtin_popcountll(word & word_mask(shift, span));
+
+            offset += span;
+            first += span;
+            count -= span;
+        }
+
+        nbfs_block_put(ctx, data);
+    }
+
+    return used;
+}
+
+static void summary_free(struct nbfs_free_summary *summary)
+{
+    if (!summary)
+        return;
+
+    free(summary->group_free);
+    free(summary->level1);
+    free(summary->level2);
+    free(summary);
+}
+
+static struct nbfs_free_summary *summary_build(
+    nbfs_context_t *ctx,
+    const nbfs_bitmap_region_t *region)
+{
+    uint64_t group_bits = (uint64_t)ctx->block_size * 8;
+
+    struct nbfs_free_summary *summary = calloc(1, sizeof(*summary));
+
+    if (!summary)
+        return NULL;
+
+    summary->groups = (region->bits + group_bits - 1) / group_bits;
+    summary->level1_words = (summary->groups + 63) / 64;
+    summary->level2_words = (summary->level1_words + 63) / 64;
+
+    summary->group_free = calloc(summary->groups, sizeof(uint32_t));
+    summary->level1 = calloc(summary->level1_words, sizeof(uint64_t));
+    summary->level2 = calloc(summary->level2_words, sizeof(uint64_t));
+
+    if (!summary->group_free || !summary->level1 || !summary->level2)
+    {
+        summary_free(summary);
+        return NULL;
+    }
+
+    for (uint64_t group = 0; group < summary->groups; group++)
+    {
+        uint64_t first = group * group_bits;
+        uint64_t end = first + group_bits;
+
+        if (end > region->bits)
+            end = region->bits;
+
+        if (first < region->low)
+            first = region->low;
+
+        if (first >= end)
+            continue;
+
+        int64_t used = bitmap_count(ctx, region, first, end - first);
+
+        if (used < 0)
+        {
+            summary_free(summary);
+            return NULL;
+        }
+
+        summary_set(summary, group, (uint32_t)(end - first - (uint64_t)used));
+    }
+
+    return summary;
+}
+
+void nbfs_free_summary_destroy(nbfs_context_t *ctx)
+{
+    if (!ctx)
+        return;
+
+    summary_free(ctx->free_summary);
+
+    ctx->free_summary = NULL;
+}
+
+int nbfs_free_summary_build(nbfs_context_t *ctx)
+{
+    nbfs_bitmap_region_t region;
+
+    if (!ctx)
+        return -1;
+
+    if (nbfs_bitmap_region(ctx, false, &region) != 0)
+        return -1;
+
+    /*
+     * The bitmap holds still while it is counted.
+     */
+    nbfs_allocator_freeze(ctx);
+
+    struct nbfs_free_summary *summary = summary_build(ctx, &region);
+
+    pthread_mutex_lock(&ctx->allocator_lock);
+
+    summary_free(ctx->free_summary);
+    ctx->free_summary = summary;
+
+    pthread_mutex_unlock(&ctx->allocator_lock);
+
+    nbfs_allocator_thaw(ctx);
+
+    return summary ? 0 : -1;
+}
+
+void nbfs_free_summary_apply(nbfs_context_t *ctx)
+{
+    if (!ctx)
+        return;
+
+    pthread_mutex_lock(&ctx->allocator_lock);
+
+    if (ctx->free_summary)
+        ctx->superblock.free_blocks = ctx->free_summary->free;
+
+    pthread_mutex_unlock(&ctx->allocator_lock);
+}
+
+/*
+ * Account for count blocks from first changing state, with the
+ * shards covering them held. With a summary the superblock counter
+ * is left to nbfs_free_summary_apply().
+ */
+static void blocks_accounted(
+    nbfs_context_t *ctx,
+    uint64_t first,
+    uint64_t count,
+    bool freed)
+{
+    if (!ctx->free_summary)
+    {
+        pthread_rwlock_wrlock(&ctx->superblock_lock);
+
+        if (freed)
+            ctx->superblock.free_blocks += count;
+        else if (ctx->superblock.free_blocks >= count)
+            ctx->superblock.free_blocks -= count;
+        else
+            ctx->superblock.free_blocks = 0;
+
+        pthread_rwlock_unlock(&ctx->superblock_lock);
+    }
+
+    pthread_mutex_lock(&ctx->allocator_lock);
+
+    if (ctx->free_summary)
+        summary_adjust(ctx, first, count, freed);
+
+    if (freed)
+        nbfs_extent_index_insert(ctx, first, count);
+    else
+        nbfs_extent_index_remove(ctx, first, count);
+
+    pthread_mutex_unlock(&ctx->allocator_lock);
+
+    ctx->superblock_dirty = true;
+    ctx->dirty = true;
+}
+
+/*
+ * Shards
+ *
+ * Shard s owns bits [s * unit, (s + 1) * unit) of a bitmap, clipped
+ * to [low, bits). unit is a multiple of 64, so no bitmap word is
+ * shared between shards.
+ */
+static uint64_t shard_unit(const nbfs_bitmap_region_t *region)
+{
+    uint64_t unit =
+        (region->bits + NBFS_ALLOC_SHARDS - 1) / NBFS_ALLOC_SHARDS;
+
+    return (unit + 63) & ~63ULL;
+}
+
+static void shard_range(
+    const nbfs_bitmap_region_t *region,
+    uint32_t shard,
+    uint64_t *start,
+    uint64_t *end)
+{
+    uint64_t unit = shard_unit(region);
+
+    *start = shard * unit;
+    *end = *start + unit;
+
+    if (*start < region->low)
+        *start = region->low;
+
+    if (*end > region->bits)
+        *end = region->bits;
+}
+
+static uint32_t shard_of(
+    const nbfs_bitmap_region_t *region,
+    uint64_t bit)
+{
+    return (uint32_t)(bit / shard_unit(region));
+}
+
+/*
+ * Lock the shards covering count bits from first, in ascending
+ * order.
+ */
+static void shards_lock(
+    nbfs_context_t *ctx,
+    const nbfs_bitmap_region_t *region,
+    uint64_t first,
+    uint64_t count)
+{
+    uint32_t last = shard_of(region, first + count - 1);
+
+    for (uint32_t s = shard_of(region, first); s <= last; s++)
+        pthread_mutex_lock(&ctx->shards[s].lock);
+}
+
+static void shards_unlock(
+    nbfs_context_t *ctx,
+    const nbfs_bitmap_region_t *region,
+    uint64_t first,
+    uint64_t count)
+{
+    uint32_t last = shard_of(region, first + count - 1);
+
+    for (uint32_t s = shard_of(region, first); s <= last; s++)
+        pthread_mutex_unlock(&ctx->shards[s].lock);
+}
+
+void nbfs_allocator_freeze(nbfs_context_t *ctx)
 {
-    (void)ctx;
-    (void)block;
+    for (int s = 0; s < NBFS_ALLOC_SHARDS; s++)
+        pthread_mutex_lock(&ctx->shards[s].lock);
+}
+
+void nbfs_allocator_thaw(nbfs_context_t *ctx)
+{
+    for (int s = NBFS_ALLOC_SHARDS - 1; s >= 0; s--)
+        pthread_mutex_unlock(&ctx->shards[s].lock);
+}
+
+/*
+ * Claim or release a block range whose shards are held.
+ */
+static int range_claim(
+    nbfs_context_t *ctx,
+    const nbfs_bitmap_region_t *region,
+    uint64_t first,
+    uint64_t count)
+{
+    if (bitmap_count(ctx, region, first, count) != 0)
+        return -1;
+
+    if (bitmap_update(ctx, region, first, count, true) != (int64_t)count)
+        return -1;
+
+    blocks_accounted(ctx, first, count, false);
+
     return 0;
 }
 
-int nbfs_allocate_inode(nbfs_context_t *ctx, uint64_t *inode)
+static int range_release(
+    nbfs_context_t *ctx,
+    const nbfs_bitmap_region_t *region,
+    uint64_t first,
+    uint64_t count)
 {
-    (void)ctx;
+    /*
+     * Freeing a range that is not wholly allocated is an error and
+     * changes nothing.
+     */
+    if (bitmap_count(ctx, region, first, count) != (int64_t)count)
+        return -1;
 
-    if (!inode)
+    if (bitmap_update(ctx, region, first, count, false) != (int64_t)count)
         return -1;
 
-    *inode = 0;
+    blocks_accounted(ctx, first, count, true);
+
     return 0;
 }
 
-int nbfs_free_inode(nbfs_context_t *ctx, uint64_t inode)
+static bool range_valid(
+    const nbfs_bitmap_region_t *region,
+    uint64_t first,
+    uint64_t count)
+{
+    return first >= region->low &&
+           first < region->bits &&
+           count <= region->bits - first;
+}
+
+/*
+ * Discard
+ *
+ * Freed ranges wait here until the free is committed, merged with
+ * the range before them when they follow on. Past DISCARD_RANGES
+ * ranges, further ones are dropped: discard only gives space back,
+ * and nothing reads a free block.
+ */
+#define DISCARD_RANGES 65536
+
+struct nbfs_discard
+{
+    uint32_t count;
+    uint32_t capacity;
+
+    struct
+    {
+        uint64_t first;
+        uint64_t count;
+
+    } ranges[];
+};
+
+static void discard_queue(
+    nbfs_context_t *ctx,
+    uint64_t first,
+    uint64_t count)
+{
+    if (!ctx->discard || !ctx->backend->discard)
+        return;
+
+    pthread_mutex_lock(&ctx->discard_lock);
+
+    struct nbfs_discard *list = ctx->discards;
+
+    if (list && list->count > 0 &&
+        list->ranges[list->count - 1].first +
+        list->ranges[list->count - 1].count == first)
+    {
+        list->ranges[list->count - 1].count += count;
+        pthread_mutex_unlock(&ctx->discard_lock);
+        return;
+    }
+
+    if (!list || list->count == list->capacity)
+    {
+        uint32_t capacity = list ? list->capacity * 2 : 64;
+
+        if (capacity > DISCARD_RANGES)
+        {
+            pthread_mutex_unlock(&ctx->discard_lock);
+            return;
+        }
+
+        list = realloc(list,
+                       sizeof(*list) + capacity * sizeof(list->ranges[0]));
+
+        if (!list)
+        {
+            pthread_mutex_unlock(&ctx->discard_lock);
+            return;
+        }
+
+        if (!ctx->discards)
+            list->count = 0;
+
+        list->capacity = capacity;
+        ctx->discards = list;
+    }
+
+    list->ranges[list->count].first = first;
+    list->ranges[list->count].count = count;
+    list->count++;
+
+    pthread_mutex_unlock(&ctx->discard_lock);
+}
+
+struct nbfs_discard *nbfs_discard_take(nbfs_context_t *ctx)
+{
+    pthread_mutex_lock(&ctx->discard_lock);
+
+    struct nbfs_discard *list = ctx->discards;
+
+    ctx->discards = NULL;
+
+    pthread_mutex_unlock(&ctx->discard_lock);
+
+    return list;
+}
+
+/*
+ * Punch the parts of a range that are still free. A block claimed
+ * since it was freed keeps its data: the range is halved until the
+ * pieces are wholly free or wholly used.
+ */
+static int discard_free_part(
+    nbfs_context_t *ctx,
+    const nbfs_bitmap_region_t *region,
+    uint64_t first,
+    uint64_t count)
+{
+    int64_t used = bitmap_count(ctx, region, first, count);
+
+    if (used < 0)
+        return -1;
+
+    if (used == (int64_t)count)
+        return 0;
+
+    if (used == 0)
+    {
+        return ctx->backend->discard(ctx,
+                                     first * ctx->block_size,
+                                     count * ctx->block_size);
+    }
+
+    uint64_t half = count / 2;
+
+    if (discard_free_part(ctx, region, first, half) != 0)
+        return -1;
+
+    return discard_free_part(ctx, region, first + half, count - half);
+}
+
+void nbfs_discard_issue(
+    nbfs_context_t *ctx,
+    struct nbfs_discard *list)
+{
+    nbfs_bitmap_region_t region;
+
+    if (!list)
+        return;
+
+    if (ctx->discard &&
+        nbfs_bitmap_region(ctx, false, &region) == 0)
+    {
+        for (uint32_t n = 0; n < list->count && ctx->discard; n++)
+        {
+            uint64_t first = list->ranges[n].first;
+            uint64_t count = list->ranges[n].count;
+
+            if (!range_valid(&region, first, count))
+                continue;
+
+            shards_lock(ctx, &region, first, count);
+
+            /*
+             * The host cannot punch holes; stop trying.
+             */
+            if (discard_free_part(ctx, &region, first, count) != 0)
+                ctx->discard = false;
+
+            shards_unlock(ctx, &region, first, count);
+        }
+    }
+
+    free(list);
+}
+
+void nbfs_discard_destroy(nbfs_context_t *ctx)
 {
-    (void)ctx;
-    (void)inode;
+    free(ctx->discards);
+
+    ctx->discards = NULL;
+}
+
+int nbfs_bitmap_claim_blocks(
+    nbfs_context_t *ctx,
+    uint64_t first,
+    uint64_t count)
+{
+    nbfs_bitmap_region_t region;
+
+    if (!ctx || ctx->read_only || count == 0)
+        return -1;
+
+    if (nbfs_bitmap_region(ctx, false, &region) != 0 ||
+        !range_valid(&region, first, count))
+        return -1;
+
+    shards_lock(ctx, &region, first, count);
+
+    int result = range_claim(ctx, &region, first, count);
+
+    shards_unlock(ctx, &region, first, count);
+
+    return result;
+}
+
+int nbfs_bitmap_release_blocks(
+    nbfs_context_t *ctx,
+    uint64_t first,
+    uint64_t count)
+{
+    nbfs_bitmap_region_t region;
+
+    if (!ctx || ctx->read_only || count == 0)
+        return -1;
+
+    if (nbfs_bitmap_region(ctx, false, &region) != 0 ||
+        !range_valid(&region, first, count))
+        return -1;
+
+    shards_lock(ctx, &region, first, count);
+
+    int result = range_release(ctx, &region, first, count);
+
+    /*
+     * Still holding the shards: once they go, the blocks can be
+     * claimed again and written, and neither the cache nor a punched
+     * hole may take that data away.
+     */
+    if (result == 0)
+    {
+        nbfs_journal_revoke(ctx, first, count);
+        discard_queue(ctx, first, count);
+    }
+
+    shards_unlock(ctx, &region, first, count);
+
+    return result;
+}
+
+int nbfs_bitmap_free_runs(
+    nbfs_context_t *ctx,
+    const nbfs_bitmap_region_t *region,
+    int (*visit)(void *arg, uint64_t start, uint64_t length),
+    void *arg)
+{
+    uint64_t block_bits = (uint64_t)ctx->block_size * 8;
+    uint64_t run_start = 0;
+    bool in_run = false;
+
+    for (uint64_t base = 0; base < region->bits; base += block_bits)
+    {
+        const uint8_t *data =
+            nbfs_block_get(ctx, region->start + base / block_bits);
+
+        if (!data)
+            return -1;
+
+        for (uint64_t index = 0;
+             index < block_bits / 64 && base + index * 64 < region->bits;
+             index++)
+        {
+            uint64_t bit = base + index * 64;
+            uint64_t word = load_word(data + index * 8);
+
+            /*
+             * Everything outside [low, bits) counts as used.
+             */
+            if (bit < region->low)
+                word |= word_mask(0, (uint32_t)
+                    (region->low - bit < 64 ? region->low - bit : 64));
+
+            if (region->bits - bit < 64)
+                word |= ~word_mask(0, (uint32_t)(region->bits - bit));
+
+            /*
+             * Uniform words fall straight through; otherwise hop
+             * from edge to edge with ctz.
+             */
+            uint32_t pos = 0;
+
+            while (pos < 64)
+            {
+                uint64_t rest = (in_run ? word : ~word) >> pos;
+
+                if (!rest)
+                    break;
+
+                pos += (uint32_t)__builtin_ctzll(rest);
+
+                if (in_run)
+                {
+                    if (visit(arg, run_start, bit + pos - run_start) != 0)
+                    {
+                        nbfs_block_put(ctx, data);
+                        return -1;
+                    }
+                }
+                else
+                {
+                    run_start = bit + pos;
+                }
+
+                in_run = !in_run;
+            }
+        }
+
+        nbfs_block_put(ctx, data);
+    }
+
+    if (in_run && visit(arg, run_start, region->bits - run_start) != 0)
+        return -1;
+
     return 0;
 }
 
-static int bitmap_test(const uint8_t *bitmap, uint64_t bit)
+/*
+ * Claim the first clear bit of the shard at or after goal, wrapping
+ * around to the shard's start. The shard is held. Returns 0, 1 when
+ * the shard is full, or -1.
+ */
+static int shard_claim(
+    nbfs_context_t *ctx,
+    const nbfs_bitmap_region_t *region,
+    bool inodes,
+    uint32_t shard,
+    uint64_t goal,
+    uint64_t *bit)
 {
-    return (bitmap[bit / 8] >> (bit % 8)) & 1;
+    const struct nbfs_free_summary *summary =
+        inodes ? NULL : ctx->free_summary;
+    uint64_t start, end;
+
+    shard_range(region, shard, &start, &end);
+
+    if (start >= end)
+        return 1;
+
+    if (goal < start || goal >= end)
+        goal = start;
+
+    int result = bitmap_find_zero(ctx, region, summary, goal, end, bit);
+
+    if (result == 1 && goal > start)
+        result = bitmap_find_zero(ctx, region, summary, start, goal, bit);
+
+    if (result != 0)
+        return result;
+
+    if (inodes)
+        return bitmap_update(ctx, region, *bit, 1, true) == 1 ? 0 : -1;
+
+    return range_claim(ctx, region, *bit, 1);
 }
 
-static void bitmap_set(uint8_t *bitmap, uint64_t bit)
+/*
+ * Claim one bit, starting in the shard holding goal, or in the
+ * calling thread's shard when goal is outside the bitmap, and
+ * moving through the others in turn until one has room.
+ */
+static int shard_allocate(
+    nbfs_context_t *ctx,
+    const nbfs_bitmap_region_t *region,
+    bool inodes,
+    uint64_t goal,
+    uint64_t *bit)
 {
-    bitmap[bit / 8] |= (1u << (bit % 8));
+    bool near = goal >= region->low && goal < region->bits;
+    uint32_t home = near ? shard_of(region, goal) : nbfs_thread_shard();
+
+    for (uint32_t i = 0; i < NBFS_ALLOC_SHARDS; i++)
+    {
+        uint32_t s = (home + i) % NBFS_ALLOC_SHARDS;
+        struct nbfs_alloc_shard *shard = &ctx->shards[s];
+        uint64_t *cursor = inodes
+            ? &shard->inode_cursor
+            : &shard->block_cursor;
+
+        pthread_mutex_lock(&shard->lock);
+
+        int result = shard_claim(ctx,
+                                 region,
+                                 inodes,
+                                 s,
+                                 near && i == 0 ? goal : *cursor,
+                                 bit);
+
+        if (result == 0)
+            *cursor = *bit + 1;
+
+        pthread_mutex_unlock(&shard->lock);
+
+        if (result < 0)
+            return -1;
+
+        if (result == 0)
+        {
+            if (!near && i > 0)
+                nbfs_thread_shard_move(s);
+
+            return 0;
+        }
+    }
+
+    return -1;
 }
 
-static void bitmap_clear(uint8_t *bitmap, uint64_t bit)
+uint64_t nbfs_allocator_goal(nbfs_context_t *ctx)
 {
-    bitmap[bit / 8] &= ~(1u << (bit % 8));
+    nbfs_bitmap_region_t region;
+
+    if (nbfs_bitmap_region(ctx, false, &region) != 0)
+        return 0;
+
+    uint32_t s = nbfs_thread_shard();
+    struct nbfs_alloc_shard *shard = &ctx->shards[s];
+    uint64_t start, end;
+
+    shard_range(&region, s, &start, &end);
+
+    pthread_mutex_lock(&shard->lock);
+
+    uint64_t goal = shard->block_cursor;
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return goal >= start && goal < end ? goal : start;
 }
 
-static uint64_t bitmap_find_first_zero(const uint8_t *bitmap, uint64_t bits)
+void nbfs_allocator_advance(
+    nbfs_context_t *ctx,
+    uint64_t next)
 {
-    for (uint64_t i = 0; i < bits; i++)
+    nbfs_bitmap_region_t region;
+
+    if (nbfs_bitmap_region(ctx, false, &region) != 0 ||
+        next <= region.low ||
+        next > region.bits)
+        return;
+
+    struct nbfs_alloc_shard *shard =
+        &ctx->shards[shard_of(&region, next - 1)];
+
+    pthread_mutex_lock(&shard->lock);
+
+    shard->block_cursor = next;
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+int nbfs_allocate_block_near(
+    nbfs_context_t *ctx,
+    uint64_t goal,
+    uint64_t *block)
+{
+    nbfs_bitmap_region_t region;
+
+    if (!ctx || !block || ctx->read_only)
+        return -1;
+
+    if (nbfs_bitmap_region(ctx, false, &region) != 0)
+        return -1;
+
+    if (!ctx->free_summary)
+        nbfs_free_summary_build(ctx);
+
+    return shard_allocate(ctx, &region, false, goal, block);
+}
+
+int nbfs_allocate_block(nbfs_context_t *ctx, uint64_t *block)
+{
+    return nbfs_allocate_block_near(ctx, 0, block);
+}
+
+int nbfs_free_block(nbfs_context_t *ctx, uint64_t block)
+{
+    return nbfs_bitmap_release_blocks(ctx, block, 1);
+}
+
+int nbfs_allocate_inode(nbfs_context_t *ctx, uint64_t *inode)
+{
+    nbfs_bitmap_region_t region;
+
+    if (!ctx || !inode || ctx->read_only)
+        return -1;
+
+    if (nbfs_bitmap_region(ctx, true, &region) != 0)
+        return -1;
+
+    /*
+     * Images from older mkfs builds left the root inode clear; keep
+     * the bit set and move on.
+     */
+    do
     {
-        if (!bitmap_test(bitmap, i))
-            return i;
+        if (shard_allocate(ctx, &region, true, 0, inode) != 0)
+            return -1;
     }
+    while (*inode == ctx->superblock.root_inode);
+
+    pthread_rwlock_wrlock(&ctx->superblock_lock);
 
-    return UINT64_MAX;
+    if (ctx->superblock.free_inodes > 0)
+        ctx->superblock.free_inodes--;
+
+    pthread_rwlock_unlock(&ctx->superblock_lock);
+
+    ctx->superblock_dirty = true;
+    ctx->dirty = true;
+
+    return 0;
+}
+
+int nbfs_free_inode(nbfs_context_t *ctx, uint64_t inode)
+{
+    nbfs_bitmap_region_t region;
+
+    if (!ctx || ctx->read_only)
+        return -1;
+
+    if (nbfs_bitmap_region(ctx, true, &region) != 0)
+        return -1;
+
+    if (inode < region.low ||
+        inode >= region.bits ||
+        inode == ctx->superblock.root_inode)
+        return -1;
+
+    shards_lock(ctx, &region, inode, 1);
+
+    int64_t changed = bitmap_update(ctx, &region, inode, 1, false);
+
+    shards_unlock(ctx, &region, inode, 1);
+
+    if (changed != 1)
+        return -1;
+
+    pthread_rwlock_wrlock(&ctx->superblock_lock);
+
+    ctx->superblock.free_inodes++;
+
+    pthread_rwlock_unlock(&ctx->superblock_lock);
+
+    ctx->superblock_dirty = true;
+    ctx->dirty = true;
+
+    return 0;
 }
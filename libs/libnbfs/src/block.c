@@ -1,29 +1,111 @@
-#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "libnbfs.h"
 #include "context_internal.h"
+#include "internal/block.h"
+#include "internal/block_cache.h"
+#include "internal/journal.h"
+
+static uint32_t context_block_size(const nbfs_context_t *ctx)
+{
+    if (ctx->block_size == 0)
+        return NBFS_DEFAULT_BLOCK_SIZE;
+
+    return ctx->block_size;
+}
+
+int nbfs_io_read(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    void *buffer,
+    size_t length)
+{
+    if (!ctx || !ctx->backend || !buffer)
+        return -1;
+
+    if (ctx->backend->read(ctx, offset, buffer, length) != 0)
+        return -1;
+
+    nbfs_cache_overlay(ctx, offset, buffer, length);
+
+    return 0;
+}
+
+int nbfs_io_write(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    const void *buffer,
+    size_t length)
+{
+    if (!ctx || !ctx->backend || !buffer)
+        return -1;
+
+    if (ctx->read_only)
+        return -1;
+
+    if (ctx->backend->write(ctx, offset, buffer, length) != 0)
+        return -1;
+
+    nbfs_cache_update(ctx, offset, buffer, length);
+
+    if (length >= NBFS_WRITEBACK_WINDOW)
+        nbfs_io_writeback(ctx, offset, length);
+
+    return 0;
+}
+
+int nbfs_io_sync(nbfs_context_t *ctx)
+{
+    if (!ctx || !ctx->backend)
+        return -1;
+
+    if (!ctx->backend->sync || ctx->durability == NBFS_DURABILITY_NONE)
+        return 0;
+
+    return ctx->backend->sync(ctx,
+                              ctx->durability == NBFS_DURABILITY_FULL);
+}
+
+void nbfs_io_writeback(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    uint64_t length)
+{
+    if (!ctx->backend->writeback ||
+        ctx->durability == NBFS_DURABILITY_NONE ||
+        length == 0)
+        return;
+
+    /*
+     * Only a hint; the next sync reports any error.
+     */
+    ctx->backend->writeback(ctx, offset, length);
+}
 
 int nbfs_read_block(
     nbfs_context_t *ctx,
     uint64_t block,
     void *buffer)
 {
-    if (!ctx || !ctx->image || !buffer)
+    if (!ctx || !ctx->backend || !buffer)
         return -1;
 
-    uint32_t block_size = ctx->block_size;
+    uint32_t block_size = context_block_size(ctx);
 
-    if (block_size == 0)
-        block_size = NBFS_DEFAULT_BLOCK_SIZE;
+    void *cached = nbfs_cache_get(ctx, block, true, false);
 
-    if (fseek(ctx->image,
-              block * block_size,
-              SEEK_SET))
-        return -1;
+    if (cached)
+    {
+        memcpy(buffer, cached, block_size);
+        nbfs_cache_release(ctx, cached, false);
+        return 0;
+    }
 
-    return fread(buffer,
-                 block_size,
-                 1,
-                 ctx->image) == 1 ? 0 : -1;
+    return nbfs_io_read(ctx,
+                        block * block_size,
+                        buffer,
+                        block_size);
 }
 
 int nbfs_write_block(
@@ -31,21 +113,321 @@ int nbfs_write_block(
     uint64_t block,
     const void *buffer)
 {
-    if (!ctx || !ctx->image || !buffer)
+    if (!ctx || !ctx->backend || !buffer)
         return -1;
 
-    uint32_t block_size = ctx->block_size;
+    if (ctx->read_only)
+        return -1;
 
-    if (block_size == 0)
-        block_size = NBFS_DEFAULT_BLOCK_SIZE;
+    uint32_t block_size = context_block_size(ctx);
 
-    if (fseek(ctx->image,
-              block * block_size,
-              SEEK_SET))
+    /*
+     * Write-back: the block reaches the image at flush or eviction.
+     */
+    void *cached = nbfs_cache_get(ctx, block, false, true);
+
+    if (cached)
+    {
+        memcpy(cached, buffer, block_size);
+        nbfs_cache_release(ctx, cached, true);
+        return 0;
+    }
+
+    /*
+     * Inside a transaction nothing goes home before it is logged.
+     */
+    if (nbfs_journal_running(ctx))
         return -1;
 
-    return fwrite(buffer,
-                  block_size,
-                  1,
-                  ctx->image) == 1 ? 0 : -1;
+    return nbfs_io_write(ctx,
+                         block * block_size,
+                         buffer,
+                         block_size);
+}
+
+static void *block_access(
+    nbfs_context_t *ctx,
+    uint64_t block,
+    bool write)
+{
+    if (!ctx || !ctx->backend)
+        return NULL;
+
+    uint32_t block_size = context_block_size(ctx);
+    uint64_t offset = block * block_size;
+
+    if (ctx->map)
+    {
+        if (offset > ctx->map_size ||
+            block_size > ctx->map_size - offset)
+            return NULL;
+
+        return ctx->map + offset;
+    }
+
+    /*
+     * A cached block is handed out in place and stays resident
+     * until it is released.
+     */
+    void *cached = nbfs_cache_get(ctx, block, true, write);
+
+    if (cached)
+        return cached;
+
+    /*
+     * A private copy would be written home at release, unlogged.
+     */
+    if (write && nbfs_journal_running(ctx))
+        return NULL;
+
+    void *copy = malloc(block_size);
+
+    if (!copy)
+        return NULL;
+
+    if (nbfs_io_read(ctx, offset, copy, block_size) != 0)
+    {
+        free(copy);
+        return NULL;
+    }
+
+    return copy;
+}
+
+void *nbfs_block_acquire(
+    nbfs_context_t *ctx,
+    uint64_t block)
+{
+    return block_access(ctx, block, true);
+}
+
+int nbfs_block_release(
+    nbfs_context_t *ctx,
+    uint64_t block,
+    void *data,
+    bool dirty)
+{
+    if (!ctx || !data)
+        return -1;
+
+    const uint8_t *p = data;
+
+    if (ctx->map &&
+        p >= ctx->map &&
+        p < ctx->map + ctx->map_size)
+    {
+        if (dirty)
+            ctx->dirty = true;
+
+        return 0;
+    }
+
+    if (nbfs_cache_owns(ctx, data))
+    {
+        nbfs_cache_release(ctx, data, dirty);
+        return 0;
+    }
+
+    int result = 0;
+
+    if (dirty)
+    {
+        uint32_t block_size = context_block_size(ctx);
+
+        result = nbfs_io_write(ctx, block * block_size, data, block_size);
+
+        /*
+         * Callers that cannot unwind still learn of it at the next
+         * nbfs_flush().
+         */
+        if (result != 0)
+            ctx->write_error = true;
+    }
+
+    free(data);
+
+    return result;
+}
+
+const void *nbfs_block_get(
+    nbfs_context_t *ctx,
+    uint64_t block)
+{
+    return block_access(ctx, block, false);
+}
+
+void nbfs_block_put(
+    nbfs_context_t *ctx,
+    const void *data)
+{
+    /*
+     * Read-only release never writes, so the block number is not
+     * needed.
+     */
+    nbfs_block_release(ctx, 0, (void *)data, false);
+}
+
+static int vector_length(
+    const nbfs_iovec_t *iov,
+    int iovcnt,
+    uint32_t block_size,
+    uint64_t *length)
+{
+    uint64_t total = 0;
+
+    if (!iov || iovcnt <= 0)
+        return -1;
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (!iov[i].base && iov[i].length)
+            return -1;
+
+        total += iov[i].length;
+    }
+
+    if (total == 0 || total % block_size)
+        return -1;
+
+    *length = total;
+
+    return 0;
+}
+
+/*
+ * Multi-block transfers bypass the cache; cached copies of the
+ * blocks they cover are overlaid or refreshed afterwards.
+ */
+int nbfs_read_blocks(
+    nbfs_context_t *ctx,
+    uint64_t block,
+    uint64_t count,
+    void *buffer)
+{
+    if (!ctx || !ctx->backend || !buffer || count == 0)
+        return -1;
+
+    uint32_t block_size = context_block_size(ctx);
+
+    return nbfs_io_read(ctx,
+                        block * block_size,
+                        buffer,
+                        (size_t)(count * block_size));
+}
+
+int nbfs_write_blocks(
+    nbfs_context_t *ctx,
+    uint64_t block,
+    uint64_t count,
+    const void *buffer)
+{
+    if (!ctx || !ctx->backend || !buffer || count == 0)
+        return -1;
+
+    uint32_t block_size = context_block_size(ctx);
+
+    return nbfs_io_write(ctx,
+                         block * block_size,
+                         buffer,
+                         (size_t)(count * block_size));
+}
+
+int nbfs_readv_blocks(
+    nbfs_context_t *ctx,
+    uint64_t block,
+    const nbfs_iovec_t *iov,
+    int iovcnt)
+{
+    uint64_t length;
+
+    if (!ctx || !ctx->backend)
+        return -1;
+
+    uint32_t block_size = context_block_size(ctx);
+
+    if (vector_length(iov, iovcnt, block_size, &length) != 0)
+        return -1;
+
+    uint64_t offset = block * block_size;
+
+    if (ctx->backend->readv)
+    {
+        if (ctx->backend->readv(ctx, offset, iov, iovcnt) != 0)
+            return -1;
+
+        for (int i = 0; i < iovcnt; i++)
+        {
+            nbfs_cache_overlay(ctx, offset, iov[i].base, iov[i].length);
+            offset += iov[i].length;
+        }
+
+        return 0;
+    }
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (iov[i].length &&
+            nbfs_io_read(ctx,
+                         offset,
+                         iov[i].base,
+                         iov[i].length) != 0)
+            return -1;
+
+        offset += iov[i].length;
+    }
+
+    return 0;
+}
+
+int nbfs_writev_blocks(
+    nbfs_context_t *ctx,
+    uint64_t block,
+    const nbfs_iovec_t *iov,
+    int iovcnt)
+{
+    uint64_t length;
+
+    if (!ctx || !ctx->backend)
+        return -1;
+
+    if (ctx->read_only)
+        return -1;
+
+    uint32_t block_size = context_block_size(ctx);
+
+    if (vector_length(iov, iovcnt, block_size, &length) != 0)
+        return -1;
+
+    uint64_t offset = block * block_size;
+
+    if (ctx->backend->writev)
+    {
+        if (ctx->backend->writev(ctx, offset, iov, iovcnt) != 0)
+            return -1;
+
+        for (int i = 0; i < iovcnt; i++)
+        {
+            nbfs_cache_update(ctx, offset, iov[i].base, iov[i].length);
+            offset += iov[i].length;
+        }
+
+        if (length >= NBFS_WRITEBACK_WINDOW)
+            nbfs_io_writeback(ctx, block * block_size, length);
+
+        return 0;
+    }
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (iov[i].length &&
+            nbfs_io_write(ctx,
+                          offset,
+                          iov[i].base,
+                          iov[i].length) != 0)
+            return -1;
+
+        offset += iov[i].length;
+    }
+
+    return 0;
 }
@@ -0,0 +1,445 @@
+/*
+ * NeoBench Filesystem Library
+ *
+ * block_async.c
+ *
+ * Asynchronous block I/O
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libnbfs.h"
+#include "context_internal.h"
+#include "internal/aio.h"
+#include "internal/block.h"
+#include "internal/block_cache.h"
+
+/*
+ * Longest single ring entry; longer requests go round in pieces.
+ */
+#define AIO_CHUNK (1u << 30)
+
+struct aio_request
+{
+    uint64_t tag;
+
+    uint64_t offset;
+
+    uint8_t *buffer;
+
+    uint64_t length;
+
+    /* Bytes moved so far */
+    uint64_t done;
+
+    int result;
+
+    bool write;
+};
+
+struct nbfs_aio
+{
+    struct nbfs_uring *ring;
+
+    uint32_t depth;
+
+    /* Requests submitted and not yet reaped */
+    uint32_t in_flight;
+
+    struct aio_request *requests;
+
+    uint32_t *free_slots;
+    uint32_t free_count;
+
+    /* Finished requests, oldest first, waiting for nbfs_reap() */
+    uint32_t *finished;
+    uint32_t finished_head;
+    uint32_t finished_count;
+};
+
+static uint32_t context_block_size(const nbfs_context_t *ctx)
+{
+    if (ctx->block_size == 0)
+        return NBFS_DEFAULT_BLOCK_SIZE;
+
+    return ctx->block_size;
+}
+
+static void aio_free(struct nbfs_aio *aio)
+{
+    nbfs_uring_destroy(aio->ring);
+
+    free(aio->requests);
+    free(aio->free_slots);
+    free(aio->finished);
+    free(aio);
+}
+
+static struct nbfs_aio *aio_state(nbfs_context_t *ctx)
+{
+    if (ctx->aio)
+        return ctx->aio;
+
+    uint32_t depth = ctx->queue_depth
+        ? ctx->queue_depth
+        : NBFS_QUEUE_DEPTH_DEFAULT;
+
+    struct nbfs_aio *aio = calloc(1, sizeof(*aio));
+
+    if (!aio)
+        return NULL;
+
+    aio->depth = depth;
+    aio->requests = calloc(depth, sizeof(*aio->requests));
+    aio->free_slots = malloc(depth * sizeof(uint32_t));
+    aio->finished = malloc(depth * sizeof(uint32_t));
+
+    if (!aio->requests || !aio->free_slots || !aio->finished)
+    {
+        aio_free(aio);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < depth; i++)
+        aio->free_slots[i] = depth - 1 - i;
+
+    aio->free_count = depth;
+
+    /*
+     * A mapping is already as asynchronous as it gets; only a file
+     * descriptor benefits from a ring.
+     */
+    if (ctx->backend == &nbfs_posix_backend && ctx->fd >= 0)
+        aio->ring = nbfs_uring_create(ctx->fd, depth);
+
+    ctx->aio = aio;
+
+    return aio;
+}
+
+static void aio_finish(
+    struct nbfs_aio *aio,
+    uint32_t slot)
+{
+    uint32_t at = (aio->finished_head + aio->finished_count) % aio->depth;
+
+    aio->finished[at] = slot;
+    aio->finished_count++;
+}
+
+static int aio_queue(
+    struct nbfs_aio *aio,
+    uint32_t slot)
+{
+    struct aio_request *request = &aio->requests[slot];
+
+    uint64_t left = request->length - request->done;
+    uint32_t length = left > AIO_CHUNK ? AIO_CHUNK : (uint32_t)left;
+
+    return nbfs_uring_queue(aio->ring,
+                            request->write,
+                            request->buffer + request->done,
+                            length,
+                            request->offset + request->done,
+                            slot);
+}
+
+/*
+ * Take every completion off the ring. Short transfers and
+ * interrupted requests go back on for the rest.
+ */
+static void aio_drain(
+    nbfs_context_t *ctx,
+    struct nbfs_aio *aio)
+{
+    uint64_t slot;
+    int32_t result;
+
+    while (nbfs_uring_complete(aio->ring, &slot, &result) == 1)
+    {
+        struct aio_request *request = &aio->requests[slot];
+        bool again = false;
+
+        if (result == -EINTR || result == -EAGAIN)
+        {
+            again = true;
+        }
+        else if (result > 0)
+        {
+            request->done += (uint64_t)result;
+            again = request->done < request->length;
+        }
+        else
+        {
+            /*
+             * An error, or nothing moved at the end of the image.
+             */
+            request->result = -1;
+        }
+
+        if (again && aio_queue(aio, (uint32_t)slot) == 0)
+            continue;
+
+        if (request->done < request->length)
+            request->result = -1;
+
+        if (request->result == 0 && !request->write)
+            nbfs_cache_overlay(ctx,
+                               request->offset,
+                               request->buffer,
+                               request->length);
+
+        aio_finish(aio, (uint32_t)slot);
+    }
+}
+
+static int aio_submit(
+    nbfs_context_t *ctx,
+    uint64_t block,
+    uint64_t count,
+    void *buffer,
+    uint64_t tag,
+    bool write)
+{
+    if (!ctx || !ctx->backend || !buffer || count == 0)
+        return -1;
+
+    if (write && ctx->read_only)
+        return -1;
+
+    uint32_t block_size = context_block_size(ctx);
+
+    pthread_mutex_lock(&ctx->aio_lock);
+
+    struct nbfs_aio *aio = aio_state(ctx);
+
+    if (!aio || aio->free_count == 0)
+    {
+        pthread_mutex_unlock(&ctx->aio_lock);
+        return -1;
+    }
+
+    uint32_t slot = aio->free_slots[--aio->free_count];
+    struct aio_request *request = &aio->requests[slot];
+
+    request->tag = tag;
+    request->offset = block * block_size;
+    request->buffer = buffer;
+    request->length = count * block_size;
+    request->done = 0;
+    request->result = 0;
+    request->write = write;
+
+    aio->in_flight++;
+
+    if (aio->ring)
+    {
+        /*
+         * The cache must not write an older copy over these blocks
+         * later, and readers see the new data from now on.
+         */
+        if (write)
+            nbfs_cache_update(ctx, request->offset, buffer,
+                              request->length);
+
+        int result = aio_queue(aio, slot);
+
+        if (result != 0)
+        {
+            aio->free_slots[aio->free_count++] = slot;
+            aio->in_flight--;
+        }
+
+        pthread_mutex_unlock(&ctx->aio_lock);
+
+        return result;
+    }
+
+    /*
+     * No ring: do the transfer now, outside the lock, and leave the
+     * completion for nbfs_reap().
+     */
+    pthread_mutex_unlock(&ctx->aio_lock);
+
+    int result = write
+        ? nbfs_io_write(ctx, request->offset, buffer, request->length)
+        : nbfs_io_read(ctx, request->offset, buffer, request->length);
+
+    pthread_mutex_lock(&ctx->aio_lock);
+
+    request->result = result;
+    request->done = result == 0 ? request->length : 0;
+
+    aio_finish(aio, slot);
+
+    pthread_mutex_unlock(&ctx->aio_lock);
+
+    return 0;
+}
+
+int nbfs_submit_read(
+    nbfs_context_t *ctx,
+    uint64_t block,
+    uint64_t count,
+    void *buffer,
+    uint64_t tag)
+{
+    return aio_submit(ctx, block, count, buffer, tag, false);
+}
+
+int nbfs_submit_write(
+    nbfs_context_t *ctx,
+    uint64_t block,
+    uint64_t count,
+    const void *buffer,
+    uint64_t tag)
+{
+    return aio_submit(ctx, block, count, (void *)buffer, tag, true);
+}
+
+int nbfs_reap(
+    nbfs_context_t *ctx,
+    nbfs_completion_t *completions,
+    int max,
+    int wait)
+{
+    if (!ctx || max < 0 || wait < 0 || (max > 0 && !completions))
+        return -1;
+
+    pthread_mutex_lock(&ctx->aio_lock);
+
+    struct nbfs_aio *aio = ctx->aio;
+
+    if (!aio)
+    {
+        pthread_mutex_unlock(&ctx->aio_lock);
+        return 0;
+    }
+
+    uint32_t need = (uint32_t)(wait < max ? wait : max);
+
+    if (need > aio->in_flight)
+        need = aio->in_flight;
+
+    if (aio->ring)
+    {
+        /*
+         * Hand the kernel everything queued in one call, then wait
+         * until enough has finished. Requests a short transfer put
+         * back on the ring go out with the next wait.
+         */
+        if (nbfs_uring_submit(aio->ring, 0) != 0)
+        {
+            pthread_mutex_unlock(&ctx->aio_lock);
+            return -1;
+        }
+
+        aio_drain(ctx, aio);
+
+        while (aio->finished_count < need)
+        {
+            if (nbfs_uring_submit(aio->ring, 1) != 0)
+            {
+                pthread_mutex_unlock(&ctx->aio_lock);
+                return -1;
+            }
+
+            aio_drain(ctx, aio);
+        }
+    }
+
+    int reaped = 0;
+
+    while (reaped < max && aio->finished_count > 0)
+    {
+        uint32_t slot = aio->finished[aio->finished_head];
+        struct aio_request *request = &aio->requests[slot];
+
+        completions[reaped].tag = request->tag;
+        completions[reaped].result = request->result;
+        reaped++;
+
+        aio->finished_head = (aio->finished_head + 1) % aio->depth;
+        aio->finished_count--;
+
+        aio->free_slots[aio->free_count++] = slot;
+        aio->in_flight--;
+    }
+
+    pthread_mutex_unlock(&ctx->aio_lock);
+
+    return reaped;
+}
+
+int nbfs_set_queue_depth(
+    nbfs_context_t *ctx,
+    uint32_t depth)
+{
+    if (!ctx || depth == 0 || depth > NBFS_QUEUE_DEPTH_MAX)
+        return -1;
+
+    pthread_mutex_lock(&ctx->aio_lock);
+
+    if (ctx->aio && ctx->aio->in_flight)
+    {
+        pthread_mutex_unlock(&ctx->aio_lock);
+        return -1;
+    }
+
+    /*
+     * The ring is sized at creation; the next submission builds a
+     * new one.
+     */
+    if (ctx->aio)
+    {
+        aio_free(ctx->aio);
+        ctx->aio = NULL;
+    }
+
+    ctx->queue_depth = depth;
+
+    pthread_mutex_unlock(&ctx->aio_lock);
+
+    return 0;
+}
+
+uint32_t nbfs_get_queue_depth(nbfs_context_t *ctx)
+{
+    if (!ctx)
+        return 0;
+
+    return ctx->queue_depth ? ctx->queue_depth : NBFS_QUEUE_DEPTH_DEFAULT;
+}
+
+void nbfs_aio_destroy(nbfs_context_t *ctx)
+{
+    struct nbfs_aio *aio = ctx->aio;
+
+    if (!aio)
+        return;
+
+    /*
+     * The kernel may still be writing into the caller's buffers and
+     * reading from the descriptor; let it finish first. Each request
+     * has at most one entry on the ring.
+     */
+    if (aio->ring)
+    {
+        uint32_t pending = aio->in_flight - aio->finished_count;
+        uint64_t slot;
+        int32_t result;
+
+        while (pending > 0 && nbfs_uring_submit(aio->ring, 1) == 0)
+        {
+            while (pending > 0 &&
+                   nbfs_uring_complete(aio->ring, &slot, &result) == 1)
+                pending--;
+        }
+    }
+
+    aio_free(aio);
+    ctx->aio = NULL;
+}
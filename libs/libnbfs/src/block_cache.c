@@ -0,0 +1,1382 @@
+/*
+ * NeoBench Filesystem Library
+ *
+ * block_cache.c
+ *
+ * Write-back block cache
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libnbfs.h"
+#include "internal/block.h"
+#include "internal/block_cache.h"
+#include "internal/inode_cache.h"
+#include "internal/journal.h"
+
+#define CACHE_NONE (-1)
+
+/*
+ * cache_claim() dropped the lock to write a victim back, and the
+ * block came in meanwhile: look it up again.
+ */
+#define CACHE_AGAIN (-2)
+
+/*
+ * Largest number of slots written back with one vectored request.
+ */
+#define CACHE_FLUSH_RUN 256
+
+typedef struct
+{
+    uint64_t block;
+
+    int32_t next;
+
+    uint32_t refs;
+    uint32_t pins;
+
+    bool valid;
+    bool loading;
+    bool dirty;
+    bool referenced;
+
+    /*
+     * Being written home with the lock dropped. The slot is held
+     * meanwhile and counts as clean unless dirtied again.
+     */
+    bool writing;
+
+    /*
+     * Dirtied inside a journal transaction: stays resident until
+     * the journal writes it home.
+     */
+    bool journaled;
+
+} cache_slot_t;
+
+struct nbfs_cache
+{
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+
+    uint32_t block_size;
+    uint32_t slots;
+    uint32_t hand;
+
+    uint32_t bucket_mask;
+    int32_t *buckets;
+
+    cache_slot_t *slot;
+    uint8_t *data;
+
+    uint32_t resident;
+    uint32_t dirty;
+    uint32_t pinned;
+    uint32_t journaled;
+    uint32_t writing;
+
+    /*
+     * Slots held or pinned, or both; never evictable.
+     */
+    uint32_t busy;
+
+    nbfs_cache_stats_t stats;
+};
+
+static uint32_t cache_hash(const struct nbfs_cache *c, uint64_t block)
+{
+    return (uint32_t)((block * 0x9E3779B97F4A7C15ull) >> 32) &
+           c->bucket_mask;
+}
+
+static uint8_t *slot_data(const struct nbfs_cache *c, int32_t i)
+{
+    return c->data + (size_t)i * c->block_size;
+}
+
+static int32_t cache_lookup(const struct nbfs_cache *c, uint64_t block)
+{
+    int32_t i = c->buckets[cache_hash(c, block)];
+
+    while (i != CACHE_NONE && c->slot[i].block != block)
+        i = c->slot[i].next;
+
+    return i;
+}
+
+static void cache_link(struct nbfs_cache *c, int32_t i)
+{
+    uint32_t h = cache_hash(c, c->slot[i].block);
+
+    c->slot[i].next = c->buckets[h];
+    c->buckets[h] = i;
+}
+
+static void cache_unlink(struct nbfs_cache *c, int32_t i)
+{
+    int32_t *p = &c->buckets[cache_hash(c, c->slot[i].block)];
+
+    while (*p != i)
+        p = &c->slot[*p].next;
+
+    *p = c->slot[i].next;
+}
+
+/*
+ * References and pins. A slot is busy while it has either.
+ */
+static void cache_hold(struct nbfs_cache *c, int32_t i)
+{
+    cache_slot_t *s = &c->slot[i];
+
+    if (s->refs++ == 0 && s->pins == 0)
+        c->busy++;
+}
+
+static void cache_drop(struct nbfs_cache *c, int32_t i)
+{
+    cache_slot_t *s = &c->slot[i];
+
+    if (--s->refs == 0 && s->pins == 0)
+        c->busy--;
+}
+
+static void cache_pin_slot(struct nbfs_cache *c, int32_t i)
+{
+    cache_slot_t *s = &c->slot[i];
+
+    if (s->pins++ > 0)
+        return;
+
+    c->pinned++;
+
+    if (s->refs == 0)
+        c->busy++;
+}
+
+static void cache_unpin_slot(struct nbfs_cache *c, int32_t i)
+{
+    cache_slot_t *s = &c->slot[i];
+
+    if (--s->pins > 0)
+        return;
+
+    c->pinned--;
+
+    if (s->refs == 0)
+        c->busy--;
+}
+
+static void cache_clean(struct nbfs_cache *c, int32_t i)
+{
+    cache_slot_t *s = &c->slot[i];
+
+    if (s->journaled)
+    {
+        s->journaled = false;
+        c->journaled--;
+    }
+
+    if (s->dirty)
+    {
+        s->dirty = false;
+        c->dirty--;
+    }
+}
+
+/*
+ * CLOCK: sweep the hand past busy slots, giving referenced slots
+ * a second chance. Two full turns without a victim means every
+ * slot is held, pinned or waiting for the journal; when the count
+ * of busy slots already says so, there is no sweep at all.
+ */
+static int32_t cache_victim(struct nbfs_cache *c)
+{
+    if (c->busy >= c->slots)
+        return CACHE_NONE;
+
+    for (uint32_t n = 0; n < 2 * c->slots; n++)
+    {
+        int32_t i = (int32_t)c->hand;
+        cache_slot_t *s = &c->slot[i];
+
+        c->hand = (c->hand + 1) % c->slots;
+
+        if (!s->valid)
+            return i;
+
+        if (s->refs || s->pins || s->loading || s->journaled)
+            continue;
+
+        if (s->referenced)
+        {
+            s->referenced = false;
+            continue;
+        }
+
+        return i;
+    }
+
+    return CACHE_NONE;
+}
+
+/*
+ * Take slot i for the running transaction, unless the transaction
+ * already holds as many blocks as the journal can log.
+ */
+static bool cache_journal(
+    struct nbfs_cache *c,
+    int32_t i,
+    uint32_t capacity)
+{
+    cache_slot_t *s = &c->slot[i];
+
+    if (s->journaled)
+        return true;
+
+    if (c->journaled >= capacity)
+        return false;
+
+    s->journaled = true;
+    c->journaled++;
+
+    return true;
+}
+
+/*
+ * Writing back. The slots are held and marked writing, and counted
+ * clean from the start: a holder that changes one meanwhile dirties
+ * it again, to be written after this. The lock is dropped for the
+ * I/O itself.
+ */
+static void write_begin(
+    struct nbfs_cache *c,
+    const int32_t *order,
+    uint32_t count)
+{
+    for (uint32_t n = 0; n < count; n++)
+    {
+        int32_t i = order[n];
+
+        cache_hold(c, i);
+        cache_clean(c, i);
+
+        c->slot[i].writing = true;
+        c->writing++;
+    }
+}
+
+/*
+ * Slots whose write failed are dirty again, and back with the
+ * journal if they were taken from it.
+ */
+static void write_end(
+    struct nbfs_cache *c,
+    const int32_t *order,
+    uint32_t count,
+    bool journaled,
+    bool failed)
+{
+    for (uint32_t n = 0; n < count; n++)
+    {
+        int32_t i = order[n];
+        cache_slot_t *s = &c->slot[i];
+
+        s->writing = false;
+        c->writing--;
+
+        if (!failed)
+            c->stats.writebacks++;
+        else
+        {
+            if (!s->dirty)
+            {
+                s->dirty = true;
+                c->dirty++;
+            }
+
+            if (journaled && !s->journaled)
+            {
+                s->journaled = true;
+                c->journaled++;
+            }
+        }
+
+        /*
+         * Taken for a transaction meanwhile and left unchanged, as
+         * at nbfs_cache_release().
+         */
+        if (!s->dirty && s->journaled && s->refs == 1)
+        {
+            s->journaled = false;
+            c->journaled--;
+        }
+
+        cache_drop(c, i);
+    }
+
+    pthread_cond_broadcast(&c->loaded);
+}
+
+static void cache_evict(
+    struct nbfs_cache *c,
+    int32_t i)
+{
+    cache_slot_t *s = &c->slot[i];
+
+    if (!s->valid)
+        return;
+
+    cache_unlink(c, i);
+
+    s->valid = false;
+    c->resident--;
+    c->stats.evictions++;
+}
+
+/*
+ * Give back a slot claimed for a block that never arrived.
+ */
+static void cache_unclaim(struct nbfs_cache *c, int32_t i)
+{
+    cache_slot_t *s = &c->slot[i];
+
+    cache_clean(c, i);
+    cache_unlink(c, i);
+    cache_drop(c, i);
+
+    s->loading = false;
+    s->valid = false;
+    c->resident--;
+
+    pthread_cond_broadcast(&c->loaded);
+}
+
+static int32_t cache_index(const struct nbfs_cache *c, const void *data)
+{
+    return (int32_t)(((const uint8_t *)data - c->data) / c->block_size);
+}
+
+static int flush_run(
+    nbfs_context_t *ctx,
+    struct nbfs_cache *c,
+    const int32_t *run,
+    int count);
+
+/*
+ * Claim a free or evictable slot for block and start loading it.
+ * Called with the lock held; the slot is held until unloaded. A
+ * dirty victim is written back with the lock dropped, and the sweep
+ * goes on; CACHE_AGAIN when block arrived in the meantime.
+ */
+static int32_t cache_claim(
+    nbfs_context_t *ctx,
+    struct nbfs_cache *c,
+    uint64_t block)
+{
+    int32_t i;
+
+    while ((i = cache_victim(c)) != CACHE_NONE &&
+           c->slot[i].valid &&
+           c->slot[i].dirty)
+    {
+        write_begin(c, &i, 1);
+
+        pthread_mutex_unlock(&c->lock);
+
+        int result = flush_run(ctx, c, &i, 1);
+
+        pthread_mutex_lock(&c->lock);
+
+        write_end(c, &i, 1, false, result != 0);
+
+        if (result != 0)
+            return CACHE_NONE;
+
+        if (cache_lookup(c, block) != CACHE_NONE)
+            return CACHE_AGAIN;
+    }
+
+    if (i == CACHE_NONE)
+        return CACHE_NONE;
+
+    cache_evict(c, i);
+
+    cache_slot_t *s = &c->slot[i];
+
+    s->block = block;
+    s->refs = 0;
+    s->pins = 0;
+    s->valid = true;
+    s->dirty = false;
+    s->journaled = false;
+    s->referenced = true;
+    s->loading = true;
+
+    s->writing = false;
+
+    cache_link(c, i);
+    cache_hold(c, i);
+    c->resident++;
+
+    return i;
+}
+
+void *nbfs_cache_get(
+    nbfs_context_t *ctx,
+    uint64_t block,
+    bool read,
+    bool write)
+{
+    struct nbfs_cache *c = ctx->cache;
+
+    if (!c)
+        return NULL;
+
+    bool journaled = write && nbfs_journal_running(ctx);
+    uint32_t capacity = journaled ? nbfs_journal_capacity(ctx) : 0;
+
+    pthread_mutex_lock(&c->lock);
+
+    int32_t i;
+
+again:
+    while ((i = cache_lookup(c, block)) != CACHE_NONE &&
+           c->slot[i].loading)
+    {
+        pthread_cond_wait(&c->loaded, &c->lock);
+    }
+
+    if (i != CACHE_NONE)
+    {
+        if (journaled && !cache_journal(c, i, capacity))
+        {
+            pthread_mutex_unlock(&c->lock);
+            return NULL;
+        }
+
+        cache_hold(c, i);
+        c->slot[i].referenced = true;
+        c->stats.hits++;
+
+        pthread_mutex_unlock(&c->lock);
+
+        return slot_data(c, i);
+    }
+
+    if (journaled && c->journaled >= capacity)
+    {
+        pthread_mutex_unlock(&c->lock);
+        return NULL;
+    }
+
+    /*
+     * The slot stays loading until its contents are real: after
+     * the read below, or at release when the caller fills it.
+     */
+    i = cache_claim(ctx, c, block);
+
+    if (i == CACHE_AGAIN)
+        goto again;
+
+    if (i == CACHE_NONE)
+    {
+        pthread_mutex_unlock(&c->lock);
+        return NULL;
+    }
+
+    c->stats.misses++;
+
+    /*
+     * The transaction may have filled up while a victim was being
+     * written back.
+     */
+    if (journaled && !cache_journal(c, i, capacity))
+    {
+        cache_unclaim(c, i);
+
+        pthread_mutex_unlock(&c->lock);
+        return NULL;
+    }
+
+    if (!read)
+    {
+        pthread_mutex_unlock(&c->lock);
+        return slot_data(c, i);
+    }
+
+    pthread_mutex_unlock(&c->lock);
+
+    int result = ctx->backend->read(ctx,
+                                    block * c->block_size,
+                                    slot_data(c, i),
+                                    c->block_size);
+
+    pthread_mutex_lock(&c->lock);
+
+    if (result != 0)
+        cache_unclaim(c, i);
+    else
+    {
+        c->slot[i].loading = false;
+        pthread_cond_broadcast(&c->loaded);
+    }
+
+    pthread_mutex_unlock(&c->lock);
+
+    return result == 0 ? slot_data(c, i) : NULL;
+}
+
+void nbfs_cache_release(
+    nbfs_context_t *ctx,
+    void *data,
+    bool dirty)
+{
+    struct nbfs_cache *c = ctx->cache;
+
+    if (!c || !data)
+        return;
+
+    cache_slot_t *s = &c->slot[cache_index(c, data)];
+
+    pthread_mutex_lock(&c->lock);
+
+    if (dirty && !s->dirty)
+    {
+        s->dirty = true;
+        c->dirty++;
+    }
+
+    /*
+     * Taken for the transaction but left unchanged by its last
+     * holder: the journal has nothing to log for it.
+     */
+    if (!s->dirty && s->journaled && s->refs == 1)
+    {
+        s->journaled = false;
+        c->journaled--;
+    }
+
+    if (s->loading)
+    {
+        s->loading = false;
+        pthread_cond_broadcast(&c->loaded);
+    }
+
+    cache_drop(c, cache_index(c, data));
+
+    pthread_mutex_unlock(&c->lock);
+
+    if (dirty)
+        ctx->dirty = true;
+}
+
+uint64_t nbfs_cache_prefetch(
+    nbfs_context_t *ctx,
+    uint64_t first,
+    uint64_t count,
+    bool pin)
+{
+    struct nbfs_cache *c = ctx->cache;
+
+    if (!c || count == 0)
+        return 0;
+
+    if (count > c->slots / 2)
+        count = c->slots / 2;
+
+    int32_t *claimed = malloc(sizeof(*claimed) * (size_t)count);
+    nbfs_iovec_t *iov = malloc(sizeof(*iov) * (size_t)count);
+
+    if (!claimed || !iov)
+    {
+        free(claimed);
+        free(iov);
+        return 0;
+    }
+
+    uint64_t resident = 0;
+    uint64_t fresh = 0;
+
+    pthread_mutex_lock(&c->lock);
+
+    for (uint64_t n = 0; n < count; n++)
+    {
+        int32_t i = cache_lookup(c, first + n);
+
+        if (i == CACHE_NONE)
+        {
+            i = cache_claim(ctx, c, first + n);
+
+            if (i == CACHE_AGAIN)
+            {
+                n--;
+                continue;
+            }
+        }
+        else if (c->slot[i].loading)
+            continue;
+        else
+            cache_hold(c, i);
+
+        if (i == CACHE_NONE)
+            break;
+
+        if (c->slot[i].loading)
+            claimed[fresh++] = i;
+        else
+        {
+            if (pin)
+                cache_pin_slot(c, i);
+
+            cache_drop(c, i);
+            resident++;
+        }
+    }
+
+    pthread_mutex_unlock(&c->lock);
+
+    /*
+     * Fresh slots are claimed in block order, so every run of
+     * consecutive block numbers is one read.
+     */
+    uint64_t start = 0;
+
+    while (start < fresh)
+    {
+        uint64_t end = start + 1;
+
+        while (end < fresh &&
+               c->slot[claimed[end]].block ==
+               c->slot[claimed[end - 1]].block + 1)
+        {
+            end++;
+        }
+
+        for (uint64_t n = start; n < end; n++)
+        {
+            iov[n - start].base = slot_data(c, claimed[n]);
+            iov[n - start].length = c->block_size;
+        }
+
+        uint64_t offset = c->slot[claimed[start]].block * c->block_size;
+        int result = 0;
+
+        if (ctx->backend->readv)
+            result = ctx->backend->readv(ctx, offset, iov, (int)(end - start));
+        else
+        {
+            for (uint64_t n = 0; n < end - start && result == 0; n++)
+            {
+                result = ctx->backend->read(ctx,
+                                            offset + n * c->block_size,
+                                            iov[n].base,
+                                            c->block_size);
+            }
+        }
+
+        pthread_mutex_lock(&c->lock);
+
+        for (uint64_t n = start; n < end; n++)
+        {
+            int32_t i = claimed[n];
+            cache_slot_t *s = &c->slot[i];
+
+            s->loading = false;
+            cache_drop(c, i);
+
+            if (result != 0)
+            {
+                cache_unlink(c, i);
+                s->valid = false;
+                c->resident--;
+                continue;
+            }
+
+            if (pin)
+                cache_pin_slot(c, i);
+
+            resident++;
+        }
+
+        c->stats.misses += end - start;
+
+        pthread_cond_broadcast(&c->loaded);
+        pthread_mutex_unlock(&c->lock);
+
+        start = end;
+    }
+
+    free(claimed);
+    free(iov);
+
+    return resident;
+}
+
+bool nbfs_cache_owns(
+    nbfs_context_t *ctx,
+    const void *data)
+{
+    const struct nbfs_cache *c = ctx->cache;
+    const uint8_t *p = data;
+
+    return c &&
+           p >= c->data &&
+           p < c->data + (size_t)c->slots * c->block_size;
+}
+
+/*
+ * Call fn for every resident slot whose block falls in
+ * [first, last]. Walks whichever is shorter: the block range or the
+ * slot array. Slots still being read are waited for, and with
+ * written set so are those being written back.
+ */
+static bool slot_settling(
+    const cache_slot_t *s,
+    bool written)
+{
+    return s->loading || (written && s->writing);
+}
+
+static void cache_range(
+    struct nbfs_cache *c,
+    uint64_t first,
+    uint64_t last,
+    bool written,
+    void (*fn)(struct nbfs_cache *, int32_t, void *),
+    void *arg)
+{
+    if (last - first < c->slots)
+    {
+        for (uint64_t block = first; block <= last; block++)
+        {
+            int32_t i;
+
+            while ((i = cache_lookup(c, block)) != CACHE_NONE &&
+                   slot_settling(&c->slot[i], written))
+            {
+                pthread_cond_wait(&c->loaded, &c->lock);
+            }
+
+            if (i != CACHE_NONE)
+                fn(c, i, arg);
+        }
+
+        return;
+    }
+
+    for (int32_t i = 0; i < (int32_t)c->slots; i++)
+    {
+        while (c->slot[i].valid && slot_settling(&c->slot[i], written))
+            pthread_cond_wait(&c->loaded, &c->lock);
+
+        if (c->slot[i].valid &&
+            c->slot[i].block >= first &&
+            c->slot[i].block <= last)
+        {
+            fn(c, i, arg);
+        }
+    }
+}
+
+typedef struct
+{
+    uint64_t offset;
+    uint64_t length;
+    uint8_t *buffer;
+
+} cache_span_t;
+
+/*
+ * Intersect slot i with a byte span. Returns the number of bytes
+ * in common and their offsets within the slot and the span.
+ */
+static uint64_t span_intersect(
+    const struct nbfs_cache *c,
+    int32_t i,
+    const cache_span_t *span,
+    uint64_t *slot_offset,
+    uint64_t *span_offset)
+{
+    uint64_t start = c->slot[i].block * c->block_size;
+    uint64_t end = start + c->block_size;
+
+    uint64_t lo = span->offset > start ? span->offset : start;
+    uint64_t hi = span->offset + span->length < end
+        ? span->offset + span->length
+        : end;
+
+    *slot_offset = lo - start;
+    *span_offset = lo - span->offset;
+
+    return hi - lo;
+}
+
+static void overlay_slot(struct nbfs_cache *c, int32_t i, void *arg)
+{
+    cache_span_t *span = arg;
+    uint64_t slot_offset, span_offset;
+
+    /*
+     * A slot being written back may not have reached the image
+     * the buffer came from.
+     */
+    if (!c->slot[i].dirty && !c->slot[i].writing)
+        return;
+
+    uint64_t n = span_intersect(c, i, span, &slot_offset, &span_offset);
+
+    memcpy(span->buffer + span_offset,
+           slot_data(c, i) + slot_offset,
+           (size_t)n);
+}
+
+static void update_slot(struct nbfs_cache *c, int32_t i, void *arg)
+{
+    cache_span_t *span = arg;
+    uint64_t slot_offset, span_offset;
+
+    uint64_t n = span_intersect(c, i, span, &slot_offset, &span_offset);
+
+    memcpy(slot_data(c, i) + slot_offset,
+           span->buffer + span_offset,
+           (size_t)n);
+
+    cache_slot_t *s = &c->slot[i];
+
+    /*
+     * A block written in full is now identical on disk, unless a
+     * write-back of the old contents is still on its way there.
+     */
+    if (s->writing)
+    {
+        if (!s->dirty)
+        {
+            s->dirty = true;
+            c->dirty++;
+        }
+    }
+    else if (n == c->block_size)
+        cache_clean(c, i);
+}
+
+void nbfs_cache_overlay(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    void *buffer,
+    uint64_t length)
+{
+    struct nbfs_cache *c = ctx->cache;
+
+    if (!c || length == 0)
+        return;
+
+    pthread_mutex_lock(&c->lock);
+
+    if (c->dirty || c->writing)
+    {
+        cache_span_t span = { offset, length, buffer };
+
+        cache_range(c,
+                    offset / c->block_size,
+                    (offset + length - 1) / c->block_size,
+                    false,
+                    overlay_slot,
+                    &span);
+    }
+
+    pthread_mutex_unlock(&c->lock);
+}
+
+void nbfs_cache_update(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    const void *buffer,
+    uint64_t length)
+{
+    struct nbfs_cache *c = ctx->cache;
+
+    if (!c || length == 0)
+        return;
+
+    pthread_mutex_lock(&c->lock);
+
+    if (c->resident)
+    {
+        cache_span_t span = { offset, length, (uint8_t *)buffer };
+
+        cache_range(c,
+                    offset / c->block_size,
+                    (offset + length - 1) / c->block_size,
+                    false,
+                    update_slot,
+                    &span);
+    }
+
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void discard_slot(struct nbfs_cache *c, int32_t i, void *arg)
+{
+    cache_slot_t *s = &c->slot[i];
+
+    (void)arg;
+
+    cache_clean(c, i);
+
+    if (s->refs || s->pins)
+        return;
+
+    cache_unlink(c, i);
+
+    s->valid = false;
+    c->resident--;
+}
+
+void nbfs_cache_discard(
+    nbfs_context_t *ctx,
+    uint64_t first,
+    uint64_t count)
+{
+    struct nbfs_cache *c = ctx->cache;
+
+    if (!c || count == 0)
+        return;
+
+    pthread_mutex_lock(&c->lock);
+
+    if (c->resident)
+        cache_range(c, first, first + count - 1, true, discard_slot, NULL);
+
+    pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * qsort() has no context argument in C11. The cache lock keeps one
+ * context's flushes apart, but not those of two contexts, so each
+ * thread has its own pointer.
+ */
+static _Thread_local const struct nbfs_cache *sort_cache;
+
+static int compare_slot_block(const void *a, const void *b)
+{
+    uint64_t x = sort_cache->slot[*(const int32_t *)a].block;
+    uint64_t y = sort_cache->slot[*(const int32_t *)b].block;
+
+    return (x > y) - (x < y);
+}
+
+static int flush_run(
+    nbfs_context_t *ctx,
+    struct nbfs_cache *c,
+    const int32_t *run,
+    int count)
+{
+    nbfs_iovec_t iov[CACHE_FLUSH_RUN];
+    uint64_t offset = c->slot[run[0]].block * c->block_size;
+
+    for (int n = 0; n < count; n++)
+    {
+        iov[n].base = slot_data(c, run[n]);
+        iov[n].length = c->block_size;
+    }
+
+    if (ctx->backend->writev)
+        return ctx->backend->writev(ctx, offset, iov, count);
+
+    for (int n = 0; n < count; n++)
+    {
+        if (ctx->backend->write(ctx,
+                                offset,
+                                iov[n].base,
+                                iov[n].length) != 0)
+            return -1;
+
+        offset += c->block_size;
+    }
+
+    return 0;
+}
+
+/*
+ * Sort the dirty slots that are (or are not) journaled by block.
+ * Called with the lock held; the caller frees the array.
+ */
+static int32_t *cache_dirty_slots(
+    struct nbfs_cache *c,
+    bool journaled,
+    uint32_t *count)
+{
+    int32_t *order = malloc(sizeof(*order) * (c->dirty ? c->dirty : 1));
+
+    *count = 0;
+
+    if (!order)
+        return NULL;
+
+    for (int32_t i = 0; i < (int32_t)c->slots; i++)
+    {
+        if (c->slot[i].valid &&
+            c->slot[i].dirty &&
+            !c->slot[i].loading &&
+            c->slot[i].journaled == journaled)
+        {
+            order[(*count)++] = i;
+        }
+    }
+
+    sort_cache = c;
+    qsort(order, *count, sizeof(*order), compare_slot_block);
+
+    return order;
+}
+
+/*
+ * Write dirty slots back in block order. Adjacent blocks go out
+ * together as one vectored request. The lock is dropped for the
+ * writes; write-backs already under way, from eviction or another
+ * flush, are waited for first, so every slot dirty at the call has
+ * reached the image when it returns.
+ */
+static int cache_writeback(
+    nbfs_context_t *ctx,
+    bool journaled)
+{
+    struct nbfs_cache *c = ctx->cache;
+
+    if (!c)
+        return 0;
+
+    pthread_mutex_lock(&c->lock);
+
+    while (c->writing > 0)
+        pthread_cond_wait(&c->loaded, &c->lock);
+
+    if (c->dirty == 0)
+    {
+        pthread_mutex_unlock(&c->lock);
+        return 0;
+    }
+
+    uint32_t count;
+    int32_t *order = cache_dirty_slots(c, journaled, &count);
+
+    if (!order)
+    {
+        pthread_mutex_unlock(&c->lock);
+        return -1;
+    }
+
+    write_begin(c, order, count);
+
+    pthread_mutex_unlock(&c->lock);
+
+    int result = 0;
+    uint32_t start = 0;
+
+    /*
+     * Image range written since the storage was last started on it.
+     */
+    uint64_t window = 0;
+    uint64_t window_end = 0;
+
+    while (start < count)
+    {
+        uint32_t end = start + 1;
+
+        while (end < count &&
+               end - start < CACHE_FLUSH_RUN &&
+               c->slot[order[end]].block ==
+               c->slot[order[end - 1]].block + 1)
+        {
+            end++;
+        }
+
+        if (flush_run(ctx, c, order + start, (int)(end - start)) != 0)
+        {
+            result = -1;
+            break;
+        }
+
+        uint64_t first = c->slot[order[start]].block * c->block_size;
+
+        if (window_end == 0)
+            window = first;
+
+        window_end = first + (uint64_t)(end - start) * c->block_size;
+
+        if (window_end - window >= NBFS_WRITEBACK_WINDOW)
+        {
+            nbfs_io_writeback(ctx, window, window_end - window);
+            window_end = 0;
+        }
+
+        start = end;
+    }
+
+    pthread_mutex_lock(&c->lock);
+
+    /*
+     * Whatever was not written, from the failed run on, stays
+     * dirty.
+     */
+    write_end(c, order, start, journaled, false);
+    write_end(c, order + start, count - start, journaled, true);
+
+    pthread_mutex_unlock(&c->lock);
+
+    free(order);
+
+    return result;
+}
+
+int nbfs_cache_flush(nbfs_context_t *ctx)
+{
+    return cache_writeback(ctx, false);
+}
+
+uint32_t nbfs_cache_journaled(nbfs_context_t *ctx)
+{
+    struct nbfs_cache *c = ctx->cache;
+
+    if (!c)
+        return 0;
+
+    pthread_mutex_lock(&c->lock);
+
+    uint32_t count = c->journaled;
+
+    pthread_mutex_unlock(&c->lock);
+
+    return count;
+}
+
+uint32_t nbfs_cache_journal_collect(
+    nbfs_context_t *ctx,
+    uint64_t *blocks,
+    nbfs_iovec_t *iov,
+    uint32_t max)
+{
+    struct nbfs_cache *c = ctx->cache;
+
+    if (!c)
+        return 0;
+
+    pthread_mutex_lock(&c->lock);
+
+    uint32_t count;
+    int32_t *order = cache_dirty_slots(c, true, &count);
+
+    if (!order)
+    {
+        pthread_mutex_unlock(&c->lock);
+        return 0;
+    }
+
+    for (uint32_t n = 0; n < count && n < max; n++)
+    {
+        int32_t i = order[n];
+
+        blocks[n] = c->slot[i].block;
+        iov[n].base = slot_data(c, i);
+        iov[n].length = c->block_size;
+    }
+
+    free(order);
+
+    pthread_mutex_unlock(&c->lock);
+
+    return count;
+}
+
+int nbfs_cache_checkpoint(nbfs_context_t *ctx)
+{
+    return cache_writeback(ctx, true);
+}
+
+void nbfs_cache_destroy(nbfs_context_t *ctx)
+{
+    struct nbfs_cache *c = ctx->cache;
+
+    if (!c)
+        return;
+
+    pthread_cond_destroy(&c->loaded);
+    pthread_mutex_destroy(&c->lock);
+
+    free(c->buckets);
+    free(c->slot);
+    free(c->data);
+    free(c);
+
+    ctx->cache = NULL;
+}
+
+static struct nbfs_cache *cache_create(
+    uint32_t block_size,
+    uint64_t bytes)
+{
+    uint64_t slots = bytes / block_size;
+
+    if (slots == 0 || slots > INT32_MAX / 2)
+        return NULL;
+
+    struct nbfs_cache *c = calloc(1, sizeof(*c));
+
+    if (!c)
+        return NULL;
+
+    uint32_t buckets = 1;
+
+    while (buckets < slots)
+        buckets <<= 1;
+
+    c->block_size = block_size;
+    c->slots = (uint32_t)slots;
+    c->bucket_mask = buckets - 1;
+
+    c->buckets = malloc(sizeof(*c->buckets) * buckets);
+    c->slot = calloc(slots, sizeof(*c->slot));
+    c->data = malloc((size_t)slots * block_size);
+
+    if (!c->buckets || !c->slot || !c->data)
+    {
+        free(c->buckets);
+        free(c->slot);
+        free(c->data);
+        free(c);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < buckets; i++)
+        c->buckets[i] = CACHE_NONE;
+
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->loaded, NULL);
+
+    return c;
+}
+
+int nbfs_cache_configure(
+    nbfs_context_t *ctx,
+    uint64_t bytes)
+{
+    if (!ctx)
+        return -1;
+
+    if (ctx->cache)
+    {
+        if (nbfs_journal_flush(ctx) != 0 ||
+            nbfs_cache_flush(ctx) != 0)
+            return -1;
+
+        nbfs_cache_destroy(ctx);
+    }
+
+    ctx->cache_size = bytes;
+    ctx->metadata_pinned = false;
+
+    nbfs_inode_cache_reset(ctx);
+
+    /*
+     * A mapped image is its own cache.
+     */
+    if (ctx->map || bytes == 0)
+        return 0;
+
+    uint32_t block_size = ctx->block_size
+        ? ctx->block_size
+        : NBFS_DEFAULT_BLOCK_SIZE;
+
+    if (bytes < block_size)
+        return 0;
+
+    ctx->cache = cache_create(block_size, bytes);
+
+    return ctx->cache ? 0 : -1;
+}
+
+int nbfs_cache_pin(
+    nbfs_context_t *ctx,
+    uint64_t block)
+{
+    if (!ctx)
+        return -1;
+
+    void *data = nbfs_cache_get(ctx, block, true, false);
+
+    if (!data)
+        return -1;
+
+    struct nbfs_cache *c = ctx->cache;
+
+    pthread_mutex_lock(&c->lock);
+
+    cache_pin_slot(c, cache_index(c, data));
+
+    pthread_mutex_unlock(&c->lock);
+
+    nbfs_cache_release(ctx, data, false);
+
+    return 0;
+}
+
+int nbfs_cache_unpin(
+    nbfs_context_t *ctx,
+    uint64_t block)
+{
+    if (!ctx || !ctx->cache)
+        return -1;
+
+    struct nbfs_cache *c = ctx->cache;
+
+    pthread_mutex_lock(&c->lock);
+
+    int32_t i = cache_lookup(c, block);
+
+    int result = -1;
+
+    if (i != CACHE_NONE && c->slot[i].pins > 0)
+    {
+        cache_unpin_slot(c, i);
+
+        result = 0;
+    }
+
+    pthread_mutex_unlock(&c->lock);
+
+    return result;
+}
+
+int nbfs_cache_stats(
+    nbfs_context_t *ctx,
+    nbfs_cache_stats_t *stats)
+{
+    if (!ctx || !stats)
+        return -1;
+
+    memset(stats, 0, sizeof(*stats));
+
+    struct nbfs_cache *c = ctx->cache;
+
+    if (!c)
+        return 0;
+
+    pthread_mutex_lock(&c->lock);
+
+    *stats = c->stats;
+
+    stats->slots = c->slots;
+    stats->resident = c->resident;
+    stats->dirty = c->dirty;
+    stats->pinned = c->pinned;
+
+    pthread_mutex_unlock(&c->lock);
+
+    return 0;
+}
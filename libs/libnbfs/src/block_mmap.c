@@ -0,0 +1,185 @@
+/*
+ * NeoBench Filesystem Library
+ *
+ * block_mmap.c
+ *
+ * Memory-mapped image backend
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "libnbfs.h"
+#include "context_internal.h"
+
+static int mmap_read(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    void *buffer,
+    size_t length)
+{
+    if (offset > ctx->map_size ||
+        length > ctx->map_size - offset)
+        return -1;
+
+    memcpy(buffer, ctx->map + offset, length);
+
+    return 0;
+}
+
+static int mmap_write(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    const void *buffer,
+    size_t length)
+{
+    if (offset > ctx->map_size ||
+        length > ctx->map_size - offset)
+        return -1;
+
+    memcpy(ctx->map + offset, buffer, length);
+
+    return 0;
+}
+
+static int mmap_sync(
+    nbfs_context_t *ctx,
+    bool full)
+{
+    if (msync(ctx->map, (size_t)ctx->map_size, MS_SYNC) != 0)
+        return -1;
+
+    if (full && ctx->fd >= 0 && fsync(ctx->fd) != 0)
+        return -1;
+
+    return 0;
+}
+
+static int mmap_writeback(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    uint64_t length)
+{
+    /*
+     * msync() wants a page-aligned start.
+     */
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = offset - offset % page;
+
+    if (start >= ctx->map_size)
+        return 0;
+
+    if (length > ctx->map_size - offset)
+        length = ctx->map_size - offset;
+
+    return msync(ctx->map + start,
+                 (size_t)(offset - start + length),
+                 MS_ASYNC) == 0 ? 0 : -1;
+}
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+static int mmap_discard(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    uint64_t length)
+{
+    /*
+     * Punching the file drops the mapped pages with it.
+     */
+    return fallocate(ctx->fd,
+                     FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                     (off_t)offset,
+                     (off_t)length) == 0 ? 0 : -1;
+}
+#endif
+
+static void mmap_close(nbfs_context_t *ctx)
+{
+    if (ctx->map)
+        munmap(ctx->map, (size_t)ctx->map_size);
+
+    ctx->map = NULL;
+    ctx->map_size = 0;
+
+    if (ctx->fd >= 0)
+        close(ctx->fd);
+
+    ctx->fd = -1;
+}
+
+const nbfs_backend_t nbfs_mmap_backend =
+{
+    .name  = "mmap",
+    .read  = mmap_read,
+    .write = mmap_write,
+    .sync  = mmap_sync,
+    .writeback = mmap_writeback,
+#ifdef FALLOC_FL_PUNCH_HOLE
+    .discard = mmap_discard,
+#endif
+    .close = mmap_close,
+};
+
+int nbfs_block_advise(
+    nbfs_context_t *ctx,
+    uint64_t block,
+    uint64_t count,
+    nbfs_advice_t advice)
+{
+    if (!ctx)
+        return -1;
+
+    if (!ctx->map || count == 0)
+        return 0;
+
+    uint64_t block_size = ctx->block_size;
+    uint64_t offset = block * block_size;
+
+    if (offset >= ctx->map_size)
+        return -1;
+
+    uint64_t length = count * block_size;
+
+    if (length > ctx->map_size - offset)
+        length = ctx->map_size - offset;
+
+    int posix_advice;
+
+    switch (advice)
+    {
+        case NBFS_ADVISE_SEQUENTIAL:
+            posix_advice = POSIX_MADV_SEQUENTIAL;
+            break;
+
+        case NBFS_ADVISE_RANDOM:
+            posix_advice = POSIX_MADV_RANDOM;
+            break;
+
+        case NBFS_ADVISE_WILLNEED:
+            posix_advice = POSIX_MADV_WILLNEED;
+            break;
+
+        case NBFS_ADVISE_DONTNEED:
+            posix_advice = POSIX_MADV_DONTNEED;
+            break;
+
+        default:
+            posix_advice = POSIX_MADV_NORMAL;
+            break;
+    }
+
+    /*
+     * block_size is a power of two of at least 1 KiB, so the start
+     * only needs rounding down when pages are larger than blocks.
+     */
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = offset & ~(page - 1);
+
+    return posix_madvise(ctx->map + start,
+                         (size_t)(length + (offset - start)),
+                         posix_advice) == 0 ? 0 : -1;
+}
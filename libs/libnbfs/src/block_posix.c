@@ -0,0 +1,237 @@
+/*
+ * NeoBench Filesystem Library
+ *
+ * block_posix.c
+ *
+ * Positional file-descriptor backend
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "context_internal.h"
+
+static int posix_read(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    void *buffer,
+    size_t length)
+{
+    uint8_t *p = buffer;
+
+    while (length > 0)
+    {
+        ssize_t n = pread(ctx->fd, p, length, (off_t)offset);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        /*
+         * Reading past the end of the image is an error, the same
+         * as a short fread() was.
+         */
+        if (n == 0)
+            return -1;
+
+        p += n;
+        offset += (uint64_t)n;
+        length -= (size_t)n;
+    }
+
+    return 0;
+}
+
+static int posix_write(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    const void *buffer,
+    size_t length)
+{
+    const uint8_t *p = buffer;
+
+    while (length > 0)
+    {
+        ssize_t n = pwrite(ctx->fd, p, length, (off_t)offset);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        /*
+         * A write that makes no progress would be retried forever.
+         */
+        if (n == 0)
+        {
+            errno = EIO;
+            return -1;
+        }
+
+        p += n;
+        offset += (uint64_t)n;
+        length -= (size_t)n;
+    }
+
+    return 0;
+}
+
+/*
+ * preadv()/pwritev() over an nbfs_iovec_t array.
+ *
+ * The array is converted in batches of POSIX_IOV_BATCH entries.
+ * Short transfers resume inside the buffer where they stopped.
+ */
+#define POSIX_IOV_BATCH 64
+
+static int posix_vector(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    const nbfs_iovec_t *iov,
+    int iovcnt,
+    bool write)
+{
+    struct iovec batch[POSIX_IOV_BATCH];
+
+    int index = 0;
+    size_t skip = 0;
+
+    while (index < iovcnt)
+    {
+        int count = 0;
+
+        for (int i = index;
+             i < iovcnt && count < POSIX_IOV_BATCH;
+             i++)
+        {
+            size_t used = (i == index) ? skip : 0;
+
+            batch[count].iov_base = (uint8_t *)iov[i].base + used;
+            batch[count].iov_len = iov[i].length - used;
+            count++;
+        }
+
+        ssize_t n = write
+            ? pwritev(ctx->fd, batch, count, (off_t)offset)
+            : preadv(ctx->fd, batch, count, (off_t)offset);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        if (n == 0)
+        {
+            errno = EIO;
+            return -1;
+        }
+
+        offset += (uint64_t)n;
+
+        size_t done = (size_t)n;
+
+        while (index < iovcnt &&
+               done >= iov[index].length - skip)
+        {
+            done -= iov[index].length - skip;
+            skip = 0;
+            index++;
+        }
+
+        skip += done;
+    }
+
+    return 0;
+}
+
+static int posix_readv(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    const nbfs_iovec_t *iov,
+    int iovcnt)
+{
+    return posix_vector(ctx, offset, iov, iovcnt, false);
+}
+
+static int posix_writev(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    const nbfs_iovec_t *iov,
+    int iovcnt)
+{
+    return posix_vector(ctx, offset, iov, iovcnt, true);
+}
+
+static int posix_sync(
+    nbfs_context_t *ctx,
+    bool full)
+{
+    int result = full ? fsync(ctx->fd) : fdatasync(ctx->fd);
+
+    return result == 0 ? 0 : -1;
+}
+
+#ifdef SYNC_FILE_RANGE_WRITE
+static int posix_writeback(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    uint64_t length)
+{
+    return sync_file_range(ctx->fd,
+                           (off_t)offset,
+                           (off_t)length,
+                           SYNC_FILE_RANGE_WRITE) == 0 ? 0 : -1;
+}
+#endif
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+static int posix_discard(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    uint64_t length)
+{
+    return fallocate(ctx->fd,
+                     FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                     (off_t)offset,
+                     (off_t)length) == 0 ? 0 : -1;
+}
+#endif
+
+static void posix_close(nbfs_context_t *ctx)
+{
+    if (ctx->fd >= 0)
+        close(ctx->fd);
+
+    ctx->fd = -1;
+}
+
+const nbfs_backend_t nbfs_posix_backend =
+{
+    .name  = "posix",
+    .read  = posix_read,
+    .write = posix_write,
+    .readv = posix_readv,
+    .writev = posix_writev,
+    .sync  = posix_sync,
+#ifdef SYNC_FILE_RANGE_WRITE
+    .writeback = posix_writeback,
+#endif
+#ifdef FALLOC_FL_PUNCH_HOLE
+    .discard = posix_discard,
+#endif
+    .close = posix_close,
+};
@@ -0,0 +1,360 @@
+/*
+ * NeoBench Filesystem Library
+ *
+ * block_uring.c
+ *
+ * io_uring submission and completion rings
+ *
+ * Driven through the raw system calls, so the library does not
+ * depend on liburing. Hosts without io_uring get stubs that never
+ * create a ring, and the asynchronous API runs synchronously.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libnbfs.h"
+#include "internal/aio.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define NBFS_HAVE_URING 1
+#endif
+#endif
+
+#ifdef NBFS_HAVE_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * The ring indices are shared with the kernel: the side that owns an
+ * index publishes it with a release store, the other side reads it
+ * with an acquire load.
+ */
+struct nbfs_uring
+{
+    int ring_fd;
+
+    int fd;
+
+    /* Entries queued since the last io_uring_enter() */
+    uint32_t queued;
+
+    uint8_t *sq_map;
+    size_t sq_map_size;
+
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t *sq_array;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    uint8_t *cq_map;
+    size_t cq_map_size;
+
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t cq_mask;
+
+    struct io_uring_cqe *cqes;
+};
+
+static int uring_setup(
+    uint32_t entries,
+    struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(
+    int ring_fd,
+    uint32_t submit,
+    uint32_t wait,
+    uint32_t flags)
+{
+    return (int)syscall(__NR_io_uring_enter,
+                        ring_fd, submit, wait, flags, NULL, 0);
+}
+
+struct nbfs_uring *nbfs_uring_create(
+    int fd,
+    uint32_t depth)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+
+    struct nbfs_uring *ring = calloc(1, sizeof(*ring));
+
+    if (!ring)
+        return NULL;
+
+    ring->fd = fd;
+    ring->ring_fd = uring_setup(depth, &params);
+
+    if (ring->ring_fd < 0)
+    {
+        free(ring);
+        return NULL;
+    }
+
+    /*
+     * IORING_OP_READ/WRITE came with the same kernel (5.6) as this
+     * feature bit; older rings would fail every request.
+     */
+    if (!(params.features & IORING_FEAT_RW_CUR_POS))
+    {
+        close(ring->ring_fd);
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_map_size = params.sq_off.array +
+                        params.sq_entries * sizeof(uint32_t);
+    ring->cq_map_size = params.cq_off.cqes +
+                        params.cq_entries * sizeof(struct io_uring_cqe);
+
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+
+    if (single && ring->cq_map_size > ring->sq_map_size)
+        ring->sq_map_size = ring->cq_map_size;
+
+    void *sq = mmap(NULL, ring->sq_map_size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE,
+                    ring->ring_fd, IORING_OFF_SQ_RING);
+
+    if (sq == MAP_FAILED)
+    {
+        close(ring->ring_fd);
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_map = sq;
+
+    if (single)
+    {
+        ring->cq_map = ring->sq_map;
+    }
+    else
+    {
+        void *cq = mmap(NULL, ring->cq_map_size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        ring->ring_fd, IORING_OFF_CQ_RING);
+
+        if (cq == MAP_FAILED)
+        {
+            nbfs_uring_destroy(ring);
+            return NULL;
+        }
+
+        ring->cq_map = cq;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    void *sqes = mmap(NULL, ring->sqes_size,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE,
+                      ring->ring_fd, IORING_OFF_SQES);
+
+    if (sqes == MAP_FAILED)
+    {
+        nbfs_uring_destroy(ring);
+        return NULL;
+    }
+
+    ring->sqes = sqes;
+
+    ring->sq_head = (uint32_t *)(ring->sq_map + params.sq_off.head);
+    ring->sq_tail = (uint32_t *)(ring->sq_map + params.sq_off.tail);
+    ring->sq_array = (uint32_t *)(ring->sq_map + params.sq_off.array);
+    ring->sq_mask = *(uint32_t *)(ring->sq_map + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+
+    ring->cq_head = (uint32_t *)(ring->cq_map + params.cq_off.head);
+    ring->cq_tail = (uint32_t *)(ring->cq_map + params.cq_off.tail);
+    ring->cq_mask = *(uint32_t *)(ring->cq_map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(ring->cq_map + params.cq_off.cqes);
+
+    return ring;
+}
+
+void nbfs_uring_destroy(struct nbfs_uring *ring)
+{
+    if (!ring)
+        return;
+
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+
+    if (ring->cq_map && ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_size);
+
+    if (ring->sq_map)
+        munmap(ring->sq_map, ring->sq_map_size);
+
+    close(ring->ring_fd);
+    free(ring);
+}
+
+int nbfs_uring_queue(
+    struct nbfs_uring *ring,
+    bool write,
+    void *buffer,
+    uint32_t length,
+    uint64_t offset,
+    uint64_t tag)
+{
+    uint32_t tail = *ring->sq_tail;
+    uint32_t head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (tail - head >= ring->sq_entries)
+        return -1;
+
+    uint32_t index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = ring->fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = tag;
+
+    ring->sq_array[index] = index;
+
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    ring->queued++;
+
+    return 0;
+}
+
+int nbfs_uring_submit(
+    struct nbfs_uring *ring,
+    uint32_t wait)
+{
+    uint32_t flags = wait ? IORING_ENTER_GETEVENTS : 0;
+
+    if (ring->queued == 0 && wait == 0)
+        return 0;
+
+    for (;;)
+    {
+        int n = uring_enter(ring->ring_fd, ring->queued, wait, flags);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        ring->queued -= (uint32_t)n;
+
+        /*
+         * The kernel takes fewer entries only when it is short of
+         * memory; go round until it has them all.
+         */
+        if (ring->queued == 0)
+            return 0;
+
+        if (n == 0)
+            return -1;
+    }
+}
+
+int nbfs_uring_complete(
+    struct nbfs_uring *ring,
+    uint64_t *tag,
+    int32_t *result)
+{
+    uint32_t head = *ring->cq_head;
+    uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail)
+        return 0;
+
+    const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+
+    *tag = cqe->user_data;
+    *result = cqe->res;
+
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+#else
+
+struct nbfs_uring *nbfs_uring_create(
+    int fd,
+    uint32_t depth)
+{
+    (void)fd;
+    (void)depth;
+
+    return NULL;
+}
+
+void nbfs_uring_destroy(struct nbfs_uring *ring)
+{
+    (void)ring;
+}
+
+int nbfs_uring_queue(
+    struct nbfs_uring *ring,
+    bool write,
+    void *buffer,
+    uint32_t length,
+    uint64_t offset,
+    uint64_t tag)
+{
+    (void)ring;
+    (void)write;
+    (void)buffer;
+    (void)length;
+    (void)offset;
+    (void)tag;
+
+    return -1;
+}
+
+int nbfs_uring_submit(
+    struct nbfs_uring *ring,
+    uint32_t wait)
+{
+    (void)ring;
+    (void)wait;
+
+    return -1;
+}
+
+int nbfs_uring_complete(
+    struct nbfs_uring *ring,
+    uint64_t *tag,
+    int32_t *result)
+{
+    (void)ring;
+    (void)tag;
+    (void)result;
+
+    return 0;
+}
+
+#endif
@@ -1,4 +1,12 @@
 #include "context_internal.h"
+#include "internal/aio.h"
+#include "internal/allocator.h"
+#include "internal/block_cache.h"
+#include "internal/dcache.h"
+#include "internal/inode_cache.h"
+#include "internal/journal.h"
+#include "internal/lock.h"
+#include "internal/private.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -9,6 +17,11 @@ nbfs_context_t *nbfs_context_create(void)
     if (!ctx)
         return NULL;
 
+    ctx->fd = -1;
+    ctx->durability = NBFS_DURABILITY_ORDERED;
+
+    nbfs_locks_init(ctx);
+
     return ctx;
 }
 
@@ -17,8 +30,20 @@ void nbfs_context_destroy(nbfs_context_t *ctx)
     if (!ctx)
         return;
 
-    if (ctx->image)
-        fclose(ctx->image);
+    nbfs_aio_destroy(ctx);
+    nbfs_cache_destroy(ctx);
+    nbfs_inode_cache_reset(ctx);
+    nbfs_dcache_destroy(ctx);
+    nbfs_journal_destroy(ctx);
+    nbfs_delalloc_destroy(ctx);
+    nbfs_free_summary_destroy(ctx);
+    nbfs_extent_index_destroy(ctx);
+    nbfs_discard_destroy(ctx);
+
+    if (ctx->backend && ctx->backend->close)
+        ctx->backend->close(ctx);
+
+    nbfs_locks_destroy(ctx);
 
     free(ctx);
 }
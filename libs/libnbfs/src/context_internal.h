@@ -1,15 +1,127 @@
 #ifndef LIBNBFS_CONTEXT_INTERNAL_H
 #define LIBNBFS_CONTEXT_INTERNAL_H
 
-#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
 #include <nbfs/nbfs.h>
 
-typedef struct nbfs_context
+#include "libnbfs.h"
+
+/*
+ * Block backend
+ *
+ * A backend moves bytes between memory and the image at absolute
+ * byte offsets. Backends keep no file-position state, so several
+ * threads may read through one context at the same time.
+ *
+ * read/write return 0 when the whole range was transferred and -1
+ * otherwise. readv/writev move one contiguous image range to or
+ * from several buffers; a backend may leave them NULL and the block
+ * layer falls back to one read/write per buffer. sync returns once
+ * everything written so far is durable; full also covers the file's
+ * own metadata (fsync() rather than fdatasync()). writeback, which
+ * may be NULL, starts writing a range out without waiting for it.
+ * discard, which may be NULL, gives the host space of a range back;
+ * the range then reads as zeros. close releases whatever the
+ * backend attached to the context.
+ */
+typedef struct nbfs_backend
 {
-    FILE *image;
+    const char *name;
+
+    int (*read)(
+        nbfs_context_t *ctx,
+        uint64_t offset,
+        void *buffer,
+        size_t length);
+
+    int (*write)(
+        nbfs_context_t *ctx,
+        uint64_t offset,
+        const void *buffer,
+        size_t length);
+
+    int (*readv)(
+        nbfs_context_t *ctx,
+        uint64_t offset,
+        const nbfs_iovec_t *iov,
+        int iovcnt);
+
+    int (*writev)(
+        nbfs_context_t *ctx,
+        uint64_t offset,
+        const nbfs_iovec_t *iov,
+        int iovcnt);
+
+    int (*sync)(
+        nbfs_context_t *ctx,
+        bool full);
+
+    int (*writeback)(
+        nbfs_context_t *ctx,
+        uint64_t offset,
+        uint64_t length);
+
+    int (*discard)(
+        nbfs_context_t *ctx,
+        uint64_t offset,
+        uint64_t length);
+
+    void (*close)(nbfs_context_t *ctx);
+
+} nbfs_backend_t;
+
+/*
+ * pread/pwrite on ctx->fd.
+ */
+extern const nbfs_backend_t nbfs_posix_backend;
+
+/*
+ * memcpy to and from ctx->map, a shared mapping of the whole image.
+ */
+extern const nbfs_backend_t nbfs_mmap_backend;
+
+/*
+ * Locking, see include/internal/lock.h.
+ */
+#define NBFS_INODE_LOCKS 64
+
+#define NBFS_ALLOC_SHARDS 16
+
+/*
+ * Pending buffers of delayed allocation are found by inode through
+ * this many hash buckets.
+ */
+#define NBFS_DELALLOC_BUCKETS 256
+
+/*
+ * Each shard owns an equal, 64-bit aligned share of the block and
+ * of the inode bitmap, with its own next-fit cursors, so threads
+ * allocating in different shards never share a lock or a bitmap
+ * word.
+ */
+struct nbfs_alloc_shard
+{
+    _Alignas(64) pthread_mutex_t lock;
+
+    uint64_t block_cursor;
+
+    uint64_t inode_cursor;
+};
+
+struct nbfs_context
+{
+    const nbfs_backend_t *backend;
+
+    int fd;
+
+    uint8_t *map;
+
+    uint64_t map_size;
 
     char image_name[256];
 
@@ -21,10 +133,110 @@ typedef struct nbfs_context
 
     bool read_only;
 
-    bool dirty;
+    atomic_bool dirty;
+
+    /*
+     * A write-back no caller could report failed; nbfs_flush()
+     * returns -1 once for it.
+     */
+    atomic_bool write_error;
+
+    nbfs_durability_t durability;
+
+    /*
+     * Fields other than the free counters never change once loaded
+     * and are read without the lock; the counters change only under
+     * it.
+     */
+    pthread_rwlock_t superblock_lock;
 
     nbfs_superblock_t superblock;
 
-} nbfs_context_t;
+    atomic_bool superblock_dirty;
+
+    /*
+     * Directory operations, see include/internal/lock.h.
+     */
+    pthread_rwlock_t namespace_lock;
+
+    pthread_rwlock_t inode_locks[NBFS_INODE_LOCKS];
+
+    /*
+     * Bitmap allocator shards, and the lock over the free-space
+     * summary and free-extent index (include/internal/allocator.h).
+     */
+    struct nbfs_alloc_shard shards[NBFS_ALLOC_SHARDS];
+
+    pthread_mutex_t allocator_lock;
+
+    struct nbfs_free_summary *free_summary;
+
+    struct nbfs_extent_index *extent_index;
+
+    /*
+     * Freed ranges waiting for their discard. discard is cleared
+     * when the host cannot punch holes.
+     */
+    pthread_mutex_t discard_lock;
+
+    struct nbfs_discard *discards;
+
+    atomic_bool discard;
+
+    /*
+     * Delayed allocation, see include/internal/private.h. Open file
+     * handles re-read their inode when file_generation moves.
+     */
+    pthread_mutex_t delalloc_lock;
+
+    struct nbfs_delalloc *delalloc;
+
+    struct nbfs_delalloc *delalloc_buckets[NBFS_DELALLOC_BUCKETS];
+
+    uint64_t delalloc_bytes;
+
+    _Atomic uint64_t file_generation;
+
+    /*
+     * Block cache, see include/internal/block_cache.h.
+     */
+    struct nbfs_cache *cache;
+
+    uint64_t cache_size;
+
+    bool metadata_pinned;
+
+    /*
+     * Inode cache, see include/internal/inode_cache.h.
+     */
+    pthread_mutex_t inode_window_lock;
+
+    uint8_t *inode_windows;
+
+    uint64_t inode_pinned;
+
+    /*
+     * Directory entry cache, see include/internal/dcache.h.
+     */
+    pthread_mutex_t dcache_lock;
+
+    struct nbfs_dcache *dcache;
+
+    /*
+     * Metadata journal, see include/internal/journal.h.
+     */
+    struct nbfs_journal *journal;
+
+    /*
+     * Asynchronous I/O queue, see include/internal/aio.h. A depth of
+     * 0 means NBFS_QUEUE_DEPTH_DEFAULT.
+     */
+    pthread_mutex_t aio_lock;
+
+    struct nbfs_aio *aio;
+
+    uint32_t queue_depth;
+
+};
 
 #endif
@@ -3,8 +3,178 @@
  * NeoBench libnbfs
  */
 
-#include <stdio.h>
-#include <stdlib.h>
+#define _POSIX_C_SOURCE 200809L
 
-#include "internal/context.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
+#include <nbfs/crc32.h>
+
+#include "libnbfs.h"
+#include "internal/crc32.h"
+
+/*
+ * x86 hosts with PCLMULQDQ fold 64 bytes per step with carry-less
+ * multiplication ("Fast CRC Computation for Generic Polynomials
+ * Using PCLMULQDQ", Intel). The CRC32 instruction of SSE4.2 is no
+ * use here: it computes CRC-32C, a different polynomial. Anything
+ * else, and the tail under 16 bytes, goes through slicing-by-8.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32_PCLMUL 1
+#endif
+
+#ifdef CRC32_PCLMUL
+
+#include <immintrin.h>
+
+#define CRC32_PCLMUL_MINIMUM 64
+
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+static bool crc32_pclmul;
+
+static void crc32_init(void)
+{
+    __builtin_cpu_init();
+
+    crc32_pclmul = __builtin_cpu_supports("pclmul") &&
+                   __builtin_cpu_supports("sse4.1");
+}
+
+/*
+ * Takes and returns the CRC register, not the finished CRC. length
+ * is at least CRC32_PCLMUL_MINIMUM and a multiple of 16.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_fold(
+    uint32_t crc,
+    const uint8_t *p,
+    size_t length)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+
+    p += 64;
+    length -= 64;
+
+    /*
+     * Four lanes of 16 bytes, each folded 64 bytes forward.
+     */
+    while (length >= 64)
+    {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((const __m128i *)(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                           _mm_loadu_si128((const __m128i *)(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                           _mm_loadu_si128((const __m128i *)(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                           _mm_loadu_si128((const __m128i *)(p + 0x30)));
+
+        p += 64;
+        length -= 64;
+    }
+
+    /*
+     * Fold the lanes into one, then the remaining 16-byte blocks.
+     */
+    __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (length >= 16)
+    {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((const __m128i *)p));
+
+        p += 16;
+        length -= 16;
+    }
+
+    /*
+     * 128 bits down to 64, then Barrett reduction to 32.
+     */
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x2 = _mm_and_si128(x1, mask);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+#endif
+
+uint32_t nbfs_crc32_update(
+    uint32_t crc,
+    const void *buffer,
+    size_t length)
+{
+    const uint8_t *p = buffer;
+
+#ifdef CRC32_PCLMUL
+    if (length >= CRC32_PCLMUL_MINIMUM)
+    {
+        pthread_once(&crc32_once, crc32_init);
+
+        if (crc32_pclmul)
+        {
+            size_t bulk = length & ~(size_t)15;
+
+            crc = ~crc32_fold(~crc, p, bulk);
+
+            p += bulk;
+            length -= bulk;
+        }
+    }
+#endif
+
+    return nbfs_crc32_sliced(crc, p, length);
+}
+
+uint32_t nbfs_crc32(
+    const void *buffer,
+    uint32_t length)
+{
+    return nbfs_crc32_update(0, buffer, length);
+}
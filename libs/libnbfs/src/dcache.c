@@ -0,0 +1,314 @@
+/*
+ * NeoBench Filesystem Library
+ *
+ * dcache.c
+ *
+ * Directory entry cache
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libnbfs.h"
+#include "internal/dcache.h"
+
+struct nbfs_dentry
+{
+    struct nbfs_dentry *chain;
+
+    /*
+     * LRU list, most recent first.
+     */
+    struct nbfs_dentry *newer;
+    struct nbfs_dentry *older;
+
+    uint64_t parent;
+
+    /*
+     * 0 for a name known to be absent.
+     */
+    uint64_t inode;
+
+    uint32_t hash;
+
+    uint16_t length;
+
+    char name[];
+};
+
+struct nbfs_dcache
+{
+    struct nbfs_dentry *buckets[NBFS_DCACHE_BUCKETS];
+
+    struct nbfs_dentry *newest;
+    struct nbfs_dentry *oldest;
+
+    uint32_t entries;
+};
+
+static uint32_t dentry_hash(
+    uint64_t parent,
+    const char *name,
+    size_t length)
+{
+    uint64_t hash = 14695981039346656037ull ^ parent;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (uint8_t)name[i];
+        hash *= 1099511628211ull;
+    }
+
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static struct nbfs_dentry **dentry_slot(
+    struct nbfs_dcache *cache,
+    uint32_t hash,
+    uint64_t parent,
+    const char *name,
+    size_t length)
+{
+    struct nbfs_dentry **slot = &cache->buckets[hash % NBFS_DCACHE_BUCKETS];
+
+    for (; *slot; slot = &(*slot)->chain)
+    {
+        struct nbfs_dentry *d = *slot;
+
+        if (d->hash == hash &&
+            d->parent == parent &&
+            d->length == length &&
+            memcmp(d->name, name, length) == 0)
+            break;
+    }
+
+    return slot;
+}
+
+static void lru_unlink(
+    struct nbfs_dcache *cache,
+    struct nbfs_dentry *d)
+{
+    if (d->newer)
+        d->newer->older = d->older;
+    else
+        cache->newest = d->older;
+
+    if (d->older)
+        d->older->newer = d->newer;
+    else
+        cache->oldest = d->newer;
+}
+
+static void lru_push(
+    struct nbfs_dcache *cache,
+    struct nbfs_dentry *d)
+{
+    d->newer = NULL;
+    d->older = cache->newest;
+
+    if (cache->newest)
+        cache->newest->newer = d;
+    else
+        cache->oldest = d;
+
+    cache->newest = d;
+}
+
+static void dentry_remove(
+    struct nbfs_dcache *cache,
+    struct nbfs_dentry **slot)
+{
+    struct nbfs_dentry *d = *slot;
+
+    *slot = d->chain;
+
+    lru_unlink(cache, d);
+    cache->entries--;
+
+    free(d);
+}
+
+static int dcache_lookup(
+    struct nbfs_dcache *cache,
+    uint64_t parent,
+    const char *name,
+    size_t length,
+    uint64_t *inode)
+{
+    uint32_t hash = dentry_hash(parent, name, length);
+    struct nbfs_dentry *d =
+        *dentry_slot(cache, hash, parent, name, length);
+
+    if (!d)
+        return -1;
+
+    if (cache->newest != d)
+    {
+        lru_unlink(cache, d);
+        lru_push(cache, d);
+    }
+
+    *inode = d->inode;
+
+    return d->inode ? 0 : 1;
+}
+
+static void dcache_forget(
+    struct nbfs_dcache *cache,
+    uint64_t parent,
+    const char *name,
+    size_t length)
+{
+    uint32_t hash = dentry_hash(parent, name, length);
+    struct nbfs_dentry **slot =
+        dentry_slot(cache, hash, parent, name, length);
+
+    if (*slot)
+        dentry_remove(cache, slot);
+}
+
+static void dcache_insert(
+    struct nbfs_dcache *cache,
+    uint64_t parent,
+    const char *name,
+    size_t length,
+    uint64_t inode)
+{
+    uint32_t hash = dentry_hash(parent, name, length);
+    struct nbfs_dentry **slot =
+        dentry_slot(cache, hash, parent, name, length);
+
+    if (*slot)
+    {
+        (*slot)->inode = inode;
+
+        lru_unlink(cache, *slot);
+        lru_push(cache, *slot);
+
+        return;
+    }
+
+    struct nbfs_dentry *d = malloc(sizeof(*d) + length);
+
+    if (!d)
+        return;
+
+    d->parent = parent;
+    d->inode = inode;
+    d->hash = hash;
+    d->length = (uint16_t)length;
+
+    memcpy(d->name, name, length);
+
+    d->chain = NULL;
+    *slot = d;
+
+    lru_push(cache, d);
+
+    if (++cache->entries > NBFS_DCACHE_ENTRIES)
+    {
+        struct nbfs_dentry *old = cache->oldest;
+
+        dcache_forget(cache, old->parent, old->name, old->length);
+    }
+}
+
+/*
+ * The cache is shared by every thread on the context; each call
+ * holds ctx->dcache_lock throughout.
+ */
+int nbfs_dcache_lookup(
+    nbfs_context_t *ctx,
+    uint64_t parent,
+    const char *name,
+    size_t length,
+    uint64_t *inode)
+{
+    int result = -1;
+
+    pthread_mutex_lock(&ctx->dcache_lock);
+
+    if (ctx->dcache)
+        result = dcache_lookup(ctx->dcache, parent, name, length, inode);
+
+    pthread_mutex_unlock(&ctx->dcache_lock);
+
+    return result;
+}
+
+void nbfs_dcache_insert(
+    nbfs_context_t *ctx,
+    uint64_t parent,
+    const char *name,
+    size_t length,
+    uint64_t inode)
+{
+    pthread_mutex_lock(&ctx->dcache_lock);
+
+    if (!ctx->dcache)
+        ctx->dcache = calloc(1, sizeof(*ctx->dcache));
+
+    if (ctx->dcache)
+        dcache_insert(ctx->dcache, parent, name, length, inode);
+
+    pthread_mutex_unlock(&ctx->dcache_lock);
+}
+
+void nbfs_dcache_forget(
+    nbfs_context_t *ctx,
+    uint64_t parent,
+    const char *name,
+    size_t length)
+{
+    pthread_mutex_lock(&ctx->dcache_lock);
+
+    if (ctx->dcache)
+        dcache_forget(ctx->dcache, parent, name, length);
+
+    pthread_mutex_unlock(&ctx->dcache_lock);
+}
+
+void nbfs_dcache_forget_directory(
+    nbfs_context_t *ctx,
+    uint64_t parent)
+{
+    pthread_mutex_lock(&ctx->dcache_lock);
+
+    struct nbfs_dcache *cache = ctx->dcache;
+
+    for (size_t i = 0; cache && i < NBFS_DCACHE_BUCKETS; i++)
+    {
+        struct nbfs_dentry **slot = &cache->buckets[i];
+
+        while (*slot)
+        {
+            if ((*slot)->parent == parent)
+                dentry_remove(cache, slot);
+            else
+                slot = &(*slot)->chain;
+        }
+    }
+
+    pthread_mutex_unlock(&ctx->dcache_lock);
+}
+
+void nbfs_dcache_destroy(nbfs_context_t *ctx)
+{
+    struct nbfs_dcache *cache = ctx->dcache;
+
+    if (!cache)
+        return;
+
+    while (cache->newest)
+    {
+        struct nbfs_dentry *d = cache->newest;
+
+        cache->newest = d->older;
+        free(d);
+    }
+
+    free(cache);
+    ctx->dcache = NULL;
+}
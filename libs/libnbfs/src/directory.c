@@ -1,5 +1,1927 @@
 /*
  * directory.c
  * libnbfs
+ *
+ * Directories stay a linear list of records while they fit one
+ * block. The insert that would need a second block converts the
+ * directory to a hash index (see nbfs/directory.h), after which a
+ * lookup reads one block per index level and one block of records,
+ * however large the directory grows.
+ *
+ * Names are resolved through the entry cache (internal/dcache.h),
+ * which every change below keeps current.
  */
 
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nbfs/directory.h>
+#include <nbfs/endian.h>
+
+#include "libnbfs.h"
+#include "internal/block.h"
+#include "internal/dcache.h"
+#include "internal/lock.h"
+#include "internal/private.h"
+#include "internal/superblock.h"
+
+/*
+ * "." and "..", ahead of the index root in block 0.
+ */
+#define DOT_SIZE NBFS_DIRENT_RECORD_SIZE(1)
+#define DOTDOT_SIZE NBFS_DIRENT_RECORD_SIZE(2)
+
+#define ROOT_OFFSET (DOT_SIZE + DOTDOT_SIZE)
+
+/*
+ * A record as held in memory; on disk it takes only
+ * NBFS_DIRENT_RECORD_SIZE(name_length) bytes.
+ */
+typedef struct
+{
+    nbfs_directory_entry_t header;
+
+    char name[NBFS_DIRENT_NAME_MAX + 1];
+
+} dirent_t;
+
+typedef struct
+{
+    uint32_t hash;
+
+    dirent_t record;
+
+} hashed_t;
+
+typedef struct
+{
+    nbfs_context_t *ctx;
+
+    nbfs_file_t *file;
+
+    uint32_t block_size;
+
+    uint64_t blocks;
+
+} dir_t;
+
+/*
+ * Index block and the entry taken in it on the way down.
+ */
+typedef struct
+{
+    uint64_t block;
+
+    int position;
+
+} dir_level_t;
+
+static bool is_dot(const char *name, size_t length)
+{
+    return (length == 1 && name[0] == '.') ||
+           (length == 2 && name[0] == '.' && name[1] == '.');
+}
+
+/*
+ * Records
+ */
+static nbfs_directory_entry_t *record_at(uint8_t *data, uint32_t offset)
+{
+    return (nbfs_directory_entry_t *)(data + offset);
+}
+
+static char *record_name(nbfs_directory_entry_t *record)
+{
+    return (char *)(record + 1);
+}
+
+/*
+ * Records are read and changed where they lie in the cached block,
+ * so their fields go through the byte order accessors one at a time.
+ */
+static uint64_t record_inode(const nbfs_directory_entry_t *record)
+{
+    return nbfs_le64(record->inode);
+}
+
+static uint32_t record_length(const nbfs_directory_entry_t *record)
+{
+    return nbfs_le16(record->record_length);
+}
+
+static void record_set_length(
+    nbfs_directory_entry_t *record,
+    uint32_t length)
+{
+    record->record_length = nbfs_le16((uint16_t)length);
+}
+
+/*
+ * Bytes the record itself needs; the rest of record_length is free.
+ */
+static uint32_t record_used(const nbfs_directory_entry_t *record)
+{
+    return record_inode(record)
+        ? (uint32_t)NBFS_DIRENT_RECORD_SIZE(record->name_length)
+        : 0;
+}
+
+/*
+ * A record must fit what is left of its block. A bad one means the
+ * block is damaged and stops the walk.
+ */
+static bool record_valid(
+    const nbfs_directory_entry_t *record,
+    uint32_t room)
+{
+    return room >= sizeof(*record) &&
+           record_length(record) >= sizeof(*record) &&
+           record_length(record) <= room &&
+           record_length(record) % NBFS_DIRENT_ALIGN == 0 &&
+           record_used(record) <= record_length(record);
+}
+
+static bool record_match(
+    nbfs_directory_entry_t *record,
+    const char *name,
+    size_t length)
+{
+    return record_inode(record) &&
+           record->name_length == length &&
+           memcmp(record_name(record), name, length) == 0;
+}
+
+static void record_fill(
+    dirent_t *record,
+    uint64_t inode,
+    const char *name,
+    size_t length,
+    uint8_t type)
+{
+    memset(record, 0, sizeof(*record));
+
+    record->header.inode = inode;
+    record->header.record_length =
+        (uint16_t)NBFS_DIRENT_RECORD_SIZE(length);
+    record->header.name_length = (uint8_t)length;
+    record->header.type = type;
+
+    memcpy(record->name, name, length);
+}
+
+static void record_load(
+    dirent_t *out,
+    nbfs_directory_entry_t *record)
+{
+    memset(out, 0, sizeof(*out));
+
+    out->header = *record;
+    nbfs_directory_entry_le(&out->header);
+    out->header.record_length = (uint16_t)record_used(record);
+
+    memcpy(out->name, record_name(record), record->name_length);
+}
+
+/*
+ * Write a record at offset, owning length bytes of the block.
+ */
+static void record_store(
+    uint8_t *data,
+    uint32_t offset,
+    const dirent_t *record,
+    uint32_t length)
+{
+    nbfs_directory_entry_t *stored = record_at(data, offset);
+    size_t used = NBFS_DIRENT_RECORD_SIZE(record->header.name_length);
+
+    memset(stored, 0, used);
+
+    *stored = record->header;
+    stored->record_length = (uint16_t)length;
+    nbfs_directory_entry_le(stored);
+
+    memcpy(record_name(stored), record->name, record->header.name_length);
+}
+
+/*
+ * One free record over the whole block.
+ */
+static void block_init(uint8_t *data, uint32_t block_size)
+{
+    memset(data, 0, block_size);
+
+    record_set_length(record_at(data, 0), block_size);
+}
+
+/*
+ * Offset of the record for name; -1 if it is not in the block.
+ */
+static int64_t block_find(
+    uint8_t *data,
+    uint32_t block_size,
+    const char *name,
+    size_t length)
+{
+    nbfs_directory_entry_t *record;
+
+    for (uint32_t offset = 0;
+         offset < block_size;
+         offset += record_length(record))
+    {
+        record = record_at(data, offset);
+
+        if (!record_valid(record, block_size - offset))
+            break;
+
+        if (record_match(record, name, length))
+            return offset;
+    }
+
+    return -1;
+}
+
+/*
+ * Store a record in the first free space large enough, splitting it
+ * off the record that owns it; 1 if the block is full.
+ */
+static int block_insert(
+    uint8_t *data,
+    uint32_t block_size,
+    const dirent_t *insert)
+{
+    uint32_t needed = insert->header.record_length;
+    nbfs_directory_entry_t *record;
+
+    for (uint32_t offset = 0;
+         offset < block_size;
+         offset += record_length(record))
+    {
+        record = record_at(data, offset);
+
+        if (!record_valid(record, block_size - offset))
+            return -1;
+
+        uint32_t used = record_used(record);
+        uint32_t length = record_length(record);
+
+        if (length - used < needed)
+            continue;
+
+        if (used)
+            record_set_length(record, used);
+
+        record_store(data, offset + used, insert, length - used);
+
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Point the record for name at replace's inode, or remove it when
+ * replace is NULL, giving its space to the record before it; 1 if
+ * the name is not in the block.
+ */
+static int block_update(
+    uint8_t *data,
+    uint32_t block_size,
+    const char *name,
+    size_t length,
+    const dirent_t *replace)
+{
+    nbfs_directory_entry_t *previous = NULL;
+    nbfs_directory_entry_t *record;
+
+    for (uint32_t offset = 0;
+         offset < block_size;
+         offset += record_length(record))
+    {
+        record = record_at(data, offset);
+
+        if (!record_valid(record, block_size - offset))
+            return -1;
+
+        if (record_match(record, name, length))
+        {
+            if (replace)
+            {
+                record->inode = nbfs_le64(replace->header.inode);
+                record->type = replace->header.type;
+            }
+            else if (previous)
+                record_set_length(previous,
+                                  record_length(previous) +
+                                  record_length(record));
+            else
+            {
+                uint32_t keep = record_length(record);
+
+                memset(record, 0, record_used(record));
+                record_set_length(record, keep);
+            }
+
+            return 0;
+        }
+
+        previous = record;
+    }
+
+    return 1;
+}
+
+/*
+ * Append the live records of a block to list, with their hashes.
+ * Dot records go to dots when it is given.
+ */
+static int block_collect(
+    uint8_t *data,
+    uint32_t block_size,
+    hashed_t *list,
+    size_t *count,
+    dirent_t *dots)
+{
+    nbfs_directory_entry_t *record;
+
+    for (uint32_t offset = 0;
+         offset < block_size;
+         offset += record_length(record))
+    {
+        record = record_at(data, offset);
+
+        if (!record_valid(record, block_size - offset))
+            return -1;
+
+        if (!record_inode(record))
+            continue;
+
+        char *name = record_name(record);
+        size_t length = record->name_length;
+
+        if (dots && is_dot(name, length))
+        {
+            record_load(&dots[length - 1], record);
+            continue;
+        }
+
+        record_load(&list[*count].record, record);
+        list[*count].hash = nbfs_dir_hash(name, length);
+
+        (*count)++;
+    }
+
+    return 0;
+}
+
+/*
+ * Lay records out from the start of the block, the last one owning
+ * the free space behind it.
+ */
+static int block_fill(
+    uint8_t *data,
+    uint32_t block_size,
+    const hashed_t *records,
+    size_t count)
+{
+    uint32_t offset = 0;
+    uint32_t last = 0;
+
+    block_init(data, block_size);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t used = records[i].record.header.record_length;
+
+        if (offset + used > block_size)
+            return -1;
+
+        record_store(data, offset, &records[i].record, used);
+
+        last = offset;
+        offset += used;
+    }
+
+    if (count)
+    {
+        nbfs_directory_entry_t *record = record_at(data, last);
+
+        record_set_length(record, record_length(record) + block_size - offset);
+    }
+
+    return 0;
+}
+
+/*
+ * Index blocks
+ */
+static uint16_t index_limit(uint32_t block_size, bool root)
+{
+    uint32_t offset = root ? ROOT_OFFSET : 0;
+
+    return (uint16_t)((block_size - offset -
+                       sizeof(nbfs_directory_entry_t) -
+                       sizeof(nbfs_dir_index_t)) /
+                      sizeof(nbfs_dir_index_entry_t));
+}
+
+static uint16_t index_count(const nbfs_dir_index_t *index)
+{
+    return nbfs_le16(index->count);
+}
+
+static void index_set_count(nbfs_dir_index_t *index, uint32_t count)
+{
+    index->count = nbfs_le16((uint16_t)count);
+}
+
+static nbfs_dir_index_entry_t index_entry(uint32_t hash, uint64_t block)
+{
+    nbfs_dir_index_entry_t entry = { hash, (uint32_t)block };
+
+    nbfs_dir_index_entry_le(&entry);
+
+    return entry;
+}
+
+static nbfs_dir_index_t *index_header(
+    uint8_t *data,
+    uint64_t block,
+    uint32_t block_size)
+{
+    uint32_t offset = block == 0 ? ROOT_OFFSET : 0;
+
+    /*
+     * The root follows "." and ".." at their smallest.
+     */
+    if (block == 0 &&
+        (record_length(record_at(data, 0)) != DOT_SIZE ||
+         record_length(record_at(data, DOT_SIZE)) != DOTDOT_SIZE))
+        return NULL;
+
+    const nbfs_directory_entry_t *record = record_at(data, offset);
+
+    if (record_inode(record) != 0 ||
+        record_length(record) != block_size - offset)
+        return NULL;
+
+    nbfs_dir_index_t *index = (nbfs_dir_index_t *)
+        (data + offset + sizeof(nbfs_directory_entry_t));
+
+    if (nbfs_le32(index->magic) != NBFS_DIR_INDEX_MAGIC ||
+        index->hash_version != NBFS_DIR_HASH_FNV1A ||
+        nbfs_le16(index->limit) != index_limit(block_size, block == 0) ||
+        index_count(index) == 0 ||
+        index_count(index) > nbfs_le16(index->limit))
+        return NULL;
+
+    return index;
+}
+
+static nbfs_dir_index_t *index_init(
+    uint8_t *data,
+    uint64_t block,
+    uint32_t block_size)
+{
+    uint32_t offset = block == 0 ? ROOT_OFFSET : 0;
+    nbfs_directory_entry_t *record = record_at(data, offset);
+
+    memset(data + offset, 0, block_size - offset);
+
+    record_set_length(record, block_size - offset);
+
+    nbfs_dir_index_t *index = (nbfs_dir_index_t *)
+        (data + offset + sizeof(nbfs_directory_entry_t));
+
+    index->magic = nbfs_le32(NBFS_DIR_INDEX_MAGIC);
+    index->hash_version = NBFS_DIR_HASH_FNV1A;
+    index->limit = nbfs_le16(index_limit(block_size, block == 0));
+
+    return index;
+}
+
+static nbfs_dir_index_entry_t *index_entries(nbfs_dir_index_t *index)
+{
+    return (nbfs_dir_index_entry_t *)(index + 1);
+}
+
+/*
+ * Last entry whose hash is at or below hash; entry 0 covers
+ * everything below entry 1.
+ */
+static int index_find(
+    const nbfs_dir_index_entry_t *entries,
+    uint16_t count,
+    uint32_t hash)
+{
+    int low = 1;
+    int high = count;
+
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+
+        if (nbfs_le32(entries[mid].hash) <= hash)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low - 1;
+}
+
+/*
+ * Directory blocks
+ */
+static int dir_open(
+    nbfs_context_t *ctx,
+    uint64_t inode,
+    dir_t *dir)
+{
+    dir->ctx = ctx;
+    dir->block_size = ctx->block_size;
+    dir->file = nbfs_file_open(ctx, inode);
+
+    if (!dir->file)
+        return -1;
+
+    uint64_t size = nbfs_file_size(dir->file);
+
+    if ((dir->file->inode.mode & NBFS_MODE_TYPE) != NBFS_MODE_DIRECTORY)
+    {
+        nbfs_file_close(dir->file);
+        return -1;
+    }
+
+    dir->blocks = size / dir->block_size;
+
+    return 0;
+}
+
+static void dir_close(dir_t *dir)
+{
+    nbfs_file_close(dir->file);
+}
+
+static uint8_t *dir_get(
+    dir_t *dir,
+    uint64_t block,
+    uint64_t *physical)
+{
+    uint64_t run;
+
+    if (block >= dir->blocks ||
+        nbfs_file_map(dir->file, block, physical, &run) != 0)
+        return NULL;
+
+    return nbfs_block_acquire(dir->ctx, *physical);
+}
+
+static void dir_put(
+    dir_t *dir,
+    uint64_t physical,
+    uint8_t *data,
+    bool dirty)
+{
+    nbfs_block_release(dir->ctx, physical, data, dirty);
+}
+
+/*
+ * Add a block holding one free record at the end.
+ */
+static int dir_grow(dir_t *dir, uint64_t *block)
+{
+    uint64_t physical;
+
+    if (dir->blocks >= UINT32_MAX)
+        return -1;
+
+    if (nbfs_file_truncate(dir->file,
+                           (dir->blocks + 1) * dir->block_size) != 0)
+        return -1;
+
+    *block = dir->blocks++;
+
+    uint8_t *data = dir_get(dir, *block, &physical);
+
+    if (!data)
+        return -1;
+
+    block_init(data, dir->block_size);
+    dir_put(dir, physical, data, true);
+
+    return 0;
+}
+
+static bool dir_indexed(dir_t *dir)
+{
+    uint64_t physical;
+    uint8_t *data = dir_get(dir, 0, &physical);
+
+    if (!data)
+        return false;
+
+    bool indexed = index_header(data, 0, dir->block_size) != NULL;
+
+    dir_put(dir, physical, data, false);
+
+    return indexed;
+}
+
+/*
+ * Walk the index from the root to the block of records that covers
+ * hash, noting the entry taken at each level.
+ */
+static int dir_probe(
+    dir_t *dir,
+    uint32_t hash,
+    dir_level_t *path,
+    int *levels,
+    uint64_t *leaf)
+{
+    uint64_t block = 0;
+    int depth = 0;
+
+    for (int level = 0; level <= depth; level++)
+    {
+        uint64_t physical;
+        uint8_t *data = dir_get(dir, block, &physical);
+
+        if (!data)
+            return -1;
+
+        nbfs_dir_index_t *index = index_header(data, block, dir->block_size);
+
+        if (!index || (level == 0 && index->depth >= NBFS_DIR_INDEX_DEPTH))
+        {
+            dir_put(dir, physical, data, false);
+            return -1;
+        }
+
+        if (level == 0)
+            depth = index->depth;
+
+        int position =
+            index_find(index_entries(index), index_count(index), hash);
+        uint64_t child = nbfs_le32(index_entries(index)[position].block);
+
+        dir_put(dir, physical, data, false);
+
+        if (child == 0 || child >= dir->blocks)
+            return -1;
+
+        path[level] = (dir_level_t){ block, position };
+        block = child;
+    }
+
+    *levels = depth + 1;
+    *leaf = block;
+
+    return 0;
+}
+
+/*
+ * Find name; 1 if it is not there. A damaged index falls back to
+ * reading every block.
+ */
+static int dir_find(
+    dir_t *dir,
+    const char *name,
+    size_t length,
+    uint64_t *inode)
+{
+    dir_level_t path[NBFS_DIR_INDEX_DEPTH];
+    uint64_t physical;
+    uint64_t leaf;
+    int levels;
+
+    if (!is_dot(name, length) &&
+        dir_indexed(dir) &&
+        dir_probe(dir, nbfs_dir_hash(name, length), path, &levels, &leaf) == 0)
+    {
+        uint8_t *data = dir_get(dir, leaf, &physical);
+
+        if (!data)
+            return -1;
+
+        int64_t found = block_find(data, dir->block_size, name, length);
+
+        if (found >= 0)
+            *inode = record_inode(record_at(data, (uint32_t)found));
+
+        dir_put(dir, physical, data, false);
+
+        return found >= 0 ? 0 : 1;
+    }
+
+    for (uint64_t block = 0; block < dir->blocks; block++)
+    {
+        uint8_t *data = dir_get(dir, block, &physical);
+
+        if (!data)
+            return -1;
+
+        int64_t found = block_find(data, dir->block_size, name, length);
+
+        if (found >= 0)
+            *inode = record_inode(record_at(data, (uint32_t)found));
+
+        dir_put(dir, physical, data, false);
+
+        if (found >= 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+static int compare_hashed(const void *a, const void *b)
+{
+    uint32_t left = ((const hashed_t *)a)->hash;
+    uint32_t right = ((const hashed_t *)b)->hash;
+
+    return (left > right) - (left < right);
+}
+
+/*
+ * Rewrite a block with the given records.
+ */
+static int dir_fill(
+    dir_t *dir,
+    uint64_t block,
+    const hashed_t *records,
+    size_t count)
+{
+    uint64_t physical;
+    uint8_t *data = dir_get(dir, block, &physical);
+
+    if (!data)
+        return -1;
+
+    int result = block_fill(data, dir->block_size, records, count);
+
+    dir_put(dir, physical, data, true);
+
+    return result;
+}
+
+/*
+ * Add an entry to an index, after the one taken at path[level].
+ *
+ * A full node gives the upper half of its entries to a new node and
+ * passes the new node up a level. A full root moves its entries into
+ * a new node below it, so the root stays in block 0.
+ */
+static int index_add(
+    dir_t *dir,
+    dir_level_t *path,
+    int level,
+    uint32_t hash,
+    uint64_t block)
+{
+    uint32_t block_size = dir->block_size;
+
+    for (;;)
+    {
+        uint64_t physical;
+        uint8_t *data = dir_get(dir, path[level].block, &physical);
+
+        if (!data)
+            return -1;
+
+        nbfs_dir_index_t *index =
+            index_header(data, path[level].block, block_size);
+
+        if (!index)
+        {
+            dir_put(dir, physical, data, false);
+            return -1;
+        }
+
+        nbfs_dir_index_entry_t *entries = index_entries(index);
+        int position = path[level].position + 1;
+
+        uint16_t count = index_count(index);
+
+        if (count < nbfs_le16(index->limit))
+        {
+            memmove(&entries[position + 1],
+                    &entries[position],
+                    (count - position) * sizeof(*entries));
+
+            entries[position] = index_entry(hash, block);
+
+            index_set_count(index, count + 1);
+
+            dir_put(dir, physical, data, true);
+
+            return 0;
+        }
+
+        bool root = level == 0;
+
+        if (root && index->depth + 1 >= NBFS_DIR_INDEX_DEPTH)
+        {
+            dir_put(dir, physical, data, false);
+            return -1;
+        }
+
+        dir_put(dir, physical, data, false);
+
+        uint64_t fresh;
+
+        if (dir_grow(dir, &fresh) != 0)
+            return -1;
+
+        uint64_t fresh_physical;
+        uint8_t *fresh_data = dir_get(dir, fresh, &fresh_physical);
+
+        if (!fresh_data)
+            return -1;
+
+        data = dir_get(dir, path[level].block, &physical);
+
+        if (!data)
+        {
+            dir_put(dir, fresh_physical, fresh_data, false);
+            return -1;
+        }
+
+        index = index_header(data, path[level].block, block_size);
+
+        if (!index)
+        {
+            dir_put(dir, physical, data, false);
+            dir_put(dir, fresh_physical, fresh_data, false);
+            return -1;
+        }
+
+        entries = index_entries(index);
+        count = index_count(index);
+
+        nbfs_dir_index_t *split = index_init(fresh_data, fresh, block_size);
+        nbfs_dir_index_entry_t *moved = index_entries(split);
+
+        if (root)
+        {
+            memcpy(moved, entries, count * sizeof(*entries));
+            index_set_count(split, count);
+
+            entries[0] = index_entry(0, fresh);
+            index_set_count(index, 1);
+            index->depth++;
+
+            dir_put(dir, fresh_physical, fresh_data, true);
+            dir_put(dir, physical, data, true);
+
+            /*
+             * The full level is now the new node, one down; it has
+             * room, as a node holds more entries than the root.
+             */
+            path[1] = (dir_level_t){ fresh, path[0].position };
+            path[0] = (dir_level_t){ 0, 0 };
+            level = 1;
+
+            continue;
+        }
+
+        uint16_t half = count / 2;
+
+        memcpy(moved,
+               &entries[half],
+               (count - half) * sizeof(*entries));
+
+        index_set_count(split, count - half);
+        index_set_count(index, half);
+
+        nbfs_dir_index_t *target = position <= half ? index : split;
+        nbfs_dir_index_entry_t *slots = index_entries(target);
+        int at = position <= half ? position : position - half;
+
+        uint16_t filled = index_count(target);
+
+        memmove(&slots[at + 1],
+                &slots[at],
+                (filled - at) * sizeof(*slots));
+
+        slots[at] = index_entry(hash, block);
+        index_set_count(target, filled + 1);
+
+        hash = nbfs_le32(moved[0].hash);
+        block = fresh;
+
+        dir_put(dir, fresh_physical, fresh_data, true);
+        dir_put(dir, physical, data, true);
+
+        level--;
+    }
+}
+
+/*
+ * Split a full block of records near its middle byte, keeping equal
+ * hashes together, and index the upper half.
+ */
+static int dir_split(
+    dir_t *dir,
+    dir_level_t *path,
+    int levels,
+    uint64_t leaf,
+    const hashed_t *insert)
+{
+    uint32_t block_size = dir->block_size;
+    size_t most = block_size / NBFS_DIRENT_RECORD_SIZE(1) + 1;
+    hashed_t *all = malloc(most * sizeof(*all));
+    uint64_t physical;
+    size_t count = 0;
+
+    if (!all)
+        return -1;
+
+    uint8_t *data = dir_get(dir, leaf, &physical);
+
+    if (!data)
+    {
+        free(all);
+        return -1;
+    }
+
+    int result = block_collect(data, block_size, all, &count, NULL);
+
+    dir_put(dir, physical, data, false);
+
+    if (result != 0)
+    {
+        free(all);
+        return -1;
+    }
+
+    all[count++] = *insert;
+
+    qsort(all, count, sizeof(*all), compare_hashed);
+
+    /*
+     * Bytes before each record; take the boundary nearest the middle
+     * that does not divide a hash and leaves both halves a block.
+     */
+    uint32_t total = 0;
+
+    for (size_t i = 0; i < count; i++)
+        total += all[i].record.header.record_length;
+
+    size_t split = 0;
+    uint32_t best = UINT32_MAX;
+    uint32_t before = 0;
+
+    for (size_t i = 1; i < count; i++)
+    {
+        before += all[i - 1].record.header.record_length;
+
+        uint32_t distance = before > total / 2
+            ? before - total / 2
+            : total / 2 - before;
+
+        if (all[i].hash != all[i - 1].hash &&
+            before <= block_size &&
+            total - before <= block_size &&
+            distance < best)
+        {
+            split = i;
+            best = distance;
+        }
+    }
+
+    uint64_t fresh;
+
+    result = -1;
+
+    if (split &&
+        dir_grow(dir, &fresh) == 0 &&
+        index_add(dir, path, levels - 1, all[split].hash, fresh) == 0 &&
+        dir_fill(dir, leaf, all, split) == 0 &&
+        dir_fill(dir, fresh, all + split, count - split) == 0)
+        result = 0;
+
+    free(all);
+
+    return result;
+}
+
+/*
+ * Turn a linear directory into an indexed one: its records, sorted
+ * by hash, go into half-full blocks behind a new root in block 0.
+ */
+static int dir_convert(dir_t *dir)
+{
+    uint32_t block_size = dir->block_size;
+    size_t most = block_size / NBFS_DIRENT_RECORD_SIZE(1);
+    uint64_t physical;
+
+    dirent_t dots[2];
+    size_t count = 0;
+
+    hashed_t *all = malloc((dir->blocks * most + 1) * sizeof(*all));
+    size_t *starts = malloc((dir->blocks * most + 1) * sizeof(*starts));
+
+    int result = -1;
+
+    if (!all || !starts)
+        goto out;
+
+    memset(dots, 0, sizeof(dots));
+
+    for (uint64_t block = 0; block < dir->blocks; block++)
+    {
+        uint8_t *data = dir_get(dir, block, &physical);
+
+        if (!data)
+            goto out;
+
+        int collected = block_collect(data, block_size, all, &count, dots);
+
+        dir_put(dir, physical, data, false);
+
+        if (collected != 0)
+            goto out;
+    }
+
+    qsort(all, count, sizeof(*all), compare_hashed);
+
+    /*
+     * Fill each block to about half, never dividing a hash.
+     */
+    size_t leaves = 0;
+    size_t start = 0;
+
+    do
+    {
+        size_t end = start;
+        uint32_t bytes = 0;
+
+        while (end < count)
+        {
+            uint32_t used = all[end].record.header.record_length;
+
+            if (end > start &&
+                all[end].hash != all[end - 1].hash &&
+                bytes + used > block_size / 2)
+                break;
+
+            if (bytes + used > block_size)
+                goto out;
+
+            bytes += used;
+            end++;
+        }
+
+        starts[leaves++] = start;
+        start = end;
+    }
+    while (start < count);
+
+    if (leaves > index_limit(block_size, true))
+        goto out;
+
+    if (nbfs_file_truncate(dir->file, (leaves + 1) * block_size) != 0)
+        goto out;
+
+    dir->blocks = leaves + 1;
+
+    for (size_t i = 0; i < leaves; i++)
+    {
+        size_t end = i + 1 < leaves ? starts[i + 1] : count;
+
+        if (dir_fill(dir, i + 1, all + starts[i], end - starts[i]) != 0)
+            goto out;
+    }
+
+    uint8_t *data = dir_get(dir, 0, &physical);
+
+    if (!data)
+        goto out;
+
+    memset(data, 0, ROOT_OFFSET);
+
+    record_store(data, 0, &dots[0], DOT_SIZE);
+    record_store(data, DOT_SIZE, &dots[1], DOTDOT_SIZE);
+
+    nbfs_dir_index_t *index = index_init(data, 0, block_size);
+    nbfs_dir_index_entry_t *entries = index_entries(index);
+
+    for (size_t i = 0; i < leaves; i++)
+        entries[i] = index_entry(i ? all[starts[i]].hash : 0, i + 1);
+
+    index_set_count(index, leaves);
+
+    dir_put(dir, physical, data, true);
+
+    result = 0;
+
+out:
+    free(starts);
+    free(all);
+
+    return result;
+}
+
+/*
+ * Add a record for a name known not to be there.
+ */
+static int dir_insert(
+    dir_t *dir,
+    const char *name,
+    size_t length,
+    uint64_t inode,
+    uint8_t type)
+{
+    hashed_t insert;
+    uint64_t physical;
+
+    record_fill(&insert.record, inode, name, length, type);
+    insert.hash = nbfs_dir_hash(name, length);
+
+    if (!dir_indexed(dir))
+    {
+        for (uint64_t block = 0; block < dir->blocks; block++)
+        {
+            uint8_t *data = dir_get(dir, block, &physical);
+
+            if (!data)
+                return -1;
+
+            int full = block_insert(data, dir->block_size, &insert.record);
+
+            dir_put(dir, physical, data, full == 0);
+
+            if (full <= 0)
+                return full;
+        }
+
+        if (dir_convert(dir) != 0)
+            return -1;
+    }
+
+    dir_level_t path[NBFS_DIR_INDEX_DEPTH];
+    uint64_t leaf;
+    int levels;
+
+    if (dir_probe(dir, insert.hash, path, &levels, &leaf) != 0)
+        return -1;
+
+    uint8_t *data = dir_get(dir, leaf, &physical);
+
+    if (!data)
+        return -1;
+
+    int full = block_insert(data, dir->block_size, &insert.record);
+
+    dir_put(dir, physical, data, full == 0);
+
+    if (full <= 0)
+        return full;
+
+    return dir_split(dir, path, levels, leaf, &insert);
+}
+
+/*
+ * Change or remove the record of name, as block_update().
+ */
+static int dir_update(
+    dir_t *dir,
+    const char *name,
+    size_t length,
+    const dirent_t *replace)
+{
+    dir_level_t path[NBFS_DIR_INDEX_DEPTH];
+    uint64_t first = 0;
+    uint64_t last = dir->blocks;
+    uint64_t leaf;
+    int levels;
+
+    if (!is_dot(name, length) &&
+        dir_indexed(dir) &&
+        dir_probe(dir, nbfs_dir_hash(name, length), path, &levels, &leaf) == 0)
+    {
+        first = leaf;
+        last = leaf + 1;
+    }
+
+    for (uint64_t block = first; block < last; block++)
+    {
+        uint64_t physical;
+        uint8_t *data = dir_get(dir, block, &physical);
+
+        if (!data)
+            return -1;
+
+        int updated = block_update(data,
+                                   dir->block_size,
+                                   name,
+                                   length,
+                                   replace);
+
+        dir_put(dir, physical, data, updated == 0);
+
+        if (updated <= 0)
+            return updated;
+    }
+
+    return -1;
+}
+
+/*
+ * Whether the directory holds anything besides "." and "..".
+ */
+static int dir_empty(dir_t *dir)
+{
+    uint32_t block_size = dir->block_size;
+
+    for (uint64_t block = 0; block < dir->blocks; block++)
+    {
+        uint64_t physical;
+        uint8_t *data = dir_get(dir, block, &physical);
+
+        if (!data)
+            return -1;
+
+        nbfs_directory_entry_t *record;
+        int empty = 1;
+
+        for (uint32_t offset = 0;
+             offset < block_size && empty == 1;
+             offset += record_length(record))
+        {
+            record = record_at(data, offset);
+
+            if (!record_valid(record, block_size - offset))
+                empty = -1;
+            else if (record_inode(record) &&
+                     !is_dot(record_name(record), record->name_length))
+                empty = 0;
+        }
+
+        dir_put(dir, physical, data, false);
+
+        if (empty != 1)
+            return empty;
+    }
+
+    return 1;
+}
+
+static bool valid_name(const char *name, size_t *length)
+{
+    if (!name)
+        return false;
+
+    *length = strlen(name);
+
+    return *length > 0 &&
+           *length <= NBFS_DIRENT_NAME_MAX &&
+           !memchr(name, '/', *length);
+}
+
+/*
+ * Look name up in parent, through the entry cache; 1 if it is not
+ * there.
+ */
+static int dir_resolve(
+    nbfs_context_t *ctx,
+    uint64_t parent,
+    const char *name,
+    size_t length,
+    uint64_t *inode)
+{
+    int cached = nbfs_dcache_lookup(ctx, parent, name, length, inode);
+
+    if (cached >= 0)
+        return cached;
+
+    dir_t dir;
+
+    if (dir_open(ctx, parent, &dir) != 0)
+        return -1;
+
+    int result = dir_find(&dir, name, length, inode);
+
+    dir_close(&dir);
+
+    if (result >= 0)
+        nbfs_dcache_insert(ctx, parent, name, length, result ? 0 : *inode);
+
+    return result;
+}
+
+static bool is_directory(const nbfs_inode_t *node)
+{
+    return (node->mode & NBFS_MODE_TYPE) == NBFS_MODE_DIRECTORY;
+}
+
+/*
+ * A name for the inode is gone; the inode goes with its last link.
+ */
+static int inode_unlinked(
+    nbfs_context_t *ctx,
+    nbfs_inode_t *node)
+{
+    if (is_directory(node))
+    {
+        nbfs_dcache_forget_directory(ctx, node->inode_number);
+        return nbfs_delete_file(ctx, node->inode_number);
+    }
+
+    if (node->links <= 1)
+        return nbfs_delete_file(ctx, node->inode_number);
+
+    node->links--;
+
+    return nbfs_write_inode(ctx, node);
+}
+
+/*
+ * Give a new directory its first block, holding "." and "..".
+ */
+static int dir_format(
+    nbfs_context_t *ctx,
+    uint64_t inode,
+    uint64_t parent)
+{
+    dir_t dir;
+    uint64_t block;
+    int result = -1;
+
+    if (dir_open(ctx, inode, &dir) != 0)
+        return -1;
+
+    if (dir.blocks == 0 && dir_grow(&dir, &block) == 0)
+    {
+        uint64_t physical;
+        uint8_t *data = dir_get(&dir, 0, &physical);
+
+        if (data)
+        {
+            dirent_t dot;
+
+            record_fill(&dot, inode, ".", 1, NBFS_DIRENT_DIRECTORY);
+            record_store(data, 0, &dot, DOT_SIZE);
+
+            record_fill(&dot, parent, "..", 2, NBFS_DIRENT_DIRECTORY);
+            record_store(data, DOT_SIZE, &dot, dir.block_size - DOT_SIZE);
+
+            dir_put(&dir, physical, data, true);
+
+            result = 0;
+        }
+    }
+
+    dir_close(&dir);
+
+    return result;
+}
+
+/*
+ * inode has been allocated for the new name; it is given back when
+ * the name cannot be made.
+ */
+static int dir_make(
+    nbfs_context_t *ctx,
+    uint64_t parent,
+    const char *name,
+    size_t length,
+    uint64_t inode,
+    uint16_t mode)
+{
+    uint64_t existing;
+    dir_t dir;
+
+    if (dir_open(ctx, parent, &dir) != 0)
+    {
+        nbfs_free_inode(ctx, inode);
+        return -1;
+    }
+
+    bool directory = mode == NBFS_MODE_DIRECTORY;
+
+    int found = nbfs_dcache_lookup(ctx, parent, name, length, &existing);
+
+    if (found < 0)
+        found = dir_find(&dir, name, length, &existing);
+
+    if (found != 1)
+    {
+        dir_close(&dir);
+        nbfs_free_inode(ctx, inode);
+        return -1;
+    }
+
+    nbfs_inode_t node;
+
+    memset(&node, 0, sizeof(node));
+
+    node.inode_number = inode;
+    node.mode = mode;
+    node.links = directory ? 2 : 1;
+
+    int result = nbfs_write_inode(ctx, &node);
+
+    if (result == 0 && directory)
+        result = dir_format(ctx, inode, parent);
+
+    if (result == 0)
+    {
+        result = dir_insert(&dir,
+                            name,
+                            length,
+                            inode,
+                            directory
+                                ? NBFS_DIRENT_DIRECTORY
+                                : NBFS_DIRENT_FILE);
+    }
+
+    /*
+     * Without its entry the new inode is unreachable; give it back.
+     */
+    if (result != 0)
+    {
+        dir_close(&dir);
+        nbfs_delete_file(ctx, inode);
+        return -1;
+    }
+
+    nbfs_dcache_insert(ctx, parent, name, length, inode);
+
+    if (directory)
+    {
+        dir.file->inode.links++;
+        result = nbfs_write_inode(ctx, &dir.file->inode);
+    }
+
+    dir_close(&dir);
+
+    return result;
+}
+
+/*
+ * Each operation below is one journal transaction. Inside it, the
+ * namespace lock is held shared, or exclusively by rename, and the
+ * directories and inodes an operation changes are locked for
+ * writing; see include/internal/lock.h.
+ */
+static int dir_create(
+    nbfs_context_t *ctx,
+    uint64_t parent,
+    const char *name,
+    uint16_t mode)
+{
+    size_t length;
+
+    if (!ctx || ctx->read_only ||
+        !valid_name(name, &length) ||
+        is_dot(name, length) ||
+        nbfs_journal_begin(ctx) != 0)
+        return -1;
+
+    pthread_rwlock_rdlock(&ctx->namespace_lock);
+
+    /*
+     * The new inode is allocated first, so that it is locked in the
+     * same set as its parent.
+     */
+    uint64_t inodes[2] = { parent, 0 };
+    int result = -1;
+
+    if (nbfs_allocate_inode(ctx, &inodes[1]) == 0)
+    {
+        if (nbfs_inode_lock(ctx, inodes, 2, true) == 0)
+        {
+            result = dir_make(ctx, parent, name, length, inodes[1], mode);
+            nbfs_inode_unlock(ctx);
+        }
+        else
+            nbfs_free_inode(ctx, inodes[1]);
+    }
+    pthread_rwlock_unlock(&ctx->namespace_lock);
+
+    if (nbfs_journal_commit(ctx) != 0)
+        result = -1;
+
+    return result;
+}
+
+int nbfs_create_file(
+    nbfs_context_t *ctx,
+    uint64_t parent_inode,
+    const char *name)
+{
+    return dir_create(ctx, parent_inode, name, NBFS_MODE_FILE);
+}
+
+int nbfs_create_directory(
+    nbfs_context_t *ctx,
+    uint64_t parent_inode,
+    const char *name)
+{
+    return dir_create(ctx, parent_inode, name, NBFS_MODE_DIRECTORY);
+}
+
+int nbfs_lookup(
+    nbfs_context_t *ctx,
+    uint64_t directory_inode,
+    const char *name,
+    uint64_t *inode)
+{
+    size_t length;
+
+    if (!ctx || !inode || !valid_name(name, &length))
+        return -1;
+
+    pthread_rwlock_rdlock(&ctx->namespace_lock);
+    int result = -1;
+
+    if (nbfs_inode_lock(ctx, &directory_inode, 1, false) == 0)
+    {
+        result = dir_resolve(ctx, directory_inode, name, length, inode);
+        nbfs_inode_unlock(ctx);
+    }
+    pthread_rwlock_unlock(&ctx->namespace_lock);
+
+    return result == 0 ? 0 : -1;
+}
+
+int nbfs_lookup_path(
+    nbfs_context_t *ctx,
+    const char *path,
+    uint64_t *inode)
+{
+    if (!ctx || !path || !inode)
+        return -1;
+
+    if (nbfs_superblock_load(ctx) != 0)
+        return -1;
+
+    uint64_t current = ctx->superblock.root_inode;
+    int result = 0;
+
+    /*
+     * Each directory is locked only while its entry is looked up;
+     * the namespace lock keeps rename out for the whole walk.
+     */
+    pthread_rwlock_rdlock(&ctx->namespace_lock);
+
+    while (*path && result == 0)
+    {
+        const char *end = path;
+
+        while (*end && *end != '/')
+            end++;
+
+        size_t length = (size_t)(end - path);
+
+        if (length > NBFS_DIRENT_NAME_MAX)
+        {
+            result = -1;
+            break;
+        }
+
+        if (length && !(length == 1 && path[0] == '.'))
+        {
+            uint64_t directory = current;
+
+            if (nbfs_inode_lock(ctx, &directory, 1, false) != 0)
+            {
+                result = -1;
+                break;
+            }
+
+            if (dir_resolve(ctx, directory, path, length, &current) != 0)
+                result = -1;
+
+            nbfs_inode_unlock(ctx);
+        }
+
+        path = *end ? end + 1 : end;
+    }
+
+    pthread_rwlock_unlock(&ctx->namespace_lock);
+
+    if (result != 0)
+        return -1;
+
+    *inode = current;
+
+    return 0;
+}
+
+/*
+ * locked is the inode the caller has locked along with the
+ * directory. When name refers to another, 1 comes back with that
+ * inode in locked, to be locked for another try.
+ */
+static int dir_unlink(
+    nbfs_context_t *ctx,
+    uint64_t directory_inode,
+    const char *name,
+    uint64_t *locked)
+{
+    size_t length;
+    uint64_t inode;
+    dir_t dir;
+
+    if (!ctx || ctx->read_only ||
+        !valid_name(name, &length) ||
+        is_dot(name, length))
+        return -1;
+
+    nbfs_inode_t node;
+
+    if (dir_resolve(ctx, directory_inode, name, length, &inode) != 0)
+        return -1;
+
+    if (inode != *locked)
+    {
+        *locked = inode;
+        return 1;
+    }
+
+    if (nbfs_read_inode(ctx, inode, &node) != 0)
+        return -1;
+
+    bool directory = is_directory(&node);
+
+    if (directory)
+    {
+        dir_t child;
+
+        if (dir_open(ctx, inode, &child) != 0)
+            return -1;
+
+        int empty = dir_empty(&child);
+
+        dir_close(&child);
+
+        if (empty != 1)
+            return -1;
+    }
+
+    if (dir_open(ctx, directory_inode, &dir) != 0)
+        return -1;
+
+    int result = dir_update(&dir, name, length, NULL);
+
+    if (result == 0)
+        nbfs_dcache_insert(ctx, directory_inode, name, length, 0);
+
+    if (result == 0 && directory)
+    {
+        dir.file->inode.links--;
+        result = nbfs_write_inode(ctx, &dir.file->inode);
+    }
+
+    dir_close(&dir);
+
+    if (result != 0)
+        return -1;
+
+    return inode_unlinked(ctx, &node);
+}
+
+/*
+ * Whether dir is inode or lies below it.
+ */
+static int dir_below(
+    nbfs_context_t *ctx,
+    uint64_t dir,
+    uint64_t inode)
+{
+    for (;;)
+    {
+        uint64_t parent;
+
+        if (dir == inode)
+            return 1;
+
+        if (dir == ctx->superblock.root_inode)
+            return 0;
+
+        if (dir_resolve(ctx, dir, "..", 2, &parent) != 0 ||
+            parent == dir)
+            return -1;
+
+        dir = parent;
+    }
+}
+
+static int dir_rename(
+    nbfs_context_t *ctx,
+    uint64_t old_parent,
+    const char *old_name,
+    uint64_t new_parent,
+    const char *new_name)
+{
+    size_t old_length;
+    size_t new_length;
+    uint64_t inode;
+    uint64_t replaced;
+
+    if (!ctx || ctx->read_only ||
+        !valid_name(old_name, &old_length) ||
+        !valid_name(new_name, &new_length) ||
+        is_dot(old_name, old_length) ||
+        is_dot(new_name, new_length))
+        return -1;
+
+    if (nbfs_superblock_load(ctx) != 0 ||
+        dir_resolve(ctx, old_parent, old_name, old_length, &inode) != 0)
+        return -1;
+
+    int found = dir_resolve(ctx, new_parent, new_name, new_length, &replaced);
+
+    if (found < 0)
+        return -1;
+
+    /*
+     * Both names already refer to the same inode.
+     */
+    if (found == 0 && replaced == inode)
+        return 0;
+
+    nbfs_inode_t node;
+    nbfs_inode_t target;
+
+    if (nbfs_read_inode(ctx, inode, &node) != 0)
+        return -1;
+
+    bool directory = is_directory(&node);
+    bool moved = directory && old_parent != new_parent;
+
+    if (moved && dir_below(ctx, new_parent, inode) != 0)
+        return -1;
+
+    /*
+     * Only a non-directory is replaced.
+     */
+    if (found == 0 &&
+        (directory ||
+         nbfs_read_inode(ctx, replaced, &target) != 0 ||
+         is_directory(&target)))
+        return -1;
+
+    dir_t source;
+    dir_t destination;
+
+    if (dir_open(ctx, old_parent, &source) != 0)
+        return -1;
+
+    dir_t *to = &source;
+
+    if (new_parent != old_parent)
+    {
+        if (dir_open(ctx, new_parent, &destination) != 0)
+        {
+            dir_close(&source);
+            return -1;
+        }
+
+        to = &destination;
+    }
+
+    /*
+     * The new name is in place before the old one goes, so the inode
+     * stays reachable throughout.
+     */
+    uint8_t type = directory ? NBFS_DIRENT_DIRECTORY : NBFS_DIRENT_FILE;
+    dirent_t record;
+    int result;
+
+    record_fill(&record, inode, new_name, new_length, type);
+
+    if (found == 0)
+        result = dir_update(to, new_name, new_length, &record);
+    else
+        result = dir_insert(to, new_name, new_length, inode, type);
+
+    if (result == 0)
+    {
+        nbfs_dcache_insert(ctx, new_parent, new_name, new_length, inode);
+
+        result = dir_update(&source, old_name, old_length, NULL);
+    }
+
+    if (result == 0)
+        nbfs_dcache_insert(ctx, old_parent, old_name, old_length, 0);
+
+    if (result == 0 && moved)
+    {
+        dir_t child;
+
+        if (dir_open(ctx, inode, &child) == 0)
+        {
+            record_fill(&record, new_parent, "..", 2, NBFS_DIRENT_DIRECTORY);
+
+            result = dir_update(&child, "..", 2, &record);
+
+            dir_close(&child);
+        }
+        else
+            result = -1;
+
+        nbfs_dcache_forget(ctx, inode, "..", 2);
+
+        source.file->inode.links--;
+        to->file->inode.links++;
+
+        if (result == 0)
+            result = nbfs_write_inode(ctx, &source.file->inode);
+
+        if (result == 0)
+            result = nbfs_write_inode(ctx, &to->file->inode);
+    }
+
+    if (to != &source)
+        dir_close(to);
+
+    dir_close(&source);
+
+    if (result == 0 && found == 0)
+        result = inode_unlinked(ctx, &target);
+
+    return result == 0 ? 0 : -1;
+}
+
+int nbfs_unlink(
+    nbfs_context_t *ctx,
+    uint64_t directory_inode,
+    const char *name)
+{
+    if (!ctx || nbfs_journal_begin(ctx) != 0)
+        return -1;
+
+    pthread_rwlock_rdlock(&ctx->namespace_lock);
+
+    uint64_t inodes[2] = { directory_inode, 0 };
+    int result;
+
+    do
+    {
+        if (nbfs_inode_lock(ctx, inodes, inodes[1] ? 2 : 1, true) != 0)
+        {
+            result = -1;
+            break;
+        }
+
+        result = dir_unlink(ctx, directory_inode, name, &inodes[1]);
+
+        nbfs_inode_unlock(ctx);
+    }
+    while (result == 1);
+
+    pthread_rwlock_unlock(&ctx->namespace_lock);
+
+    if (nbfs_journal_commit(ctx) != 0)
+        result = -1;
+
+    return result;
+}
+
+int nbfs_rename(
+    nbfs_context_t *ctx,
+    uint64_t old_parent,
+    const char *old_name,
+    uint64_t new_parent,
+    const char *new_name)
+{
+    if (!ctx || nbfs_journal_begin(ctx) != 0)
+        return -1;
+
+    /*
+     * With the namespace held exclusively no name can change, so
+     * the inodes both names refer to can be looked up before they
+     * are locked.
+     */
+    pthread_rwlock_wrlock(&ctx->namespace_lock);
+
+    uint64_t inodes[4] = { old_parent, new_parent, 0, 0 };
+    int count = 2;
+    size_t length;
+
+    if (valid_name(old_name, &length) &&
+        dir_resolve(ctx, old_parent, old_name, length, &inodes[count]) == 0)
+        count++;
+
+    if (valid_name(new_name, &length) &&
+        dir_resolve(ctx, new_parent, new_name, length, &inodes[count]) == 0)
+        count++;
+
+    int result = -1;
+
+    if (nbfs_inode_lock(ctx, inodes, count, true) == 0)
+    {
+        result = dir_rename(ctx, old_parent, old_name, new_parent, new_name);
+        nbfs_inode_unlock(ctx);
+    }
+    pthread_rwlock_unlock(&ctx->namespace_lock);
+
+    if (nbfs_journal_commit(ctx) != 0)
+        result = -1;
+
+    return result;
+}
@@ -1,10 +0,0 @@
-/*
- * endian.c
- * NeoBench libnbfs
- */
-
-#include <stdio.h>
-#include <stdlib.h>
-
-#include "internal/context.h"
-
@@ -0,0 +1,478 @@
+/*
+ * NeoBench Filesystem Library
+ *
+ * extent.c
+ *
+ * Contiguous extent allocation
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libnbfs.h"
+#include "internal/allocator.h"
+
+typedef struct
+{
+    uint64_t start;
+    uint64_t length;
+} free_run_t;
+
+struct nbfs_extent_index
+{
+    free_run_t *by_start;
+
+    free_run_t *by_size;
+
+    size_t count;
+
+    size_t capacity;
+};
+
+static int size_order(
+    const free_run_t *a,
+    uint64_t length,
+    uint64_t start)
+{
+    if (a->length != length)
+        return a->length < length ? -1 : 1;
+
+    if (a->start != start)
+        return a->start < start ? -1 : 1;
+
+    return 0;
+}
+
+static int sort_size(const void *a, const void *b)
+{
+    const free_run_t *y = b;
+
+    return size_order(a, y->length, y->start);
+}
+
+/*
+ * First run whose start is at least start.
+ */
+static size_t start_lower(
+    const struct nbfs_extent_index *index,
+    uint64_t start)
+{
+    size_t low = 0;
+    size_t high = index->count;
+
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+
+        if (index->by_start[mid].start < start)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+/*
+ * First run ordered at or after (length, start).
+ */
+static size_t size_lower(
+    const struct nbfs_extent_index *index,
+    uint64_t length,
+    uint64_t start)
+{
+    size_t low = 0;
+    size_t high = index->count;
+
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+
+        if (size_order(&index->by_size[mid], length, start) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+static int index_reserve(struct nbfs_extent_index *index)
+{
+    if (index->count < index->capacity)
+        return 0;
+
+    size_t capacity = index->capacity ? index->capacity * 2 : 64;
+
+    free_run_t *by_start =
+        realloc(index->by_start, capacity * sizeof(free_run_t));
+
+    if (!by_start)
+        return -1;
+
+    index->by_start = by_start;
+
+    free_run_t *by_size =
+        realloc(index->by_size, capacity * sizeof(free_run_t));
+
+    if (!by_size)
+        return -1;
+
+    index->by_size = by_size;
+    index->capacity = capacity;
+
+    return 0;
+}
+
+static void run_remove(
+    struct nbfs_extent_index *index,
+    size_t position)
+{
+    free_run_t run = index->by_start[position];
+
+    memmove(&index->by_start[position],
+            &index->by_start[position + 1],
+            (index->count - position - 1) * sizeof(free_run_t));
+
+    size_t s = size_lower(index, run.length, run.start);
+
+    memmove(&index->by_size[s],
+            &index->by_size[s + 1],
+            (index->count - s - 1) * sizeof(free_run_t));
+
+    index->count--;
+}
+
+static int run_add(
+    struct nbfs_extent_index *index,
+    uint64_t start,
+    uint64_t length)
+{
+    if (index_reserve(index) != 0)
+        return -1;
+
+    size_t p = start_lower(index, start);
+    size_t s = size_lower(index, length, start);
+
+    memmove(&index->by_start[p + 1],
+            &index->by_start[p],
+            (index->count - p) * sizeof(free_run_t));
+
+    memmove(&index->by_size[s + 1],
+            &index->by_size[s],
+            (index->count - s) * sizeof(free_run_t));
+
+    index->by_start[p] = (free_run_t){ start, length };
+    index->by_size[s] = (free_run_t){ start, length };
+    index->count++;
+
+    return 0;
+}
+
+static int index_append(void *arg, uint64_t start, uint64_t length)
+{
+    struct nbfs_extent_index *index = arg;
+
+    if (index_reserve(index) != 0)
+        return -1;
+
+    index->by_start[index->count++] = (free_run_t){ start, length };
+
+    return 0;
+}
+
+static void index_free(struct nbfs_extent_index *index)
+{
+    if (!index)
+        return;
+
+    free(index->by_start);
+    free(index->by_size);
+    free(index);
+}
+
+int nbfs_extent_index_build(nbfs_context_t *ctx)
+{
+    nbfs_bitmap_region_t region;
+
+    if (!ctx)
+        return -1;
+
+    if (nbfs_bitmap_region(ctx, false, &region) != 0)
+        return -1;
+
+    struct nbfs_extent_index *index = calloc(1, sizeof(*index));
+
+    if (!index)
+        return -1;
+
+    /*
+     * Runs arrive in start order; only the size view needs sorting.
+     * The bitmap holds still while it is walked.
+     */
+    nbfs_allocator_freeze(ctx);
+
+    if (nbfs_bitmap_free_runs(ctx, &region, index_append, index) != 0 ||
+        index_reserve(index) != 0)
+    {
+        index_free(index);
+        index = NULL;
+    }
+    else
+    {
+        memcpy(index->by_size,
+               index->by_start,
+               index->count * sizeof(free_run_t));
+
+        qsort(index->by_size, index->count, sizeof(free_run_t), sort_size);
+    }
+
+    pthread_mutex_lock(&ctx->allocator_lock);
+
+    index_free(ctx->extent_index);
+    ctx->extent_index = index;
+
+    pthread_mutex_unlock(&ctx->allocator_lock);
+
+    nbfs_allocator_thaw(ctx);
+
+    return index ? 0 : -1;
+}
+
+void nbfs_extent_index_destroy(nbfs_context_t *ctx)
+{
+    if (!ctx)
+        return;
+
+    index_free(ctx->extent_index);
+
+    ctx->extent_index = NULL;
+}
+
+/*
+ * A freed range, merged with the runs on either side.
+ */
+void nbfs_extent_index_insert(
+    nbfs_context_t *ctx,
+    uint64_t start,
+    uint64_t length)
+{
+    struct nbfs_extent_index *index = ctx->extent_index;
+
+    if (!index)
+        return;
+
+    size_t p = start_lower(index, start);
+
+    if (p < index->count && index->by_start[p].start < start + length)
+    {
+        nbfs_extent_index_destroy(ctx);
+        return;
+    }
+
+    if (p > 0)
+    {
+        free_run_t *prev = &index->by_start[p - 1];
+
+        if (prev->start + prev->length > start)
+        {
+            nbfs_extent_index_destroy(ctx);
+            return;
+        }
+
+        if (prev->start + prev->length == start)
+        {
+            start = prev->start;
+            length += prev->length;
+            run_remove(index, --p);
+        }
+    }
+
+    if (p < index->count && index->by_start[p].start == start + length)
+    {
+        length += index->by_start[p].length;
+        run_remove(index, p);
+    }
+
+    if (run_add(index, start, length) != 0)
+        nbfs_extent_index_destroy(ctx);
+}
+
+/*
+ * A claimed range, cut out of the run that holds it.
+ */
+void nbfs_extent_index_remove(
+    nbfs_context_t *ctx,
+    uint64_t start,
+    uint64_t length)
+{
+    struct nbfs_extent_index *index = ctx->extent_index;
+
+    if (!index)
+        return;
+
+    size_t p = start_lower(index, start + 1);
+
+    if (p == 0)
+    {
+        nbfs_extent_index_destroy(ctx);
+        return;
+    }
+
+    free_run_t run = index->by_start[p - 1];
+
+    if (run.start + run.length < start + length)
+    {
+        nbfs_extent_index_destroy(ctx);
+        return;
+    }
+
+    run_remove(index, p - 1);
+
+    if (start > run.start &&
+        run_add(index, run.start, start - run.start) != 0)
+    {
+        nbfs_extent_index_destroy(ctx);
+        return;
+    }
+
+    uint64_t end = start + length;
+
+    if (run.start + run.length > end &&
+        run_add(index, end, run.start + run.length - end) != 0)
+        nbfs_extent_index_destroy(ctx);
+}
+
+/*
+ * Choose up to want blocks:
+ *
+ *  1. straight from goal, when the run holding goal is long enough;
+ *  2. otherwise the smallest run that fits, the first at or after
+ *     goal among runs of that length;
+ *  3. otherwise all of the largest run.
+ */
+static int extent_choose(
+    const struct nbfs_extent_index *index,
+    uint64_t want,
+    uint64_t goal,
+    free_run_t *out)
+{
+    if (index->count == 0)
+        return -1;
+
+    if (goal)
+    {
+        size_t p = start_lower(index, goal + 1);
+
+        if (p > 0)
+        {
+            const free_run_t *run = &index->by_start[p - 1];
+
+            if (run->start + run->length >= goal + want)
+            {
+                *out = (free_run_t){ goal, want };
+                return 0;
+            }
+        }
+    }
+
+    size_t s = size_lower(index, want, 0);
+
+    if (s < index->count)
+    {
+        size_t near = size_lower(index, index->by_size[s].length, goal);
+
+        if (near < index->count &&
+            index->by_size[near].length == index->by_size[s].length)
+            s = near;
+
+        *out = (free_run_t){ index->by_size[s].start, want };
+        return 0;
+    }
+
+    *out = index->by_size[index->count - 1];
+
+    return 0;
+}
+
+int nbfs_allocate_extent(
+    nbfs_context_t *ctx,
+    uint64_t want,
+    uint64_t goal,
+    nbfs_extent_t *extent)
+{
+    if (!ctx || !extent || want == 0 || ctx->read_only)
+        return -1;
+
+    if (want > UINT32_MAX)
+        want = UINT32_MAX;
+
+    /*
+     * Without a goal, threads look from their own shards, so that
+     * they do not all reach for the same run.
+     */
+    if (goal == 0)
+        goal = nbfs_allocator_goal(ctx);
+
+    /*
+     * The claim fails when another thread took the run between the
+     * choice and the claim; look again. A second miss means a stale
+     * index: drop it and rebuild once.
+     */
+    for (int attempt = 0; attempt < 3; attempt++)
+    {
+        free_run_t run;
+
+        if (!ctx->extent_index && nbfs_extent_index_build(ctx) != 0)
+            return -1;
+
+        pthread_mutex_lock(&ctx->allocator_lock);
+
+        int chosen = ctx->extent_index
+            ? extent_choose(ctx->extent_index, want, goal, &run)
+            : -1;
+
+        pthread_mutex_unlock(&ctx->allocator_lock);
+
+        if (chosen != 0)
+            return -1;
+
+        if (run.length > want)
+            run.length = want;
+
+        if (nbfs_bitmap_claim_blocks(ctx, run.start, run.length) == 0)
+        {
+            extent->start_block = run.start;
+            extent->block_count = (uint32_t)run.length;
+            extent->flags = 0;
+
+            nbfs_allocator_advance(ctx, run.start + run.length);
+
+            return 0;
+        }
+
+        if (attempt == 1)
+        {
+            pthread_mutex_lock(&ctx->allocator_lock);
+
+            nbfs_extent_index_destroy(ctx);
+
+            pthread_mutex_unlock(&ctx->allocator_lock);
+        }
+    }
+
+    return -1;
+}
+
+int nbfs_free_extent(
+    nbfs_context_t *ctx,
+    const nbfs_extent_t *extent)
+{
+    if (!ctx || !extent || extent->block_count == 0)
+        return -1;
+
+    return nbfs_bitmap_release_blocks(ctx,
+                                      extent->start_block,
+                                      extent->block_count);
+}
@@ -0,0 +1,717 @@
+/*
+ * NeoBench Filesystem Library
+ *
+ * extent_tree.c
+ *
+ * Extent B+tree for files with more than NBFS_EXTENTS_PER_INODE
+ * extents
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <nbfs/endian.h>
+#include <nbfs/extent.h>
+
+#include "libnbfs.h"
+#include "internal/block.h"
+#include "internal/private.h"
+
+/*
+ * Deeper than any tree a 64-bit block count can need.
+ */
+#define TREE_MAX_DEPTH 8
+
+static uint64_t tree_root(const nbfs_file_t *file)
+{
+    return file->inode.extents[0].start_block;
+}
+
+static uint16_t node_capacity(uint32_t block_size, uint16_t depth)
+{
+    size_t entry = depth
+        ? sizeof(nbfs_extent_branch_t)
+        : sizeof(nbfs_extent_record_t);
+
+    return (uint16_t)((block_size - sizeof(nbfs_extent_node_t)) / entry);
+}
+
+static void *node_entries(nbfs_extent_node_t *node)
+{
+    return (uint8_t *)node + sizeof(*node);
+}
+
+/*
+ * Nodes are worked on in the block cache, so header fields and
+ * entries are converted as they are read and stored; copies taken
+ * out of a node are converted whole.
+ */
+static uint16_t node_depth(const nbfs_extent_node_t *node)
+{
+    return nbfs_le16(node->depth);
+}
+
+static uint16_t node_count(const nbfs_extent_node_t *node)
+{
+    return nbfs_le16(node->entries);
+}
+
+static void node_set_count(nbfs_extent_node_t *node, uint16_t entries)
+{
+    node->entries = nbfs_le16(entries);
+}
+
+/*
+ * An empty node at depth over the whole block.
+ */
+static void node_format(
+    nbfs_extent_node_t *node,
+    uint32_t block_size,
+    uint16_t depth)
+{
+    memset(node, 0, block_size);
+
+    node->magic = NBFS_EXTENT_NODE_MAGIC;
+    node->depth = depth;
+    node->max_entries = node_capacity(block_size, depth);
+
+    nbfs_extent_node_le(node);
+}
+
+static nbfs_extent_branch_t branch_make(uint64_t logical, uint64_t child)
+{
+    nbfs_extent_branch_t branch = { logical, child };
+
+    nbfs_extent_branch_le(&branch);
+
+    return branch;
+}
+
+static void record_store(
+    nbfs_extent_record_t *slot,
+    const nbfs_extent_record_t *record)
+{
+    *slot = *record;
+
+    nbfs_extent_record_le(slot);
+}
+
+static void records_load(
+    nbfs_extent_record_t *records,
+    nbfs_extent_node_t *node)
+{
+    uint16_t entries = node_count(node);
+
+    memcpy(records,
+           node_entries(node),
+           entries * sizeof(nbfs_extent_record_t));
+
+    for (uint16_t i = 0; i < entries; i++)
+        nbfs_extent_record_le(&records[i]);
+}
+
+/*
+ * Writable access to a node, checked against its header.
+ */
+static nbfs_extent_node_t *node_get(
+    nbfs_context_t *ctx,
+    uint64_t block)
+{
+    nbfs_extent_node_t *node = nbfs_block_acquire(ctx, block);
+
+    if (!node)
+        return NULL;
+
+    if (nbfs_le32(node->magic) != NBFS_EXTENT_NODE_MAGIC ||
+        node_depth(node) >= TREE_MAX_DEPTH ||
+        node_count(node) > nbfs_le16(node->max_entries) ||
+        nbfs_le16(node->max_entries) !=
+            node_capacity(ctx->block_size, node_depth(node)))
+    {
+        nbfs_block_release(ctx, block, node, false);
+        return NULL;
+    }
+
+    return node;
+}
+
+/*
+ * Allocate a node block and give it an empty header.
+ */
+static nbfs_extent_node_t *node_create(
+    nbfs_context_t *ctx,
+    uint64_t goal,
+    uint16_t depth,
+    uint64_t *block)
+{
+    if (nbfs_allocate_block_near(ctx, goal, block) != 0)
+        return NULL;
+
+    nbfs_extent_node_t *node = nbfs_block_acquire(ctx, *block);
+
+    if (!node)
+    {
+        nbfs_free_block(ctx, *block);
+        return NULL;
+    }
+
+    node_format(node, ctx->block_size, depth);
+
+    return node;
+}
+
+/*
+ * Last branch whose key is at or below block.
+ */
+static int branch_find(
+    const nbfs_extent_branch_t *branches,
+    uint16_t entries,
+    uint64_t block)
+{
+    int low = 0;
+    int high = entries;
+
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+
+        if (nbfs_le64(branches[mid].logical) <= block)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low - 1;
+}
+
+static int record_find(
+    const nbfs_extent_record_t *records,
+    uint16_t entries,
+    uint64_t block)
+{
+    int low = 0;
+    int high = entries;
+
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+
+        if (records[mid].logical <= block)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low - 1;
+}
+
+/*
+ * Look block up in the cached leaf.
+ */
+static int leaf_lookup(
+    const nbfs_file_t *file,
+    uint64_t block,
+    nbfs_extent_record_t *record)
+{
+    if (!file->leaf_block || file->leaf_entries == 0)
+        return -1;
+
+    int i = record_find(file->leaf, file->leaf_entries, block);
+
+    if (i < 0)
+        return -1;
+
+    const nbfs_extent_record_t *found = &file->leaf[i];
+
+    if (block >= found->logical + found->block_count)
+        return -1;
+
+    *record = *found;
+
+    return 0;
+}
+
+int nbfs_extent_tree_lookup(
+    nbfs_file_t *file,
+    uint64_t block,
+    nbfs_extent_record_t *record)
+{
+    nbfs_context_t *ctx = file->ctx;
+
+    if (leaf_lookup(file, block, record) == 0)
+        return 0;
+
+    uint64_t current = tree_root(file);
+
+    for (int level = 0; level < TREE_MAX_DEPTH; level++)
+    {
+        nbfs_extent_node_t *node = node_get(ctx, current);
+
+        if (!node)
+            return -1;
+
+        if (node_depth(node) == 0)
+        {
+            if (!file->leaf &&
+                !(file->leaf = malloc(ctx->block_size)))
+            {
+                nbfs_block_release(ctx, current, node, false);
+                return -1;
+            }
+
+            records_load(file->leaf, node);
+
+            file->leaf_entries = node_count(node);
+            file->leaf_block = current;
+
+            nbfs_block_release(ctx, current, node, false);
+
+            return leaf_lookup(file, block, record);
+        }
+
+        const nbfs_extent_branch_t *branches = node_entries(node);
+        int i = branch_find(branches, node_count(node), block);
+
+        uint64_t child = i >= 0 ? nbfs_le64(branches[i].child) : 0;
+
+        nbfs_block_release(ctx, current, node, false);
+
+        if (i < 0)
+            return -1;
+
+        current = child;
+    }
+
+    return -1;
+}
+
+/*
+ * Follow the last branch of every level down to the rightmost leaf,
+ * recording the blocks on the way.
+ */
+static int tree_rightmost(
+    nbfs_file_t *file,
+    uint64_t *path,
+    int *levels)
+{
+    nbfs_context_t *ctx = file->ctx;
+    uint64_t current = tree_root(file);
+
+    for (int level = 0; level < TREE_MAX_DEPTH; level++)
+    {
+        nbfs_extent_node_t *node = node_get(ctx, current);
+
+        if (!node)
+            return -1;
+
+        path[level] = current;
+
+        if (node_depth(node) == 0)
+        {
+            nbfs_block_release(ctx, current, node, false);
+            *levels = level + 1;
+            return 0;
+        }
+
+        const nbfs_extent_branch_t *branches = node_entries(node);
+        uint16_t entries = node_count(node);
+        uint64_t child = entries
+            ? nbfs_le64(branches[entries - 1].child)
+            : 0;
+
+        nbfs_block_release(ctx, current, node, false);
+
+        if (!child)
+            return -1;
+
+        current = child;
+    }
+
+    return -1;
+}
+
+int nbfs_extent_tree_last(
+    nbfs_file_t *file,
+    nbfs_extent_record_t *record)
+{
+    nbfs_context_t *ctx = file->ctx;
+    uint64_t path[TREE_MAX_DEPTH];
+    int levels;
+
+    if (tree_rightmost(file, path, &levels) != 0)
+        return -1;
+
+    uint64_t leaf = path[levels - 1];
+    nbfs_extent_node_t *node = node_get(ctx, leaf);
+
+    if (!node)
+        return -1;
+
+    int result = 1;
+
+    if (node_count(node))
+    {
+        const nbfs_extent_record_t *records = node_entries(node);
+
+        *record = records[node_count(node) - 1];
+        nbfs_extent_record_le(record);
+        result = 0;
+    }
+
+    nbfs_block_release(ctx, leaf, node, false);
+
+    return result;
+}
+
+/*
+ * Add a record at the end of the file.
+ *
+ * Records only ever arrive in file order, so a full leaf is never
+ * split down the middle: the new record starts a fresh rightmost
+ * leaf and its branch is pushed up the right edge. A full root is
+ * copied out to a new block and becomes the parent of that copy,
+ * which keeps the root where the inode points.
+ */
+int nbfs_extent_tree_append(
+    nbfs_file_t *file,
+    const nbfs_extent_record_t *record)
+{
+    nbfs_context_t *ctx = file->ctx;
+    uint64_t path[TREE_MAX_DEPTH];
+    int levels;
+
+    if (tree_rightmost(file, path, &levels) != 0)
+        return -1;
+
+    file->leaf_block = 0;
+
+    uint64_t leaf = path[levels - 1];
+    nbfs_extent_node_t *node = node_get(ctx, leaf);
+
+    if (!node)
+        return -1;
+
+    nbfs_extent_record_t *records = node_entries(node);
+    uint16_t entries = node_count(node);
+
+    if (entries)
+    {
+        nbfs_extent_record_t last = records[entries - 1];
+
+        nbfs_extent_record_le(&last);
+
+        if (last.logical + last.block_count == record->logical &&
+            last.start_block + last.block_count == record->start_block &&
+            (uint64_t)last.block_count + record->block_count <= UINT32_MAX)
+        {
+            records[entries - 1].block_count =
+                nbfs_le32(last.block_count + record->block_count);
+            nbfs_block_release(ctx, leaf, node, true);
+            return 0;
+        }
+    }
+
+    if (entries < nbfs_le16(node->max_entries))
+    {
+        record_store(&records[entries], record);
+        node_set_count(node, entries + 1);
+        nbfs_block_release(ctx, leaf, node, true);
+        return 0;
+    }
+
+    nbfs_block_release(ctx, leaf, node, false);
+
+    uint64_t child;
+    nbfs_extent_node_t *fresh = node_create(ctx, leaf, 0, &child);
+
+    if (!fresh)
+        return -1;
+
+    record_store(node_entries(fresh), record);
+    node_set_count(fresh, 1);
+
+    nbfs_block_release(ctx, child, fresh, true);
+
+    uint64_t key = record->logical;
+
+    for (int level = levels - 2; level >= 0; level--)
+    {
+        node = node_get(ctx, path[level]);
+
+        if (!node)
+            return -1;
+
+        uint16_t entries = node_count(node);
+
+        if (entries < nbfs_le16(node->max_entries))
+        {
+            nbfs_extent_branch_t *branches = node_entries(node);
+
+            branches[entries] = branch_make(key, child);
+            node_set_count(node, entries + 1);
+
+            nbfs_block_release(ctx, path[level], node, true);
+            return 0;
+        }
+
+        uint16_t depth = node_depth(node);
+
+        nbfs_block_release(ctx, path[level], node, false);
+
+        uint64_t parent;
+
+        fresh = node_create(ctx, path[level], depth, &parent);
+
+        if (!fresh)
+            return -1;
+
+        ((nbfs_extent_branch_t *)node_entries(fresh))[0] =
+            branch_make(key, child);
+        node_set_count(fresh, 1);
+
+        nbfs_block_release(ctx, parent, fresh, true);
+
+        child = parent;
+    }
+
+    /*
+     * The root itself is full.
+     */
+    uint64_t root = path[0];
+    node = node_get(ctx, root);
+
+    if (!node)
+        return -1;
+
+    if (node_depth(node) + 1 >= TREE_MAX_DEPTH)
+    {
+        nbfs_block_release(ctx, root, node, false);
+        return -1;
+    }
+
+    uint64_t moved;
+    nbfs_extent_node_t *copy =
+        node_create(ctx, root, node_depth(node), &moved);
+
+    if (!copy)
+    {
+        nbfs_block_release(ctx, root, node, false);
+        return -1;
+    }
+
+    memcpy(copy, node, ctx->block_size);
+    nbfs_block_release(ctx, moved, copy, true);
+
+    node_format(node, ctx->block_size, node_depth(node) + 1);
+    node_set_count(node, 2);
+
+    nbfs_extent_branch_t *branches = node_entries(node);
+
+    branches[0] = branch_make(0, moved);
+    branches[1] = branch_make(key, child);
+
+    nbfs_block_release(ctx, root, node, true);
+
+    return 0;
+}
+
+/*
+ * Build a tree over count records, bottom up with full nodes, and
+ * point the inode at its root.
+ */
+int nbfs_extent_tree_build(
+    nbfs_file_t *file,
+    const nbfs_extent_record_t *records,
+    size_t count)
+{
+    nbfs_context_t *ctx = file->ctx;
+    uint32_t block_size = ctx->block_size;
+
+    file->leaf_block = 0;
+
+    if (count == 0)
+        return -1;
+
+    uint16_t per_leaf = node_capacity(block_size, 0);
+    size_t nodes = (count + per_leaf - 1) / per_leaf;
+
+    nbfs_extent_branch_t *level = malloc(nodes * sizeof(*level));
+
+    if (!level)
+        return -1;
+
+    for (size_t n = 0; n < nodes; n++)
+    {
+        size_t first = n * per_leaf;
+        size_t take = count - first < per_leaf ? count - first : per_leaf;
+        uint64_t block;
+
+        nbfs_extent_node_t *node = node_create(ctx, 0, 0, &block);
+
+        if (!node)
+        {
+            free(level);
+            return -1;
+        }
+
+        nbfs_extent_record_t *slots = node_entries(node);
+
+        for (size_t i = 0; i < take; i++)
+            record_store(&slots[i], &records[first + i]);
+
+        node_set_count(node, (uint16_t)take);
+        nbfs_block_release(ctx, block, node, true);
+
+        level[n] = (nbfs_extent_branch_t){ records[first].logical, block };
+    }
+
+    uint16_t depth = 0;
+
+    while (nodes > 1)
+    {
+        depth++;
+
+        if (depth >= TREE_MAX_DEPTH)
+        {
+            free(level);
+            return -1;
+        }
+
+        uint16_t per_node = node_capacity(block_size, depth);
+        size_t parents = (nodes + per_node - 1) / per_node;
+
+        for (size_t n = 0; n < parents; n++)
+        {
+            size_t first = n * per_node;
+            size_t take = nodes - first < per_node ? nodes - first : per_node;
+            uint64_t block;
+
+            nbfs_extent_node_t *node = node_create(ctx, 0, depth, &block);
+
+            if (!node)
+            {
+                free(level);
+                return -1;
+            }
+
+            nbfs_extent_branch_t *slots = node_entries(node);
+
+            for (size_t i = 0; i < take; i++)
+                slots[i] = branch_make(level[first + i].logical,
+                                       level[first + i].child);
+
+            node_set_count(node, (uint16_t)take);
+            nbfs_block_release(ctx, block, node, true);
+
+            level[n] = (nbfs_extent_branch_t){ level[first].logical, block };
+        }
+
+        nodes = parents;
+    }
+
+    memset(file->inode.extents, 0, sizeof(file->inode.extents));
+
+    file->inode.extents[0].start_block = level[0].child;
+    file->inode.extents[0].block_count = 1;
+    file->inode.extents[0].flags = NBFS_EXTENT_TREE;
+
+    free(level);
+
+    return 0;
+}
+
+typedef struct
+{
+    nbfs_extent_record_t *records;
+    size_t count;
+    size_t capacity;
+} record_list_t;
+
+static int collect_node(
+    nbfs_context_t *ctx,
+    uint64_t block,
+    int level,
+    record_list_t *list)
+{
+    if (level >= TREE_MAX_DEPTH)
+        return -1;
+
+    nbfs_extent_node_t *node = node_get(ctx, block);
+
+    if (!node)
+        return -1;
+
+    int result = 0;
+
+    uint16_t entries = node_count(node);
+
+    if (node_depth(node) == 0)
+    {
+        if (list->count + entries > list->capacity)
+        {
+            size_t capacity = list->capacity * 2 + entries;
+
+            nbfs_extent_record_t *grown =
+                realloc(list->records, capacity * sizeof(*grown));
+
+            if (!grown)
+                result = -1;
+            else
+            {
+                list->records = grown;
+                list->capacity = capacity;
+            }
+        }
+
+        if (result == 0)
+        {
+            records_load(&list->records[list->count], node);
+
+            list->count += entries;
+        }
+    }
+    else
+    {
+        const nbfs_extent_branch_t *branches = node_entries(node);
+
+        for (uint16_t i = 0; i < entries && result == 0; i++)
+            result = collect_node(ctx,
+                                  nbfs_le64(branches[i].child),
+                                  level + 1,
+                                  list);
+    }
+
+    nbfs_block_release(ctx, block, node, false);
+
+    if (result == 0)
+        nbfs_free_block(ctx, block);
+
+    return result;
+}
+
+/*
+ * Gather every record in file order and release the tree's node
+ * blocks. The caller rebuilds the mapping from the records.
+ */
+int nbfs_extent_tree_collect(
+    nbfs_file_t *file,
+    nbfs_extent_record_t **records,
+    size_t *count)
+{
+    record_list_t list = { NULL, 0, 0 };
+
+    file->leaf_block = 0;
+
+    if (collect_node(file->ctx, tree_root(file), 0, &list) != 0)
+    {
+        free(list.records);
+        return -1;
+    }
+
+    memset(file->inode.extents, 0, sizeof(file->inode.extents));
+
+    *records = list.records;
+    *count = list.count;
+
+    return 0;
+}
@@ -1,47 +1,1385 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "file.h"
+#include "context_internal.h"
+#include "internal/block.h"
+#include "internal/lock.h"
+#include "internal/private.h"
+#include "internal/superblock.h"
+
+/*
+ * Files
+ *
+ * Bytes past the end of a file inside its last block are always
+ * zero, and so is every block between the old end and a write past
+ * it. A block that lies wholly past the end of the file can
+ * therefore be started from zeros instead of being read.
+ */
+
+static uint64_t round_blocks(uint64_t bytes, uint32_t block_size)
+{
+    return (bytes + block_size - 1) / block_size;
+}
+
+/*
+ * Rebuild the logical block index after the extents changed. A tree
+ * keeps its own index, so only the end of its last record is needed.
+ */
+static int file_index(nbfs_file_t *file)
+{
+    file->cursor = 0;
+    file->leaf_block = 0;
+
+    if (nbfs_extent_tree_active(&file->inode))
+    {
+        nbfs_extent_record_t last;
+
+        int result = nbfs_extent_tree_last(file, &last);
+
+        if (result < 0)
+            return -1;
+
+        file->count = 0;
+        file->logical[0] = 0;
+
+        file->blocks = result == 0 ? last.logical + last.block_count : 0;
+        file->goal = result == 0 ? last.start_block + last.block_count : 0;
+
+        return 0;
+    }
+
+    uint64_t logical = 0;
+    int i = 0;
+
+    while (i < NBFS_EXTENTS_PER_INODE &&
+           file->inode.extents[i].block_count)
+    {
+        file->logical[i] = logical;
+        logical += file->inode.extents[i].block_count;
+        i++;
+    }
+
+    file->logical[i] = logical;
+    file->count = i;
+
+    file->blocks = logical;
+    file->goal = i
+        ? file->inode.extents[i - 1].start_block +
+          file->inode.extents[i - 1].block_count
+        : 0;
+
+    return 0;
+}
+
+int nbfs_file_map(
+    nbfs_file_t *file,
+    uint64_t block,
+    uint64_t *physical,
+    uint64_t *run)
+{
+    if (nbfs_extent_tree_active(&file->inode))
+    {
+        nbfs_extent_record_t record;
+
+        if (nbfs_extent_tree_lookup(file, block, &record) != 0)
+            return -1;
+
+        *physical = record.start_block + (block - record.logical);
+        *run = record.logical + record.block_count - block;
+
+        return 0;
+    }
+
+    int i = file->cursor;
+
+    /*
+     * Sequential access stays on the cursor or moves one extent on;
+     * anything earlier restarts from the first extent.
+     */
+    if (i >= file->count || block < file->logical[i])
+        i = 0;
+
+    while (i < file->count && block >= file->logical[i + 1])
+        i++;
+
+    if (i == file->count)
+        return -1;
+
+    file->cursor = i;
+
+    *physical = file->inode.extents[i].start_block +
+        (block - file->logical[i]);
+
+    *run = file->logical[i + 1] - block;
+
+    return 0;
+}
+
+/*
+ * Store the extent mapping as direct extents when it fits the inode,
+ * as a tree otherwise.
+ */
+static int file_store(
+    nbfs_file_t *file,
+    const nbfs_extent_record_t *records,
+    size_t count)
+{
+    if (count > NBFS_EXTENTS_PER_INODE)
+    {
+        if (nbfs_extent_tree_build(file, records, count) != 0)
+            return -1;
+
+        return file_index(file);
+    }
+
+    memset(file->inode.extents, 0, sizeof(file->inode.extents));
+
+    for (size_t i = 0; i < count; i++)
+    {
+        file->inode.extents[i].start_block = records[i].start_block;
+        file->inode.extents[i].block_count = records[i].block_count;
+    }
+
+    return file_index(file);
+}
+
+/*
+ * Add an extent behind the last block the file owns.
+ */
+static int file_append(
+    nbfs_file_t *file,
+    const nbfs_extent_t *extent)
+{
+    nbfs_extent_record_t record =
+    {
+        .logical = file->blocks,
+        .start_block = extent->start_block,
+        .block_count = extent->block_count,
+        .flags = 0,
+    };
+
+    if (nbfs_extent_tree_active(&file->inode))
+    {
+        if (nbfs_extent_tree_append(file, &record) != 0)
+            return -1;
+
+        file->blocks += extent->block_count;
+        file->goal = extent->start_block + extent->block_count;
+
+        return 0;
+    }
+
+    int used = file->count;
+    nbfs_extent_t *last = used ? &file->inode.extents[used - 1] : NULL;
+
+    if (last &&
+        extent->start_block == last->start_block + last->block_count &&
+        (uint64_t)last->block_count + extent->block_count <= UINT32_MAX)
+    {
+        last->block_count += extent->block_count;
+    }
+    else if (used < NBFS_EXTENTS_PER_INODE)
+    {
+        file->inode.extents[used] = *extent;
+    }
+    else
+    {
+        /*
+         * The inode is full: move its extents and this one into a
+         * tree.
+         */
+        nbfs_extent_record_t records[NBFS_EXTENTS_PER_INODE + 1];
+
+        for (int i = 0; i < used; i++)
+        {
+            records[i] = (nbfs_extent_record_t)
+            {
+                .logical = file->logical[i],
+                .start_block = file->inode.extents[i].start_block,
+                .block_count = file->inode.extents[i].block_count,
+                .flags = 0,
+            };
+        }
+
+        records[used] = record;
+
+        return file_store(file, records, (size_t)used + 1);
+    }
+
+    return file_index(file);
+}
+
+/*
+ * Release every block from file block keep onwards.
+ */
+static int file_release(
+    nbfs_file_t *file,
+    uint64_t keep)
+{
+    nbfs_context_t *ctx = file->ctx;
+
+    if (keep >= file->blocks)
+        return 0;
+
+    if (!nbfs_extent_tree_active(&file->inode))
+    {
+        for (int i = file->count - 1; i >= 0; i--)
+        {
+            nbfs_extent_t *extent = &file->inode.extents[i];
+            uint64_t first = file->logical[i];
+
+            if (first + extent->block_count <= keep)
+                break;
+
+            uint64_t kept = keep > first ? keep - first : 0;
+
+            nbfs_extent_t dropped =
+            {
+                .start_block = extent->start_block + kept,
+                .block_count = (uint32_t)(extent->block_count - kept),
+                .flags = 0,
+            };
+
+            if (nbfs_free_extent(ctx, &dropped) != 0)
+                return -1;
+
+            if (kept)
+                extent->block_count = (uint32_t)kept;
+            else
+                memset(extent, 0, sizeof(*extent));
+        }
+
+        return file_index(file);
+    }
+
+    /*
+     * A tree is taken apart, trimmed and stored again, which drops
+     * back to direct extents once few enough are left.
+     */
+    nbfs_extent_record_t *records;
+    size_t count;
+
+    if (nbfs_extent_tree_collect(file, &records, &count) != 0)
+        return -1;
+
+    size_t kept = 0;
+    int result = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        nbfs_extent_record_t *record = &records[i];
+        uint64_t first = record->logical;
+
+        if (first + record->block_count <= keep)
+        {
+            kept++;
+            continue;
+        }
+
+        uint64_t part = keep > first ? keep - first : 0;
+
+        nbfs_extent_t dropped =
+        {
+            .start_block = record->start_block + part,
+            .block_count = (uint32_t)(record->block_count - part),
+            .flags = 0,
+        };
+
+        if (nbfs_free_extent(ctx, &dropped) != 0)
+            result = -1;
+
+        if (part)
+        {
+            record->block_count = (uint32_t)part;
+            kept++;
+        }
+    }
+
+    if (file_store(file, records, kept) != 0)
+        result = -1;
+
+    free(records);
+
+    return result;
+}
+
+int nbfs_file_reserve(
+    nbfs_file_t *file,
+    uint64_t blocks)
+{
+    uint64_t before = file->blocks;
+
+    while (file->blocks < blocks)
+    {
+        nbfs_extent_t extent;
+
+        if (nbfs_allocate_extent(file->ctx,
+                                 blocks - file->blocks,
+                                 file->goal,
+                                 &extent) != 0)
+            goto fail;
+
+        if (file_append(file, &extent) != 0)
+        {
+            nbfs_free_extent(file->ctx, &extent);
+            goto fail;
+        }
+    }
+
+    return 0;
+
+    /*
+     * Hand back everything allocated here.
+     */
+fail:
+    file_release(file, before);
+
+    return -1;
+}
+
+/*
+ * Write zeros over file blocks [first, first + count). Each request
+ * covers up to FILE_ZERO_BATCH blocks, all pointing at the same
+ * zeroed buffer.
+ */
+#define FILE_ZERO_BATCH 64
+
+static int file_zero(
+    nbfs_file_t *file,
+    uint64_t first,
+    uint64_t count)
+{
+    uint32_t block_size = file->ctx->block_size;
+    nbfs_iovec_t iov[FILE_ZERO_BATCH];
+
+    if (count == 0)
+        return 0;
+
+    memset(file->bounce, 0, block_size);
+
+    for (int i = 0; i < FILE_ZERO_BATCH; i++)
+    {
+        iov[i].base = file->bounce;
+        iov[i].length = block_size;
+    }
+
+    while (count > 0)
+    {
+        uint64_t physical;
+        uint64_t run;
+
+        if (nbfs_file_map(file, first, &physical, &run) != 0)
+            return -1;
+
+        if (run > count)
+            run = count;
+
+        if (run > FILE_ZERO_BATCH)
+            run = FILE_ZERO_BATCH;
+
+        if (nbfs_writev_blocks(file->ctx, physical, iov, (int)run) != 0)
+            return -1;
+
+        first += run;
+        count -= run;
+    }
 
-int nbfs_create_file(
+    return 0;
+}
+
+/*
+ * Move length bytes at offset between the caller's buffer and the
+ * file's blocks, which must already be allocated.
+ *
+ * Runs of whole blocks are one request each, straight to or from
+ * the buffer. A partial block at either end goes through the block
+ * layer; a write to one that lies wholly past end starts it from
+ * zeros instead of reading it.
+ */
+static int file_io(
+    nbfs_file_t *file,
+    uint8_t *buffer,
+    uint64_t length,
+    uint64_t offset,
+    uint64_t end,
+    bool write)
+{
+    nbfs_context_t *ctx = file->ctx;
+    uint32_t block_size = ctx->block_size;
+    uint64_t fresh = round_blocks(end, block_size);
+
+    while (length > 0)
+    {
+        uint64_t block = offset / block_size;
+        uint64_t within = offset % block_size;
+        uint64_t physical;
+        uint64_t run;
+        uint64_t bytes;
+
+        if (nbfs_file_map(file, block, &physical, &run) != 0)
+            return -1;
+
+        if (within == 0 && length >= block_size)
+        {
+            uint64_t blocks = length / block_size;
+
+            if (blocks > run)
+                blocks = run;
+
+            bytes = blocks * block_size;
+
+            int result = write
+                ? nbfs_write_blocks(ctx, physical, blocks, buffer)
+                : nbfs_read_blocks(ctx, physical, blocks, buffer);
+
+            if (result != 0)
+                return -1;
+        }
+        else
+        {
+            bytes = block_size - within;
+
+            if (bytes > length)
+                bytes = length;
+
+            if (!write)
+            {
+                const uint8_t *data = nbfs_block_get(ctx, physical);
+
+                if (!data)
+                    return -1;
+
+                memcpy(buffer, data + within, (size_t)bytes);
+                nbfs_block_put(ctx, data);
+            }
+            else if (block >= fresh)
+            {
+                memset(file->bounce, 0, block_size);
+                memcpy(file->bounce + within, buffer, (size_t)bytes);
+
+                if (nbfs_write_block(ctx, physical, file->bounce) != 0)
+                    return -1;
+            }
+            else
+            {
+                uint8_t *data = nbfs_block_acquire(ctx, physical);
+
+                if (!data)
+                    return -1;
+
+                memcpy(data + within, buffer, (size_t)bytes);
+
+                if (nbfs_block_release(ctx, physical, data, true) != 0)
+                    return -1;
+            }
+        }
+
+        buffer += bytes;
+        offset += bytes;
+        length -= bytes;
+    }
+
+    return 0;
+}
+
+/*
+ * Make size the new end of file. Growing allocates and zeroes the
+ * blocks in between; shrinking releases the blocks past the new end
+ * and clears the tail of the new last block.
+ */
+static int file_resize(nbfs_file_t *file, uint64_t size)
+{
+    nbfs_context_t *ctx = file->ctx;
+    uint32_t block_size = ctx->block_size;
+    uint64_t old_blocks = round_blocks(file->inode.size, block_size);
+    uint64_t new_blocks = round_blocks(size, block_size);
+
+    if (size > file->inode.size)
+    {
+        if (nbfs_file_reserve(file, new_blocks) != 0)
+            return -1;
+
+        if (file_zero(file, old_blocks, new_blocks - old_blocks) != 0)
+            return -1;
+    }
+    else if (size < file->inode.size)
+    {
+        uint64_t within = size % block_size;
+        uint64_t physical;
+        uint64_t run;
+
+        if (within &&
+            nbfs_file_map(file, size / block_size, &physical, &run) == 0)
+        {
+            uint8_t *data = nbfs_block_acquire(ctx, physical);
+
+            if (!data)
+                return -1;
+
+            memset(data + within, 0, (size_t)(block_size - within));
+
+            if (nbfs_block_release(ctx, physical, data, true) != 0)
+                return -1;
+        }
+
+        if (file_release(file, new_blocks) != 0)
+            return -1;
+    }
+
+    file->inode.size = size;
+
+    return nbfs_write_inode(ctx, &file->inode);
+}
+
+/*
+ * Delayed allocation
+ *
+ * The list, its hash buckets and the byte count sit under
+ * ctx->delalloc_lock. A buffer itself belongs to whoever holds its
+ * inode's lock, and only that thread drops it.
+ */
+static struct nbfs_delalloc **delalloc_bucket(
     nbfs_context_t *ctx,
-    uint64_t parent_inode,
-    const char *name)
+    uint64_t inode)
 {
-    (void)ctx;
-    (void)parent_inode;
-    (void)name;
+    return &ctx->delalloc_buckets[
+        ((inode * 0x9e3779b97f4a7c15ull) >> 32) % NBFS_DELALLOC_BUCKETS];
+}
+
+static struct nbfs_delalloc *delalloc_find(
+    nbfs_context_t *ctx,
+    uint64_t inode)
+{
+    struct nbfs_delalloc *d;
+
+    pthread_mutex_lock(&ctx->delalloc_lock);
+
+    for (d = *delalloc_bucket(ctx, inode); d; d = d->chain)
+    {
+        if (d->inode == inode)
+            break;
+    }
+
+    pthread_mutex_unlock(&ctx->delalloc_lock);
+
+    return d;
+}
+
+static uint64_t delalloc_held(nbfs_context_t *ctx)
+{
+    pthread_mutex_lock(&ctx->delalloc_lock);
+
+    uint64_t bytes = ctx->delalloc_bytes;
+
+    pthread_mutex_unlock(&ctx->delalloc_lock);
+
+    return bytes;
+}
+
+static void delalloc_drop(
+    nbfs_context_t *ctx,
+    struct nbfs_delalloc *pending)
+{
+    pthread_mutex_lock(&ctx->delalloc_lock);
+
+    struct nbfs_delalloc **link = delalloc_bucket(ctx, pending->inode);
+
+    while (*link && *link != pending)
+        link = &(*link)->chain;
+
+    if (*link)
+        *link = pending->chain;
+
+    if (pending->next)
+        pending->next->prev = pending->prev;
+
+    if (pending->prev)
+        pending->prev->next = pending->next;
+    else
+        ctx->delalloc = pending->next;
+
+    ctx->delalloc_bytes -= pending->capacity;
+
+    pthread_mutex_unlock(&ctx->delalloc_lock);
+
+    ctx->file_generation++;
+
+    free(pending->data);
+    free(pending);
+}
+
+/*
+ * Give the pending bytes their blocks, all in one allocation behind
+ * the last extent, write them with one request per extent and move
+ * the size on disk.
+ */
+static int delalloc_commit(
+    nbfs_context_t *ctx,
+    struct nbfs_delalloc *pending)
+{
+    uint32_t block_size = ctx->block_size;
+    nbfs_file_t file;
+
+    memset(&file, 0, sizeof(file));
+    file.ctx = ctx;
+
+    int result = -1;
+
+    if (nbfs_read_inode(ctx, pending->inode, &file.inode) != 0 ||
+        file_index(&file) != 0 ||
+        file.blocks * block_size != pending->base)
+        goto out;
+
+    uint64_t blocks = round_blocks(pending->size, block_size);
+
+    if (nbfs_file_reserve(&file, blocks) != 0)
+        goto out;
+
+    /*
+     * The buffer is whole blocks, so no edge block needs a bounce.
+     */
+    if (file_io(&file,
+                pending->data,
+                blocks * block_size - pending->base,
+                pending->base,
+                pending->base,
+                true) != 0)
+        goto out;
+
+    file.inode.size = pending->size;
+
+    if (nbfs_write_inode(ctx, &file.inode) != 0)
+        goto out;
+
+    delalloc_drop(ctx, pending);
+    result = 0;
+
+out:
+    free(file.leaf);
+
+    return result;
+}
+
+int nbfs_delalloc_flush(nbfs_context_t *ctx)
+{
+    /*
+     * Each commit runs under its inode's lock, which is not waited
+     * for with the list locked; list the inodes first.
+     */
+    pthread_mutex_lock(&ctx->delalloc_lock);
+
+    size_t count = 0;
+
+    for (struct nbfs_delalloc *d = ctx->delalloc; d; d = d->next)
+        count++;
+
+    uint64_t *inodes = count ? malloc(count * sizeof(*inodes)) : NULL;
+
+    if (inodes)
+    {
+        size_t i = 0;
+
+        for (struct nbfs_delalloc *d = ctx->delalloc; d; d = d->next)
+            inodes[i++] = d->inode;
+    }
+
+    pthread_mutex_unlock(&ctx->delalloc_lock);
+
+    if (count && !inodes)
+        return -1;
+
+    int result = 0;
+
+    for (size_t i = 0; i < count && result == 0; i++)
+    {
+        if (nbfs_journal_begin(ctx) != 0)
+        {
+            result = -1;
+            break;
+        }
+
+        if (nbfs_inode_lock(ctx, &inodes[i], 1, true) == 0)
+        {
+            struct nbfs_delalloc *pending = delalloc_find(ctx, inodes[i]);
+
+            if (pending && delalloc_commit(ctx, pending) != 0)
+                result = -1;
+
+            nbfs_inode_unlock(ctx);
+        }
+        else
+            result = -1;
+
+        if (nbfs_journal_commit(ctx) != 0)
+            result = -1;
+    }
+
+    free(inodes);
+
+    return result;
+}
+
+void nbfs_delalloc_destroy(nbfs_context_t *ctx)
+{
+    while (ctx->delalloc)
+        delalloc_drop(ctx, ctx->delalloc);
+}
+
+/*
+ * Copy length bytes at offset into the pending buffer of the file,
+ * growing it in whole blocks. Room has been checked by the caller.
+ */
+static int delalloc_write(
+    nbfs_file_t *file,
+    const uint8_t *buffer,
+    uint64_t length,
+    uint64_t offset,
+    uint64_t needed)
+{
+    nbfs_context_t *ctx = file->ctx;
+    struct nbfs_delalloc *pending =
+        delalloc_find(ctx, file->inode.inode_number);
+
+    if (!pending)
+    {
+        pending = calloc(1, sizeof(*pending));
+
+        if (!pending)
+            return -1;
+
+        pending->inode = file->inode.inode_number;
+        pending->base = file->blocks * ctx->block_size;
+        pending->size = file->inode.size;
+        pthread_mutex_lock(&ctx->delalloc_lock);
+
+        struct nbfs_delalloc **bucket = delalloc_bucket(ctx, pending->inode);
+
+        pending->chain = *bucket;
+        *bucket = pending;
+
+        pending->next = ctx->delalloc;
+
+        if (ctx->delalloc)
+            ctx->delalloc->prev = pending;
+
+        ctx->delalloc = pending;
+
+        pthread_mutex_unlock(&ctx->delalloc_lock);
+    }
+
+    if (needed > pending->capacity)
+    {
+        uint64_t capacity = pending->capacity * 2;
+
+        if (capacity < needed || capacity > NBFS_DELALLOC_LIMIT)
+            capacity = needed;
+
+        uint8_t *data = realloc(pending->data, (size_t)capacity);
+
+        if (!data)
+            return -1;
+
+        memset(data + pending->capacity,
+               0,
+               (size_t)(capacity - pending->capacity));
+
+        pthread_mutex_lock(&ctx->delalloc_lock);
+
+        ctx->delalloc_bytes += capacity - pending->capacity;
+
+        pthread_mutex_unlock(&ctx->delalloc_lock);
+
+        pending->data = data;
+        pending->capacity = capacity;
+    }
+
+    memcpy(pending->data + (offset - pending->base),
+           buffer,
+           (size_t)length);
+
+    if (offset + length > pending->size)
+        pending->size = offset + length;
+
+    file->inode.size = pending->size;
+    ctx->dirty = true;
+
     return 0;
 }
 
+/*
+ * Re-read the inode if a commit has moved it since the handle last
+ * looked, and take the size from any pending buffer.
+ */
+static int file_refresh(nbfs_file_t *file)
+{
+    nbfs_context_t *ctx = file->ctx;
+
+    if (file->generation != ctx->file_generation)
+    {
+        if (nbfs_read_inode(ctx,
+                            file->inode.inode_number,
+                            &file->inode) != 0)
+            return -1;
+
+        file->generation = ctx->file_generation;
+
+        if (file_index(file) != 0)
+            return -1;
+    }
+
+    struct nbfs_delalloc *pending =
+        delalloc_find(ctx, file->inode.inode_number);
+
+    if (pending)
+        file->inode.size = pending->size;
+
+    return 0;
+}
+
+nbfs_file_t *nbfs_file_open(
+    nbfs_context_t *ctx,
+    uint64_t inode)
+{
+    if (!ctx || ctx->block_size == 0)
+        return NULL;
+
+    nbfs_file_t *file = calloc(1, sizeof(*file));
+
+    if (!file)
+        return NULL;
+
+    file->ctx = ctx;
+    file->bounce = malloc(ctx->block_size);
+
+    file->inode.inode_number = inode;
+    file->generation = ctx->file_generation - 1;
+
+    int result = -1;
+
+    if (file->bounce && nbfs_inode_lock(ctx, &inode, 1, false) == 0)
+    {
+        result = file_refresh(file);
+        nbfs_inode_unlock(ctx);
+    }
+
+    if (result != 0 || file->inode.inode_number != inode)
+    {
+        free(file->bounce);
+        free(file->leaf);
+        free(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+/*
+ * The inode is written whenever the handle changes it, so closing
+ * only releases the handle.
+ */
+int nbfs_file_close(nbfs_file_t *file)
+{
+    if (!file)
+        return -1;
+
+    free(file->bounce);
+    free(file->leaf);
+    free(file);
+
+    return 0;
+}
+
+/*
+ * Calls on a handle lock its inode: for reading to look, for
+ * writing to change it. A journal handle is taken first.
+ */
+uint64_t nbfs_file_size(nbfs_file_t *file)
+{
+    if (!file)
+        return 0;
+
+    uint64_t inode = file->inode.inode_number;
+
+    uint64_t size = 0;
+
+    if (nbfs_inode_lock(file->ctx, &inode, 1, false) == 0)
+    {
+        if (file_refresh(file) == 0)
+            size = file->inode.size;
+
+        nbfs_inode_unlock(file->ctx);
+    }
+
+    return size;
+}
+
+static int64_t file_pread(
+    nbfs_file_t *file,
+    void *buffer,
+    uint64_t length,
+    uint64_t offset)
+{
+    if (file_refresh(file) != 0)
+        return -1;
+
+    if (offset >= file->inode.size)
+        return 0;
+
+    if (length > file->inode.size - offset)
+        length = file->inode.size - offset;
+
+    if (length > INT64_MAX)
+        length = INT64_MAX;
+
+    /*
+     * Bytes below the end of the owned blocks are on disk; the rest
+     * are pending.
+     */
+    uint64_t owned = file->blocks * file->ctx->block_size;
+    uint64_t head = 0;
+
+    if (offset < owned)
+    {
+        head = owned - offset < length ? owned - offset : length;
+
+        if (file_io(file,
+                    buffer,
+                    head,
+                    offset,
+                    file->inode.size,
+                    false) != 0)
+            return -1;
+    }
+
+    if (head < length)
+    {
+        struct nbfs_delalloc *pending =
+            delalloc_find(file->ctx, file->inode.inode_number);
+
+        if (!pending)
+            return -1;
+
+        memcpy((uint8_t *)buffer + head,
+               pending->data + (offset + head - pending->base),
+               (size_t)(length - head));
+    }
+
+    return (int64_t)length;
+}
+
+int64_t nbfs_file_pread(
+    nbfs_file_t *file,
+    void *buffer,
+    uint64_t length,
+    uint64_t offset)
+{
+    if (!file || (!buffer && length))
+        return -1;
+
+    uint64_t inode = file->inode.inode_number;
+
+    int64_t read = -1;
+
+    if (nbfs_inode_lock(file->ctx, &inode, 1, false) == 0)
+    {
+        read = file_pread(file, buffer, length, offset);
+        nbfs_inode_unlock(file->ctx);
+    }
+
+    return read;
+}
+
+/*
+ * file_pwrite() found other files' pending data in the way.
+ */
+#define FILE_FLUSH (-2)
+
+static int64_t file_pwrite(
+    nbfs_file_t *file,
+    const void *buffer,
+    uint64_t length,
+    uint64_t offset,
+    bool flushed)
+{
+    if (!file || (!buffer && length))
+        return -1;
+
+    if (file->ctx->read_only ||
+        length > INT64_MAX ||
+        offset > UINT64_MAX - length)
+        return -1;
+
+    if (length == 0)
+        return 0;
+
+    nbfs_context_t *ctx = file->ctx;
+    uint32_t block_size = ctx->block_size;
+    uint64_t end = offset + length;
+
+    /*
+     * Hold writes past the owned blocks in memory while they fit.
+     * When other pending data is in the way, the caller commits it
+     * with this inode unlocked and calls again.
+     */
+    for (;;)
+    {
+        if (file_refresh(file) != 0)
+            return -1;
+
+        uint64_t owned = file->blocks * block_size;
+
+        if (end <= owned)
+            break;
+
+        struct nbfs_delalloc *pending =
+            delalloc_find(ctx, file->inode.inode_number);
+
+        uint64_t needed = (round_blocks(end, block_size) * block_size) - owned;
+        uint64_t held = pending ? pending->capacity : 0;
+
+        if (needed > NBFS_DELALLOC_LIMIT)
+        {
+            /*
+             * Too large to hold: allocate now, after whatever is
+             * already pending so it keeps its place in the file.
+             */
+            if (pending && delalloc_commit(ctx, pending) != 0)
+                return -1;
+
+            if (file_refresh(file) != 0)
+                return -1;
+
+            break;
+        }
+
+        if (delalloc_held(ctx) - held + needed > NBFS_DELALLOC_LIMIT)
+        {
+            if (!flushed)
+                return FILE_FLUSH;
+
+            /*
+             * What is left belongs to files other threads are
+             * writing; allocate now rather than wait for them.
+             */
+            if (pending && delalloc_commit(ctx, pending) != 0)
+                return -1;
+
+            if (file_refresh(file) != 0)
+                return -1;
+
+            break;
+        }
+
+        uint64_t head = offset < owned ? owned - offset : 0;
+
+        if (head &&
+            file_io(file,
+                    (uint8_t *)buffer,
+                    head,
+                    offset,
+                    file->inode.size,
+                    true) != 0)
+            return -1;
+
+        if (delalloc_write(file,
+                           (const uint8_t *)buffer + head,
+                           length - head,
+                           offset + head,
+                           needed) != 0)
+            return -1;
+
+        return (int64_t)length;
+    }
+
+    uint64_t size = file->inode.size;
+
+    if (end > size)
+    {
+        if (nbfs_file_reserve(file, round_blocks(end, block_size)) != 0)
+            return -1;
+
+        /*
+         * Zero the whole blocks skipped between the old end and the
+         * block the write starts in.
+         */
+        uint64_t first = round_blocks(size, block_size);
+        uint64_t start = offset / block_size;
+
+        if (start > first && file_zero(file, first, start - first) != 0)
+            return -1;
+    }
+
+    if (file_io(file, (uint8_t *)buffer, length, offset, size, true) != 0)
+        return -1;
+
+    if (end > size)
+    {
+        file->inode.size = end;
+
+        if (nbfs_write_inode(file->ctx, &file->inode) != 0)
+            return -1;
+    }
+
+    return (int64_t)length;
+}
+
+int64_t nbfs_file_pwrite(
+    nbfs_file_t *file,
+    const void *buffer,
+    uint64_t length,
+    uint64_t offset)
+{
+    if (!file)
+        return -1;
+
+    uint64_t inode = file->inode.inode_number;
+    bool flushed = false;
+
+    for (;;)
+    {
+        if (nbfs_journal_begin(file->ctx) != 0)
+            return -1;
+
+        int64_t written = -1;
+
+        if (nbfs_inode_lock(file->ctx, &inode, 1, true) == 0)
+        {
+            written = file_pwrite(file, buffer, length, offset, flushed);
+            nbfs_inode_unlock(file->ctx);
+        }
+
+        if (nbfs_journal_commit(file->ctx) != 0)
+            return -1;
+
+        if (written != FILE_FLUSH)
+            return written;
+
+        flushed = true;
+
+        if (nbfs_delalloc_flush(file->ctx) != 0)
+            return -1;
+    }
+}
+
+static int file_truncate(
+    nbfs_file_t *file,
+    uint64_t size)
+{
+    if (file->ctx->read_only)
+        return -1;
+
+    if (file_refresh(file) != 0)
+        return -1;
+
+    struct nbfs_delalloc *pending =
+        delalloc_find(file->ctx, file->inode.inode_number);
+
+    if (pending)
+    {
+        /*
+         * Shrinking inside the pending bytes stays in memory; a cut
+         * below them discards them. Growing commits first.
+         */
+        if (size >= pending->base && size <= pending->size)
+        {
+            memset(pending->data + (size - pending->base),
+                   0,
+                   (size_t)(pending->size - size));
+
+            pending->size = size;
+            file->inode.size = size;
+
+            return 0;
+        }
+
+        if (size < pending->base)
+            delalloc_drop(file->ctx, pending);
+        else if (delalloc_commit(file->ctx, pending) != 0)
+            return -1;
+
+        if (file_refresh(file) != 0)
+            return -1;
+    }
+
+    return file_resize(file, size);
+}
+
+int nbfs_file_truncate(
+    nbfs_file_t *file,
+    uint64_t size)
+{
+    if (!file || nbfs_journal_begin(file->ctx) != 0)
+        return -1;
+
+    uint64_t inode = file->inode.inode_number;
+
+    int result = -1;
+
+    if (nbfs_inode_lock(file->ctx, &inode, 1, true) == 0)
+    {
+        result = file_truncate(file, size);
+        nbfs_inode_unlock(file->ctx);
+    }
+
+    if (nbfs_journal_commit(file->ctx) != 0)
+        result = -1;
+
+    return result;
+}
+
+/*
+ * Replace the contents of the file with size bytes.
+ */
 int nbfs_write_file(
     nbfs_context_t *ctx,
     uint64_t inode,
     const void *buffer,
     uint64_t size)
 {
-    (void)ctx;
-    (void)inode;
-    (void)buffer;
-    (void)size;
-    return 0;
+    if (!ctx || (!buffer && size))
+        return -1;
+
+    nbfs_file_t *file = nbfs_file_open(ctx, inode);
+
+    if (!file)
+        return -1;
+
+    if (nbfs_journal_begin(ctx) != 0)
+    {
+        nbfs_file_close(file);
+        return -1;
+    }
+
+    bool flushed = false;
+    int result;
+
+    for (;;)
+    {
+        int64_t written = -1;
+
+        if (nbfs_inode_lock(ctx, &inode, 1, true) == 0)
+        {
+            written = 0;
+
+            if (size < nbfs_file_size(file) &&
+                file_truncate(file, size) != 0)
+                written = -1;
+
+            if (written == 0)
+                written = file_pwrite(file, buffer, size, 0, flushed);
+
+            nbfs_inode_unlock(ctx);
+        }
+
+        result = written == (int64_t)size ? 0 : -1;
+
+        if (written != FILE_FLUSH)
+            break;
+
+        flushed = true;
+
+        if (nbfs_delalloc_flush(ctx) != 0)
+            break;
+    }
+
+    if (nbfs_journal_commit(ctx) != 0)
+        result = -1;
+
+    nbfs_file_close(file);
+
+    return result;
 }
 
+/*
+ * Read the first size bytes of the file.
+ */
 int nbfs_read_file(
     nbfs_context_t *ctx,
     uint64_t inode,
     void *buffer,
     uint64_t size)
 {
-    (void)ctx;
-    (void)inode;
-    (void)buffer;
-    (void)size;
-    return 0;
+    if (!ctx || (!buffer && size))
+        return -1;
+
+    nbfs_file_t *file = nbfs_file_open(ctx, inode);
+
+    if (!file)
+        return -1;
+
+    int result = -1;
+
+    if (size <= file->inode.size &&
+        nbfs_file_pread(file, buffer, size, 0) == (int64_t)size)
+        result = 0;
+
+    nbfs_file_close(file);
+
+    return result;
+}
+
+static int file_delete(
+    nbfs_context_t *ctx,
+    uint64_t inode)
+{
+    if (ctx->read_only)
+        return -1;
+
+    if (nbfs_superblock_load(ctx) != 0 ||
+        inode == ctx->superblock.root_inode)
+        return -1;
+
+    struct nbfs_delalloc *pending = delalloc_find(ctx, inode);
+
+    if (pending)
+        delalloc_drop(ctx, pending);
+
+    nbfs_file_t *file = nbfs_file_open(ctx, inode);
+
+    if (!file)
+        return -1;
+
+    int result = file_resize(file, 0);
+
+    nbfs_file_close(file);
+
+    if (result != 0)
+        return -1;
+
+    nbfs_inode_t cleared;
+
+    memset(&cleared, 0, sizeof(cleared));
+    cleared.inode_number = inode;
+
+    if (nbfs_write_inode(ctx, &cleared) != 0)
+        return -1;
+
+    return nbfs_free_inode(ctx, inode);
 }
 
+/*
+ * Release the file's blocks and its inode. Directory entries that
+ * name it are left to the caller.
+ */
 int nbfs_delete_file(
     nbfs_context_t *ctx,
     uint64_t inode)
 {
-    (void)ctx;
-    (void)inode;
-    return 0;
+    if (!ctx || nbfs_journal_begin(ctx) != 0)
+        return -1;
+
+    int result = -1;
+
+    if (nbfs_inode_lock(ctx, &inode, 1, true) == 0)
+    {
+        result = file_delete(ctx, inode);
+        nbfs_inode_unlock(ctx);
+    }
+
+    if (nbfs_journal_commit(ctx) != 0)
+        result = -1;
+
+    return result;
 }
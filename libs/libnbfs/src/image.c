@@ -6,75 +6,142 @@
  * Image management
  */
 
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "libnbfs.h"
 #include "internal/context.h"
+#include "internal/allocator.h"
+#include "internal/block.h"
+#include "internal/block_cache.h"
+#include "internal/journal.h"
+#include "internal/private.h"
+#include "internal/superblock.h"
+
+static uint64_t image_size(int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) != 0)
+        return 0;
+
+    return (uint64_t)st.st_size;
+}
 
-static uint64_t image_size(FILE *fp)
+/*
+ * Attach the positional file-descriptor backend.
+ */
+static int image_attach(
+    nbfs_context_t *ctx,
+    const char *path,
+    int flags)
 {
-    long current = ftell(fp);
+    ctx->fd = open(path, flags | O_CLOEXEC, 0644);
+
+    /*
+     * Inspection tools are often pointed at images they cannot
+     * write. Fall back to a read-only context for those.
+     */
+    if (ctx->fd < 0 &&
+        !(flags & O_CREAT) &&
+        (errno == EACCES || errno == EROFS))
+    {
+        ctx->fd = open(path, O_RDONLY | O_CLOEXEC);
+        ctx->read_only = true;
+    }
 
-    fseek(fp, 0, SEEK_END);
+    if (ctx->fd < 0)
+        return -1;
 
-    long size = ftell(fp);
+    ctx->backend = &nbfs_posix_backend;
+    ctx->discard = !ctx->read_only;
 
-    fseek(fp, current, SEEK_SET);
+    strncpy(ctx->image_name,
+            path,
+            sizeof(ctx->image_name)-1);
 
-    return (uint64_t)size;
+    return 0;
 }
 
 nbfs_context_t *nbfs_create(const char *path)
+{
+    return nbfs_create_size(path, 0);
+}
+
+nbfs_context_t *nbfs_create_size(
+    const char *path,
+    uint64_t bytes)
 {
     nbfs_context_t *ctx = nbfs_context_create();
 
     if (!ctx)
         return NULL;
 
-    ctx->image = fopen(path, "wb+");
-
-    if (!ctx->image)
+    if (image_attach(ctx, path, O_RDWR | O_CREAT | O_TRUNC) != 0)
     {
         nbfs_context_destroy(ctx);
         return NULL;
     }
 
-    strncpy(ctx->image_name,
-            path,
-            sizeof(ctx->image_name)-1);
+    /*
+     * Setting the size writes nothing: the image is one hole until
+     * blocks are written.
+     */
+    if (bytes > 0 && ftruncate(ctx->fd, (off_t)bytes) != 0)
+    {
+        nbfs_context_destroy(ctx);
+        return NULL;
+    }
 
-    ctx->image_size = 0;
+    ctx->image_size = bytes;
     ctx->block_size = NBFS_DEFAULT_BLOCK_SIZE;
-    ctx->total_blocks = 0;
+    ctx->total_blocks = bytes / ctx->block_size;
     ctx->dirty = true;
 
+    if (nbfs_cache_configure(ctx, NBFS_CACHE_DEFAULT_SIZE) != 0)
+    {
+        nbfs_context_destroy(ctx);
+        return NULL;
+    }
+
     return ctx;
 }
 
-nbfs_context_t *nbfs_open(const char *path)
+/*
+ * Attach an existing image and size it up, shared by both ways of
+ * opening one.
+ */
+static nbfs_context_t *image_probe(const char *path)
 {
     nbfs_context_t *ctx = nbfs_context_create();
 
     if (!ctx)
         return NULL;
 
-    ctx->image = fopen(path, "rb+");
-
-    if (!ctx->image)
+    if (image_attach(ctx, path, O_RDWR) != 0)
     {
         nbfs_context_destroy(ctx);
         return NULL;
     }
 
-    strncpy(ctx->image_name,
-            path,
-            sizeof(ctx->image_name)-1);
+    ctx->image_size = image_size(ctx->fd);
 
-    ctx->image_size = image_size(ctx->image);
+    /*
+     * mkfs picks the block size; everything else is located from
+     * the superblock once it is loaded.
+     */
+    ctx->block_size = nbfs_superblock_probe(ctx);
 
-    ctx->block_size = NBFS_DEFAULT_BLOCK_SIZE;
+    if (ctx->block_size == 0)
+        ctx->block_size = NBFS_DEFAULT_BLOCK_SIZE;
 
     ctx->total_blocks =
         ctx->image_size / ctx->block_size;
@@ -84,13 +151,117 @@ nbfs_context_t *nbfs_open(const char *path)
     return ctx;
 }
 
+nbfs_context_t *nbfs_open(const char *path)
+{
+    nbfs_context_t *ctx = image_probe(path);
+
+    if (!ctx)
+        return NULL;
+
+    if (nbfs_cache_configure(ctx, NBFS_CACHE_DEFAULT_SIZE) != 0)
+    {
+        nbfs_context_destroy(ctx);
+        return NULL;
+    }
+
+    /*
+     * Bring the image up to date with the journal before anything
+     * else reads it.
+     */
+    if (nbfs_journal_open(ctx) != 0)
+    {
+        nbfs_context_destroy(ctx);
+        return NULL;
+    }
+
+    /*
+     * Summarise and index free space up front. An unformatted image
+     * has no bitmap to read; allocation will try again later.
+     */
+    if (!ctx->read_only &&
+        nbfs_free_summary_build(ctx) == 0)
+        nbfs_extent_index_build(ctx);
+
+    return ctx;
+}
+
+nbfs_context_t *nbfs_open_mmap(const char *path)
+{
+    nbfs_context_t *ctx = image_probe(path);
+
+    if (!ctx)
+        return NULL;
+
+    if (ctx->image_size == 0)
+    {
+        nbfs_context_destroy(ctx);
+        return NULL;
+    }
+
+    /*
+     * Stores into the mapping cannot be held back for a journal, so
+     * the context gets no cache and no journal. Whatever the journal
+     * still holds goes home first, through the file descriptor.
+     * The free-space summary and extent index are left to the first
+     * allocation; inspection never needs them.
+     */
+    if (nbfs_journal_recover(ctx) != 0)
+    {
+        nbfs_context_destroy(ctx);
+        return NULL;
+    }
+
+    int prot = PROT_READ;
+
+    if (!ctx->read_only)
+        prot |= PROT_WRITE;
+
+    void *map = mmap(NULL,
+                     (size_t)ctx->image_size,
+                     prot,
+                     MAP_SHARED,
+                     ctx->fd,
+                     0);
+
+    if (map == MAP_FAILED)
+    {
+        nbfs_context_destroy(ctx);
+        return NULL;
+    }
+
+    ctx->map = map;
+    ctx->map_size = ctx->image_size;
+    ctx->backend = &nbfs_mmap_backend;
+
+    /*
+     * Everything in front of the data area is metadata that
+     * inspectors walk front to back. Start reading it in now.
+     */
+    uint64_t metadata_blocks = NBFS_DATA_START;
+    nbfs_superblock_t sb;
+
+    if (nbfs_read_superblock(ctx, &sb) == 0 &&
+        nbfs_verify_superblock(&sb) == 0 &&
+        sb.data_start != 0)
+    {
+        metadata_blocks = sb.data_start;
+    }
+
+    nbfs_block_advise(ctx, 0, metadata_blocks, NBFS_ADVISE_SEQUENTIAL);
+    nbfs_block_advise(ctx, 0, metadata_blocks, NBFS_ADVISE_WILLNEED);
+
+    return ctx;
+}
+
 void nbfs_close(nbfs_context_t *ctx)
 {
     if (!ctx)
         return;
 
     if (ctx->dirty)
-        fflush(ctx->image);
+        nbfs_flush(ctx);
+
+    nbfs_journal_checkpoint(ctx);
 
     nbfs_context_destroy(ctx);
 }
@@ -100,12 +271,86 @@ int nbfs_flush(nbfs_context_t *ctx)
     if (!ctx)
         return -1;
 
-    if (!ctx->image)
+    if (!ctx->backend)
+        return -1;
+
+    /*
+     * Pending file data takes its blocks first, a transaction per
+     * file; that moves the free counters the superblock write picks
+     * up.
+     */
+    if (ctx->delalloc && nbfs_delalloc_flush(ctx) != 0)
+        return -1;
+
+    if (ctx->superblock_dirty)
+    {
+        if (nbfs_journal_begin(ctx) != 0)
+            return -1;
+
+        int result = nbfs_superblock_sync(ctx);
+
+        if (nbfs_journal_commit(ctx) != 0 || result != 0)
+            return -1;
+    }
+
+    /*
+     * Commit this thread's transactions, then write back the rest
+     * of the block cache. Beyond that the posix backend has no
+     * user-space buffering, and stores into a shared mapping are
+     * visible at once.
+     */
+    if (nbfs_journal_sync(ctx) != 0 ||
+        nbfs_cache_flush(ctx) != 0)
+        return -1;
+
+    /*
+     * Without a journal the flush is the only commit there is.
+     */
+    bool sync = ctx->durability == NBFS_DURABILITY_FULL ||
+                (ctx->durability == NBFS_DURABILITY_ORDERED &&
+                 !ctx->journal);
+
+    if (sync && nbfs_io_sync(ctx) != 0)
+        return -1;
+
+    /*
+     * A block released without a cache that failed to go home.
+     */
+    if (atomic_exchange(&ctx->write_error, false))
         return -1;
 
-    fflush(ctx->image);
+    /*
+     * Journaled frees gave their space back at commit.
+     */
+    if (!ctx->journal)
+        nbfs_discard_issue(ctx, nbfs_discard_take(ctx));
 
     ctx->dirty = false;
 
     return 0;
 }
+
+int nbfs_set_durability(
+    nbfs_context_t *ctx,
+    nbfs_durability_t durability)
+{
+    if (!ctx)
+        return -1;
+
+    if (durability != NBFS_DURABILITY_NONE &&
+        durability != NBFS_DURABILITY_ORDERED &&
+        durability != NBFS_DURABILITY_FULL)
+        return -1;
+
+    ctx->durability = durability;
+
+    return 0;
+}
+
+nbfs_durability_t nbfs_get_durability(nbfs_context_t *ctx)
+{
+    if (!ctx)
+        return NBFS_DURABILITY_NONE;
+
+    return ctx->durability;
+}
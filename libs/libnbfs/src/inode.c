@@ -6,16 +6,28 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <nbfs/endian.h>
+
 #include "libnbfs.h"
 #include "internal/context.h"
+#include "internal/crc32.h"
+#include "internal/inode_cache.h"
 #include <nbfs/layout.h>
 
 
-static uint64_t inode_offset(uint64_t inode)
+static uint64_t inode_offset(
+    const nbfs_context_t *ctx,
+    uint64_t inode)
 {
+    uint64_t table = NBFS_INODE_TABLE_BLOCK;
+
+    if (ctx->superblock.magic == NBFS_MAGIC &&
+        ctx->superblock.inode_table_start != 0)
+        table = ctx->superblock.inode_table_start;
+
     return
-        ((uint64_t)NBFS_INODE_TABLE_BLOCK *
-        NBFS_DEFAULT_BLOCK_SIZE)
+        (table *
+        ctx->block_size)
         +
         ((inode - 1) *
         sizeof(nbfs_inode_t));
@@ -23,6 +35,28 @@ static uint64_t inode_offset(uint64_t inode)
 
 
 
+static bool inode_checksums(const nbfs_context_t *ctx)
+{
+    return (ctx->superblock.flags & NBFS_SUPERBLOCK_CHECKSUMS) != 0;
+}
+
+
+
+/*
+ * Checksum of the on-disk form of a native inode.
+ */
+static uint32_t inode_crc32(const nbfs_inode_t *inode)
+{
+    nbfs_inode_t copy = *inode;
+
+    copy.crc32 = 0;
+    nbfs_inode_le(&copy);
+
+    return nbfs_crc32(&copy, sizeof(copy));
+}
+
+
+
 int nbfs_read_inode(
     nbfs_context_t *ctx,
     uint64_t inode,
@@ -32,16 +66,21 @@ int nbfs_read_inode(
         return -1;
 
 
-    if (fseek(ctx->image,
-              inode_offset(inode),
-              SEEK_SET))
+    if (nbfs_inode_cache_read(ctx,
+                              inode_offset(ctx, inode),
+                              out,
+                              sizeof(nbfs_inode_t)) != 0)
         return -1;
 
+    nbfs_inode_le(out);
+
 
-    if (fread(out,
-              sizeof(nbfs_inode_t),
-              1,
-              ctx->image) != 1)
+    /*
+     * Unused slots are never written and carry no checksum.
+     */
+    if (inode_checksums(ctx) &&
+        out->inode_number != 0 &&
+        out->crc32 != inode_crc32(out))
         return -1;
 
 
@@ -62,49 +101,27 @@ int nbfs_write_inode(
         return -1;
 
 
-    if (fseek(ctx->image,
-              inode_offset(inode->inode_number),
-              SEEK_SET))
-        return -1;
+    nbfs_inode_t disk = *inode;
 
+    if (inode_checksums(ctx))
+        disk.crc32 = inode_crc32(inode);
 
-    if (fwrite(inode,
-               sizeof(nbfs_inode_t),
-               1,
-               ctx->image) != 1)
-        return -1;
+    nbfs_inode_le(&disk);
 
 
-    ctx->dirty = true;
-
-    return 0;
-}
-
-
-
-int nbfs_allocate_inode(
-    nbfs_context_t *ctx,
-    uint64_t *inode)
-{
-    static uint64_t next_inode = 2;
-
-    if (!ctx || !inode)
+    /*
+     * Only the cached table block is updated here; it reaches the
+     * image once, at flush.
+     */
+    if (nbfs_inode_cache_write(ctx,
+                               inode_offset(ctx, inode->inode_number),
+                               &disk,
+                               sizeof(nbfs_inode_t)) != 0)
         return -1;
 
 
-    *inode = next_inode++;
+    ctx->dirty = true;
 
     return 0;
 }
 
-
-
-int nbfs_free_inode(
-    nbfs_context_t *ctx,
-    uint64_t inode)
-{
-    (void)ctx;
-    (void)inode;
-
-    return 0;
-}
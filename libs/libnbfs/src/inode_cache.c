@@ -0,0 +1,187 @@
+/*
+ * NeoBench Filesystem Library
+ *
+ * inode_cache.c
+ *
+ * Resident inode-table blocks
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libnbfs.h"
+#include "internal/block.h"
+#include "internal/block_cache.h"
+#include "internal/inode_cache.h"
+#include "internal/journal.h"
+
+static void inode_table_span(
+    const nbfs_context_t *ctx,
+    uint64_t *start,
+    uint64_t *blocks)
+{
+    const nbfs_superblock_t *sb = &ctx->superblock;
+
+    *start = NBFS_INODE_TABLE;
+    *blocks = NBFS_INODE_TABLE_BLOCKS;
+
+    if (sb->magic == NBFS_MAGIC &&
+        sb->inode_table_start != 0 &&
+        sb->total_inodes != 0)
+    {
+        *start = sb->inode_table_start;
+        *blocks =
+            (sb->total_inodes * sizeof(nbfs_inode_t) +
+             ctx->block_size - 1) / ctx->block_size;
+    }
+}
+
+/*
+ * Make sure the readahead window holding block is resident.
+ */
+static void inode_window_load(nbfs_context_t *ctx, uint64_t block)
+{
+    uint64_t start, blocks;
+
+    inode_table_span(ctx, &start, &blocks);
+
+    if (block < start || block >= start + blocks)
+        return;
+
+    uint64_t window = (block - start) / NBFS_INODE_READAHEAD;
+    uint64_t windows =
+        (blocks + NBFS_INODE_READAHEAD - 1) / NBFS_INODE_READAHEAD;
+
+    pthread_mutex_lock(&ctx->inode_window_lock);
+
+    if (!ctx->inode_windows)
+        ctx->inode_windows = calloc((size_t)(windows + 7) / 8, 1);
+
+    if (ctx->inode_windows &&
+        !(ctx->inode_windows[window / 8] & (1u << (window % 8))))
+    {
+        uint64_t first = start + window * NBFS_INODE_READAHEAD;
+        uint64_t count = start + blocks - first;
+
+        if (count > NBFS_INODE_READAHEAD)
+            count = NBFS_INODE_READAHEAD;
+
+        nbfs_cache_stats_t stats;
+
+        nbfs_cache_stats(ctx, &stats);
+
+        bool pin = ctx->inode_pinned + count <= stats.slots / 2;
+
+        if (nbfs_cache_prefetch(ctx, first, count, pin) == count)
+        {
+            if (pin)
+                ctx->inode_pinned += count;
+
+            ctx->inode_windows[window / 8] |= (uint8_t)(1u << (window % 8));
+        }
+    }
+
+    pthread_mutex_unlock(&ctx->inode_window_lock);
+}
+
+static int inode_cache_io(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    uint8_t *buffer,
+    size_t length,
+    bool write)
+{
+    if (!ctx || !buffer)
+        return -1;
+
+    if (write && ctx->read_only)
+        return -1;
+
+    if (!ctx->cache)
+    {
+        return write
+            ? nbfs_io_write(ctx, offset, buffer, length)
+            : nbfs_io_read(ctx, offset, buffer, length);
+    }
+
+    uint32_t block_size = ctx->block_size;
+
+    /*
+     * An inode may straddle two table blocks.
+     */
+    while (length > 0)
+    {
+        uint64_t block = offset / block_size;
+        size_t within = (size_t)(offset % block_size);
+        size_t part = block_size - within;
+
+        if (part > length)
+            part = length;
+
+        inode_window_load(ctx, block);
+
+        uint8_t *data = nbfs_cache_get(ctx, block, true, write);
+
+        if (data)
+        {
+            if (write)
+                memcpy(data + within, buffer, part);
+            else
+                memcpy(buffer, data + within, part);
+
+            nbfs_cache_release(ctx, data, write);
+        }
+        else
+        {
+            /*
+             * Inside a transaction nothing goes home unlogged.
+             */
+            if (write && nbfs_journal_running(ctx))
+                return -1;
+
+            int result = write
+                ? nbfs_io_write(ctx, offset, buffer, part)
+                : nbfs_io_read(ctx, offset, buffer, part);
+
+            if (result != 0)
+                return -1;
+        }
+
+        offset += part;
+        buffer += part;
+        length -= part;
+    }
+
+    return 0;
+}
+
+int nbfs_inode_cache_read(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    void *buffer,
+    size_t length)
+{
+    return inode_cache_io(ctx, offset, buffer, length, false);
+}
+
+int nbfs_inode_cache_write(
+    nbfs_context_t *ctx,
+    uint64_t offset,
+    const void *buffer,
+    size_t length)
+{
+    return inode_cache_io(ctx, offset, (uint8_t *)buffer, length, true);
+}
+
+void nbfs_inode_cache_reset(nbfs_context_t *ctx)
+{
+    pthread_mutex_lock(&ctx->inode_window_lock);
+
+    free(ctx->inode_windows);
+
+    ctx->inode_windows = NULL;
+    ctx->inode_pinned = 0;
+
+    pthread_mutex_unlock(&ctx->inode_window_lock);
+}
@@ -1,5 +1,902 @@
 /*
+ * NeoBench Filesystem Library
+ *
  * journal.c
- * libnbfs
+ *
+ * Write-ahead metadata journal
  */
 
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <nbfs/endian.h>
+#include <nbfs/journal.h>
+
+#include "libnbfs.h"
+#include "internal/allocator.h"
+#include "internal/block.h"
+#include "internal/block_cache.h"
+#include "internal/crc32.h"
+#include "internal/journal.h"
+
+struct nbfs_journal
+{
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+
+    /*
+     * Unique for the life of the process; an address can be reused.
+     */
+    uint64_t id;
+
+    uint64_t start;
+    uint32_t blocks;
+    uint32_t block_size;
+
+    /*
+     * Sequence number of the transaction at journal block 1, of the
+     * next one to be written, and where that one goes.
+     */
+    uint64_t first;
+    uint64_t sequence;
+    uint32_t head;
+
+    /*
+     * Most block images one transaction can carry.
+     */
+    uint32_t limit;
+
+    uint32_t handles;
+
+    /*
+     * committing: a commit waits for open transactions to close and
+     * holds off new ones. writing: it is logging, and nobody joins.
+     */
+    bool committing;
+    bool writing;
+    bool requested;
+
+    /*
+     * A block with an image in the journal was freed.
+     */
+    bool reset;
+
+    /*
+     * Home blocks logged since the journal was last empty.
+     */
+    uint64_t *logged;
+    uint32_t logged_count;
+
+    uint64_t *homes;
+    nbfs_iovec_t *iov;
+    uint8_t *scratch;
+};
+
+/*
+ * What the calling thread knows of each journal it uses: the
+ * transactions it has open there, which it may add to while a
+ * commit waits for them since it cannot wait for itself to close,
+ * and the sequence number of the transaction it last closed.
+ */
+#define JOURNAL_THREAD_SLOTS 8
+
+typedef struct
+{
+    uint64_t journal;
+
+    uint32_t handles;
+
+    bool closed;
+    uint64_t sequence;
+
+} thread_state_t;
+
+static _Thread_local thread_state_t thread_state[JOURNAL_THREAD_SLOTS];
+
+static _Atomic uint64_t journal_ids;
+
+/*
+ * The calling thread's state for j. With create set an entry is
+ * made when there is none, taking an unused one or else one with
+ * nothing open, whose closed sequence is forgotten; a later sync
+ * then simply commits. NULL when there is no entry to be had.
+ */
+static thread_state_t *thread_find(
+    const struct nbfs_journal *j,
+    bool create)
+{
+    thread_state_t *spare = NULL;
+
+    for (int n = 0; n < JOURNAL_THREAD_SLOTS; n++)
+    {
+        thread_state_t *t = &thread_state[n];
+
+        if (t->journal == j->id)
+            return t;
+
+        if (t->handles == 0 && (!spare || t->journal == 0))
+            spare = t;
+    }
+
+    if (!create || !spare)
+        return NULL;
+
+    spare->journal = j->id;
+    spare->handles = 0;
+    spare->closed = false;
+    spare->sequence = 0;
+
+    return spare;
+}
+
+static int journal_write_blocks(
+    nbfs_context_t *ctx,
+    struct nbfs_journal *j,
+    uint32_t block,
+    const nbfs_iovec_t *iov,
+    int iovcnt)
+{
+    uint64_t offset = (j->start + block) * j->block_size;
+
+    if (ctx->backend->writev)
+        return ctx->backend->writev(ctx, offset, iov, iovcnt);
+
+    for (int n = 0; n < iovcnt; n++)
+    {
+        if (ctx->backend->write(ctx,
+                                offset,
+                                iov[n].base,
+                                iov[n].length) != 0)
+            return -1;
+
+        offset += iov[n].length;
+    }
+
+    return 0;
+}
+
+static int header_write(
+    nbfs_context_t *ctx,
+    struct nbfs_journal *j)
+{
+    uint8_t *block = j->scratch;
+    nbfs_journal_header_t *header = (nbfs_journal_header_t *)block;
+
+    memset(block, 0, j->block_size);
+
+    header->block.magic = NBFS_JOURNAL_MAGIC;
+    header->block.type = NBFS_JOURNAL_HEADER;
+    header->block.sequence = j->first;
+    header->block_size = j->block_size;
+    header->blocks = j->blocks;
+
+    /*
+     * CRCs cover the on-disk, little-endian bytes.
+     */
+    nbfs_journal_header_le(header);
+
+    header->crc32 = nbfs_le32(nbfs_crc32(header, sizeof(*header)));
+
+    nbfs_iovec_t iov = { block, j->block_size };
+
+    return journal_write_blocks(ctx, j, 0, &iov, 1);
+}
+
+/*
+ * Everything logged has been written home; once that is durable the
+ * journal can forget it. The header must be durable before a new
+ * transaction overwrites the old ones, or replay could stop inside
+ * them and leave older images on top of newer ones.
+ */
+static int journal_reset(
+    nbfs_context_t *ctx,
+    struct nbfs_journal *j)
+{
+    if (j->head == 1 && !j->reset)
+        return 0;
+
+    j->first = j->sequence;
+
+    if (nbfs_io_sync(ctx) != 0 ||
+        header_write(ctx, j) != 0 ||
+        nbfs_io_sync(ctx) != 0)
+        return -1;
+
+    j->head = 1;
+    j->logged_count = 0;
+    j->reset = false;
+
+    return 0;
+}
+
+/*
+ * Log j->homes[0, count) with their images in j->iov[1, count] as
+ * one transaction at the head of the journal. Everything written
+ * before the commit block is made durable ahead of it.
+ */
+static int journal_log(
+    nbfs_context_t *ctx,
+    struct nbfs_journal *j,
+    uint32_t count)
+{
+    uint32_t block_size = j->block_size;
+    uint8_t *descriptor = j->scratch;
+    uint8_t *commit = j->scratch + block_size;
+
+    memset(descriptor, 0, block_size);
+    memset(commit, 0, block_size);
+
+    nbfs_journal_descriptor_t *d = (nbfs_journal_descriptor_t *)descriptor;
+
+    d->block.magic = NBFS_JOURNAL_MAGIC;
+    d->block.type = NBFS_JOURNAL_DESCRIPTOR;
+    d->block.sequence = j->sequence;
+    d->count = count;
+
+    nbfs_journal_descriptor_le(d);
+
+    uint64_t *homes = (uint64_t *)(descriptor + sizeof(*d));
+
+    for (uint32_t n = 0; n < count; n++)
+        homes[n] = nbfs_le64(j->homes[n]);
+
+    j->iov[0].base = descriptor;
+    j->iov[0].length = block_size;
+
+    uint32_t crc = 0;
+
+    for (uint32_t n = 0; n <= count; n++)
+        crc = nbfs_crc32_update(crc, j->iov[n].base, block_size);
+
+    nbfs_journal_commit_t *c = (nbfs_journal_commit_t *)commit;
+
+    c->block.magic = NBFS_JOURNAL_MAGIC;
+    c->block.type = NBFS_JOURNAL_COMMIT;
+    c->block.sequence = j->sequence;
+    c->count = count;
+    c->data_crc32 = crc;
+    c->timestamp = (uint64_t)time(NULL);
+
+    nbfs_journal_commit_le(c);
+
+    c->crc32 = nbfs_le32(nbfs_crc32(c, sizeof(*c)));
+
+    j->iov[count + 1].base = commit;
+    j->iov[count + 1].length = block_size;
+
+    /*
+     * The CRC already rejects a commit block that overtook the
+     * images; the barrier is for what the images refer to.
+     */
+    if (journal_write_blocks(ctx, j, j->head, j->iov, (int)count + 1) != 0 ||
+        nbfs_io_sync(ctx) != 0 ||
+        journal_write_blocks(ctx,
+                             j,
+                             j->head + count + 1,
+                             j->iov + count + 1,
+                             1) != 0 ||
+        nbfs_io_sync(ctx) != 0)
+        return -1;
+
+    memcpy(j->logged + j->logged_count, j->homes, count * sizeof(uint64_t));
+
+    j->logged_count += count;
+    j->head += count + 2;
+    j->sequence++;
+
+    return 0;
+}
+
+static int journal_write(
+    nbfs_context_t *ctx,
+    struct nbfs_journal *j)
+{
+    /*
+     * Ordered: file data outside the transaction reaches the image
+     * before the metadata that refers to it is committed. The
+     * barrier ahead of the first commit block covers it.
+     */
+    if (nbfs_cache_flush(ctx) != 0)
+        return -1;
+
+    uint32_t count = nbfs_cache_journal_collect(ctx,
+                                                j->homes,
+                                                j->iov + 1,
+                                                j->limit);
+
+    if (count == 0)
+        return 0;
+
+    /*
+     * The cache lets no transaction grow past what one journal
+     * transaction carries, so a group is always logged whole.
+     */
+    if (count > j->limit)
+        return -1;
+
+    if (j->reset || j->head + count + 2 > j->blocks)
+    {
+        if (journal_reset(ctx, j) != 0)
+            return -1;
+    }
+
+    if (journal_log(ctx, j, count) != 0)
+        return -1;
+
+    /*
+     * Committed. The home writes need no barrier of their own: the
+     * next reset syncs them before the journal lets go.
+     */
+    return nbfs_cache_checkpoint(ctx);
+}
+
+/*
+ * Parse the transaction at block position of the journal image
+ * read into data. Returns its image count, or -1 when there is no
+ * complete transaction with this sequence number.
+ */
+static int64_t transaction_check(
+    const struct nbfs_journal *j,
+    const uint8_t *data,
+    uint32_t position,
+    uint64_t sequence)
+{
+    uint32_t block_size = j->block_size;
+
+    if (position + 2 > j->blocks)
+        return -1;
+
+    const uint8_t *descriptor = data + (size_t)position * block_size;
+    nbfs_journal_descriptor_t d;
+
+    memcpy(&d, descriptor, sizeof(d));
+    nbfs_journal_descriptor_le(&d);
+
+    if (d.block.magic != NBFS_JOURNAL_MAGIC ||
+        d.block.type != NBFS_JOURNAL_DESCRIPTOR ||
+        d.block.sequence != sequence ||
+        d.count == 0 ||
+        d.count > j->limit ||
+        position + d.count + 2 > j->blocks)
+        return -1;
+
+    nbfs_journal_commit_t c;
+
+    memcpy(&c,
+           data + (size_t)(position + d.count + 1) * block_size,
+           sizeof(c));
+
+    uint32_t crc = nbfs_le32(c.crc32);
+
+    c.crc32 = 0;
+
+    if (nbfs_crc32(&c, sizeof(c)) != crc)
+        return -1;
+
+    nbfs_journal_commit_le(&c);
+
+    if (c.block.magic != NBFS_JOURNAL_MAGIC ||
+        c.block.type != NBFS_JOURNAL_COMMIT ||
+        c.block.sequence != sequence ||
+        c.count != d.count)
+        return -1;
+
+    if (nbfs_crc32_update(0,
+                          descriptor,
+                          (size_t)(d.count + 1) * block_size) != c.data_crc32)
+        return -1;
+
+    return d.count;
+}
+
+int nbfs_journal_replay(nbfs_context_t *ctx)
+{
+    if (!ctx)
+        return -1;
+
+    struct nbfs_journal *j = ctx->journal;
+
+    if (!j)
+        return 0;
+
+    uint32_t block_size = j->block_size;
+
+    /*
+     * The journal is small; read all of it in one request.
+     */
+    uint8_t *data = malloc((size_t)j->blocks * block_size);
+
+    if (!data)
+        return -1;
+
+    if (ctx->backend->read(ctx,
+                           j->start * block_size,
+                           data,
+                           (size_t)j->blocks * block_size) != 0)
+    {
+        free(data);
+        return -1;
+    }
+
+    uint64_t sequence = j->first;
+    uint32_t position = 1;
+    int result = 0;
+    int64_t count;
+
+    while ((count = transaction_check(j, data, position, sequence)) > 0)
+    {
+        const uint64_t *homes = (const uint64_t *)
+            (data + (size_t)position * block_size +
+             sizeof(nbfs_journal_descriptor_t));
+
+        for (int64_t n = 0; n < count && result == 0; n++)
+        {
+            uint64_t home = nbfs_le64(homes[n]);
+
+            if (home >= ctx->total_blocks ||
+                nbfs_io_write(ctx,
+                              home * block_size,
+                              data + (size_t)(position + 1 + n) * block_size,
+                              block_size) != 0)
+                result = -1;
+        }
+
+        if (result != 0)
+            break;
+
+        position += (uint32_t)count + 2;
+        sequence++;
+    }
+
+    free(data);
+
+    if (result != 0)
+        return -1;
+
+    /*
+     * Whatever was replayed is home now; empty the journal so it is
+     * not replayed again.
+     */
+    j->sequence = sequence;
+    j->head = position;
+
+    return journal_reset(ctx, j);
+}
+
+static void journal_free(struct nbfs_journal *j)
+{
+    pthread_cond_destroy(&j->idle);
+    pthread_mutex_destroy(&j->lock);
+
+    free(j->logged);
+    free(j->homes);
+    free(j->iov);
+    free(j->scratch);
+    free(j);
+}
+
+static int journal_attach(nbfs_context_t *ctx)
+{
+    /*
+     * The journal location never changes, so the superblock on the
+     * image is good enough even if the journal holds a newer one.
+     */
+    nbfs_superblock_t sb;
+
+    if (ctx->backend->read(ctx,
+                           (uint64_t)NBFS_SUPERBLOCK * ctx->block_size,
+                           &sb,
+                           sizeof(sb)) != 0)
+        return 0;
+
+    nbfs_superblock_le(&sb);
+
+    if (nbfs_verify_superblock(&sb) != 0 ||
+        sb.block_size != ctx->block_size ||
+        sb.journal_blocks < 4 ||
+        sb.journal_blocks > UINT32_MAX ||
+        sb.journal_start + sb.journal_blocks > sb.total_blocks)
+        return 0;
+
+    struct nbfs_journal *j = calloc(1, sizeof(*j));
+
+    if (!j)
+        return -1;
+
+    j->id = atomic_fetch_add(&journal_ids, 1) + 1;
+    j->start = sb.journal_start;
+    j->blocks = (uint32_t)sb.journal_blocks;
+    j->block_size = sb.block_size;
+    j->head = 1;
+
+    uint32_t per_descriptor =
+        (j->block_size - sizeof(nbfs_journal_descriptor_t)) / sizeof(uint64_t);
+
+    j->limit = j->blocks - 3;
+
+    if (j->limit > per_descriptor)
+        j->limit = per_descriptor;
+
+    j->logged = malloc(sizeof(*j->logged) * j->blocks);
+    j->homes = malloc(sizeof(*j->homes) * j->limit);
+    j->iov = malloc(sizeof(*j->iov) * (j->limit + 2));
+    j->scratch = malloc((size_t)j->block_size * 2);
+
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->idle, NULL);
+
+    if (!j->logged || !j->homes || !j->iov || !j->scratch)
+    {
+        journal_free(j);
+        return -1;
+    }
+
+    nbfs_journal_header_t header;
+
+    if (ctx->backend->read(ctx,
+                           j->start * j->block_size,
+                           &header,
+                           sizeof(header)) != 0)
+    {
+        journal_free(j);
+        return -1;
+    }
+
+    uint32_t crc = nbfs_le32(header.crc32);
+
+    header.crc32 = 0;
+
+    bool valid = nbfs_crc32(&header, sizeof(header)) == crc;
+
+    nbfs_journal_header_le(&header);
+
+    ctx->journal = j;
+
+    if (valid &&
+        header.block.magic == NBFS_JOURNAL_MAGIC &&
+        header.block.type == NBFS_JOURNAL_HEADER &&
+        header.block_size == j->block_size &&
+        header.blocks == j->blocks)
+    {
+        j->first = header.block.sequence;
+        j->sequence = j->first;
+
+        return nbfs_journal_replay(ctx);
+    }
+
+    /*
+     * A journal never used, or one whose header is lost. Start the
+     * sequence numbers from the clock so that nothing left in the
+     * journal area can pass for a new transaction.
+     */
+    j->first = (uint64_t)time(NULL) << 20;
+    j->sequence = j->first;
+
+    if (header_write(ctx, j) != 0 ||
+        nbfs_io_sync(ctx) != 0)
+    {
+        nbfs_journal_destroy(ctx);
+        return -1;
+    }
+
+    return 0;
+}
+
+int nbfs_journal_open(nbfs_context_t *ctx)
+{
+    if (ctx->read_only || !ctx->cache || ctx->map)
+        return 0;
+
+    return journal_attach(ctx);
+}
+
+int nbfs_journal_recover(nbfs_context_t *ctx)
+{
+    if (ctx->read_only || ctx->cache || ctx->map)
+        return 0;
+
+    /*
+     * Replay writes straight to the backend, so no cache is needed
+     * to bring the image up to date; only to journal anything new.
+     */
+    int result = journal_attach(ctx);
+
+    nbfs_journal_destroy(ctx);
+
+    return result;
+}
+
+bool nbfs_journal_running(nbfs_context_t *ctx)
+{
+    struct nbfs_journal *j = ctx->journal;
+
+    if (!j)
+        return false;
+
+    pthread_mutex_lock(&j->lock);
+
+    bool running = j->handles > 0;
+
+    pthread_mutex_unlock(&j->lock);
+
+    return running;
+}
+
+uint32_t nbfs_journal_capacity(nbfs_context_t *ctx)
+{
+    struct nbfs_journal *j = ctx->journal;
+
+    return j ? j->limit : 0;
+}
+
+/*
+ * The running transaction is measured against the journal and
+ * against the cache slots it can still take, whichever is smaller.
+ */
+static uint64_t journal_room(
+    nbfs_context_t *ctx,
+    const struct nbfs_journal *j)
+{
+    nbfs_cache_stats_t stats;
+
+    nbfs_cache_stats(ctx, &stats);
+
+    uint64_t room = stats.slots - stats.pinned;
+
+    return room < j->limit ? room : j->limit;
+}
+
+static bool journal_full(
+    nbfs_context_t *ctx,
+    const struct nbfs_journal *j)
+{
+    return nbfs_cache_journaled(ctx) >=
+           journal_room(ctx, j) * NBFS_JOURNAL_THRESHOLD / 100;
+}
+
+static int journal_commit(
+    nbfs_context_t *ctx,
+    bool all)
+{
+    struct nbfs_journal *j = ctx->journal;
+
+    if (!j)
+        return 0;
+
+    thread_state_t *t = thread_find(j, false);
+
+    pthread_mutex_lock(&j->lock);
+
+    if (t && t->handles > 0)
+    {
+        j->requested = true;
+        pthread_mutex_unlock(&j->lock);
+        return 0;
+    }
+
+    /*
+     * Group commit: a commit under way takes every transaction that
+     * closed before it. Once it is done, the caller's own may have
+     * nothing left to wait for.
+     */
+    while (j->committing)
+        pthread_cond_wait(&j->idle, &j->lock);
+
+    if (!all &&
+        t &&
+        t->closed &&
+        t->sequence < j->sequence)
+    {
+        pthread_mutex_unlock(&j->lock);
+        return 0;
+    }
+
+    j->committing = true;
+
+    while (j->handles > 0)
+        pthread_cond_wait(&j->idle, &j->lock);
+
+    j->writing = true;
+
+    pthread_mutex_unlock(&j->lock);
+
+    int result = journal_write(ctx, j);
+
+    /*
+     * The frees just committed may give their space back. Taken
+     * while no transaction is open, so none still running comes
+     * along.
+     */
+    struct nbfs_discard *discards =
+        result == 0 ? nbfs_discard_take(ctx) : NULL;
+
+    pthread_mutex_lock(&j->lock);
+
+    j->committing = false;
+    j->writing = false;
+    j->requested = false;
+
+    pthread_cond_broadcast(&j->idle);
+    pthread_mutex_unlock(&j->lock);
+
+    nbfs_discard_issue(ctx, discards);
+
+    return result;
+}
+
+int nbfs_journal_flush(nbfs_context_t *ctx)
+{
+    return journal_commit(ctx, true);
+}
+
+int nbfs_journal_sync(nbfs_context_t *ctx)
+{
+    return journal_commit(ctx, false);
+}
+
+int nbfs_journal_begin(nbfs_context_t *ctx)
+{
+    if (!ctx)
+        return -1;
+
+    struct nbfs_journal *j = ctx->journal;
+
+    if (!j)
+        return 0;
+
+    thread_state_t *t = thread_find(j, true);
+
+    if (!t)
+        return -1;
+
+    /*
+     * Commit first when the running transaction is as large as it
+     * should get.
+     */
+    if (t->handles == 0 &&
+        journal_full(ctx, j) &&
+        nbfs_journal_flush(ctx) != 0)
+        return -1;
+
+    for (;;)
+    {
+        /*
+         * Looked at unlocked: the cache lock comes before the
+         * journal's.
+         */
+        uint64_t used = nbfs_cache_journaled(ctx);
+        uint64_t room = journal_room(ctx, j);
+
+        pthread_mutex_lock(&j->lock);
+
+        while (j->writing || (j->committing && t->handles == 0))
+            pthread_cond_wait(&j->idle, &j->lock);
+
+        /*
+         * Every open transaction may still add its credits. When a
+         * new one would not fit, the last to close commits and the
+         * caller waits for that rather than fail a write later.
+         */
+        if (t->handles > 0 ||
+            j->handles == 0 ||
+            used + (j->handles + 1) * (uint64_t)NBFS_JOURNAL_CREDITS <= room)
+            break;
+
+        j->requested = true;
+
+        while (j->requested && j->handles > 0)
+            pthread_cond_wait(&j->idle, &j->lock);
+
+        pthread_mutex_unlock(&j->lock);
+    }
+
+    j->handles++;
+    t->handles++;
+
+    pthread_mutex_unlock(&j->lock);
+
+    return 0;
+}
+
+int nbfs_journal_commit(nbfs_context_t *ctx)
+{
+    if (!ctx)
+        return -1;
+
+    struct nbfs_journal *j = ctx->journal;
+
+    if (!j)
+        return 0;
+
+    thread_state_t *t = thread_find(j, false);
+
+    pthread_mutex_lock(&j->lock);
+
+    if (j->handles == 0 || !t || t->handles == 0)
+    {
+        pthread_mutex_unlock(&j->lock);
+        return -1;
+    }
+
+    j->handles--;
+    t->handles--;
+
+    t->closed = true;
+    t->sequence = j->sequence;
+
+    bool last = j->handles == 0;
+    bool requested = last && j->requested;
+
+    if (last)
+        pthread_cond_broadcast(&j->idle);
+
+    pthread_mutex_unlock(&j->lock);
+
+    if (requested || (t->handles == 0 && journal_full(ctx, j)))
+        return nbfs_journal_flush(ctx);
+
+    return 0;
+}
+
+void nbfs_journal_revoke(
+    nbfs_context_t *ctx,
+    uint64_t first,
+    uint64_t count)
+{
+    struct nbfs_journal *j = ctx->journal;
+
+    if (!j)
+        return;
+
+    /*
+     * A freed block may come back as file data, which is written
+     * home without going through the journal. An image of it still
+     * in the journal must not be replayed over that, and one in the
+     * running transaction need not be logged at all.
+     */
+    pthread_mutex_lock(&j->lock);
+
+    for (uint32_t n = 0; n < j->logged_count && !j->reset; n++)
+    {
+        if (j->logged[n] - first < count)
+            j->reset = true;
+    }
+
+    pthread_mutex_unlock(&j->lock);
+
+    nbfs_cache_discard(ctx, first, count);
+}
+
+int nbfs_journal_checkpoint(nbfs_context_t *ctx)
+{
+    struct nbfs_journal *j = ctx->journal;
+
+    if (!j)
+        return 0;
+
+    if (nbfs_journal_flush(ctx) != 0)
+        return -1;
+
+    pthread_mutex_lock(&j->lock);
+
+    int result = journal_reset(ctx, j);
+
+    pthread_mutex_unlock(&j->lock);
+
+    return result;
+}
+
+void nbfs_journal_destroy(nbfs_context_t *ctx)
+{
+    if (!ctx->journal)
+        return;
+
+    journal_free(ctx->journal);
+
+    ctx->journal = NULL;
+}
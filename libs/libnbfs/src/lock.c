@@ -0,0 +1,239 @@
+/*
+ * NeoBench Filesystem Library
+ *
+ * lock.c
+ *
+ * Context locking
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libnbfs.h"
+#include "internal/lock.h"
+
+/*
+ * Stripes the calling thread holds, in the order it took them, and
+ * whether each is held for writing. A public call made under
+ * another's locks takes only the stripes it is missing and drops
+ * them again when it returns; held_marks[] records where each level
+ * of nesting starts.
+ */
+#define INODE_LOCK_HELD  (NBFS_INODE_LOCK_SET * 2)
+#define INODE_LOCK_DEPTH 8
+
+static _Thread_local uint32_t held_depth;
+static _Thread_local uint32_t held_count;
+static _Thread_local uint32_t held_stripes[INODE_LOCK_HELD];
+static _Thread_local bool held_write[INODE_LOCK_HELD];
+static _Thread_local uint32_t held_marks[INODE_LOCK_DEPTH];
+
+static uint32_t inode_stripe(uint64_t inode)
+{
+    /*
+     * Neighbouring inodes are usually created together; spread them.
+     */
+    return (uint32_t)((inode * 0x9e3779b97f4a7c15ull) >> 58) %
+        NBFS_INODE_LOCKS;
+}
+
+static int stripe_find(uint32_t stripe)
+{
+    for (uint32_t i = 0; i < held_count; i++)
+    {
+        if (held_stripes[i] == stripe)
+            return (int)i;
+    }
+
+    return -1;
+}
+
+static void stripe_push(uint32_t stripe, bool write)
+{
+    held_stripes[held_count] = stripe;
+    held_write[held_count] = write;
+    held_count++;
+}
+
+/*
+ * Unlock everything taken since mark, newest first.
+ */
+static void stripes_release(nbfs_context_t *ctx, uint32_t mark)
+{
+    while (held_count > mark)
+    {
+        held_count--;
+        pthread_rwlock_unlock(&ctx->inode_locks[held_stripes[held_count]]);
+    }
+}
+
+int nbfs_inode_lock(
+    nbfs_context_t *ctx,
+    const uint64_t *inodes,
+    int count,
+    bool write)
+{
+    if (count < 0 ||
+        count > NBFS_INODE_LOCK_SET ||
+        held_depth == INODE_LOCK_DEPTH)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /*
+     * Sorted and without duplicates, so that two threads locking
+     * overlapping sets always meet in the same order.
+     */
+    uint32_t stripes[NBFS_INODE_LOCK_SET];
+    uint32_t n = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t stripe = inode_stripe(inodes[i]);
+        uint32_t at = n;
+
+        while (at > 0 && stripes[at - 1] > stripe)
+            at--;
+
+        if (at > 0 && stripes[at - 1] == stripe)
+            continue;
+
+        for (uint32_t j = n; j > at; j--)
+            stripes[j] = stripes[j - 1];
+
+        stripes[at] = stripe;
+        n++;
+    }
+
+    uint32_t mark = held_count;
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        int at = stripe_find(stripes[i]);
+
+        /*
+         * Held already; a read lock cannot be turned into a write
+         * lock without dropping it.
+         */
+        if (at >= 0)
+        {
+            if (write && !held_write[at])
+            {
+                errno = EDEADLK;
+                goto fail;
+            }
+
+            continue;
+        }
+
+        if (held_count == INODE_LOCK_HELD)
+        {
+            errno = ENOLCK;
+            goto fail;
+        }
+
+        pthread_rwlock_t *lock = &ctx->inode_locks[stripes[i]];
+
+        if (write)
+            pthread_rwlock_wrlock(lock);
+        else
+            pthread_rwlock_rdlock(lock);
+
+        stripe_push(stripes[i], write);
+    }
+
+    held_marks[held_depth++] = mark;
+
+    return 0;
+
+fail:
+    stripes_release(ctx, mark);
+
+    return -1;
+}
+
+void nbfs_inode_unlock(nbfs_context_t *ctx)
+{
+    if (held_depth == 0)
+        return;
+
+    stripes_release(ctx, held_marks[--held_depth]);
+}
+
+/*
+ * Threads are dealt shards round-robin as they first allocate.
+ */
+static atomic_uint next_shard;
+static _Thread_local uint32_t thread_shard = UINT32_MAX;
+
+uint32_t nbfs_thread_shard(void)
+{
+    if (thread_shard == UINT32_MAX)
+        thread_shard = atomic_fetch_add(&next_shard, 1) % NBFS_ALLOC_SHARDS;
+
+    return thread_shard;
+}
+
+void nbfs_thread_shard_move(uint32_t shard)
+{
+    thread_shard = shard % NBFS_ALLOC_SHARDS;
+}
+
+void nbfs_locks_init(nbfs_context_t *ctx)
+{
+    /*
+     * Writers (creates, allocation) should not starve behind a
+     * steady stream of lookups.
+     */
+    pthread_rwlockattr_t attr;
+
+    pthread_rwlockattr_init(&attr);
+
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&attr,
+        PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+
+    pthread_rwlock_init(&ctx->superblock_lock, &attr);
+    pthread_rwlock_init(&ctx->namespace_lock, &attr);
+
+    for (int i = 0; i < NBFS_INODE_LOCKS; i++)
+        pthread_rwlock_init(&ctx->inode_locks[i], &attr);
+
+    pthread_rwlockattr_destroy(&attr);
+
+    for (int i = 0; i < NBFS_ALLOC_SHARDS; i++)
+        pthread_mutex_init(&ctx->shards[i].lock, NULL);
+
+    pthread_mutex_init(&ctx->allocator_lock, NULL);
+    pthread_mutex_init(&ctx->delalloc_lock, NULL);
+    pthread_mutex_init(&ctx->inode_window_lock, NULL);
+    pthread_mutex_init(&ctx->dcache_lock, NULL);
+    pthread_mutex_init(&ctx->aio_lock, NULL);
+    pthread_mutex_init(&ctx->discard_lock, NULL);
+}
+
+void nbfs_locks_destroy(nbfs_context_t *ctx)
+{
+    pthread_rwlock_destroy(&ctx->superblock_lock);
+    pthread_rwlock_destroy(&ctx->namespace_lock);
+
+    for (int i = 0; i < NBFS_INODE_LOCKS; i++)
+        pthread_rwlock_destroy(&ctx->inode_locks[i]);
+
+    for (int i = 0; i < NBFS_ALLOC_SHARDS; i++)
+        pthread_mutex_destroy(&ctx->shards[i].lock);
+
+    pthread_mutex_destroy(&ctx->allocator_lock);
+    pthread_mutex_destroy(&ctx->delalloc_lock);
+    pthread_mutex_destroy(&ctx->inode_window_lock);
+    pthread_mutex_destroy(&ctx->dcache_lock);
+    pthread_mutex_destroy(&ctx->aio_lock);
+    pthread_mutex_destroy(&ctx->discard_lock);
+}
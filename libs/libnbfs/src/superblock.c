@@ -6,11 +6,142 @@
  * Superblock management
  */
 
+#include <pthread.h>
 #include <string.h>
 #include <stdint.h>
 
+#include <nbfs/endian.h>
+
 #include "../include/libnbfs.h"
 #include "context_internal.h"
+#include "internal/allocator.h"
+#include "internal/block_cache.h"
+#include "internal/crc32.h"
+#include "internal/superblock.h"
+
+
+static bool supported_block_size(uint32_t block_size)
+{
+    return block_size >= NBFS_BLOCK_SIZE_1K &&
+           block_size <= NBFS_BLOCK_SIZE_16K &&
+           (block_size & (block_size - 1)) == 0;
+}
+
+
+/*
+ * Pin the blocks every metadata update touches: the superblock and
+ * both allocation bitmaps, the inode bitmap first and the block
+ * bitmap from the front, where allocation starts. Pins stay for
+ * the life of the cache, so they stop at NBFS_CACHE_PIN_SHARE of
+ * it; a large volume has more bitmap than that.
+ */
+static void pin_metadata(
+    nbfs_context_t *ctx,
+    const nbfs_superblock_t *sb)
+{
+    if (ctx->metadata_pinned || !ctx->cache)
+        return;
+
+    ctx->metadata_pinned = true;
+
+    uint64_t bits_per_block = (uint64_t)ctx->block_size * 8;
+
+    uint64_t block_bitmap = sb->block_bitmap_start
+        ? sb->block_bitmap_start
+        : NBFS_BLOCK_BITMAP;
+
+    uint64_t inode_bitmap = sb->inode_bitmap_start
+        ? sb->inode_bitmap_start
+        : NBFS_INODE_BITMAP;
+
+    uint64_t block_bitmap_blocks =
+        (sb->total_blocks + bits_per_block - 1) / bits_per_block;
+
+    uint64_t inode_bitmap_blocks =
+        (sb->total_inodes + bits_per_block - 1) / bits_per_block;
+
+    uint64_t budget =
+        ctx->cache_size / ctx->block_size * NBFS_CACHE_PIN_SHARE / 100;
+
+    if (budget == 0 || nbfs_cache_pin(ctx, NBFS_SUPERBLOCK) != 0)
+        return;
+
+    budget--;
+
+    if (inode_bitmap_blocks > budget)
+        inode_bitmap_blocks = budget;
+
+    budget -= nbfs_cache_prefetch(ctx, inode_bitmap, inode_bitmap_blocks, true);
+
+    if (block_bitmap_blocks > budget)
+        block_bitmap_blocks = budget;
+
+    nbfs_cache_prefetch(ctx, block_bitmap, block_bitmap_blocks, true);
+}
+
+
+static bool same_geometry(
+    const nbfs_superblock_t *a,
+    const nbfs_superblock_t *b)
+{
+    nbfs_superblock_t x = *a;
+    nbfs_superblock_t y = *b;
+
+    x.free_blocks = y.free_blocks = 0;
+    x.free_inodes = y.free_inodes = 0;
+    x.crc32 = y.crc32 = 0;
+
+    return memcmp(&x, &y, sizeof(x)) == 0;
+}
+
+
+/*
+ * Make sb the context's view of the filesystem. The caller holds the
+ * superblock lock for writing.
+ */
+static int superblock_apply(
+    nbfs_context_t *ctx,
+    const nbfs_superblock_t *sb)
+{
+    /*
+     * Other threads read the geometry without the lock. Once it is
+     * loaded, a write-back leaves it alone and moves only what
+     * changes.
+     */
+    if (ctx->superblock.magic == NBFS_MAGIC &&
+        same_geometry(&ctx->superblock, sb))
+    {
+        ctx->superblock.free_blocks = sb->free_blocks;
+        ctx->superblock.free_inodes = sb->free_inodes;
+        ctx->superblock.crc32 = sb->crc32;
+
+        return 0;
+    }
+
+    ctx->superblock = *sb;
+
+    ctx->total_blocks = sb->total_blocks;
+
+    if (sb->block_size != 0 &&
+        sb->block_size != ctx->block_size)
+    {
+        if (!supported_block_size(sb->block_size))
+            return 0;
+
+        ctx->block_size = sb->block_size;
+
+        /*
+         * Cache slots are sized in blocks.
+         */
+        if (nbfs_cache_configure(ctx, ctx->cache_size) != 0)
+            return -1;
+    }
+
+    if (sb->magic == NBFS_MAGIC)
+        pin_metadata(ctx, sb);
+
+    return 0;
+}
 
 
 int nbfs_read_superblock(
@@ -21,56 +152,96 @@ int nbfs_read_superblock(
         return -1;
 
     /*
-     * The block layer reads a full filesystem block.
-     * Do not read directly into the smaller superblock structure.
+     * Allocation has moved the free counters on since the block
+     * was last written; the live copy is the current one.
      */
-    uint8_t buffer[NBFS_DEFAULT_BLOCK_SIZE];
-
-    if (nbfs_read_block(ctx,
-                        NBFS_SUPERBLOCK,
-                        buffer) != 0)
+    if (ctx->superblock_dirty)
     {
-        return -1;
+        pthread_rwlock_wrlock(&ctx->superblock_lock);
+
+        nbfs_free_summary_apply(ctx);
+
+        *sb = ctx->superblock;
+
+        pthread_rwlock_unlock(&ctx->superblock_lock);
+
+        return 0;
     }
 
+    /*
+     * The block layer hands out a full filesystem block.
+     * On a mapped image this points straight into the mapping,
+     * so only the superblock structure itself is copied.
+     */
+    const void *block = nbfs_block_get(ctx, NBFS_SUPERBLOCK);
+
+    if (!block)
+        return -1;
+
     memcpy(sb,
-           buffer,
+           block,
            sizeof(nbfs_superblock_t));
 
-    /*
-     * Cache the loaded superblock.
-     */
-    ctx->superblock = *sb;
+    nbfs_block_put(ctx, block);
+
+    nbfs_superblock_le(sb);
 
     /*
-     * Update runtime block information.
+     * Cache the loaded superblock and update runtime block
+     * information.
      */
-    if (sb->block_size != 0)
-        ctx->block_size = sb->block_size;
+    pthread_rwlock_wrlock(&ctx->superblock_lock);
 
-    ctx->total_blocks = sb->total_blocks;
+    int result = superblock_apply(ctx, sb);
 
-    return 0;
+    pthread_rwlock_unlock(&ctx->superblock_lock);
+
+    return result;
 }
 
 
-int nbfs_write_superblock(
+/*
+ * Checksum of the on-disk form of a native superblock.
+ */
+static uint32_t superblock_crc32(const nbfs_superblock_t *sb)
+{
+    nbfs_superblock_t copy = *sb;
+
+    copy.crc32 = 0;
+    nbfs_superblock_le(&copy);
+
+    return nbfs_crc32(&copy, sizeof(copy));
+}
+
+
+/*
+ * Write sb and make it the live copy, with the superblock lock held
+ * for writing.
+ */
+static int superblock_store(
     nbfs_context_t *ctx,
     const nbfs_superblock_t *sb)
 {
-    if (!ctx || !sb)
-        return -1;
-
-    uint8_t buffer[NBFS_DEFAULT_BLOCK_SIZE];
+    /*
+     * Large enough for any supported block size.
+     */
+    uint8_t buffer[NBFS_BLOCK_SIZE_16K];
 
     memset(buffer,
            0,
            sizeof(buffer));
 
+    nbfs_superblock_t native = *sb;
+
+    if (native.flags & NBFS_SUPERBLOCK_CHECKSUMS)
+        native.crc32 = superblock_crc32(&native);
+
     memcpy(buffer,
-           sb,
+           &native,
            sizeof(nbfs_superblock_t));
 
+    nbfs_superblock_le((nbfs_superblock_t *)buffer);
+
     if (nbfs_write_block(ctx,
                          NBFS_SUPERBLOCK,
                          buffer) != 0)
@@ -78,14 +249,100 @@ int nbfs_write_superblock(
         return -1;
     }
 
-    ctx->superblock = *sb;
+    ctx->dirty = true;
 
-    if (sb->block_size != 0)
-        ctx->block_size = sb->block_size;
+    return superblock_apply(ctx, &native);
+}
 
-    ctx->total_blocks = sb->total_blocks;
 
-    ctx->dirty = true;
+int nbfs_write_superblock(
+    nbfs_context_t *ctx,
+    const nbfs_superblock_t *sb)
+{
+    if (!ctx || !sb)
+        return -1;
+
+    pthread_rwlock_wrlock(&ctx->superblock_lock);
+
+    int result = superblock_store(ctx, sb);
+
+    pthread_rwlock_unlock(&ctx->superblock_lock);
+
+    return result;
+}
+
+
+/*
+ * A region lies behind the superblock and in front of the data area.
+ */
+static bool region_valid(
+    const nbfs_superblock_t *sb,
+    uint64_t start,
+    uint64_t blocks)
+{
+    return start > NBFS_SUPERBLOCK &&
+           start < sb->data_start &&
+           blocks <= sb->data_start - start;
+}
+
+
+/*
+ * mkfs sizes the regions for the volume; check that each one fits.
+ */
+static bool regions_valid(const nbfs_superblock_t *sb)
+{
+    uint64_t bits_per_block = (uint64_t)sb->block_size * 8;
+    uint64_t inodes_per_block = sb->block_size / sizeof(nbfs_inode_t);
+
+    if (sb->data_start >= sb->total_blocks ||
+        sb->total_inodes == 0 ||
+        sb->total_inodes / inodes_per_block >= sb->data_start)
+        return false;
+
+    uint64_t block_bitmap_blocks =
+        (sb->total_blocks + bits_per_block - 1) / bits_per_block;
+
+    uint64_t inode_bitmap_blocks =
+        (sb->total_inodes + bits_per_block - 1) / bits_per_block;
+
+    uint64_t inode_table_blocks =
+        (sb->total_inodes * sizeof(nbfs_inode_t) +
+         sb->block_size - 1) / sb->block_size;
+
+    if (!region_valid(sb, sb->block_bitmap_start, block_bitmap_blocks) ||
+        !region_valid(sb, sb->inode_bitmap_start, inode_bitmap_blocks) ||
+        !region_valid(sb, sb->inode_table_start, inode_table_blocks))
+        return false;
+
+    return sb->journal_blocks == 0 ||
+           region_valid(sb, sb->journal_start, sb->journal_blocks);
+}
+
+
+/*
+ * Find the superblock of an image whose block size is not known yet.
+ * It lives in block 1, so its offset is the block size itself.
+ */
+uint32_t nbfs_superblock_probe(nbfs_context_t *ctx)
+{
+    nbfs_superblock_t sb;
+
+    for (uint32_t block_size = NBFS_BLOCK_SIZE_1K;
+         block_size <= NBFS_BLOCK_SIZE_16K;
+         block_size *= 2)
+    {
+        if (ctx->backend->read(ctx,
+                               (uint64_t)NBFS_SUPERBLOCK * block_size,
+                               &sb,
+                               sizeof(sb)) != 0)
+            break;
+
+        nbfs_superblock_le(&sb);
+
+        if (sb.block_size == block_size &&
+            nbfs_verify_superblock(&sb) == 0)
+            return block_size;
+    }
 
     return 0;
 }
@@ -106,7 +363,7 @@ int nbfs_verify_superblock(
         return -1;
 
 
-    if (sb->block_size != NBFS_BLOCK_SIZE_4K)
+    if (!supported_block_size(sb->block_size))
         return -1;
 
 
@@ -114,5 +371,74 @@ int nbfs_verify_superblock(
         return -1;
 
 
+    if (!regions_valid(sb))
+        return -1;
+
+
+    if ((sb->flags & NBFS_SUPERBLOCK_CHECKSUMS) &&
+        sb->crc32 != superblock_crc32(sb))
+        return -1;
+
+
+    return 0;
+}
+
+
+int nbfs_superblock_load(nbfs_context_t *ctx)
+{
+    nbfs_superblock_t sb;
+
+    if (!ctx)
+        return -1;
+
+    if (ctx->superblock.magic == NBFS_MAGIC)
+        return 0;
+
+    if (nbfs_read_superblock(ctx, &sb) != 0)
+        return -1;
+
+    if (nbfs_verify_superblock(&sb) != 0)
+    {
+        pthread_rwlock_wrlock(&ctx->superblock_lock);
+
+        memset(&ctx->superblock, 0, sizeof(ctx->superblock));
+
+        pthread_rwlock_unlock(&ctx->superblock_lock);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int nbfs_superblock_sync(nbfs_context_t *ctx)
+{
+    if (!ctx)
+        return -1;
+
+    /*
+     * Clear the flag first: a counter that moves while the block is
+     * written sets it again, for the next sync.
+     */
+    if (!atomic_exchange(&ctx->superblock_dirty, false))
+        return 0;
+
+    pthread_rwlock_wrlock(&ctx->superblock_lock);
+
+    nbfs_free_summary_apply(ctx);
+
+    nbfs_superblock_t sb = ctx->superblock;
+
+    int result = superblock_store(ctx, &sb);
+
+    pthread_rwlock_unlock(&ctx->superblock_lock);
+
+    if (result != 0)
+    {
+        ctx->superblock_dirty = true;
+        return -1;
+    }
+
     return 0;
 }
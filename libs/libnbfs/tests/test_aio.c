@@ -0,0 +1,345 @@
+/*
+ * NeoBench Filesystem Library
+ *
+ * test_aio.c
+ *
+ * Asynchronous against synchronous block I/O
+ *
+ * A scratch image is filled with blocks that carry their own number.
+ * Random single-block reads and writes are then timed one at a time
+ * through nbfs_read_blocks()/nbfs_write_blocks(), and with several
+ * queue depths through nbfs_submit_read()/nbfs_submit_write() and
+ * nbfs_reap(). Every block read back is checked. The image sits in
+ * the page cache, so the figures show per-request overhead more
+ * than device latency.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libnbfs.h"
+
+#define IMAGE_BYTES  (256ull * 1024 * 1024)
+#define BLOCK_SIZE   ((uint32_t)NBFS_DEFAULT_BLOCK_SIZE)
+#define REQUESTS     32768u
+#define FILL_BLOCKS  256u
+#define MAX_DEPTH    128u
+
+static int failures;
+
+static void check(const char *what, bool ok)
+{
+    if (ok)
+        return;
+
+    printf("FAIL %s\n", what);
+
+    failures++;
+}
+
+static double seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/*
+ * The first word of a block is its number, the second the round
+ * that last wrote it.
+ */
+static void stamp(uint8_t *data, uint64_t block, uint64_t round)
+{
+    memcpy(data, &block, sizeof(block));
+    memcpy(data + sizeof(block), &round, sizeof(round));
+}
+
+static bool stamped(const uint8_t *data, uint64_t block)
+{
+    uint64_t found;
+
+    memcpy(&found, data, sizeof(found));
+
+    return found == block;
+}
+
+static uint64_t *random_blocks(uint64_t blocks)
+{
+    uint64_t *list = malloc(REQUESTS * sizeof(*list));
+    uint64_t seed = 0x9E3779B97F4A7C15ull;
+
+    if (!list)
+        return NULL;
+
+    for (uint32_t i = 0; i < REQUESTS; i++)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        list[i] = seed % blocks;
+    }
+
+    return list;
+}
+
+/*
+ * depth 0 is the synchronous run.
+ */
+static void report(const char *name, uint32_t depth, double elapsed)
+{
+    char mode[24];
+
+    if (depth)
+        snprintf(mode, sizeof(mode), "depth %3u", (unsigned)depth);
+    else
+        snprintf(mode, sizeof(mode), "sync");
+
+    printf("  %-6s %-9s  %9.0f IOPS  %8.1f MiB/s\n",
+           name,
+           mode,
+           REQUESTS / elapsed,
+           REQUESTS * (double)BLOCK_SIZE / elapsed / (1024.0 * 1024.0));
+}
+
+static int fill(nbfs_context_t *ctx, uint64_t blocks)
+{
+    uint8_t *buffer = malloc((size_t)FILL_BLOCKS * BLOCK_SIZE);
+
+    if (!buffer)
+        return -1;
+
+    memset(buffer, 0, (size_t)FILL_BLOCKS * BLOCK_SIZE);
+
+    int result = 0;
+
+    for (uint64_t first = 0; first < blocks && result == 0;
+         first += FILL_BLOCKS)
+    {
+        for (uint32_t i = 0; i < FILL_BLOCKS; i++)
+            stamp(buffer + (size_t)i * BLOCK_SIZE, first + i, 0);
+
+        result = nbfs_write_blocks(ctx, first, FILL_BLOCKS, buffer);
+    }
+
+    free(buffer);
+
+    return result;
+}
+
+static void sync_run(
+    nbfs_context_t *ctx,
+    const uint64_t *list,
+    bool write)
+{
+    uint8_t *buffer = malloc(BLOCK_SIZE);
+    int bad = 0;
+
+    if (!buffer)
+    {
+        failures++;
+        return;
+    }
+
+    double start = seconds();
+
+    for (uint32_t i = 0; i < REQUESTS; i++)
+    {
+        if (write)
+        {
+            stamp(buffer, list[i], 1);
+
+            if (nbfs_write_blocks(ctx, list[i], 1, buffer) != 0)
+                bad++;
+        }
+        else if (nbfs_read_blocks(ctx, list[i], 1, buffer) != 0 ||
+                 !stamped(buffer, list[i]))
+            bad++;
+    }
+
+    report(write ? "write" : "read", 0, seconds() - start);
+
+    check(write ? "sync writes" : "sync reads", bad == 0);
+
+    free(buffer);
+}
+
+/*
+ * Keep depth requests in flight, each with a buffer of its own,
+ * named by its slot.
+ */
+static void async_run(
+    nbfs_context_t *ctx,
+    const uint64_t *list,
+    uint32_t depth,
+    bool write)
+{
+    uint8_t *buffers = malloc((size_t)depth * BLOCK_SIZE);
+    uint64_t *blocks = malloc(depth * sizeof(*blocks));
+    uint32_t *free_slots = malloc(depth * sizeof(*free_slots));
+    nbfs_completion_t done[MAX_DEPTH];
+    int bad = 0;
+
+    if (!buffers || !blocks || !free_slots ||
+        nbfs_set_queue_depth(ctx, depth) != 0)
+    {
+        failures++;
+        goto out;
+    }
+
+    uint32_t spare = depth;
+
+    for (uint32_t i = 0; i < depth; i++)
+        free_slots[i] = i;
+
+    uint32_t next = 0;
+    uint32_t finished = 0;
+
+    double start = seconds();
+
+    while (finished < REQUESTS)
+    {
+        while (spare > 0 && next < REQUESTS)
+        {
+            uint32_t slot = free_slots[--spare];
+            uint8_t *data = buffers + (size_t)slot * BLOCK_SIZE;
+            int result;
+
+            blocks[slot] = list[next++];
+
+            if (write)
+            {
+                stamp(data, blocks[slot], 2);
+                result = nbfs_submit_write(ctx, blocks[slot], 1, data, slot);
+            }
+            else
+                result = nbfs_submit_read(ctx, blocks[slot], 1, data, slot);
+
+            if (result != 0)
+            {
+                bad++;
+                finished++;
+                free_slots[spare++] = slot;
+            }
+        }
+
+        if (finished == REQUESTS)
+            break;
+
+        int reaped = nbfs_reap(ctx, done, (int)depth, 1);
+
+        if (reaped < 0)
+        {
+            bad++;
+            break;
+        }
+
+        for (int i = 0; i < reaped; i++)
+        {
+            uint32_t slot = (uint32_t)done[i].tag;
+
+            if (done[i].result != 0 ||
+                (!write &&
+                 !stamped(buffers + (size_t)slot * BLOCK_SIZE, blocks[slot])))
+                bad++;
+
+            free_slots[spare++] = slot;
+            finished++;
+        }
+    }
+
+    report(write ? "write" : "read", depth, seconds() - start);
+
+    check(write ? "async writes" : "async reads", bad == 0);
+
+out:
+    free(free_slots);
+    free(blocks);
+    free(buffers);
+}
+
+int main(void)
+{
+    char path[] = "/tmp/nbfs-test-aio-XXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd < 0)
+    {
+        printf("test_aio: no scratch file\n");
+        return 1;
+    }
+
+    close(fd);
+
+    nbfs_context_t *ctx = nbfs_create_size(path, IMAGE_BYTES);
+    uint64_t blocks = IMAGE_BYTES / BLOCK_SIZE;
+    uint64_t *list = random_blocks(blocks);
+
+    if (!ctx || !list || fill(ctx, blocks) != 0)
+    {
+        printf("test_aio: cannot set up the image\n");
+        unlink(path);
+        return 1;
+    }
+
+    static const uint32_t depths[] = { 1, 8, 32, MAX_DEPTH };
+
+    printf("%u random %u-byte requests over %llu MiB\n",
+           REQUESTS,
+           BLOCK_SIZE,
+           (unsigned long long)(IMAGE_BYTES >> 20));
+
+    sync_run(ctx, list, false);
+    sync_run(ctx, list, true);
+
+    for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++)
+        async_run(ctx, list, depths[i], false);
+
+    for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++)
+        async_run(ctx, list, depths[i], true);
+
+    /*
+     * The last writes must have landed where they were sent.
+     */
+    uint8_t *data = malloc(BLOCK_SIZE);
+    int bad = 0;
+
+    for (uint32_t i = 0; data && i < REQUESTS; i += 97)
+    {
+        uint64_t round = 0;
+
+        if (nbfs_read_blocks(ctx, list[i], 1, data) != 0 ||
+            !stamped(data, list[i]))
+            bad++;
+
+        memcpy(&round, data + sizeof(uint64_t), sizeof(round));
+
+        if (round != 2)
+            bad++;
+    }
+
+    check("async writes read back", data && bad == 0);
+
+    free(data);
+    free(list);
+    nbfs_close(ctx);
+    unlink(path);
+
+    if (failures)
+    {
+        printf("test_aio: %d failures\n", failures);
+        return 1;
+    }
+
+    printf("test_aio: OK\n");
+
+    return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * NeoBench Filesystem Library
+ *
+ * test_crc32.c
+ *
+ * CRC-32 check values and throughput
+ *
+ * Both implementations are compared with a bit-at-a-time reference:
+ * nbfs_crc32_sliced(), the portable slicing-by-8 code, and
+ * nbfs_crc32_update(), which folds with PCLMULQDQ where the host has
+ * it. Lengths and alignments are chosen to cover the fold, its
+ * 16-byte tail and the sliced remainder. The throughput loop then
+ * times both over a metadata-sized and a large buffer.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <nbfs/crc32.h>
+
+#include "internal/crc32.h"
+
+#define BENCH_BYTES (256u * 1024u * 1024u)
+
+typedef uint32_t (*crc_fn)(uint32_t, const void *, size_t);
+
+static int failures;
+
+static uint32_t crc32_bitwise(
+    uint32_t crc,
+    const void *buffer,
+    size_t length)
+{
+    const uint8_t *p = buffer;
+
+    crc = ~crc;
+
+    while (length--)
+    {
+        crc ^= *p++;
+
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+    }
+
+    return ~crc;
+}
+
+static void check(
+    const char *what,
+    size_t length,
+    uint32_t got,
+    uint32_t want)
+{
+    if (got == want)
+        return;
+
+    printf("FAIL %s, %zu bytes: %08x, expected %08x\n",
+           what,
+           length,
+           (unsigned)got,
+           (unsigned)want);
+
+    failures++;
+}
+
+static void check_vectors(void)
+{
+    static const struct
+    {
+        const char *text;
+        uint32_t crc;
+
+    } vectors[] =
+    {
+        { "", 0x00000000u },
+        { "a", 0xE8B7BE43u },
+        { "abc", 0x352441C2u },
+        { "123456789", 0xCBF43926u },
+        { "The quick brown fox jumps over the lazy dog", 0x414FA339u },
+    };
+
+    for (size_t n = 0; n < sizeof(vectors) / sizeof(vectors[0]); n++)
+    {
+        size_t length = strlen(vectors[n].text);
+
+        check("reference", length,
+              crc32_bitwise(0, vectors[n].text, length), vectors[n].crc);
+        check("sliced", length,
+              nbfs_crc32_sliced(0, vectors[n].text, length), vectors[n].crc);
+        check("update", length,
+              nbfs_crc32_update(0, vectors[n].text, length), vectors[n].crc);
+    }
+
+    /*
+     * 64 KiB of 0xFF and of zeros, long enough for many fold rounds.
+     */
+    static uint8_t block[65536];
+
+    memset(block, 0xFF, sizeof(block));
+
+    check("sliced", sizeof(block),
+          nbfs_crc32_sliced(0, block, sizeof(block)),
+          crc32_bitwise(0, block, sizeof(block)));
+    check("update", sizeof(block),
+          nbfs_crc32_update(0, block, sizeof(block)),
+          crc32_bitwise(0, block, sizeof(block)));
+
+    memset(block, 0, sizeof(block));
+
+    check("update", sizeof(block),
+          nbfs_crc32_update(0, block, sizeof(block)),
+          crc32_bitwise(0, block, sizeof(block)));
+}
+
+static void check_lengths(void)
+{
+    enum { MAX_LENGTH = 1100, ALIGNMENTS = 16 };
+
+    uint8_t *buffer = malloc(MAX_LENGTH + ALIGNMENTS);
+
+    if (!buffer)
+    {
+        failures++;
+        return;
+    }
+
+    uint32_t seed = 0x2545F491u;
+
+    for (size_t n = 0; n < MAX_LENGTH + ALIGNMENTS; n++)
+    {
+        seed = seed * 1103515245u + 12345u;
+        buffer[n] = (uint8_t)(seed >> 16);
+    }
+
+    for (size_t align = 0; align < ALIGNMENTS; align++)
+    {
+        for (size_t length = 0; length <= MAX_LENGTH; length++)
+        {
+            const uint8_t *p = buffer + align;
+            uint32_t want = crc32_bitwise(0, p, length);
+
+            check("sliced", length, nbfs_crc32_sliced(0, p, length), want);
+            check("update", length, nbfs_crc32_update(0, p, length), want);
+
+            /*
+             * Continued across a split that leaves both halves on
+             * either side of the fold threshold.
+             */
+            size_t half = length / 3;
+
+            uint32_t crc = nbfs_crc32_update(0, p, half);
+
+            check("update, split", length,
+                  nbfs_crc32_update(crc, p + half, length - half), want);
+        }
+    }
+
+    free(buffer);
+}
+
+static double seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void bench(
+    const char *name,
+    crc_fn fn,
+    const uint8_t *buffer,
+    size_t size)
+{
+    uint32_t crc = 0;
+    size_t rounds = BENCH_BYTES / size;
+    double start = seconds();
+
+    for (size_t n = 0; n < rounds; n++)
+        crc = fn(crc, buffer, size);
+
+    double elapsed = seconds() - start;
+
+    printf("  %-8s %8zu B  %8.2f GB/s  (%08x)\n",
+           name,
+           size,
+           (double)rounds * (double)size / elapsed / 1e9,
+           (unsigned)crc);
+}
+
+static void bench_paths(void)
+{
+    static const size_t sizes[] = { 256, 4096, 1u << 20 };
+
+    uint8_t *buffer = malloc(1u << 20);
+
+    if (!buffer)
+        return;
+
+    for (size_t n = 0; n < (1u << 20); n++)
+        buffer[n] = (uint8_t)(n * 31 + 7);
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+
+    bool pclmul = __builtin_cpu_supports("pclmul") &&
+                  __builtin_cpu_supports("sse4.1");
+#else
+    bool pclmul = false;
+#endif
+
+    printf("throughput, %u MiB per run; update uses %s\n",
+           BENCH_BYTES >> 20,
+           pclmul ? "PCLMULQDQ" : "slicing-by-8");
+
+    for (size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++)
+    {
+        bench("sliced", nbfs_crc32_sliced, buffer, sizes[n]);
+        bench("update", nbfs_crc32_update, buffer, sizes[n]);
+    }
+
+    free(buffer);
+}
+
+int main(void)
+{
+    check_vectors();
+    check_lengths();
+
+    if (failures)
+    {
+        printf("test_crc32: %d failures\n", failures);
+        return 1;
+    }
+
+    printf("test_crc32: check values OK\n");
+
+    bench_paths();
+
+    return 0;
+}
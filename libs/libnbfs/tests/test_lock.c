@@ -0,0 +1,526 @@
+/*
+ * NeoBench Filesystem Library
+ *
+ * test_lock.c
+ *
+ * Inode stripe locks under nesting and contention
+ *
+ * The checks look at which stripes are busy, from a second thread,
+ * as calls nest: a nested call must lock the stripes of its own
+ * inodes and give them back when it returns. The stress run then
+ * formats a scratch image and has 1 to 16 threads create files in
+ * shared directories, write them and look names up, all through one
+ * context; no call may fail. It prints files per second for each
+ * thread count, and reads every file back by name, before and after
+ * the image is closed and opened again.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libnbfs.h"
+#include "internal/lock.h"
+
+#define STRESS_THREADS     16
+#define STRESS_RUNS        5
+#define STRESS_FILES       400
+#define STRESS_DIRS        4
+#define STRESS_BYTES       12288
+#define STRESS_IMAGE       "512M"
+#define STRESS_INODE_BYTES "16K"
+
+static int failures;
+
+static void check(const char *what, bool ok)
+{
+    if (ok)
+        return;
+
+    printf("FAIL %s\n", what);
+
+    failures++;
+}
+
+/*
+ * Stripes another thread cannot lock for writing.
+ */
+typedef struct
+{
+    nbfs_context_t *ctx;
+    int busy;
+} probe_t;
+
+static void *probe_thread(void *arg)
+{
+    probe_t *probe = arg;
+
+    probe->busy = 0;
+
+    for (int i = 0; i < NBFS_INODE_LOCKS; i++)
+    {
+        pthread_rwlock_t *lock = &probe->ctx->inode_locks[i];
+
+        if (pthread_rwlock_trywrlock(lock) == 0)
+            pthread_rwlock_unlock(lock);
+        else
+            probe->busy++;
+    }
+
+    return NULL;
+}
+
+static int busy_stripes(nbfs_context_t *ctx)
+{
+    probe_t probe = { ctx, 0 };
+    pthread_t thread;
+
+    pthread_create(&thread, NULL, probe_thread, &probe);
+    pthread_join(thread, NULL);
+
+    return probe.busy;
+}
+
+static void check_nesting(nbfs_context_t *ctx)
+{
+    uint64_t outer = 1;
+
+    check("outer lock", nbfs_inode_lock(ctx, &outer, 1, true) == 0);
+    check("outer stripe busy", busy_stripes(ctx) == 1);
+
+    /*
+     * An inode on another stripe: the nested call has to lock it.
+     */
+    uint64_t inner = 2;
+
+    for (;; inner++)
+    {
+        check("nested lock", nbfs_inode_lock(ctx, &inner, 1, false) == 0);
+
+        int busy = busy_stripes(ctx);
+
+        nbfs_inode_unlock(ctx);
+
+        if (busy == 2)
+            break;
+
+        check("nested on the outer stripe", busy == 1);
+    }
+
+    check("nested stripe released", busy_stripes(ctx) == 1);
+
+    /*
+     * Covered by the outer lock, so nothing new.
+     */
+    check("nested on a held stripe",
+          nbfs_inode_lock(ctx, &outer, 1, true) == 0 &&
+          busy_stripes(ctx) == 1);
+
+    nbfs_inode_unlock(ctx);
+    nbfs_inode_unlock(ctx);
+
+    check("all released", busy_stripes(ctx) == 0);
+
+    /*
+     * Larger than a set, and a read lock wanted for writing.
+     */
+    uint64_t many[NBFS_INODE_LOCK_SET + 1] = { 1, 2, 3, 4, 5 };
+
+    check("set too large",
+          nbfs_inode_lock(ctx, many, NBFS_INODE_LOCK_SET + 1, true) != 0 &&
+          busy_stripes(ctx) == 0);
+
+    check("read lock", nbfs_inode_lock(ctx, &outer, 1, false) == 0);
+    check("no upgrade", nbfs_inode_lock(ctx, &outer, 1, true) != 0);
+    check("read stripe still held", busy_stripes(ctx) == 1);
+
+    nbfs_inode_unlock(ctx);
+
+    check("read released", busy_stripes(ctx) == 0);
+
+    /*
+     * A full nest of sets, each on inodes of its own.
+     */
+    int depth = 0;
+
+    for (uint64_t base = 100; depth < 3; base += 10, depth++)
+    {
+        uint64_t set[NBFS_INODE_LOCK_SET];
+
+        for (int i = 0; i < NBFS_INODE_LOCK_SET; i++)
+            set[i] = base + (uint64_t)i;
+
+        if (nbfs_inode_lock(ctx, set, NBFS_INODE_LOCK_SET, true) != 0)
+            break;
+    }
+
+    check("nested sets", depth >= 2);
+
+    while (depth--)
+        nbfs_inode_unlock(ctx);
+
+    check("nested sets released", busy_stripes(ctx) == 0);
+}
+
+/*
+ * Image stress: threads create files in shared directories, write
+ * them and look names up, all through one context. Each run gets
+ * a directory of its own holding STRESS_DIRS shared ones.
+ */
+typedef struct
+{
+    nbfs_context_t *ctx;
+    const uint64_t *dirs;
+    int thread;
+    uint64_t *inodes;
+    int errors;
+} worker_t;
+
+static void file_name(char *name, size_t size, int thread, int i)
+{
+    snprintf(name, size, "f%d-%d", thread, i);
+}
+
+static uint64_t file_length(int thread, int i)
+{
+    return 1 + (uint64_t)((thread * 131 + i * 71) % STRESS_BYTES);
+}
+
+static uint8_t file_byte(int thread, int i, uint64_t at)
+{
+    return (uint8_t)(thread * 31 + i * 7 + at);
+}
+
+static void *stress_thread(void *arg)
+{
+    worker_t *w = arg;
+    uint8_t *data = malloc(STRESS_BYTES);
+
+    if (!data)
+    {
+        w->errors++;
+        return NULL;
+    }
+
+    for (int i = 0; i < STRESS_FILES; i++)
+    {
+        uint64_t dir = w->dirs[(w->thread + i) % STRESS_DIRS];
+        uint64_t length = file_length(w->thread, i);
+        char name[32];
+        uint64_t inode;
+
+        file_name(name, sizeof(name), w->thread, i);
+
+        for (uint64_t at = 0; at < length; at++)
+            data[at] = file_byte(w->thread, i, at);
+
+        if (nbfs_create_file(w->ctx, dir, name) != 0 ||
+            nbfs_lookup(w->ctx, dir, name, &inode) != 0)
+        {
+            w->errors++;
+            continue;
+        }
+
+        w->inodes[i] = inode;
+
+        /*
+         * In two writes, so that the second grows the file.
+         */
+        nbfs_file_t *file = nbfs_file_open(w->ctx, inode);
+        uint64_t half = length / 2;
+
+        if (!file ||
+            nbfs_file_pwrite(file, data, half, 0) != (int64_t)half ||
+            nbfs_file_pwrite(file, data + half, length - half, half) !=
+                (int64_t)(length - half))
+            w->errors++;
+
+        nbfs_file_close(file);
+
+        /*
+         * An earlier name of this thread still leads to its inode.
+         */
+        int earlier = i / 2;
+        uint64_t found;
+
+        file_name(name, sizeof(name), w->thread, earlier);
+
+        if (w->inodes[earlier] &&
+            (nbfs_lookup(w->ctx,
+                         w->dirs[(w->thread + earlier) % STRESS_DIRS],
+                         name,
+                         &found) != 0 ||
+             found != w->inodes[earlier]))
+            w->errors++;
+    }
+
+    free(data);
+
+    return NULL;
+}
+
+/*
+ * Every file a run made, by name: its inode and its bytes.
+ */
+static int verify_run(
+    nbfs_context_t *ctx,
+    const uint64_t *dirs,
+    int threads,
+    uint64_t *const *inodes)
+{
+    uint8_t *data = malloc(STRESS_BYTES);
+    int bad = 0;
+
+    if (!data)
+        return 1;
+
+    for (int t = 0; t < threads; t++)
+    {
+        for (int i = 0; i < STRESS_FILES; i++)
+        {
+            uint64_t length = file_length(t, i);
+            char name[32];
+            uint64_t inode;
+
+            file_name(name, sizeof(name), t, i);
+
+            if (nbfs_lookup(ctx, dirs[(t + i) % STRESS_DIRS], name, &inode) != 0 ||
+                inode != inodes[t][i])
+            {
+                bad++;
+                continue;
+            }
+
+            nbfs_file_t *file = nbfs_file_open(ctx, inode);
+            bool same = file &&
+                nbfs_file_size(file) == length &&
+                nbfs_file_pread(file, data, length, 0) == (int64_t)length;
+
+            for (uint64_t at = 0; same && at < length; at++)
+                same = data[at] == file_byte(t, i, at);
+
+            nbfs_file_close(file);
+
+            if (!same)
+                bad++;
+        }
+    }
+
+    free(data);
+
+    return bad;
+}
+
+static double seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int make_dirs(
+    nbfs_context_t *ctx,
+    uint64_t root,
+    int threads,
+    uint64_t *dirs)
+{
+    char name[32];
+    uint64_t run;
+
+    snprintf(name, sizeof(name), "run%d", threads);
+
+    if (nbfs_create_directory(ctx, root, name) != 0 ||
+        nbfs_lookup(ctx, root, name, &run) != 0)
+        return -1;
+
+    for (int d = 0; d < STRESS_DIRS; d++)
+    {
+        snprintf(name, sizeof(name), "d%d", d);
+
+        if (nbfs_create_directory(ctx, run, name) != 0 ||
+            nbfs_lookup(ctx, run, name, &dirs[d]) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Each run's directories and inodes, to check again once the image
+ * has been closed and opened.
+ */
+static uint64_t run_dirs[STRESS_RUNS][STRESS_DIRS];
+static uint64_t run_inodes[STRESS_RUNS][STRESS_THREADS][STRESS_FILES];
+
+static void stress(const char *path)
+{
+    nbfs_context_t *ctx = nbfs_open(path);
+    uint64_t root;
+
+    if (!ctx || nbfs_lookup_path(ctx, "", &root) != 0)
+    {
+        check("stress: open the image", false);
+        nbfs_close(ctx);
+        return;
+    }
+
+    /*
+     * Locking, not syncing, is what is measured.
+     */
+    nbfs_set_durability(ctx, NBFS_DURABILITY_NONE);
+
+    printf("stress, %d files per thread in %d shared directories\n",
+           STRESS_FILES,
+           STRESS_DIRS);
+
+    int runs = 0;
+
+    for (int threads = 1; threads <= STRESS_THREADS; threads *= 2, runs++)
+    {
+        uint64_t *dirs = run_dirs[runs];
+        uint64_t *inodes[STRESS_THREADS];
+        pthread_t thread[STRESS_THREADS];
+        worker_t work[STRESS_THREADS];
+        int errors = 0;
+
+        if (make_dirs(ctx, root, threads, dirs) != 0)
+        {
+            check("stress: make the directories", false);
+            break;
+        }
+
+        double start = seconds();
+
+        for (int t = 0; t < threads; t++)
+        {
+            inodes[t] = run_inodes[runs][t];
+            work[t] = (worker_t){ ctx, dirs, t, inodes[t], 0 };
+
+            pthread_create(&thread[t], NULL, stress_thread, &work[t]);
+        }
+
+        for (int t = 0; t < threads; t++)
+        {
+            pthread_join(thread[t], NULL);
+            errors += work[t].errors;
+        }
+
+        double elapsed = seconds() - start;
+
+        printf("  %2d threads  %8.0f files/s  %8.0f per thread\n",
+               threads,
+               (double)threads * STRESS_FILES / elapsed,
+               STRESS_FILES / elapsed);
+
+        check("stress: no call failed", errors == 0);
+        check("stress: files read back",
+              verify_run(ctx, dirs, threads, inodes) == 0);
+    }
+
+    check("stress: all released", busy_stripes(ctx) == 0);
+    check("stress: flushed", nbfs_flush(ctx) == 0);
+
+    nbfs_close(ctx);
+
+    /*
+     * And again from the image alone.
+     */
+    ctx = nbfs_open(path);
+
+    int bad = ctx ? 0 : 1;
+
+    for (int r = 0, threads = 1; ctx && r < runs; r++, threads *= 2)
+    {
+        uint64_t *inodes[STRESS_THREADS];
+
+        for (int t = 0; t < threads; t++)
+            inodes[t] = run_inodes[r][t];
+
+        bad += verify_run(ctx, run_dirs[r], threads, inodes);
+    }
+
+    check("stress: files read back after reopening", bad == 0);
+
+    nbfs_close(ctx);
+}
+
+/*
+ * A scratch image, formatted by mkfs.nbfs: $NBFS_MKFS, or the one
+ * built next to this library.
+ */
+static int scratch_image(char *path)
+{
+    int fd = mkstemp(path);
+
+    if (fd < 0)
+        return -1;
+
+    close(fd);
+
+    const char *mkfs = getenv("NBFS_MKFS");
+    char command[512];
+
+    if (!mkfs)
+        mkfs = "../../tools/nbfs/mkfs/build/bin/mkfs.nbfs";
+
+    snprintf(command, sizeof(command),
+             "%s -s %s -i %s %s >/dev/null",
+             mkfs, STRESS_IMAGE, STRESS_INODE_BYTES, path);
+
+    if (system(command) != 0)
+    {
+        unlink(path);
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(void)
+{
+    nbfs_context_t *ctx = nbfs_context_create();
+
+    if (!ctx)
+    {
+        printf("test_lock: no context\n");
+        return 1;
+    }
+
+    /*
+     * A deadlock fails the test rather than hanging it.
+     */
+    alarm(120);
+
+    check_nesting(ctx);
+
+    nbfs_context_destroy(ctx);
+
+    char path[] = "/tmp/nbfs-test-lock-XXXXXX";
+
+    if (scratch_image(path) != 0)
+    {
+        printf("test_lock: cannot format a scratch image\n");
+        return 1;
+    }
+
+    stress(path);
+    unlink(path);
+
+    if (failures)
+    {
+        printf("test_lock: %d failures\n", failures);
+        return 1;
+    }
+
+    printf("test_lock: OK\n");
+
+    return 0;
+}
@@ -1,28 +1,47 @@
+#include <nbfs/endian.h>
 #include <nbfs/inode.h>
+#include <nbfs/nbfs.h>
 #include "disk.h"
-#include <nbfs/layout.h>
-
-#define INODES_PER_BLOCK \
-    (NBFS_BLOCK_SIZE / sizeof(nbfs_inode_t))
+#include "memory.h"
+#include "nbfs.h"
 
+/*
+ * Inodes are packed back to back from the superblock's table start,
+ * inode 1 first, as mkfs and libnbfs lay them out. One can straddle
+ * two table blocks.
+ */
 int nbfs_read_inode(
     uint32_t inode_number,
     nbfs_inode_t *inode)
 {
+    static uint8_t buffer[2 * NBFS_BLOCK_SIZE];
+
+    const nbfs_superblock_t *sb = nbfs_superblock();
+
+    if (inode_number == 0 ||
+        inode_number > sb->total_inodes)
+        return 0;
+
+    uint64_t offset =
+        (uint64_t)(inode_number - 1) *
+        sizeof(nbfs_inode_t);
+
     uint32_t block =
-        NBFS_INODE_TABLE_BLOCK +
-        (inode_number / INODES_PER_BLOCK);
+        (uint32_t)(sb->inode_table_start +
+                   offset / NBFS_BLOCK_SIZE);
+
+    uint32_t within =
+        (uint32_t)(offset % NBFS_BLOCK_SIZE);
 
-    uint8_t buffer[NBFS_BLOCK_SIZE];
+    uint32_t count =
+        within + sizeof(nbfs_inode_t) > NBFS_BLOCK_SIZE ? 2 : 1;
 
-    if (!disk_read_blocks(block, 1, buffer))
+    if (!disk_read_blocks(block, count, buffer))
         return 0;
 
-    nbfs_inode_t *table =
-        (nbfs_inode_t *)buffer;
+    memcpy(inode, buffer + within, sizeof(*inode));
 
-    *inode =
-        table[inode_number % INODES_PER_BLOCK];
+    nbfs_inode_le(inode);
 
     return 1;
 }
@@ -1,5 +1,8 @@
+#include <nbfs/crc32.h>
+#include <nbfs/endian.h>
 #include <nbfs/nbfs.h>
 #include "disk.h"
+#include "memory.h"
 
 static nbfs_superblock_t g_superblock;
 
@@ -8,16 +11,47 @@ const nbfs_superblock_t *nbfs_superblock(void)
     return &g_superblock;
 }
 
-int nbfs_mount(void)
+static int superblock_valid(const nbfs_superblock_t *sb)
 {
-    if (!disk_read_blocks(0, 1, &g_superblock))
+    if (sb->magic != NBFS_MAGIC ||
+        sb->version_major != NBFS_VERSION_MAJOR ||
+        sb->version_minor != NBFS_VERSION_MINOR)
+    {
         return 0;
+    }
 
-    if (g_superblock.version_major != NBFS_VERSION_MAJOR ||
-        g_superblock.version_minor != NBFS_VERSION_MINOR)
+    /*
+     * The loader reads in fixed NBFS_BLOCK_SIZE blocks.
+     */
+    if (sb->block_size != NBFS_BLOCK_SIZE ||
+        sb->inode_table_start == 0)
     {
-        return -1;
+        return 0;
+    }
+
+    if (sb->flags & NBFS_SUPERBLOCK_CHECKSUMS)
+    {
+        nbfs_superblock_t copy = *sb;
+
+        copy.crc32 = 0;
+        nbfs_superblock_le(&copy);
+
+        if (nbfs_crc32_sliced(0, &copy, sizeof(copy)) != sb->crc32)
+            return 0;
     }
 
     return 1;
 }
+
+int nbfs_mount(void)
+{
+    static uint8_t block[NBFS_BLOCK_SIZE];
+
+    if (!disk_read_blocks(NBFS_SUPERBLOCK, 1, block))
+        return 0;
+
+    memcpy(&g_superblock, block, sizeof(g_superblock));
+    nbfs_superblock_le(&g_superblock);
+
+    return superblock_valid(&g_superblock);
+}
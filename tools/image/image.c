@@ -1,22 +1,28 @@
 #include "image.h"
 
-#include <stdio.h>
+#include <fcntl.h>
 #include <stdint.h>
+#include <unistd.h>
 
 #define IMAGE_SIZE (64 * 1024 * 1024)
 
+/*
+ * The image starts out as one hole: ftruncate() sets its size
+ * without writing anything, and blocks take up host space only once
+ * something is written to them.
+ */
 int image_create(const char *filename)
 {
-    FILE *fp = fopen(filename, "wb");
-    if (!fp)
-        return -1;
-
-    uint8_t zero[4096] = {0};
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-    for (size_t i = 0; i < IMAGE_SIZE / sizeof(zero); i++)
-        fwrite(zero, sizeof(zero), 1, fp);
+    if (fd < 0)
+        return -1;
 
-    fclose(fp);
+    if (ftruncate(fd, (off_t)IMAGE_SIZE) != 0)
+    {
+        close(fd);
+        return -1;
+    }
 
-    return 0;
+    return close(fd);
 }
@@ -9,75 +9,77 @@
 #include <stdlib.h>
 
 #include <nbfs/nbfs.h>
+#include <nbfs/directory.h>
+#include <nbfs/endian.h>
 
-
-typedef struct
-{
-    uint64_t inode;
-    uint16_t record_length;
-    uint8_t  name_length;
-    uint8_t  type;
-    char     name[252];
-
-} nbfs_dirent_t;
+#include <libnbfs.h>
 
 
-
-static void dump_root_directory(FILE *fp, uint64_t block)
+static void dump_root_directory(nbfs_context_t *ctx,
+                                uint64_t block,
+                                uint32_t block_size)
 {
-    uint8_t data[NBFS_DEFAULT_BLOCK_SIZE];
+    const uint8_t *data = nbfs_block_get(ctx, block);
 
-    if (fseek(fp,
-              (long)(block * NBFS_DEFAULT_BLOCK_SIZE),
-              SEEK_SET) != 0)
+    if (!data)
     {
-        printf("Failed to seek root directory.\n");
+        printf("Failed to read root directory.\n");
         return;
     }
 
 
-    if (fread(data, 1, sizeof(data), fp) != sizeof(data))
-    {
-        printf("Failed to read root directory.\n");
-        return;
-    }
+    printf("\nRoot directory\n");
+    printf("--------------\n");
 
 
-    nbfs_dirent_t *entries =
-        (nbfs_dirent_t *)data;
+    /*
+     * Follow record_length: each record owns the free space behind
+     * it, and in an indexed directory the index root sits in one
+     * long free record behind "." and "..".
+     */
+    size_t offset = 0;
 
+    while (offset + sizeof(nbfs_directory_entry_t) <= block_size)
+    {
+        nbfs_directory_entry_t entry =
+            *(const nbfs_directory_entry_t *)(data + offset);
 
-    printf("\nRoot directory\n");
-    printf("--------------\n");
+        nbfs_directory_entry_le(&entry);
 
+        if (entry.record_length < sizeof(entry) ||
+            entry.record_length > block_size - offset)
+            break;
 
-    size_t count =
-        NBFS_DEFAULT_BLOCK_SIZE /
-        sizeof(nbfs_dirent_t);
+        const char *name =
+            (const char *)(data + offset + sizeof(entry));
 
+        offset += entry.record_length;
 
-    for (size_t i = 0; i < count; i++)
-    {
-        if (entries[i].inode == 0)
+        if (entry.inode == 0)
             continue;
 
 
-        printf("%s\n", entries[i].name);
+        printf("%.*s\n",
+               entry.name_length,
+               name);
 
         printf("  inode: %llu\n",
                (unsigned long long)
-               entries[i].inode);
+               entry.inode);
 
         printf("  type:  %u\n",
-               entries[i].type);
+               entry.type);
     }
+
+
+    nbfs_block_put(ctx, data);
 }
 
 
 
 int main(int argc, char **argv)
 {
-    FILE *fp;
+    nbfs_context_t *ctx;
 
     nbfs_superblock_t sb;
     nbfs_inode_t root;
@@ -91,11 +93,14 @@ int main(int argc, char **argv)
     }
 
 
-    fp = fopen(argv[1], "rb");
+    /*
+     * Map the image: every block below is read in place.
+     */
+    ctx = nbfs_open_mmap(argv[1]);
 
-    if (!fp)
+    if (!ctx)
     {
-        perror("fopen");
+        perror("nbfs_open_mmap");
         return 1;
     }
 
@@ -106,22 +111,9 @@ int main(int argc, char **argv)
      *
      * Block 1
      */
-    if (fseek(fp,
-              (long)(NBFS_SUPERBLOCK *
-              NBFS_DEFAULT_BLOCK_SIZE),
-              SEEK_SET) != 0)
-    {
-        fclose(fp);
-        return 1;
-    }
-
-
-    if (fread(&sb,
-              sizeof(sb),
-              1,
-              fp) != 1)
+    if (nbfs_read_superblock(ctx, &sb) != 0)
     {
-        fclose(fp);
+        nbfs_close(ctx);
         return 1;
     }
 
@@ -157,12 +149,10 @@ int main(int argc, char **argv)
 
 
     /*
-     * NBFS v1 inode table
-     *
-     * Blocks 4-67
+     * Inode table, where the superblock puts it
      */
     uint64_t inode_offset =
-        ((uint64_t)NBFS_INODE_TABLE *
+        (sb.inode_table_start *
          sb.block_size) +
         ((sb.root_inode - 1) *
          sizeof(nbfs_inode_t));
@@ -174,24 +164,12 @@ int main(int argc, char **argv)
 
 
 
-    if (fseek(fp,
-              (long)inode_offset,
-              SEEK_SET) != 0)
-    {
-        printf("Failed inode seek.\n");
-        fclose(fp);
-        return 1;
-    }
-
-
-
-    if (fread(&root,
-              sizeof(nbfs_inode_t),
-              1,
-              fp) != 1)
+    if (nbfs_read_inode(ctx,
+                        sb.root_inode,
+                        &root) != 0)
     {
         printf("Failed inode read.\n");
-        fclose(fp);
+        nbfs_close(ctx);
         return 1;
     }
 
@@ -223,12 +201,13 @@ int main(int argc, char **argv)
 
     if (root.extents[0].block_count)
     {
-        dump_root_directory(fp,
-                            root.extents[0].start_block);
+        dump_root_directory(ctx,
+                            root.extents[0].start_block,
+                            sb.block_size);
     }
 
 
-    fclose(fp);
+    nbfs_close(ctx);
 
     return 0;
 }
@@ -2,10 +2,26 @@
 #define NBFS_FS_BITMAP_H
 
 #include <stdint.h>
-#include <stdio.h>
 
-uint64_t nbfs_alloc_block(void);
+#include "image.h"
 
-int nbfs_write_block_bitmap(FILE *fp);
+uint64_t nbfs_alloc_block(image_t *image);
+
+/*
+ * count contiguous blocks; UINT64_MAX when the image is full.
+ */
+uint64_t nbfs_alloc_blocks(image_t *image, uint64_t count);
+
+uint64_t nbfs_free_block_count(image_t *image);
+
+/*
+ * Set the first bits bits of the bitmap starting at block start.
+ */
+int nbfs_bitmap_fill(
+    image_t *image,
+    uint64_t start,
+    uint64_t bits);
+
+int nbfs_write_block_bitmap(image_t *image);
 
 #endif
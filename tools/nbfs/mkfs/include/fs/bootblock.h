@@ -1,8 +1,8 @@
 #ifndef NBFS_FS_BOOTBLOCK_H
 #define NBFS_FS_BOOTBLOCK_H
 
-#include <stdio.h>
+#include "image.h"
 
-int nbfs_write_bootblock(FILE *fp);
+int nbfs_write_bootblock(image_t *image);
 
 #endif
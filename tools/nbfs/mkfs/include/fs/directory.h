@@ -1,14 +1,42 @@
 #ifndef NBFS_FS_DIRECTORY_H
 #define NBFS_FS_DIRECTORY_H
 
-#include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include <nbfs/nbfs.h>
 
+#include "image.h"
+
 /*
  * Write the root directory to the supplied data block.
  */
-int nbfs_write_root_directory(FILE *fp, uint64_t block);
+int nbfs_write_root_directory(image_t *image, uint64_t block);
+
+/*
+ * One entry of a directory being written.
+ */
+typedef struct
+{
+    uint64_t inode;
+
+    const char *name;
+
+    uint8_t type;
+
+} nbfs_dir_record_t;
+
+/*
+ * Allocate and write the blocks of directory self, with "." and ".."
+ * followed by records. The directory takes blocks blocks from start.
+ */
+int nbfs_write_directory(
+    image_t *image,
+    uint64_t self,
+    uint64_t parent,
+    const nbfs_dir_record_t *records,
+    size_t count,
+    uint64_t *start,
+    uint64_t *blocks);
 
 #endif /* NBFS_FS_DIRECTORY_H */
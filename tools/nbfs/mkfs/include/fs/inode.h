@@ -6,16 +6,20 @@
 
 #include <nbfs/nbfs.h>
 
-uint64_t nbfs_alloc_inode(void);
+#include "image.h"
+
+uint64_t nbfs_alloc_inode(image_t *image);
+
+uint64_t nbfs_free_inode_count(image_t *image);
 
 int nbfs_write_inode(
-    FILE *fp,
+    image_t *image,
     uint64_t inode_number,
     const nbfs_inode_t *inode
 );
 
-int nbfs_write_inode_bitmap(FILE *fp);
+int nbfs_write_inode_bitmap(image_t *image);
 
-int nbfs_create_root_inode(FILE *fp);
+int nbfs_create_root_inode(image_t *image);
 
 #endif
@@ -0,0 +1,32 @@
+#ifndef NBFS_FS_MANIFEST_H
+#define NBFS_FS_MANIFEST_H
+
+#include <stddef.h>
+
+/*
+ * Access-order manifest
+ *
+ * Image paths in the order boot reads them, one per line, such as a
+ * list recorded from a boot trace. Blank lines and lines starting
+ * with '#' are skipped. nbfs_populate() places the files named here
+ * first, back to back, in this order.
+ */
+typedef struct
+{
+    char **paths;
+
+    size_t count;
+
+} nbfs_manifest_t;
+
+int nbfs_manifest_load(nbfs_manifest_t *manifest, const char *path);
+
+/*
+ * The order used without a manifest: the loader configuration and
+ * kernel, init and what init reads and starts.
+ */
+int nbfs_manifest_default(nbfs_manifest_t *manifest);
+
+void nbfs_manifest_free(nbfs_manifest_t *manifest);
+
+#endif
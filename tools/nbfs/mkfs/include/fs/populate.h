@@ -0,0 +1,18 @@
+#ifndef NBFS_FS_POPULATE_H
+#define NBFS_FS_POPULATE_H
+
+#include "image.h"
+#include "fs/manifest.h"
+
+/*
+ * Copy the host directory tree at source into the image, its top
+ * directory becoming the root. Regular files and directories are
+ * copied; anything else is skipped. The files manifest names are
+ * placed first, in its order; NULL keeps tree order.
+ */
+int nbfs_populate(
+    image_t *image,
+    const char *source,
+    const nbfs_manifest_t *manifest);
+
+#endif
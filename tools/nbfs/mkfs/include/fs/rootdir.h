@@ -1,8 +1,8 @@
 #ifndef NBFS_ROOTDIR_H
 #define NBFS_ROOTDIR_H
 
-#include <stdio.h>
+#include "image.h"
 
-int nbfs_create_root_inode(FILE *fp);
+int nbfs_create_root_inode(image_t *image);
 
 #endif
@@ -1,8 +1,8 @@
 #ifndef MKFS_SUPERBLOCK_H
 #define MKFS_SUPERBLOCK_H
 
-#include <stdio.h>
+#include "image.h"
 
-int nbfs_write_superblock(FILE *fp);
+int nbfs_write_superblock(image_t *image);
 
 #endif
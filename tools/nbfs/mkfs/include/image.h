@@ -1,9 +1,41 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
-#include <stdio.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
-FILE *image_create(const char *path, uint64_t bytes);
+#include "layout.h"
+
+/*
+ * In-memory image
+ *
+ * mkfs builds every block it writes in memory first. image_block()
+ * hands out a zeroed block the first time it is asked for one; the
+ * pointer stays valid until image_close(). image_write() then emits
+ * the blocks in one ascending pass, each run of neighbouring blocks
+ * in one request, and syncs once at the end. Blocks never asked for
+ * are left as holes in the sparse image.
+ *
+ * The image is sized and blocked as layout says; the writers look
+ * their regions up in image_layout().
+ */
+typedef struct image image_t;
+
+image_t *image_create(const char *path, const nbfs_layout_t *layout);
+
+const nbfs_layout_t *image_layout(const image_t *image);
+
+uint8_t *image_block(image_t *image, uint64_t block);
+
+int image_write(image_t *image);
+
+/*
+ * Write file data straight to the image from block onwards, without
+ * keeping it in memory. The buffers add up to whole blocks, and none
+ * of the blocks may also be asked for through image_block().
+ */
+int image_write_data(image_t *image, uint64_t block, const struct iovec *iov, int count);
+
+void image_close(image_t *image);
 
 #endif
@@ -1,6 +1,8 @@
 #ifndef NBFS_LAYOUT_H
 #define NBFS_LAYOUT_H
 
+#include <stdint.h>
+
 #include <nbfs/nbfs.h>
 
 /*
@@ -22,4 +24,61 @@
 
 #define NBFS_DATA_BLOCK             NBFS_DATA_START
 
+/*
+ * Volume geometry
+ *
+ * The defaults give the v1 layout above: 128 MiB of 4 KiB blocks,
+ * one inode per 128 KiB and a 1 MiB journal. The inode table keeps
+ * NBFS_INODE_SLOT bytes per inode, as v1 did.
+ */
+#define NBFS_IMAGE_SIZE_DEFAULT      (128ULL * 1024ULL * 1024ULL)
+#define NBFS_BYTES_PER_INODE_DEFAULT (128ULL * 1024ULL)
+#define NBFS_JOURNAL_SIZE_DEFAULT    (1024ULL * 1024ULL)
+
+#define NBFS_INODE_SLOT 256
+
+/*
+ * libnbfs ignores a journal shorter than this.
+ */
+#define NBFS_JOURNAL_MIN_BLOCKS 4
+
+/*
+ * Regions in block order: boot block, superblock, block bitmap,
+ * inode bitmap, inode table, journal, data.
+ */
+typedef struct
+{
+    uint32_t block_size;
+
+    uint64_t total_blocks;
+    uint64_t total_inodes;
+
+    uint64_t block_bitmap_start;
+    uint64_t block_bitmap_blocks;
+
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+
+    uint64_t journal_start;
+    uint64_t journal_blocks;
+
+    uint64_t data_start;
+} nbfs_layout_t;
+
+/*
+ * Lay out a volume of bytes. A journal_bytes of 0 leaves the volume
+ * without a journal. Returns -1 when the block size is not one NBFS
+ * supports, the journal is too short to use, or the volume is too
+ * small for its metadata.
+ */
+int nbfs_layout_compute(
+    nbfs_layout_t *layout,
+    uint64_t bytes,
+    uint32_t block_size,
+    uint64_t bytes_per_inode,
+    uint64_t journal_bytes);
+
 #endif /* NBFS_LAYOUT_H */
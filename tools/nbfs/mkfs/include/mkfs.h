@@ -1,7 +1,19 @@
 #ifndef MKFS_H
 #define MKFS_H
 
-int mkfs_create(const char *image);
-int nbfs_create_root_inode(FILE *fp);
+#include "image.h"
+#include "layout.h"
+
+/*
+ * Create the image at path; with source, populated from that host
+ * directory, files in the order of the manifest at manifest or, when
+ * that is NULL, the default boot order.
+ */
+int mkfs_create(
+    const char *path,
+    const nbfs_layout_t *layout,
+    const char *source,
+    const char *manifest);
+int nbfs_create_root_inode(image_t *image);
 
 #endif
@@ -9,62 +9,104 @@
 
 #include <nbfs/nbfs.h>
 
+#include "image.h"
 #include "layout.h"
 #include "fs/bitmap.h"
 
-static uint8_t bitmap[NBFS_DEFAULT_BLOCK_SIZE];
+/*
+ * Blocks are handed out in order from the start of the data area,
+ * so everything below next_block is in use. 0 until the first
+ * allocation.
+ */
+static uint64_t next_block;
 
-static uint64_t next_block = NBFS_DATA_START;
+static void next_block_init(const nbfs_layout_t *layout)
+{
+    if (next_block == 0)
+        next_block = layout->data_start;
+}
 
-uint64_t nbfs_alloc_block(void)
+uint64_t nbfs_alloc_block(image_t *image)
 {
-    uint64_t block = next_block++;
+    return nbfs_alloc_blocks(image, 1);
+}
 
-    if (block >=
-        ((128ULL * 1024ULL * 1024ULL) /
-         NBFS_DEFAULT_BLOCK_SIZE))
-    {
+uint64_t nbfs_alloc_blocks(image_t *image, uint64_t count)
+{
+    const nbfs_layout_t *layout = image_layout(image);
+
+    next_block_init(layout);
+
+    if (count > layout->total_blocks - next_block)
         return UINT64_MAX;
-    }
 
-    bitmap[block / 8] |=
-        (uint8_t)(1u << (block % 8));
+    uint64_t block = next_block;
+
+    next_block += count;
 
     return block;
 }
 
-int nbfs_write_block_bitmap(FILE *fp)
+uint64_t nbfs_free_block_count(image_t *image)
 {
-    /*
-     * Reserve every block before the data area:
-     *
-     * 0-323 = boot, superblock, bitmaps, inode table, journal.
-     */
-    for (uint64_t i = 0; i < NBFS_DATA_START; i++)
-    {
-        bitmap[i / 8] |=
-            (uint8_t)(1u << (i % 8));
-    }
+    const nbfs_layout_t *layout = image_layout(image);
 
-    if (fseek(
-            fp,
-            (long)((uint64_t)NBFS_BLOCK_BITMAP *
-                   NBFS_DEFAULT_BLOCK_SIZE),
-            SEEK_SET) != 0)
-    {
-        return -1;
-    }
+    next_block_init(layout);
+
+    return layout->total_blocks - next_block;
+}
+
+int nbfs_bitmap_fill(
+    image_t *image,
+    uint64_t start,
+    uint64_t bits)
+{
+    uint64_t bits_per_block =
+        (uint64_t)image_layout(image)->block_size * 8;
 
-    if (fwrite(
-            bitmap,
-            sizeof(bitmap),
-            1,
-            fp) != 1)
+    for (uint64_t bit = 0; bit < bits; )
     {
-        return -1;
-    }
+        uint8_t *block =
+            image_block(image, start + bit / bits_per_block);
+
+        if (!block)
+            return -1;
+
+        /*
+         * Whole bytes first, then the bits of a last partial one.
+         */
+        uint64_t offset = bit % bits_per_block;
+        uint64_t count = bits - bit;
+
+        if (count > bits_per_block - offset)
+            count = bits_per_block - offset;
+
+        uint64_t bytes = count / 8;
+
+        memset(block + offset / 8, 0xff, (size_t)bytes);
 
-    fflush(fp);
+        for (uint64_t i = bytes * 8; i < count; i++)
+            block[(offset + i) / 8] |=
+                (uint8_t)(1u << ((offset + i) % 8));
+
+        bit += count;
+    }
 
     return 0;
 }
+
+int nbfs_write_block_bitmap(image_t *image)
+{
+    const nbfs_layout_t *layout = image_layout(image);
+
+    next_block_init(layout);
+
+    /*
+     * Every block before the data area is reserved for the boot
+     * block, superblock, bitmaps, inode table and journal; the
+     * allocated data blocks follow on directly.
+     */
+    return nbfs_bitmap_fill(image,
+                            layout->block_bitmap_start,
+                            next_block);
+}
@@ -6,24 +6,18 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "image.h"
 #include "layout.h"
 #include "fs/bootblock.h"
 
-int nbfs_write_bootblock(FILE *fp)
+int nbfs_write_bootblock(image_t *image)
 {
-    uint8_t block[4096];
+    uint8_t *block = image_block(image, NBFS_BOOT_BLOCK);
 
-    memset(block, 0, sizeof(block));
-
-    memcpy(block, "NBBOOT", 6);
-
-    if (fseek(fp, 0, SEEK_SET) != 0)
+    if (!block)
         return -1;
 
-    if (fwrite(block, sizeof(block), 1, fp) != 1)
-        return -1;
-
-    fflush(fp);
+    memcpy(block, "NBBOOT", 6);
 
     return 0;
 }
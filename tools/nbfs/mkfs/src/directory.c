@@ -7,76 +7,74 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <nbfs/nbfs.h>
+#include <nbfs/directory.h>
+#include <nbfs/endian.h>
 
+#include "image.h"
 #include "layout.h"
+#include "fs/bitmap.h"
 #include "fs/directory.h"
 
 /*
- * Fixed-size directory entry.
- *
- * The first 12 bytes match the NBFS on-disk directory-entry
- * header:
- *
- *   uint64_t inode
- *   uint16_t record_length
- *   uint8_t  name_length
- *   uint8_t  type
- *
- * The remaining bytes contain the filename.
+ * "." and "..", ahead of the index root in block 0.
  */
-typedef struct
-{
-    uint64_t inode;
-    uint16_t record_length;
-    uint8_t  name_length;
-    uint8_t  type;
-    char     name[252];
-
-} nbfs_dirent_t;
+#define DOT_SIZE    NBFS_DIRENT_RECORD_SIZE(1)
+#define DOTDOT_SIZE NBFS_DIRENT_RECORD_SIZE(2)
 
+#define ROOT_OFFSET (DOT_SIZE + DOTDOT_SIZE)
 
 /*
- * Create one directory entry.
+ * Write one directory record at offset.
+ *
+ * The record is the NBFS directory-entry header followed by
+ * the name, padded to NBFS_DIRENT_ALIGN. record_length also
+ * covers any free space behind it, up to the next record or
+ * the end of the block.
  */
-static void create_entry(
-    nbfs_dirent_t *entry,
+static uint32_t create_entry(
+    uint8_t *data,
+    uint32_t offset,
+    uint32_t record_length,
     uint64_t inode,
-    const char *name
+    const char *name,
+    uint8_t type
 )
 {
+    nbfs_directory_entry_t *entry;
+
     size_t length;
 
-    memset(entry, 0, sizeof(*entry));
 
-    entry->inode = inode;
+    entry =
+        (nbfs_directory_entry_t *)(data + offset);
 
     length = strlen(name);
 
-    if (length > sizeof(entry->name) - 1)
-        length = sizeof(entry->name) - 1;
+    if (length > NBFS_DIRENT_NAME_MAX)
+        length = NBFS_DIRENT_NAME_MAX;
 
-    entry->name_length = (uint8_t)length;
 
-    /*
-     * NBFS directory type 2 = directory.
-     */
-    entry->type = 2;
+    entry->inode = nbfs_le64(inode);
 
-    /*
-     * Every entry currently occupies the complete
-     * fixed-size directory record.
-     */
     entry->record_length =
-        (uint16_t)sizeof(nbfs_dirent_t);
+        nbfs_le16((uint16_t)record_length);
+
+    entry->name_length = (uint8_t)length;
+
+    entry->type = type;
+
 
     memcpy(
-        entry->name,
+        data + offset + sizeof(*entry),
         name,
         length
     );
+
+    return offset + record_length;
 }
 
 
@@ -85,32 +83,35 @@ static void create_entry(
  * by the filesystem allocator.
  */
 int nbfs_write_root_directory(
-    FILE *fp,
+    image_t *image,
     uint64_t block
 )
 {
-    uint8_t data[NBFS_DEFAULT_BLOCK_SIZE];
+    const nbfs_layout_t *layout = image_layout(image);
 
-    nbfs_dirent_t *entries;
+    uint8_t *data;
 
-    uint64_t offset;
+    uint32_t used;
 
 
     /*
      * A directory block must be a normal data block.
      */
-    if (block < NBFS_DATA_START)
+    if (block < layout->data_start)
         return -1;
 
 
     /*
-     * Clear the complete 4 KiB directory block.
+     * The complete directory block, zeroed.
      */
-    memset(
-        data,
-        0,
-        sizeof(data)
-    );
+    data =
+        image_block(
+            image,
+            block
+        );
+
+    if (!data)
+        return -1;
 
 
     /*
@@ -118,58 +119,421 @@ int nbfs_write_root_directory(
      *
      *   .
      *   ..
+     *
+     * ".." owns the rest of the block as free space.
      */
-    entries =
-        (nbfs_dirent_t *)data;
+    used =
+        create_entry(
+            data,
+            0,
+            (uint32_t)NBFS_DIRENT_RECORD_SIZE(1),
+            1,
+            ".",
+            NBFS_DIRENT_DIRECTORY
+        );
 
 
     create_entry(
-        &entries[0],
+        data,
+        used,
+        layout->block_size - used,
         1,
-        "."
+        "..",
+        NBFS_DIRENT_DIRECTORY
     );
 
+    return 0;
+}
 
-    create_entry(
-        &entries[1],
-        1,
-        ".."
-    );
 
+typedef struct
+{
+    uint32_t hash;
+
+    uint32_t size;
+
+    const nbfs_dir_record_t *record;
+
+} hashed_t;
+
+static int compare_hashed(const void *a, const void *b)
+{
+    uint32_t left = ((const hashed_t *)a)->hash;
+    uint32_t right = ((const hashed_t *)b)->hash;
+
+    return (left > right) - (left < right);
+}
+
+/*
+ * Entries an index block holds; libnbfs checks the same figure.
+ */
+static uint16_t index_limit(uint32_t block_size, int root)
+{
+    uint32_t offset = root ? ROOT_OFFSET : 0;
+
+    return (uint16_t)((block_size - offset -
+                       sizeof(nbfs_directory_entry_t) -
+                       sizeof(nbfs_dir_index_t)) /
+                      sizeof(nbfs_dir_index_entry_t));
+}
+
+/*
+ * One free record from offset to the end of the block, holding an
+ * index.
+ */
+static nbfs_dir_index_t *index_init(
+    uint8_t *data,
+    uint32_t offset,
+    uint32_t block_size,
+    int root
+)
+{
+    nbfs_directory_entry_t *record =
+        (nbfs_directory_entry_t *)(data + offset);
+
+    record->record_length = nbfs_le16((uint16_t)(block_size - offset));
+
+    nbfs_dir_index_t *index = (nbfs_dir_index_t *)
+        (data + offset + sizeof(*record));
+
+    index->magic = nbfs_le32(NBFS_DIR_INDEX_MAGIC);
+    index->hash_version = NBFS_DIR_HASH_FNV1A;
+    index->limit = nbfs_le16(index_limit(block_size, root));
+
+    return index;
+}
+
+/*
+ * Copy count index entries into a block, in disk byte order.
+ */
+static void store_entries(
+    nbfs_dir_index_entry_t *slots,
+    const nbfs_dir_index_entry_t *entries,
+    size_t count
+)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        slots[i] = entries[i];
+        nbfs_dir_index_entry_le(&slots[i]);
+    }
+}
+
+/*
+ * Records laid out from the start of the block, the last one owning
+ * the free space behind it.
+ */
+static void fill_block(
+    uint8_t *data,
+    uint32_t block_size,
+    const hashed_t *records,
+    size_t count
+)
+{
+    uint32_t offset = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t length = i + 1 < count
+            ? records[i].size
+            : block_size - offset;
+
+        offset = create_entry(data,
+                              offset,
+                              length,
+                              records[i].record->inode,
+                              records[i].record->name,
+                              records[i].record->type);
+    }
+}
+
+static int write_linear(
+    image_t *image,
+    uint64_t self,
+    uint64_t parent,
+    const nbfs_dir_record_t *records,
+    size_t count,
+    uint64_t *start,
+    uint64_t *blocks
+)
+{
+    uint32_t block_size = image_layout(image)->block_size;
+
+    uint64_t block = nbfs_alloc_blocks(image, 1);
+
+    if (block == UINT64_MAX)
+        return -1;
+
+    uint8_t *data = image_block(image, block);
+
+    if (!data)
+        return -1;
+
+    uint32_t used = create_entry(data, 0, DOT_SIZE, self, ".",
+                                 NBFS_DIRENT_DIRECTORY);
+
+    uint32_t length = count
+        ? DOTDOT_SIZE
+        : block_size - used;
+
+    used = create_entry(data, used, length, parent, "..",
+                        NBFS_DIRENT_DIRECTORY);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const nbfs_dir_record_t *record = &records[i];
+
+        length = i + 1 < count
+            ? (uint32_t)NBFS_DIRENT_RECORD_SIZE(strlen(record->name))
+            : block_size - used;
+
+        used = create_entry(data, used, length,
+                            record->inode, record->name, record->type);
+    }
+
+    *start = block;
+    *blocks = 1;
+
+    return 0;
+}
+
+/*
+ * A directory that outgrows one block is written indexed, the way
+ * libnbfs converts one: records sorted by hash fill blocks 1 onwards
+ * without dividing a hash, and the index over them starts in block 0
+ * behind "." and "..". Index nodes, if the root cannot hold every
+ * block, follow the records.
+ */
+static int write_indexed(
+    image_t *image,
+    uint64_t self,
+    uint64_t parent,
+    const nbfs_dir_record_t *records,
+    size_t count,
+    uint64_t *start,
+    uint64_t *blocks
+)
+{
+    uint32_t block_size = image_layout(image)->block_size;
+
+    hashed_t *all = malloc(count * sizeof(*all));
+    size_t *starts = malloc((count + 1) * sizeof(*starts));
+    nbfs_dir_index_entry_t *entries =
+        malloc(count * sizeof(*entries));
+
+    int result = -1;
+
+    if (!all || !starts || !entries)
+        goto out;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t length = strlen(records[i].name);
+
+        all[i].hash = nbfs_dir_hash(records[i].name, length);
+        all[i].size = (uint32_t)NBFS_DIRENT_RECORD_SIZE(length);
+        all[i].record = &records[i];
+    }
+
+    qsort(all, count, sizeof(*all), compare_hashed);
+
+    size_t leaves = 0;
+
+    for (size_t first = 0; first < count; )
+    {
+        size_t end = first;
+        uint32_t bytes = 0;
+
+        while (end < count)
+        {
+            if (bytes + all[end].size > block_size)
+            {
+                /*
+                 * Names with equal hashes must share a block; end
+                 * the block in front of them.
+                 */
+                size_t back = end;
+
+                while (back > first &&
+                       all[back - 1].hash == all[end].hash)
+                    back--;
+
+                if (back == first)
+                    goto out;
+
+                end = back;
+
+                break;
+            }
+
+            bytes += all[end].size;
+            end++;
+        }
+
+        starts[leaves] = first;
+        entries[leaves].hash = all[first].hash;
+        entries[leaves].block = (uint32_t)(leaves + 1);
+        leaves++;
+
+        first = end;
+    }
+
+    starts[leaves] = count;
 
     /*
-     * Convert filesystem block number to byte offset.
+     * Group the entries into nodes until the root can hold them.
      */
-    offset =
-        block *
-        (uint64_t)NBFS_DEFAULT_BLOCK_SIZE;
+    uint16_t node_limit = index_limit(block_size, 0);
+    uint16_t root_limit = index_limit(block_size, 1);
+
+    uint64_t total = 1 + leaves;
+    size_t level_count = leaves;
+    uint8_t depth = 0;
+
+    nbfs_dir_index_entry_t *levels[NBFS_DIR_INDEX_DEPTH];
+    size_t level_counts[NBFS_DIR_INDEX_DEPTH];
 
+    levels[0] = entries;
+    level_counts[0] = leaves;
 
-    if (fseek(
-            fp,
-            (long)offset,
-            SEEK_SET
-        ) != 0)
+    while (level_count > root_limit)
     {
-        return -1;
+        if (depth + 1 >= NBFS_DIR_INDEX_DEPTH)
+            goto free_levels;
+
+        size_t nodes = (level_count + node_limit - 1) / node_limit;
+        nbfs_dir_index_entry_t *upper =
+            malloc(nodes * sizeof(*upper));
+
+        if (!upper)
+            goto free_levels;
+
+        for (size_t n = 0; n < nodes; n++)
+        {
+            upper[n].hash = levels[depth][n * node_limit].hash;
+            upper[n].block = (uint32_t)(total + n);
+        }
+
+        total += nodes;
+        depth++;
+
+        levels[depth] = upper;
+        level_counts[depth] = nodes;
+        level_count = nodes;
     }
 
+    uint64_t first_block = nbfs_alloc_blocks(image, total);
+
+    if (first_block == UINT64_MAX)
+        goto free_levels;
+
+    for (size_t i = 0; i < leaves; i++)
+    {
+        uint8_t *data = image_block(image, first_block + 1 + i);
+
+        if (!data)
+            goto free_levels;
+
+        fill_block(data, block_size,
+                   all + starts[i], starts[i + 1] - starts[i]);
+    }
 
     /*
-     * Write exactly one filesystem block.
+     * Nodes of each level, below the root, in the blocks the level
+     * above points at.
      */
-    if (fwrite(
-            data,
-            sizeof(data),
-            1,
-            fp
-        ) != 1)
+    for (uint8_t level = 0; level < depth; level++)
     {
-        return -1;
+        const nbfs_dir_index_entry_t *below = levels[level];
+        const nbfs_dir_index_entry_t *above = levels[level + 1];
+
+        for (size_t n = 0; n < level_counts[level + 1]; n++)
+        {
+            uint8_t *data = image_block(image,
+                                        first_block + above[n].block);
+
+            if (!data)
+                goto free_levels;
+
+            nbfs_dir_index_t *index =
+                index_init(data, 0, block_size, 0);
+
+            size_t from = n * node_limit;
+            size_t take = level_counts[level] - from;
+
+            if (take > node_limit)
+                take = node_limit;
+
+            index->count = nbfs_le16((uint16_t)take);
+
+            store_entries((nbfs_dir_index_entry_t *)(index + 1),
+                          below + from,
+                          take);
+        }
     }
 
+    uint8_t *data = image_block(image, first_block);
 
-    fflush(fp);
+    if (!data)
+        goto free_levels;
 
-    return 0;
+    create_entry(data, 0, DOT_SIZE, self, ".", NBFS_DIRENT_DIRECTORY);
+    create_entry(data, DOT_SIZE, DOTDOT_SIZE, parent, "..",
+                 NBFS_DIRENT_DIRECTORY);
+
+    nbfs_dir_index_t *root =
+        index_init(data, ROOT_OFFSET, block_size, 1);
+
+    nbfs_dir_index_entry_t *slots = (nbfs_dir_index_entry_t *)(root + 1);
+
+    store_entries(slots, levels[depth], level_count);
+
+    /*
+     * Entry 0 covers everything below entry 1.
+     */
+    slots[0].hash = 0;
+
+    root->depth = depth;
+    root->count = nbfs_le16((uint16_t)level_count);
+
+    *start = first_block;
+    *blocks = total;
+
+    result = 0;
+
+free_levels:
+    for (uint8_t level = 1; level <= depth; level++)
+        free(levels[level]);
+
+out:
+    free(entries);
+    free(starts);
+    free(all);
+
+    return result;
+}
+
+
+int nbfs_write_directory(
+    image_t *image,
+    uint64_t self,
+    uint64_t parent,
+    const nbfs_dir_record_t *records,
+    size_t count,
+    uint64_t *start,
+    uint64_t *blocks
+)
+{
+    uint32_t block_size = image_layout(image)->block_size;
+    uint64_t bytes = ROOT_OFFSET;
+
+    for (size_t i = 0; i < count; i++)
+        bytes += NBFS_DIRENT_RECORD_SIZE(strlen(records[i].name));
+
+    if (bytes <= block_size)
+        return write_linear(image, self, parent,
+                            records, count, start, blocks);
+
+    return write_indexed(image, self, parent,
+                         records, count, start, blocks);
 }
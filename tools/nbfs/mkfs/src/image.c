@@ -1,16 +1,186 @@
-#include <stdio.h>
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <nbfs/nbfs.h>
+
+#include "image.h"
+
+/*
+ * Most buffers passed to one pwritev().
+ */
+#define IMAGE_IOV_BATCH 256
+
+struct image
+{
+    int fd;
+
+    nbfs_layout_t layout;
+
+    uint64_t blocks;
+
+    /*
+     * One pointer per block up to the highest block asked for; NULL
+     * for blocks that stay holes.
+     */
+    uint8_t **block;
+    uint64_t capacity;
+};
+
+/*
+ * The image is created sparse: ftruncate() sets its size without
+ * writing, and only the blocks mkfs writes take up host space.
+ */
+image_t *image_create(const char *path,const nbfs_layout_t *layout)
+{
+    image_t *image=calloc(1,sizeof(*image));
+
+    if(!image)
+        return NULL;
+
+    image->fd=open(path,O_RDWR|O_CREAT|O_TRUNC,0644);
+
+    if(image->fd<0)
+    {
+        free(image);
+        return NULL;
+    }
+
+    image->layout=*layout;
+    image->blocks=layout->total_blocks;
+
+    if(ftruncate(image->fd,(off_t)(image->blocks*layout->block_size))!=0)
+    {
+        image_close(image);
+        return NULL;
+    }
 
-FILE *image_create(const char *path,uint64_t bytes)
+    return image;
+}
+
+const nbfs_layout_t *image_layout(const image_t *image)
 {
-    FILE *fp=fopen(path,"wb+");
+    return &image->layout;
+}
 
-    if(!fp)
+uint8_t *image_block(image_t *image,uint64_t block)
+{
+    if(block>=image->blocks)
         return NULL;
 
-    fseek(fp,bytes-1,SEEK_SET);
-    fputc(0,fp);
-    rewind(fp);
+    if(block>=image->capacity)
+    {
+        uint64_t capacity=image->capacity?image->capacity:image->layout.data_start+1;
+
+        while(capacity<=block)
+            capacity*=2;
+
+        if(capacity>image->blocks)
+            capacity=image->blocks;
+
+        uint8_t **grown=realloc(image->block,capacity*sizeof(*grown));
+
+        if(!grown)
+            return NULL;
+
+        for(uint64_t i=image->capacity;i<capacity;i++)
+            grown[i]=NULL;
+
+        image->block=grown;
+        image->capacity=capacity;
+    }
+
+    if(!image->block[block])
+        image->block[block]=calloc(1,image->layout.block_size);
+
+    return image->block[block];
+}
+
+static int write_run(image_t *image,uint64_t first,uint64_t count)
+{
+    struct iovec iov[IMAGE_IOV_BATCH];
+
+    while(count>0)
+    {
+        int n=0;
+
+        while(n<IMAGE_IOV_BATCH&&(uint64_t)n<count)
+        {
+            iov[n].iov_base=image->block[first+n];
+            iov[n].iov_len=image->layout.block_size;
+            n++;
+        }
+
+        ssize_t length=(ssize_t)n*image->layout.block_size;
+        off_t offset=(off_t)(first*image->layout.block_size);
+
+        /*
+         * Regular files take a whole pwritev() or fail; a short one
+         * means the disk is full.
+         */
+        if(pwritev(image->fd,iov,n,offset)!=length)
+            return -1;
+
+        first+=(uint64_t)n;
+        count-=(uint64_t)n;
+    }
+
+    return 0;
+}
+
+int image_write_data(image_t *image,uint64_t block,const struct iovec *iov,int count)
+{
+    ssize_t length=0;
+
+    for(int i=0;i<count;i++)
+        length+=(ssize_t)iov[i].iov_len;
+
+    off_t offset=(off_t)(block*image->layout.block_size);
+
+    if(pwritev(image->fd,iov,count,offset)!=length)
+        return -1;
+
+    return 0;
+}
+
+int image_write(image_t *image)
+{
+    uint64_t block=0;
+
+    while(block<image->capacity)
+    {
+        if(!image->block[block])
+        {
+            block++;
+            continue;
+        }
+
+        uint64_t first=block;
+
+        while(block<image->capacity&&image->block[block])
+            block++;
+
+        if(write_run(image,first,block-first)!=0)
+            return -1;
+    }
+
+    return fsync(image->fd)==0?0:-1;
+}
+
+void image_close(image_t *image)
+{
+    if(!image)
+        return;
+
+    for(uint64_t i=0;i<image->capacity;i++)
+        free(image->block[i]);
+
+    free(image->block);
 
-    return fp;
+    close(image->fd);
+    free(image);
 }
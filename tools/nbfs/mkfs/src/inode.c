@@ -7,86 +7,96 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <nbfs/crc32.h>
+#include <nbfs/endian.h>
 #include <nbfs/nbfs.h>
 
+#include "image.h"
 #include "layout.h"
+#include "fs/bitmap.h"
 #include "fs/inode.h"
 
-static uint8_t inode_bitmap[NBFS_DEFAULT_BLOCK_SIZE];
-
+/*
+ * Inodes are handed out in order; inode 0 is reserved/invalid and
+ * inode 1 is the root.
+ */
 static uint64_t next_inode = 1;
 
-uint64_t nbfs_alloc_inode(void)
+uint64_t nbfs_alloc_inode(image_t *image)
 {
-    uint64_t inode = next_inode++;
-
-    if (inode >= 1024)
+    if (next_inode >= image_layout(image)->total_inodes)
         return UINT64_MAX;
 
-    inode_bitmap[inode / 8] |=
-        (uint8_t)(1u << (inode % 8));
+    return next_inode++;
+}
 
-    return inode;
+uint64_t nbfs_free_inode_count(image_t *image)
+{
+    return image_layout(image)->total_inodes - next_inode;
 }
 
-int nbfs_write_inode_bitmap(FILE *fp)
+int nbfs_write_inode_bitmap(image_t *image)
 {
     /*
-     * Inode zero is reserved/invalid.
-     * Root inode is inode 1.
+     * Inode zero and every allocated inode.
      */
-    inode_bitmap[0] |= 1u;
-
-    if (fseek(
-            fp,
-            (long)((uint64_t)NBFS_INODE_BITMAP *
-                   NBFS_DEFAULT_BLOCK_SIZE),
-            SEEK_SET) != 0)
-    {
-        return -1;
-    }
-
-    if (fwrite(
-            inode_bitmap,
-            sizeof(inode_bitmap),
-            1,
-            fp) != 1)
-    {
-        return -1;
-    }
-
-    fflush(fp);
-
-    return 0;
+    return nbfs_bitmap_fill(image,
+                            image_layout(image)->inode_bitmap_start,
+                            next_inode);
 }
 
 int nbfs_write_inode(
-    FILE *fp,
+    image_t *image,
     uint64_t inode_number,
     const nbfs_inode_t *inode)
 {
-    if (inode_number == 0 || inode_number > 1024)
+    const nbfs_layout_t *layout = image_layout(image);
+
+    if (inode_number == 0 || inode_number > layout->total_inodes)
         return -1;
 
     uint64_t offset =
-        ((uint64_t)NBFS_INODE_TABLE *
-         NBFS_DEFAULT_BLOCK_SIZE) +
+        (layout->inode_table_start *
+         layout->block_size) +
         ((inode_number - 1) *
          sizeof(nbfs_inode_t));
 
-    if (fseek(fp, (long)offset, SEEK_SET) != 0)
-        return -1;
+    /*
+     * The superblock announces checksums for every inode.
+     */
+    nbfs_inode_t copy = *inode;
+
+    nbfs_inode_le(&copy);
+
+    copy.crc32 = 0;
+    copy.crc32 = nbfs_le32(nbfs_crc32_sliced(0, &copy, sizeof(copy)));
+
+    /*
+     * Inodes are packed, so one may straddle two table blocks.
+     */
+    const uint8_t *from = (const uint8_t *)&copy;
+    size_t left = sizeof(copy);
 
-    if (fwrite(
-            inode,
-            sizeof(nbfs_inode_t),
-            1,
-            fp) != 1)
+    while (left > 0)
     {
-        return -1;
-    }
+        uint8_t *block = image_block(image,
+                                     offset / layout->block_size);
+
+        if (!block)
+            return -1;
 
-    fflush(fp);
+        size_t at = (size_t)(offset % layout->block_size);
+        size_t length = layout->block_size - at;
+
+        if (length > left)
+            length = left;
+
+        memcpy(block + at, from, length);
+
+        from += length;
+        offset += length;
+        left -= length;
+    }
 
     return 0;
 }
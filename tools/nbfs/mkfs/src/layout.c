@@ -1,7 +1,87 @@
 /*
  * layout.c
  * NeoBench mkfs.nbfs
+ *
+ * Volume geometry
  */
 
-#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 
+#include <nbfs/nbfs.h>
+
+#include "layout.h"
+
+static uint64_t blocks_for(uint64_t bytes, uint32_t block_size)
+{
+    return (bytes + block_size - 1) / block_size;
+}
+
+int nbfs_layout_compute(
+    nbfs_layout_t *layout,
+    uint64_t bytes,
+    uint32_t block_size,
+    uint64_t bytes_per_inode,
+    uint64_t journal_bytes)
+{
+    if (block_size < NBFS_BLOCK_SIZE_1K ||
+        block_size > NBFS_BLOCK_SIZE_16K ||
+        (block_size & (block_size - 1)) != 0)
+        return -1;
+
+    if (bytes_per_inode < block_size)
+        return -1;
+
+    memset(layout, 0, sizeof(*layout));
+
+    uint64_t bits_per_block = (uint64_t)block_size * 8;
+    uint64_t inodes_per_block = block_size / NBFS_INODE_SLOT;
+
+    layout->block_size = block_size;
+    layout->total_blocks = bytes / block_size;
+
+    /*
+     * Round the inode count up to fill the last table block.
+     */
+    uint64_t inodes = bytes / bytes_per_inode;
+
+    if (inodes < inodes_per_block)
+        inodes = inodes_per_block;
+
+    layout->total_inodes =
+        blocks_for(inodes, (uint32_t)inodes_per_block) *
+        inodes_per_block;
+
+    layout->block_bitmap_start = NBFS_SUPERBLOCK + 1;
+    layout->block_bitmap_blocks =
+        blocks_for(layout->total_blocks, (uint32_t)bits_per_block);
+
+    layout->inode_bitmap_start =
+        layout->block_bitmap_start + layout->block_bitmap_blocks;
+    layout->inode_bitmap_blocks =
+        blocks_for(layout->total_inodes, (uint32_t)bits_per_block);
+
+    layout->inode_table_start =
+        layout->inode_bitmap_start + layout->inode_bitmap_blocks;
+    layout->inode_table_blocks =
+        layout->total_inodes / inodes_per_block;
+
+    layout->journal_start =
+        layout->inode_table_start + layout->inode_table_blocks;
+    layout->journal_blocks = blocks_for(journal_bytes, block_size);
+
+    if (layout->journal_blocks != 0 &&
+        layout->journal_blocks < NBFS_JOURNAL_MIN_BLOCKS)
+        return -1;
+
+    layout->data_start =
+        layout->journal_start + layout->journal_blocks;
+
+    /*
+     * The root directory needs one data block.
+     */
+    if (layout->data_start >= layout->total_blocks)
+        return -1;
+
+    return 0;
+}
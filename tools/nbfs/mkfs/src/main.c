@@ -1,15 +1,107 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
+#include "layout.h"
 #include "mkfs.h"
 
+static void usage(void)
+{
+    printf("Usage:\n");
+    printf("  mkfs.nbfs [options] disk.nbfs\n");
+    printf("\n");
+    printf("Options:\n");
+    printf("  -s size    Image size (default 128M)\n");
+    printf("  -b size    Block size, 1K to 16K (default 4K)\n");
+    printf("  -i bytes   Bytes per inode (default 128K)\n");
+    printf("  -j size    Journal size, 0 for none (default 1M)\n");
+    printf("  -d dir     Copy the files under dir into the image\n");
+    printf("  -m file    Access-order manifest for -d (default: boot order)\n");
+}
+
+/*
+ * A byte count with an optional K, M, G or T suffix.
+ */
+static int parse_size(const char *text,uint64_t *out)
+{
+    char *end;
+    unsigned long long value=strtoull(text,&end,0);
+
+    if(end==text)
+        return -1;
+
+    unsigned shift=0;
+
+    switch(*end)
+    {
+        case 'k': case 'K': shift=10; end++; break;
+        case 'm': case 'M': shift=20; end++; break;
+        case 'g': case 'G': shift=30; end++; break;
+        case 't': case 'T': shift=40; end++; break;
+        default: break;
+    }
+
+    if(*end!='\0'||value>(UINT64_MAX>>shift))
+        return -1;
+
+    *out=(uint64_t)value<<shift;
+
+    return 0;
+}
+
 int main(int argc,char **argv)
 {
-    if(argc<2)
+    uint64_t bytes=NBFS_IMAGE_SIZE_DEFAULT;
+    uint64_t block_size=NBFS_DEFAULT_BLOCK_SIZE;
+    uint64_t bytes_per_inode=NBFS_BYTES_PER_INODE_DEFAULT;
+    uint64_t journal_bytes=NBFS_JOURNAL_SIZE_DEFAULT;
+    const char *source=NULL;
+    const char *manifest=NULL;
+    int opt;
+
+    while((opt=getopt(argc,argv,"s:b:i:j:d:m:"))!=-1)
+    {
+        uint64_t *value;
+
+        switch(opt)
+        {
+            case 'd': source=optarg; continue;
+            case 'm': manifest=optarg; continue;
+            case 's': value=&bytes; break;
+            case 'b': value=&block_size; break;
+            case 'i': value=&bytes_per_inode; break;
+            case 'j': value=&journal_bytes; break;
+            default: usage(); return 1;
+        }
+
+        if(parse_size(optarg,value)!=0)
+        {
+            printf("Invalid size: %s\n",optarg);
+            return 1;
+        }
+    }
+
+    if(optind!=argc-1)
+    {
+        usage();
+        return 1;
+    }
+
+    nbfs_layout_t layout;
+
+    if(block_size>UINT32_MAX||
+       nbfs_layout_compute(&layout,
+                           bytes,
+                           (uint32_t)block_size,
+                           bytes_per_inode,
+                           journal_bytes)!=0)
     {
-        printf("Usage:\n");
-        printf("  mkfs.nbfs disk.nbfs\n");
+        puts("Unsupported geometry.");
         return 1;
     }
 
-    return mkfs_create(argv[1]);
+    return mkfs_create(argv[optind],&layout,source,manifest);
 }
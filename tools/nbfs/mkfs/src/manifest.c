@@ -0,0 +1,141 @@
+/*
+ * manifest.c
+ * NeoBench mkfs.nbfs
+ *
+ * Access-order manifest
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs/manifest.h"
+
+/*
+ * Paths missing from the tree are ignored, so this also covers
+ * images laid out without some of them.
+ */
+static const char *const default_order[] =
+{
+    "/boot/neoloader.conf",
+    "/boot/kernel.elf",
+    "/boot/initrd.nbfs",
+
+    "/sbin/init",
+    "/bin/init",
+
+    "/etc/neobench.conf",
+    "/etc/fstab",
+    "/bin/mount",
+    "/etc/hostname",
+    "/bin/hostname",
+    "/bin/date",
+
+    "/etc/passwd",
+    "/etc/group",
+    "/etc/profile",
+    "/etc/motd",
+    "/bin/sh",
+};
+
+static int manifest_add(
+    nbfs_manifest_t *manifest,
+    const char *path,
+    size_t length
+)
+{
+    char **grown = realloc(manifest->paths,
+                           (manifest->count + 1) * sizeof(*grown));
+
+    if (!grown)
+        return -1;
+
+    manifest->paths = grown;
+
+    char *copy = malloc(length + 1);
+
+    if (!copy)
+        return -1;
+
+    memcpy(copy, path, length);
+    copy[length] = '\0';
+
+    manifest->paths[manifest->count++] = copy;
+
+    return 0;
+}
+
+int nbfs_manifest_load(nbfs_manifest_t *manifest, const char *path)
+{
+    memset(manifest, 0, sizeof(*manifest));
+
+    FILE *fp = fopen(path, "r");
+
+    if (!fp)
+    {
+        printf("Unable to open manifest %s\n", path);
+        return -1;
+    }
+
+    char line[4096];
+    int result = 0;
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        size_t length = strlen(line);
+
+        while (length > 0 &&
+               (line[length - 1] == '\n' ||
+                line[length - 1] == '\r' ||
+                line[length - 1] == ' ' ||
+                line[length - 1] == '\t'))
+            length--;
+
+        if (length == 0 || line[0] == '#')
+            continue;
+
+        if (manifest_add(manifest, line, length) != 0)
+        {
+            result = -1;
+            break;
+        }
+    }
+
+    fclose(fp);
+
+    if (result != 0)
+        nbfs_manifest_free(manifest);
+
+    return result;
+}
+
+int nbfs_manifest_default(nbfs_manifest_t *manifest)
+{
+    memset(manifest, 0, sizeof(*manifest));
+
+    size_t count = sizeof(default_order) / sizeof(default_order[0]);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (manifest_add(manifest,
+                         default_order[i],
+                         strlen(default_order[i])) != 0)
+        {
+            nbfs_manifest_free(manifest);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void nbfs_manifest_free(nbfs_manifest_t *manifest)
+{
+    for (size_t i = 0; i < manifest->count; i++)
+        free(manifest->paths[i]);
+
+    free(manifest->paths);
+
+    manifest->paths = NULL;
+    manifest->count = 0;
+}
@@ -8,15 +8,50 @@
 #include "fs/inode.h"
 #include "fs/rootdir.h"
 #include "fs/directory.h"
+#include "fs/manifest.h"
+#include "fs/populate.h"
 
-int mkfs_create(const char *image)
+/*
+ * Populate from source, placing files in the manifest's order or
+ * the default boot order.
+ */
+static int mkfs_populate(
+    image_t *image,
+    const char *source,
+    const char *manifest_path)
 {
-    FILE *fp =
+    nbfs_manifest_t manifest;
+
+    int result = manifest_path
+        ? nbfs_manifest_load(&manifest, manifest_path)
+        : nbfs_manifest_default(&manifest);
+
+    if (result != 0)
+        return -1;
+
+    result = nbfs_populate(image, source, &manifest);
+
+    nbfs_manifest_free(&manifest);
+
+    return result;
+}
+
+int mkfs_create(
+    const char *path,
+    const nbfs_layout_t *layout,
+    const char *source,
+    const char *manifest)
+{
+    /*
+     * Everything below is built in memory and reaches the image in
+     * one ascending pass at the end.
+     */
+    image_t *image =
         image_create(
-            image,
-            128ULL * 1024ULL * 1024ULL);
+            path,
+            layout);
 
-    if (!fp)
+    if (!image)
     {
         puts("Unable to create image.");
         return 1;
@@ -25,22 +60,32 @@ int mkfs_create(const char *image)
     /*
      * 1. Boot block
      */
-    if (nbfs_write_bootblock(fp) != 0)
+    if (nbfs_write_bootblock(image) != 0)
     {
         puts("Failed to write boot block.");
-        fclose(fp);
+        image_close(image);
         return 1;
     }
 
     /*
      * 2. Create root inode.
      *
-     * This allocates the first DATA block (324).
+     * This allocates the first data block. With a source
+     * directory, its tree follows.
      */
-    if (nbfs_create_root_inode(fp) != 0)
+    if (source)
+    {
+        if (mkfs_populate(image, source, manifest) != 0)
+        {
+            puts("Failed to populate image.");
+            image_close(image);
+            return 1;
+        }
+    }
+    else if (nbfs_create_root_inode(image) != 0)
     {
         puts("Failed to create root inode.");
-        fclose(fp);
+        image_close(image);
         return 1;
     }
 
@@ -48,13 +93,13 @@ int mkfs_create(const char *image)
      * 3. Write block bitmap.
      *
      * This now includes:
-     *   - reserved blocks 0-323
-     *   - allocated root directory block 324
+     *   - reserved blocks before data_start
+     *   - allocated directory and file blocks
      */
-    if (nbfs_write_block_bitmap(fp) != 0)
+    if (nbfs_write_block_bitmap(image) != 0)
     {
         puts("Failed to write block bitmap.");
-        fclose(fp);
+        image_close(image);
         return 1;
     }
 
@@ -64,14 +109,24 @@ int mkfs_create(const char *image)
      * Written after root allocation so free_blocks
      * reflects the actual filesystem state.
      */
-    if (nbfs_write_superblock(fp) != 0)
+    if (nbfs_write_superblock(image) != 0)
     {
         puts("Failed to write superblock.");
-        fclose(fp);
+        image_close(image);
+        return 1;
+    }
+
+    /*
+     * 5. One sequential write of every block, one sync.
+     */
+    if (image_write(image) != 0)
+    {
+        puts("Failed to write image.");
+        image_close(image);
         return 1;
     }
 
-    fclose(fp);
+    image_close(image);
 
     puts("NBFS filesystem created.");
 
@@ -0,0 +1,915 @@
+/*
+ * populate.c
+ * NeoBench mkfs.nbfs
+ *
+ * Populate the image from a host directory tree
+ *
+ * The tree is scanned first, so every directory and inode is written
+ * in memory and every file knows its extent before any data moves.
+ * Files named in the access-order manifest come first, in its order:
+ * their inodes share the front of the table and their data follows
+ * the directories as one run, so early boot reads front to back.
+ * The file data is then read by a pool of threads, a chunk at a time
+ * and a bounded window ahead, while the calling thread writes the
+ * chunks out in block order.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <nbfs/directory.h>
+#include <nbfs/nbfs.h>
+
+#include "image.h"
+#include "layout.h"
+#include "fs/bitmap.h"
+#include "fs/directory.h"
+#include "fs/inode.h"
+#include "fs/manifest.h"
+#include "fs/populate.h"
+
+/*
+ * Most bytes a reader takes in one go; larger files are split. A
+ * whole number of blocks at every block size.
+ */
+#define POPULATE_CHUNK (1u << 20)
+
+/*
+ * Chunks read ahead of the writer.
+ */
+#define POPULATE_WINDOW 64
+
+#define POPULATE_THREADS_MAX 32
+
+typedef struct
+{
+    char *path;
+
+    /* Points into path */
+    const char *name;
+
+    struct stat st;
+
+    size_t parent;
+
+    /* Children are kept together, sorted by name */
+    size_t first_child;
+    size_t children;
+
+    uint32_t subdirs;
+
+    /* Already in the placement order */
+    bool ordered;
+
+    uint64_t inode;
+
+    uint64_t start;
+    uint64_t blocks;
+
+} node_t;
+
+typedef struct
+{
+    node_t *nodes;
+
+    size_t count;
+    size_t capacity;
+
+} tree_t;
+
+typedef struct
+{
+    size_t file;
+
+    uint64_t offset;
+
+    uint32_t length;
+
+} chunk_t;
+
+enum
+{
+    SLOT_FREE,
+    SLOT_READY,
+    SLOT_FAILED
+};
+
+typedef struct
+{
+    const tree_t *tree;
+
+    uint32_t block_size;
+
+    const chunk_t *chunks;
+    size_t count;
+
+    /* Chunk k is read into slot k % POPULATE_WINDOW */
+    uint8_t *buffers[POPULATE_WINDOW];
+    uint32_t lengths[POPULATE_WINDOW];
+    int state[POPULATE_WINDOW];
+
+    /* Next chunk for a reader, and chunks written so far */
+    size_t next;
+    size_t written;
+
+    bool stop;
+
+    pthread_mutex_t lock;
+
+    /* A slot was filled; a slot was freed */
+    pthread_cond_t ready;
+    pthread_cond_t room;
+
+} copy_t;
+
+
+/*
+ * Scan
+ */
+static int tree_add(
+    tree_t *tree,
+    char *path,
+    size_t name_offset,
+    size_t parent,
+    const struct stat *st
+)
+{
+    if (tree->count == tree->capacity)
+    {
+        size_t capacity = tree->capacity ? tree->capacity * 2 : 256;
+        node_t *grown = realloc(tree->nodes, capacity * sizeof(*grown));
+
+        if (!grown)
+            return -1;
+
+        tree->nodes = grown;
+        tree->capacity = capacity;
+    }
+
+    node_t *node = &tree->nodes[tree->count++];
+
+    memset(node, 0, sizeof(*node));
+
+    node->path = path;
+    node->name = path + name_offset;
+    node->st = *st;
+    node->parent = parent;
+
+    return 0;
+}
+
+static void tree_free(tree_t *tree)
+{
+    for (size_t i = 0; i < tree->count; i++)
+        free(tree->nodes[i].path);
+
+    free(tree->nodes);
+}
+
+static int compare_name(const void *a, const void *b)
+{
+    return strcmp(((const node_t *)a)->name, ((const node_t *)b)->name);
+}
+
+/*
+ * Append the entries of directory index to the tree. Anything that
+ * is not a regular file or a directory is left out.
+ */
+static int scan_directory(tree_t *tree, size_t index)
+{
+    DIR *dir = opendir(tree->nodes[index].path);
+
+    if (!dir)
+    {
+        printf("Unable to read %s: %s\n",
+               tree->nodes[index].path,
+               strerror(errno));
+        return -1;
+    }
+
+    size_t first = tree->count;
+    struct dirent *entry;
+    int result = 0;
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        const char *name = entry->d_name;
+        size_t length = strlen(name);
+
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+
+        if (length > NBFS_DIRENT_NAME_MAX)
+        {
+            printf("Name too long: %s/%s\n",
+                   tree->nodes[index].path,
+                   name);
+            result = -1;
+            break;
+        }
+
+        size_t prefix = strlen(tree->nodes[index].path);
+        char *path = malloc(prefix + 1 + length + 1);
+
+        if (!path)
+        {
+            result = -1;
+            break;
+        }
+
+        memcpy(path, tree->nodes[index].path, prefix);
+        path[prefix] = '/';
+        memcpy(path + prefix + 1, name, length + 1);
+
+        struct stat st;
+
+        if (lstat(path, &st) != 0)
+        {
+            printf("Unable to stat %s: %s\n", path, strerror(errno));
+            free(path);
+            result = -1;
+            break;
+        }
+
+        if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+        {
+            printf("Skipping %s: not a file or directory\n", path);
+            free(path);
+            continue;
+        }
+
+        if (tree_add(tree, path, prefix + 1, index, &st) != 0)
+        {
+            free(path);
+            result = -1;
+            break;
+        }
+
+        if (S_ISDIR(st.st_mode))
+            tree->nodes[index].subdirs++;
+    }
+
+    closedir(dir);
+
+    /*
+     * Name order, so the same tree always gives the same image.
+     */
+    tree->nodes[index].first_child = first;
+    tree->nodes[index].children = tree->count - first;
+
+    qsort(tree->nodes + first,
+          tree->count - first,
+          sizeof(node_t),
+          compare_name);
+
+    return result;
+}
+
+/*
+ * Breadth first: the nodes array is its own queue.
+ */
+static int scan_tree(tree_t *tree, const char *source)
+{
+    struct stat st;
+
+    if (stat(source, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        printf("Not a directory: %s\n", source);
+        return -1;
+    }
+
+    size_t length = strlen(source);
+
+    while (length > 1 && source[length - 1] == '/')
+        length--;
+
+    char *path = malloc(length + 1);
+
+    if (!path)
+        return -1;
+
+    memcpy(path, source, length);
+    path[length] = '\0';
+
+    if (tree_add(tree, path, length, 0, &st) != 0)
+    {
+        free(path);
+        return -1;
+    }
+
+    for (size_t i = 0; i < tree->count; i++)
+    {
+        if (S_ISDIR(tree->nodes[i].st.st_mode) &&
+            scan_directory(tree, i) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+
+static int compare_child(const void *key, const void *node)
+{
+    return strcmp(key, ((const node_t *)node)->name);
+}
+
+/*
+ * Node for an image path, following the sorted children one
+ * component at a time; SIZE_MAX if the tree has no such node.
+ */
+static size_t tree_find(const tree_t *tree, const char *path)
+{
+    char component[NBFS_DIRENT_NAME_MAX + 1];
+    size_t index = 0;
+
+    while (*path)
+    {
+        while (*path == '/')
+            path++;
+
+        size_t length = strcspn(path, "/");
+
+        if (length == 0)
+            break;
+
+        if (length > NBFS_DIRENT_NAME_MAX)
+            return SIZE_MAX;
+
+        memcpy(component, path, length);
+        component[length] = '\0';
+        path += length;
+
+        if (strcmp(component, ".") == 0)
+            continue;
+
+        const node_t *node = &tree->nodes[index];
+
+        if (strcmp(component, "..") == 0)
+        {
+            index = node->parent;
+            continue;
+        }
+
+        if (!S_ISDIR(node->st.st_mode))
+            return SIZE_MAX;
+
+        const node_t *found = bsearch(component,
+                                      tree->nodes + node->first_child,
+                                      node->children,
+                                      sizeof(node_t),
+                                      compare_child);
+
+        if (!found)
+            return SIZE_MAX;
+
+        index = (size_t)(found - tree->nodes);
+    }
+
+    return index;
+}
+
+/*
+ * The root, then the manifest's files in its order, then everything
+ * else breadth first.
+ */
+static size_t *build_order(tree_t *tree, const nbfs_manifest_t *manifest)
+{
+    size_t *order = malloc(tree->count * sizeof(*order));
+
+    if (!order)
+        return NULL;
+
+    size_t count = 0;
+
+    order[count++] = 0;
+    tree->nodes[0].ordered = true;
+
+    for (size_t i = 0; manifest && i < manifest->count; i++)
+    {
+        size_t index = tree_find(tree, manifest->paths[i]);
+
+        /*
+         * A trace names each file every time it is opened; the
+         * first time counts.
+         */
+        if (index == SIZE_MAX ||
+            tree->nodes[index].ordered ||
+            !S_ISREG(tree->nodes[index].st.st_mode))
+            continue;
+
+        order[count++] = index;
+        tree->nodes[index].ordered = true;
+    }
+
+    for (size_t i = 0; i < tree->count; i++)
+    {
+        if (!tree->nodes[i].ordered)
+            order[count++] = i;
+    }
+
+    return order;
+}
+
+
+/*
+ * Layout
+ */
+static int write_directories(image_t *image, tree_t *tree)
+{
+    for (size_t i = 0; i < tree->count; i++)
+    {
+        node_t *node = &tree->nodes[i];
+
+        if (!S_ISDIR(node->st.st_mode))
+            continue;
+
+        nbfs_dir_record_t *records =
+            malloc((node->children + 1) * sizeof(*records));
+
+        if (!records)
+            return -1;
+
+        for (size_t c = 0; c < node->children; c++)
+        {
+            const node_t *child = &tree->nodes[node->first_child + c];
+
+            records[c].inode = child->inode;
+            records[c].name = child->name;
+            records[c].type = S_ISDIR(child->st.st_mode)
+                ? NBFS_DIRENT_DIRECTORY
+                : NBFS_DIRENT_FILE;
+        }
+
+        int result = nbfs_write_directory(image,
+                                          node->inode,
+                                          tree->nodes[node->parent].inode,
+                                          records,
+                                          node->children,
+                                          &node->start,
+                                          &node->blocks);
+
+        free(records);
+
+        if (result != 0)
+        {
+            printf("Failed to write directory %s\n", node->path);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * One contiguous extent per file, in placement order.
+ */
+static int place_files(
+    image_t *image,
+    tree_t *tree,
+    const size_t *order
+)
+{
+    uint32_t block_size = image_layout(image)->block_size;
+
+    for (size_t i = 0; i < tree->count; i++)
+    {
+        node_t *node = &tree->nodes[order[i]];
+
+        if (!S_ISREG(node->st.st_mode) || node->st.st_size == 0)
+            continue;
+
+        node->blocks =
+            ((uint64_t)node->st.st_size + block_size - 1) / block_size;
+
+        node->start = nbfs_alloc_blocks(image, node->blocks);
+
+        if (node->start == UINT64_MAX)
+        {
+            puts("Image is full.");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int write_inodes(image_t *image, const tree_t *tree)
+{
+    uint32_t block_size = image_layout(image)->block_size;
+
+    for (size_t i = 0; i < tree->count; i++)
+    {
+        const node_t *node = &tree->nodes[i];
+        bool directory = S_ISDIR(node->st.st_mode);
+
+        nbfs_inode_t inode;
+
+        memset(&inode, 0, sizeof(inode));
+
+        inode.inode_number = node->inode;
+
+        inode.mode = (uint16_t)((directory
+                                     ? NBFS_MODE_DIRECTORY
+                                     : NBFS_MODE_FILE) |
+                                (node->st.st_mode & 07777));
+
+        inode.links = directory ? (uint16_t)(2 + node->subdirs) : 1;
+
+        inode.uid = (uint32_t)node->st.st_uid;
+        inode.gid = (uint32_t)node->st.st_gid;
+
+        inode.size = directory
+            ? node->blocks * block_size
+            : (uint64_t)node->st.st_size;
+
+        inode.created = (uint64_t)node->st.st_ctime;
+        inode.modified = (uint64_t)node->st.st_mtime;
+        inode.accessed = (uint64_t)node->st.st_atime;
+
+        /*
+         * The run goes into as many direct extents as it needs.
+         */
+        uint64_t start = node->start;
+        uint64_t left = node->blocks;
+
+        for (int e = 0; left > 0; e++)
+        {
+            if (e == NBFS_EXTENTS_PER_INODE)
+            {
+                printf("File too large: %s\n", node->path);
+                return -1;
+            }
+
+            uint32_t count = left > UINT32_MAX
+                ? UINT32_MAX
+                : (uint32_t)left;
+
+            inode.extents[e].start_block = start;
+            inode.extents[e].block_count = count;
+
+            start += count;
+            left -= count;
+        }
+
+        if (nbfs_write_inode(image, node->inode, &inode) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Copy
+ */
+static int read_chunk(
+    const copy_t *copy,
+    const chunk_t *chunk,
+    uint8_t *buffer,
+    uint32_t *length
+)
+{
+    const node_t *node = &copy->tree->nodes[chunk->file];
+
+    int fd = open(node->path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        printf("Unable to open %s: %s\n", node->path, strerror(errno));
+        return -1;
+    }
+
+    uint32_t done = 0;
+
+    while (done < chunk->length)
+    {
+        ssize_t n = pread(fd,
+                          buffer + done,
+                          chunk->length - done,
+                          (off_t)(chunk->offset + done));
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+        {
+            printf("Unable to read %s: %s\n",
+                   node->path,
+                   n < 0 ? strerror(errno) : "file shrank");
+            close(fd);
+            return -1;
+        }
+
+        done += (uint32_t)n;
+    }
+
+    close(fd);
+
+    /*
+     * The tail of the last block is zero on disk too.
+     */
+    *length = (chunk->length + copy->block_size - 1) /
+              copy->block_size * copy->block_size;
+
+    memset(buffer + chunk->length, 0, *length - chunk->length);
+
+    return 0;
+}
+
+static void *copy_reader(void *argument)
+{
+    copy_t *copy = argument;
+
+    pthread_mutex_lock(&copy->lock);
+
+    for (;;)
+    {
+        while (!copy->stop &&
+               copy->next < copy->count &&
+               copy->next >= copy->written + POPULATE_WINDOW)
+            pthread_cond_wait(&copy->room, &copy->lock);
+
+        if (copy->stop || copy->next >= copy->count)
+            break;
+
+        size_t k = copy->next++;
+        size_t slot = k % POPULATE_WINDOW;
+
+        pthread_mutex_unlock(&copy->lock);
+
+        int result = read_chunk(copy,
+                                &copy->chunks[k],
+                                copy->buffers[slot],
+                                &copy->lengths[slot]);
+
+        pthread_mutex_lock(&copy->lock);
+
+        copy->state[slot] = result == 0 ? SLOT_READY : SLOT_FAILED;
+
+        pthread_cond_broadcast(&copy->ready);
+    }
+
+    pthread_mutex_unlock(&copy->lock);
+
+    return NULL;
+}
+
+static uint64_t chunk_block(const copy_t *copy, size_t k)
+{
+    const chunk_t *chunk = &copy->chunks[k];
+
+    return copy->tree->nodes[chunk->file].start +
+           chunk->offset / copy->block_size;
+}
+
+/*
+ * Write the chunks in order, each run of ready chunks that follow on
+ * from each other on disk in one request.
+ */
+static int copy_write(image_t *image, copy_t *copy)
+{
+    struct iovec iov[POPULATE_WINDOW];
+    int result = 0;
+
+    pthread_mutex_lock(&copy->lock);
+
+    while (copy->written < copy->count)
+    {
+        size_t first = copy->written;
+
+        while (copy->state[first % POPULATE_WINDOW] == SLOT_FREE)
+            pthread_cond_wait(&copy->ready, &copy->lock);
+
+        if (copy->state[first % POPULATE_WINDOW] == SLOT_FAILED)
+        {
+            result = -1;
+            break;
+        }
+
+        int n = 0;
+        uint64_t block = chunk_block(copy, first);
+        uint64_t end = block;
+
+        while (first + (size_t)n < copy->count &&
+               n < POPULATE_WINDOW)
+        {
+            size_t k = first + (size_t)n;
+            size_t slot = k % POPULATE_WINDOW;
+
+            if (copy->state[slot] != SLOT_READY ||
+                chunk_block(copy, k) != end)
+                break;
+
+            iov[n].iov_base = copy->buffers[slot];
+            iov[n].iov_len = copy->lengths[slot];
+
+            end += copy->lengths[slot] / copy->block_size;
+            n++;
+        }
+
+        pthread_mutex_unlock(&copy->lock);
+
+        result = image_write_data(image, block, iov, n);
+
+        pthread_mutex_lock(&copy->lock);
+
+        if (result != 0)
+        {
+            puts("Failed to write file data.");
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+            copy->state[(first + (size_t)i) % POPULATE_WINDOW] = SLOT_FREE;
+
+        copy->written += (size_t)n;
+
+        pthread_cond_broadcast(&copy->room);
+    }
+
+    copy->stop = true;
+
+    pthread_cond_broadcast(&copy->room);
+    pthread_mutex_unlock(&copy->lock);
+
+    return result;
+}
+
+static int copy_files(
+    image_t *image,
+    const tree_t *tree,
+    const size_t *order
+)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < tree->count; i++)
+    {
+        if (S_ISREG(tree->nodes[i].st.st_mode))
+            count += ((uint64_t)tree->nodes[i].st.st_size +
+                      POPULATE_CHUNK - 1) / POPULATE_CHUNK;
+    }
+
+    if (count == 0)
+        return 0;
+
+    chunk_t *chunks = malloc(count * sizeof(*chunks));
+
+    if (!chunks)
+        return -1;
+
+    /*
+     * Chunks in block order, so the writer moves front to back.
+     */
+    count = 0;
+
+    for (size_t i = 0; i < tree->count; i++)
+    {
+        const node_t *node = &tree->nodes[order[i]];
+
+        if (!S_ISREG(node->st.st_mode))
+            continue;
+
+        for (uint64_t offset = 0;
+             offset < (uint64_t)node->st.st_size;
+             offset += POPULATE_CHUNK)
+        {
+            uint64_t left = (uint64_t)node->st.st_size - offset;
+
+            chunks[count++] = (chunk_t){
+                order[i],
+                offset,
+                left > POPULATE_CHUNK ? POPULATE_CHUNK : (uint32_t)left
+            };
+        }
+    }
+
+    copy_t copy;
+
+    memset(&copy, 0, sizeof(copy));
+
+    copy.tree = tree;
+    copy.block_size = image_layout(image)->block_size;
+    copy.chunks = chunks;
+    copy.count = count;
+
+    int result = -1;
+
+    for (int i = 0; i < POPULATE_WINDOW; i++)
+    {
+        copy.buffers[i] = malloc(POPULATE_CHUNK);
+
+        if (!copy.buffers[i])
+            goto out;
+    }
+
+    pthread_mutex_init(&copy.lock, NULL);
+    pthread_cond_init(&copy.ready, NULL);
+    pthread_cond_init(&copy.room, NULL);
+
+    /*
+     * Readers mostly wait on the host disk; run more than there are
+     * processors.
+     */
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = processors > 0 ? (size_t)processors * 2 : 4;
+
+    if (threads > POPULATE_THREADS_MAX)
+        threads = POPULATE_THREADS_MAX;
+
+    if (threads > count)
+        threads = count;
+
+    pthread_t readers[POPULATE_THREADS_MAX];
+    size_t started = 0;
+
+    while (started < threads &&
+           pthread_create(&readers[started], NULL, copy_reader, &copy) == 0)
+        started++;
+
+    if (started > 0)
+        result = copy_write(image, &copy);
+
+    for (size_t i = 0; i < started; i++)
+        pthread_join(readers[i], NULL);
+
+    pthread_cond_destroy(&copy.room);
+    pthread_cond_destroy(&copy.ready);
+    pthread_mutex_destroy(&copy.lock);
+
+out:
+    for (int i = 0; i < POPULATE_WINDOW; i++)
+        free(copy.buffers[i]);
+
+    free(chunks);
+
+    return result;
+}
+
+
+int nbfs_populate(
+    image_t *image,
+    const char *source,
+    const nbfs_manifest_t *manifest)
+{
+    tree_t tree;
+    size_t *order = NULL;
+
+    memset(&tree, 0, sizeof(tree));
+
+    int result = -1;
+
+    if (scan_tree(&tree, source) != 0)
+        goto out;
+
+    order = build_order(&tree, manifest);
+
+    if (!order)
+        goto out;
+
+    /*
+     * Inode numbers in placement order; the root takes inode 1.
+     */
+    for (size_t i = 0; i < tree.count; i++)
+    {
+        node_t *node = &tree.nodes[order[i]];
+
+        node->inode = nbfs_alloc_inode(image);
+
+        if (node->inode == UINT64_MAX)
+        {
+            puts("Out of inodes.");
+            goto out;
+        }
+    }
+
+    /*
+     * Directories first, so a path walk reads from the front of the
+     * data area, then the files behind them.
+     */
+    if (write_directories(image, &tree) != 0 ||
+        place_files(image, &tree, order) != 0 ||
+        write_inodes(image, &tree) != 0 ||
+        nbfs_write_inode_bitmap(image) != 0)
+        goto out;
+
+    result = copy_files(image, &tree, order);
+
+out:
+    free(order);
+    tree_free(&tree);
+
+    return result;
+}
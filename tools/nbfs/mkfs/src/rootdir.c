@@ -12,13 +12,14 @@
 
 #include <nbfs/nbfs.h>
 
+#include "image.h"
 #include "layout.h"
 #include "fs/inode.h"
 #include "fs/bitmap.h"
 #include "fs/directory.h"
 
 
-int nbfs_create_root_inode(FILE *fp)
+int nbfs_create_root_inode(image_t *image)
 {
     nbfs_inode_t root;
 
@@ -28,7 +29,10 @@ int nbfs_create_root_inode(FILE *fp)
     memset(&root, 0, sizeof(root));
 
 
-    root.inode_number = 1;
+    /*
+     * First inode allocation; marks inode 1 in the bitmap.
+     */
+    root.inode_number = nbfs_alloc_inode(image);
 
 
     /*
@@ -40,19 +44,9 @@ int nbfs_create_root_inode(FILE *fp)
 
 
     /*
-     * Allocate first filesystem data block.
-     *
-     * Layout v1:
-     *
-     * 0       boot
-     * 1       superblock
-     * 2       block bitmap
-     * 3       inode bitmap
-     * 4-67    inode table
-     * 68-323  journal
-     * 324+    data
+     * Allocate first filesystem data block, at data_start.
      */
-    root_block = nbfs_alloc_block();
+    root_block = nbfs_alloc_block(image);
 
 
     if (root_block == UINT64_MAX)
@@ -67,7 +61,7 @@ int nbfs_create_root_inode(FILE *fp)
      * Root directory is one block.
      */
     root.size =
-        NBFS_DEFAULT_BLOCK_SIZE;
+        image_layout(image)->block_size;
 
 
     root.extents[0].start_block =
@@ -90,7 +84,7 @@ int nbfs_create_root_inode(FILE *fp)
      * ..
      */
     if (nbfs_write_root_directory(
-            fp,
+            image,
             root_block) != 0)
     {
         puts("Failed to write root directory.");
@@ -103,7 +97,7 @@ int nbfs_create_root_inode(FILE *fp)
      * Write inode 1.
      */
     if (nbfs_write_inode(
-            fp,
+            image,
             root.inode_number,
             &root) != 0)
     {
@@ -116,7 +110,7 @@ int nbfs_create_root_inode(FILE *fp)
     /*
      * Mark inode bitmap.
      */
-    if (nbfs_write_inode_bitmap(fp) != 0)
+    if (nbfs_write_inode_bitmap(image) != 0)
     {
         puts("Failed to write inode bitmap.");
         return -1;
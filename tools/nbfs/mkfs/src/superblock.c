@@ -7,14 +7,16 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <nbfs/crc32.h>
+#include <nbfs/endian.h>
 #include <nbfs/nbfs.h>
 
+#include "image.h"
+#include "fs/bitmap.h"
+#include "fs/inode.h"
 #include "fs/superblock.h"
 
-#define NBFS_IMAGE_SIZE (128ULL * 1024ULL * 1024ULL)
-#define NBFS_TOTAL_INODES 1024ULL
-
-int nbfs_write_superblock(FILE *fp)
+int nbfs_write_superblock(image_t *image)
 {
     nbfs_superblock_t sb;
 
@@ -25,63 +27,52 @@ int nbfs_write_superblock(FILE *fp)
     sb.version_major = NBFS_VERSION_MAJOR;
     sb.version_minor = NBFS_VERSION_MINOR;
 
-    sb.block_size = NBFS_DEFAULT_BLOCK_SIZE;
-    sb.flags = 0;
+    const nbfs_layout_t *layout = image_layout(image);
+
+    sb.block_size = layout->block_size;
+    sb.flags = NBFS_SUPERBLOCK_CHECKSUMS;
 
-    sb.total_blocks =
-        NBFS_IMAGE_SIZE / NBFS_DEFAULT_BLOCK_SIZE;
+    sb.total_blocks = layout->total_blocks;
 
     /*
-     * Blocks before DATA_START are permanently reserved:
-     *
-     * 0-323 = metadata + journal
-     *
-     * One data block is already allocated to the root directory.
+     * Blocks before data_start are permanently reserved for
+     * metadata and the journal; the allocator counts those and
+     * every data block handed out so far.
      */
-    sb.free_blocks =
-        sb.total_blocks -
-        NBFS_DATA_START -
-        1;
+    sb.free_blocks = nbfs_free_block_count(image);
 
-    sb.total_inodes = NBFS_TOTAL_INODES;
-    sb.free_inodes  = NBFS_TOTAL_INODES - 1;
+    sb.total_inodes = layout->total_inodes;
+    sb.free_inodes  = nbfs_free_inode_count(image);
 
     sb.root_inode = 1;
 
-    sb.journal_start = NBFS_JOURNAL_START;
-    sb.journal_blocks = NBFS_JOURNAL_BLOCKS;
+    sb.journal_start = layout->journal_start;
+    sb.journal_blocks = layout->journal_blocks;
 
-    sb.block_bitmap_start = NBFS_BLOCK_BITMAP;
-    sb.inode_bitmap_start = NBFS_INODE_BITMAP;
-    sb.inode_table_start  = NBFS_INODE_TABLE;
-    sb.data_start         = NBFS_DATA_START;
+    sb.block_bitmap_start = layout->block_bitmap_start;
+    sb.inode_bitmap_start = layout->inode_bitmap_start;
+    sb.inode_table_start  = layout->inode_table_start;
+    sb.data_start         = layout->data_start;
 
     strncpy(
         sb.volume_name,
         "NeoBench",
         sizeof(sb.volume_name) - 1);
 
+    /*
+     * Checksummed in its on-disk byte order.
+     */
+    nbfs_superblock_le(&sb);
+
     sb.crc32 = 0;
+    sb.crc32 = nbfs_le32(nbfs_crc32_sliced(0, &sb, sizeof(sb)));
 
-    if (fseek(
-            fp,
-            (long)((uint64_t)NBFS_SUPERBLOCK *
-                   NBFS_DEFAULT_BLOCK_SIZE),
-            SEEK_SET) != 0)
-    {
-        return -1;
-    }
-
-    if (fwrite(
-            &sb,
-            sizeof(sb),
-            1,
-            fp) != 1)
-    {
+    uint8_t *block = image_block(image, NBFS_SUPERBLOCK);
+
+    if (!block)
         return -1;
-    }
 
-    fflush(fp);
+    memcpy(block, &sb, sizeof(sb));
 
     return 0;
 }